@@ -20,7 +20,7 @@
  **/
 class FileSystemEvent {
  public:
-  FileSystemEvent(int wd, uint32_t mask, const boost::filesystem::path path);
+  FileSystemEvent(int wd, uint32_t mask, const boost::filesystem::path path, uint32_t cookie = 0);
   ~FileSystemEvent();
   std::string getMaskString() const;
 
@@ -29,6 +29,8 @@ class FileSystemEvent {
   int wd;
   uint32_t mask;
   boost::filesystem::path path;
+  // Pairs the IN_MOVED_FROM and IN_MOVED_TO of the same rename (0 otherwise)
+  uint32_t cookie;
 
  private:
   std::string maskToString(uint32_t events) const;
@@ -36,11 +38,12 @@ class FileSystemEvent {
 };
 
 
-inline FileSystemEvent::FileSystemEvent(const int wd, uint32_t mask, const boost::filesystem::path path) :
+inline FileSystemEvent::FileSystemEvent(const int wd, uint32_t mask, const boost::filesystem::path path, uint32_t cookie) :
   isRecursive(false),
   wd(wd),
   mask(mask),
-  path(path){
+  path(path),
+  cookie(cookie){
 
 }
 
@@ -9,8 +9,12 @@
 #include <string>
 #include <queue>
 #include <map>
+#include <unordered_map>
+#include <fstream>
+#include <iostream>
 #include <vector>
 #include <boost/filesystem.hpp>
+#include <limits.h>
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
@@ -18,6 +22,7 @@
 #include <string>
 #include <exception>
 #include <sstream>
+#include <poll.h>
 #include <boost/filesystem.hpp>
 
 
@@ -25,7 +30,10 @@
 
 #define MAX_EVENTS     4096
 #define EVENT_SIZE     (sizeof (inotify_event))
-#define EVENT_BUF_LEN  (MAX_EVENTS * (EVENT_SIZE + 16))
+#define EVENT_BUF_LEN  (MAX_EVENTS * (EVENT_SIZE + NAME_MAX + 1))
+
+// Events every watch needs so the watch tree can maintain itself
+#define WATCH_TREE_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE_SELF)
 
 namespace fs = boost::filesystem;
 
@@ -65,6 +73,17 @@ namespace fs = boost::filesystem;
  *
  * See inotify manpage for more event details
  *
+ * If the kernel event queue overflows, getNextEvent returns an
+ * event with mask IN_Q_OVERFLOW and an empty path. Events were
+ * lost and the watched directories must be rescanned.
+ *
+ * The watch tree maintains itself: directories created or moved
+ * into a watched directory are watched and scanned right away,
+ * and an IN_CREATE event is generated for everything that was
+ * already inside them. Watches of deleted directories and of
+ * directories moved out of the tree are dropped. Symlinks are
+ * not followed.
+ *
  */
 class Inotify {
  public:
@@ -76,13 +95,20 @@ class Inotify {
   void watchFile(fs::path file);
   void ignoreFileOnce(fs::path file);
   FileSystemEvent getNextEvent();
+  bool hasEvent(int timeoutMs);
   int getLastErrno();
+  size_t watchCount() const;
+  static size_t maxUserWatches();
   
  private:
   fs::path wdToPath(int wd);
   bool isIgnored(std::string file);
   bool onTimeout(time_t eventTime);
-  void removeWatch(int wd);  // TODO
+  void readEvents();
+  void removeWatch(int wd);
+  void forgetWatch(int wd);
+  void removeWatchesBelow(fs::path path);
+  void watchNewDirectory(fs::path path);
   void init();
 
   // Member
@@ -93,7 +119,9 @@ class Inotify {
   std::vector<std::string> mIgnoredDirectories;
   std::vector<std::string> mOnceIgnoredDirectories;
   std::queue<FileSystemEvent> mEventQueue;
-  std::map<int, fs::path> mDirectorieMap;
+  std::unordered_map<int, fs::path> mDirectorieMap;
+  std::unordered_map<std::string, int> mPathMap;
+  std::vector<char> mEventBuffer;
   int mInotifyFd;
 
 
@@ -106,6 +134,7 @@ inline Inotify::Inotify() :
   mLastEventTime(0),
   mEventMask(IN_ALL_EVENTS),
   mIgnoredDirectories(std::vector<std::string>()),
+  mEventBuffer(EVENT_BUF_LEN),
   mInotifyFd(0){
 
   // Initialize inotify
@@ -118,6 +147,7 @@ inline Inotify::Inotify(uint32_t eventMask) :
   mLastEventTime(0),
   mEventMask(eventMask),
   mIgnoredDirectories(std::vector<std::string>()),
+  mEventBuffer(EVENT_BUF_LEN),
   mInotifyFd(0){
 
   // Initialize inotify
@@ -130,6 +160,7 @@ inline Inotify::Inotify(std::vector<std::string> ignoredDirectories,  unsigned e
   mLastEventTime(0),
   mEventMask(eventMask),
   mIgnoredDirectories(ignoredDirectories),
+  mEventBuffer(EVENT_BUF_LEN),
   mInotifyFd(0){
   
   // Initialize inotify
@@ -155,34 +186,38 @@ inline void Inotify::init(){
 }
 
 /**
- * @brief Adds the given path and all files and subdirectories
- *        to the set of watched files/directories.
- *        Symlinks will be followed!
+ * @brief Adds the given path and all subdirectories
+ *        to the set of watched directories.
+ *        Symlinks are not followed, so link cycles
+ *        can't make the tree grow without bound.
+ *
+ *        The directory itself is watched before its
+ *        children, so nothing created during the walk
+ *        goes unnoticed.
  *
  * @param path that will be watched recursively
  *
  */
 inline void Inotify::watchDirectoryRecursively(fs::path path){
   if(fs::exists(path)){
+    watchFile(path);
+
     if(fs::is_directory(path)){
-      fs::recursive_directory_iterator it(path, fs::symlink_option::recurse);
+      boost::system::error_code error;
+      fs::recursive_directory_iterator it(path, error);
       fs::recursive_directory_iterator end;
   
-      while(it != end){
+      while(!error && it != end){
 	fs::path currentPath = *it;
 
-	if(fs::is_directory(currentPath)){
-	  watchFile(currentPath);
-	}
-	if(fs::is_symlink(currentPath)){
+	if(fs::is_directory(fs::symlink_status(currentPath))){
 	  watchFile(currentPath);
 	}
-	++it;
+	it.increment(error);
 
       }
 
     }
-    watchFile(path);
   }
   else {
     throw std::invalid_argument("Can´t watch Path! Path does not exist. Path: " + path.string());
@@ -203,16 +238,18 @@ inline void Inotify::watchDirectoryRecursively(fs::path path){
 inline void Inotify::watchFile(fs::path filePath){
   if(fs::exists(filePath)){
     mError = 0;
-    int wd = 0;
-    if(!isIgnored(filePath.string())){
-      wd = inotify_add_watch(mInotifyFd, filePath.string().c_str(), mEventMask);
+    if(isIgnored(filePath.string())){
+      return;
     }
 
+    int wd = inotify_add_watch(mInotifyFd, filePath.string().c_str(), mEventMask | WATCH_TREE_EVENTS);
+
     if(wd == -1){
       mError = errno;
       std::stringstream errorStream;
-      if(mError == 28){
-	errorStream << "Failed to watch! " << strerror(mError) << ". Please increase number of watches in \"/proc/sys/fs/inotify/max_user_watches\".";
+      if(mError == ENOSPC){
+	errorStream << "Failed to watch! " << strerror(mError) << ". " << watchCount() << " of "
+		    << maxUserWatches() << " watches in use. Please increase number of watches in \"/proc/sys/fs/inotify/max_user_watches\".";
 	throw std::runtime_error(errorStream.str());
       }
 
@@ -220,7 +257,14 @@ inline void Inotify::watchFile(fs::path filePath){
       throw std::runtime_error(errorStream.str());
 
     }
+
+    // The same directory may already be watched under an older path
+    auto old = mDirectorieMap.find(wd);
+    if(old != mDirectorieMap.end()){
+      mPathMap.erase(old->second.string());
+    }
     mDirectorieMap[wd] = filePath;
+    mPathMap[filePath.string()] = wd;
   }
 
 }
@@ -239,19 +283,121 @@ inline void Inotify::ignoreFileOnce(fs::path file){
  *
  */
 inline void Inotify::removeWatch(int wd){
-  int result = inotify_rm_watch(mInotifyFd, wd);
-  if(result == -1){
+  forgetWatch(wd);
+
+  // EINVAL means the kernel already removed the watch
+  if(inotify_rm_watch(mInotifyFd, wd) == -1 && errno != EINVAL){
     mError = errno;
-    std::stringstream errorStream;
-    errorStream << "Failed to remove watch! " << strerror(mError) << ".";
-    throw std::runtime_error(errorStream.str());
+    std::cerr << "Failed to remove watch! " << strerror(mError) << ".\n";
+  }
+}
+
+/**
+ * @brief Drops the bookkeeping of a watch that the kernel
+ *        already removed (IN_IGNORED).
+ *
+ * @param wd watchdescriptor
+ *
+ */
+inline void Inotify::forgetWatch(int wd){
+  auto it = mDirectorieMap.find(wd);
+  if(it == mDirectorieMap.end()){
+    return;
+  }
+
+  // Only forget the path if it still belongs to this watch
+  auto path = mPathMap.find(it->second.string());
+  if(path != mPathMap.end() && path->second == wd){
+    mPathMap.erase(path);
+  }
+  mDirectorieMap.erase(it);
+}
+
+/**
+ * @brief Removes the watches of a directory and everything
+ *        below it, used when a directory leaves the tree.
+ *
+ * @param path of the directory
+ *
+ */
+inline void Inotify::removeWatchesBelow(fs::path path){
+  std::string prefix = path.string() + "/";
+  std::vector<int> watches;
+
+  for(auto &entry : mDirectorieMap){
+    std::string current = entry.second.string();
+    if(current == path.string() || current.compare(0, prefix.size(), prefix) == 0){
+      watches.push_back(entry.first);
+    }
+  }
+
+  for(int wd : watches){
+    removeWatch(wd);
+  }
+}
+
+/**
+ * @brief Watches a directory that appeared inside the tree and
+ *        queues an IN_CREATE event for everything already
+ *        inside it, since those entries were created before
+ *        the watch existed and raised no events.
+ *
+ * @param path of the new directory
+ *
+ */
+inline void Inotify::watchNewDirectory(fs::path path){
+  try{
+    watchDirectoryRecursively(path);
+  }
+  catch(std::exception &e){
+    std::cerr << e.what() << "\n";
+    return;
+  }
+
+  boost::system::error_code error;
+  fs::recursive_directory_iterator it(path, error);
+  fs::recursive_directory_iterator end;
+
+  while(!error && it != end){
+    fs::path currentPath = *it;
+    uint32_t mask = IN_CREATE;
+    if(fs::is_directory(fs::symlink_status(currentPath))){
+      mask |= IN_ISDIR;
+    }
+
+    if((mask & mEventMask) && !isIgnored(currentPath.string())){
+      mEventQueue.push(FileSystemEvent(-1, mask, currentPath));
+    }
+    it.increment(error);
+  }
+}
+
+inline size_t Inotify::watchCount() const{
+  return mDirectorieMap.size();
+}
+
+/**
+ * @brief Reads the per-user watch limit of the kernel.
+ *
+ * @return max_user_watches, or 0 if it can't be read
+ *
+ */
+inline size_t Inotify::maxUserWatches(){
+  std::ifstream file("/proc/sys/fs/inotify/max_user_watches");
+  size_t limit = 0;
+  if(!(file >> limit)){
+    return 0;
   }
-  mDirectorieMap.erase(wd);
+  return limit;
 }
 
 
 inline fs::path Inotify::wdToPath(int wd){
-  return mDirectorieMap[wd];
+  auto it = mDirectorieMap.find(wd);
+  if(it == mDirectorieMap.end()){
+    return fs::path();
+  }
+  return it->second;
 
 }
 
@@ -262,82 +408,140 @@ inline fs::path Inotify::wdToPath(int wd){
  *        function can be called in some while(true)
  *        loop.
  *
+ *        Events are read in large batches into a heap buffer,
+ *        so that bursts are drained quickly and the kernel
+ *        queue is less likely to overflow.
+ *
  * @return A new FileSystemEvent
  *
  */
 inline FileSystemEvent Inotify::getNextEvent(){
+  while(mEventQueue.empty()){
+    readEvents();
+  }
+
+  // Return next event
+  FileSystemEvent event = mEventQueue.front();
+  mEventQueue.pop();
+  return event;
+}
+
+/**
+ * @brief Waits at most timeoutMs milliseconds for an event,
+ *        without consuming it. Used to decide whether an
+ *        IN_MOVED_FROM will be followed by its IN_MOVED_TO.
+ *
+ * @return True if getNextEvent will return without blocking
+ *
+ */
+inline bool Inotify::hasEvent(int timeoutMs){
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while(mEventQueue.empty()){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    if(elapsed >= timeoutMs){
+      return false;
+    }
+
+    struct pollfd ready = {mInotifyFd, POLLIN, 0};
+    int result = poll(&ready, 1, (int) (timeoutMs - elapsed));
+    if(result == -1 && errno != EINTR){
+      mError = errno;
+      return false;
+    }
+    if(result > 0){
+      // The events read may all be filtered out, so keep waiting
+      readEvents();
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Blocking read of the next batch of events from the
+ *        inotify fd into the event queue.
+ *
+ */
+inline void Inotify::readEvents(){
   int length = 0;
-  char buffer[EVENT_BUF_LEN];
+  char *buffer = mEventBuffer.data();
   time_t currentEventTime = time(NULL);
-  std::vector<FileSystemEvent> events;
 
   // Read Events from fd into buffer
-  while(mEventQueue.empty()){
-    length = 0;
-    memset(&buffer, 0, EVENT_BUF_LEN);
-    while(length <= 0 ){
-      length = read(mInotifyFd, buffer, EVENT_BUF_LEN);
-      currentEventTime = time(NULL);
-      if(length == -1){
-	mError = errno;
-	if(mError != EINTR){
-	  continue;
-
-	}
+  while(length <= 0 ){
+    length = read(mInotifyFd, buffer, mEventBuffer.size());
+    currentEventTime = time(NULL);
+    if(length == -1){
+      mError = errno;
+      if(mError != EINTR){
+        continue;
 
       }
 
     }
 
-    // Read events from buffer into queue
-    currentEventTime = time(NULL);
-    int i = 0;
-    while(i < length){
-      inotify_event *event = ((struct inotify_event*) &buffer[i]);
-      fs::path path(wdToPath(event->wd) / std::string(event->name));
-      if(fs::is_directory(path)){
-	event->mask |= IN_ISDIR;
-      }
-      FileSystemEvent fsEvent(event->wd, event->mask, path);
+  }
 
-      if(!fsEvent.path.empty()){
-	events.push_back(fsEvent);
-	
-      }
-      else{
-	// Event is not complete --> ignore
-      }
+  // Read events from buffer into queue
+  currentEventTime = time(NULL);
+  int i = 0;
+  while(i < length){
+    inotify_event *event = ((struct inotify_event*) &buffer[i]);
+    i += EVENT_SIZE + event->len;
+
+    // The kernel dropped events; there is no path to report
+    if(event->mask & IN_Q_OVERFLOW){
+      mEventQueue.push(FileSystemEvent(event->wd, event->mask, fs::path()));
+      continue;
+    }
 
-      i += EVENT_SIZE + event->len;
+    // The kernel removed the watch (directory deleted or unmounted)
+    if(event->mask & IN_IGNORED){
+      forgetWatch(event->wd);
+      continue;
+    }
 
+    fs::path watchPath = wdToPath(event->wd);
+    if(watchPath.empty()){
+      // Event of a watch that was already removed
+      continue;
     }
-    
-    
-
-    // Filter events
-    for(auto eventIt = events.begin(); eventIt < events.end(); ++eventIt){
-      FileSystemEvent currentEvent = *eventIt;
-      if(onTimeout(currentEventTime)){
-	events.erase(eventIt);
-    
-      }
-      else if(isIgnored(currentEvent.path.string())){
-      	events.erase(eventIt);
+
+    fs::path path(event->len > 0 ? watchPath / std::string(event->name) : watchPath);
+    if(fs::is_directory(path)){
+      event->mask |= IN_ISDIR;
+    }
+    FileSystemEvent fsEvent(event->wd, event->mask, path, event->cookie);
+
+    if(!(event->mask & mEventMask)){
+      // Only needed to maintain the watch tree
+    }
+    else if(onTimeout(currentEventTime)){
+      // Filtered by the event timeout
+    }
+    else if(isIgnored(fsEvent.path.string())){
+      // Filtered by the ignore list
+    }
+    else{
+      mLastEventTime = currentEventTime;
+      mEventQueue.push(fsEvent);
+    }
+
+    // Keep the watch tree in sync with the directories
+    if(event->mask & IN_ISDIR){
+      if(event->mask & (IN_CREATE | IN_MOVED_TO)){
+        watchNewDirectory(path);
       }
-      else{
-	mLastEventTime = currentEventTime;
-	mEventQueue.push(currentEvent);
+      else if(event->mask & IN_MOVED_FROM){
+        removeWatchesBelow(path);
       }
-
     }
 
   }
 
-  // Return next event
-  FileSystemEvent event = mEventQueue.front();
-  mEventQueue.pop();
-  return event;
-
 }
 
 inline int Inotify::getLastErrno(){
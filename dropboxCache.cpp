@@ -0,0 +1,179 @@
+#include "dropboxCache.h"
+
+//=============================================================================
+// FileCache
+//=============================================================================
+FileCache::FileCache(size_t budget_bytes, size_t max_file_bytes) {
+    budget_bytes_ = budget_bytes;
+    max_file_bytes_ = max_file_bytes;
+    probation_bytes_ = 0;
+    protected_bytes_ = 0;
+}
+
+
+/*
+ * Altera o orçamento da cache.  As entradas que não couberem no novo
+ * orçamento são despejadas.
+ */
+void FileCache::configure(size_t budget_bytes, size_t max_file_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_bytes_ = budget_bytes;
+    max_file_bytes_ = max_file_bytes;
+    evict();
+}
+
+
+/*
+ * Indica se um arquivo desse tamanho pode ser guardado na cache.  Serve para
+ * que o chamador não precise ler o arquivo inteiro para a memória à toa.
+ */
+bool FileCache::accepts(size_t file_size) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return file_size <= max_file_bytes_ && file_size <= budget_bytes_;
+}
+
+
+/*
+ * Retorna o conteúdo do arquivo, caso ele esteja na cache com a versão
+ * pedida.  Caso contrário retorna um ponteiro nulo.
+ */
+FileBytes FileCache::get(const std::string &user_id, const std::string &filename, time_t version) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(make_key(user_id, filename));
+    if (it == index_.end()) {
+        return nullptr;
+    }
+
+    EntryList::iterator entry = it->second;
+    if (entry->version != version) {
+        // A entrada é de uma versão antiga do arquivo
+        erase(entry);
+        return nullptr;
+    }
+
+    promote(entry);
+    return entry->bytes;
+}
+
+
+/*
+ * Insere o conteúdo de um arquivo na cache, substituindo qualquer versão
+ * anterior.  Novas entradas sempre começam no segmento de experiência.
+ */
+void FileCache::put(const std::string &user_id, const std::string &filename, time_t version, FileBytes bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::string key = make_key(user_id, filename);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        erase(it->second);
+    }
+
+    if (!bytes || bytes->size() > max_file_bytes_ || bytes->size() > budget_bytes_) {
+        return;
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.version = version;
+    entry.bytes = std::move(bytes);
+    entry.segment = Probation;
+
+    probation_bytes_ += entry.bytes->size();
+    probation_.push_front(std::move(entry));
+    index_[key] = probation_.begin();
+
+    evict();
+}
+
+
+/*
+ * Remove o arquivo da cache.  Deve ser chamada sempre que o arquivo for
+ * alterado ou excluído no servidor.
+ */
+void FileCache::invalidate(const std::string &user_id, const std::string &filename) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(make_key(user_id, filename));
+    if (it != index_.end()) {
+        erase(it->second);
+    }
+}
+
+
+size_t FileCache::size_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return probation_bytes_ + protected_bytes_;
+}
+
+
+std::string FileCache::make_key(const std::string &user_id, const std::string &filename) {
+    // O '/' não pode aparecer num user_id, pois ele é o nome de um diretório
+    return user_id + '/' + filename;
+}
+
+
+FileCache::EntryList &FileCache::segment_list(Segment segment) {
+    return segment == Probation ? probation_ : protected_;
+}
+
+
+void FileCache::erase(EntryList::iterator it) {
+    if (it->segment == Probation) {
+        probation_bytes_ -= it->bytes->size();
+    }
+    else {
+        protected_bytes_ -= it->bytes->size();
+    }
+    index_.erase(it->key);
+    segment_list(it->segment).erase(it);
+}
+
+
+/*
+ * Move a entrada para o início do segmento protegido.  Se o segmento
+ * protegido ultrapassar sua parte do orçamento, as entradas menos usadas
+ * dele voltam ao início do segmento de experiência, ganhando mais uma chance.
+ */
+void FileCache::promote(EntryList::iterator it) {
+    size_t size = it->bytes->size();
+    EntryList &source = segment_list(it->segment);
+
+    if (it->segment == Probation) {
+        probation_bytes_ -= size;
+        protected_bytes_ += size;
+        it->segment = Protected;
+    }
+    protected_.splice(protected_.begin(), source, it);
+
+    size_t protected_budget = budget_bytes_ / 100 * CACHE_PROTECTED_PERCENT;
+    while (protected_bytes_ > protected_budget && protected_.size() > 1) {
+        auto last = std::prev(protected_.end());
+        size_t last_size = last->bytes->size();
+        protected_bytes_ -= last_size;
+        probation_bytes_ += last_size;
+        last->segment = Probation;
+        probation_.splice(probation_.begin(), protected_, last);
+    }
+}
+
+
+/*
+ * Despeja entradas até que a cache caiba no orçamento.  As vítimas são
+ * escolhidas primeiro do fim do segmento de experiência.
+ */
+void FileCache::evict() {
+    while (probation_bytes_ + protected_bytes_ > budget_bytes_) {
+        if (!probation_.empty()) {
+            erase(std::prev(probation_.end()));
+        }
+        else if (!protected_.empty()) {
+            erase(std::prev(protected_.end()));
+        }
+        else {
+            break;
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef __DROPBOX_CACHE_H__
+#define __DROPBOX_CACHE_H__
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ctime>
+#include <iterator>
+
+// Orçamento padrão da cache (64 MiB) e tamanho máximo de um arquivo na cache
+// (4 MiB).  Ambos podem ser alterados por argumentos do servidor.
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_FILE_BYTES (4 * 1024 * 1024)
+
+// Percentual do orçamento reservado ao segmento protegido
+#define CACHE_PROTECTED_PERCENT 80
+
+// Conteúdo imutável de um arquivo, compartilhado entre a cache e as threads
+// que estão enviando o arquivo.
+typedef std::shared_ptr<const std::vector<char>> FileBytes;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * FileCache
+ * ----------------------------------------------------------------------------
+ * Cache em memória dos arquivos mais acessados do servidor, limitada por um
+ * orçamento de bytes.
+ *
+ * A política de despejo é LRU segmentada: arquivos novos entram no segmento
+ * de experiência ("probation") e só passam ao segmento protegido quando são
+ * acessados de novo.  Assim, uma varredura de arquivos lidos uma única vez
+ * não expulsa da cache os arquivos realmente populares.
+ *
+ * As entradas são indexadas por (usuário, arquivo) e guardam a versão do
+ * arquivo (sua data de modificação).  Uma busca com versão diferente é
+ * tratada como falha e descarta a entrada obsoleta.
+ *
+ * Todos os métodos são seguros para uso por várias threads.
+ * ----------------------------------------------------------------------------
+ */
+class FileCache {
+public:
+    FileCache(size_t budget_bytes, size_t max_file_bytes);
+
+    void configure(size_t budget_bytes, size_t max_file_bytes);
+
+    bool accepts(size_t file_size) const;
+
+    FileBytes get(const std::string &user_id, const std::string &filename, time_t version);
+    void put(const std::string &user_id, const std::string &filename, time_t version, FileBytes bytes);
+    void invalidate(const std::string &user_id, const std::string &filename);
+
+    size_t size_bytes() const;
+
+private:
+    enum Segment { Probation, Protected };
+
+    struct Entry {
+        std::string key;
+        time_t version;
+        FileBytes bytes;
+        Segment segment;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    static std::string make_key(const std::string &user_id, const std::string &filename);
+
+    EntryList &segment_list(Segment segment);
+    void erase(EntryList::iterator it);
+    void promote(EntryList::iterator it);
+    void evict();
+
+    size_t budget_bytes_;
+    size_t max_file_bytes_;
+    size_t probation_bytes_;
+    size_t protected_bytes_;
+
+    // O início de cada lista é o item usado mais recentemente
+    EntryList probation_;
+    EntryList protected_;
+    std::unordered_map<std::string, EntryList::iterator> index_;
+
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "dropboxChunked.h"
+
+#include <algorithm>
+#include <iostream>
+
+
+//=============================================================================
+// ChunkTracker
+//=============================================================================
+ChunkTracker::ChunkTracker(uint64_t file_size, uint64_t chunk_size) {
+    file_size_ = file_size;
+    chunk_size_ = std::max<uint64_t>(chunk_size, 1);
+    count_ = (size_t) ((file_size_ + chunk_size_ - 1) / chunk_size_);
+    next_ = 0;
+    done_.assign(count_, false);
+    completed_ = 0;
+}
+
+
+size_t ChunkTracker::count() const {
+    return count_;
+}
+
+
+ByteRange ChunkTracker::range(size_t index) const {
+    ByteRange range{};
+    range.offset = index * chunk_size_;
+    range.length = std::min(chunk_size_, file_size_ - range.offset);
+    return range;
+}
+
+
+/*
+ * Entrega o próximo pedaço a ser transferido, dando preferência aos que
+ * falharam.  Retorna falso quando não há mais pedaços a entregar.
+ */
+bool ChunkTracker::next(size_t *index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!retry_.empty()) {
+        *index = retry_.front();
+        retry_.pop_front();
+        return true;
+    }
+    if (next_ < count_) {
+        *index = next_++;
+        return true;
+    }
+    return false;
+}
+
+
+void ChunkTracker::done(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index < count_ && !done_[index]) {
+        done_[index] = true;
+        ++completed_;
+    }
+}
+
+
+void ChunkTracker::failed(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index < count_ && !done_[index]) {
+        retry_.push_back(index);
+    }
+}
+
+
+bool ChunkTracker::complete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return completed_ == count_;
+}
+
+
+//=============================================================================
+// ChunkSink
+//=============================================================================
+ChunkSink::ChunkSink(FileSink &target, ByteRange range) : target_(target), range_(range), failed_(false) {}
+
+
+bool ChunkSink::write(uint64_t offset, const char *data, size_t size) {
+    if (offset < range_.offset || offset + size > range_.offset + range_.length) {
+        if (!failed_) {
+            std::cerr << "Bytes recebidos fora do pedaço\n";
+        }
+        failed_ = true;
+        return false;
+    }
+    return target_.write(offset, data, size);
+}
+
+
+// O tamanho do arquivo foi ajustado antes dos pedaços, e os buracos do
+// pedaço continuam como buracos
+bool ChunkSink::finish(uint64_t file_size) {
+    return target_.finish(file_size) && !failed_;
+}
+
+
+//=============================================================================
+// ChunkGate
+//=============================================================================
+ChunkGate::ChunkGate(TransferGate &inner, std::atomic<time_t> &last_used) : inner_(inner), last_used_(last_used) {}
+
+
+void ChunkGate::acquire(size_t bytes) {
+    inner_.acquire(bytes);
+    last_used_ = time(nullptr);
+}
+
+
+void ChunkGate::release(size_t bytes) {
+    inner_.release(bytes);
+    last_used_ = time(nullptr);
+}
@@ -0,0 +1,112 @@
+#ifndef __DROPBOX_CHUNKED_H__
+#define __DROPBOX_CHUNKED_H__
+
+#include <deque>
+#include <atomic>
+#include <ctime>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include "dropboxUtil.h"
+#include "dropboxRanges.h"
+
+// Tamanho dos pedaços de uma transferência em paralelo
+#define CHUNK_SIZE (16 * 1024 * 1024)
+
+// Arquivos a partir deste tamanho são transferidos em pedaços
+#define CHUNKED_TRANSFER_THRESHOLD (64 * 1024 * 1024)
+
+// Conexões padrão de uma transferência em pedaços (1 desliga)
+#define DEFAULT_TRANSFER_STREAMS 4
+
+// Segundos sem nenhum byte depois dos quais o servidor descarta uma
+// transferência em pedaços abandonada
+#define CHUNKED_IDLE_TIMEOUT 300
+
+// Intervalo, em segundos, entre as procuras por transferências abandonadas
+#define CHUNKED_EXPIRE_INTERVAL 60
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ChunkTracker
+ * ----------------------------------------------------------------------------
+ * Divide um arquivo em pedaços de tamanho fixo e acompanha quais já foram
+ * transferidos.  Várias conexões transferem os pedaços ao mesmo tempo, cada
+ * uma pedindo o próximo com "next".  Um pedaço cuja conexão falhou volta
+ * com "failed" e é entregue de novo a outra conexão.
+ * ----------------------------------------------------------------------------
+ */
+class ChunkTracker {
+public:
+    ChunkTracker(uint64_t file_size, uint64_t chunk_size);
+
+    size_t count() const;
+    ByteRange range(size_t index) const;
+
+    bool next(size_t *index);
+    void done(size_t index);
+    void failed(size_t index);
+    bool complete();
+
+private:
+    uint64_t file_size_;
+    uint64_t chunk_size_;
+    size_t count_;
+
+    size_t next_;
+    std::deque<size_t> retry_;
+
+    std::vector<bool> done_;
+    size_t completed_;
+
+    std::mutex mutex_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ChunkSink
+ * ----------------------------------------------------------------------------
+ * Recebe um pedaço enviado por um RangeSource e o escreve na sua posição do
+ * arquivo através de "target".  Bytes fora do pedaço são recusados, para
+ * que uma conexão não escreva sobre os pedaços das outras.  O arquivo já
+ * deve ter o tamanho final.
+ * ----------------------------------------------------------------------------
+ */
+class ChunkSink : public FileSink {
+public:
+    ChunkSink(FileSink &target, ByteRange range);
+
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+private:
+    FileSink &target_;
+    ByteRange range_;
+    bool failed_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ChunkGate
+ * ----------------------------------------------------------------------------
+ * Portão dos blocos de um pedaço.  Repassa cada bloco a "inner" e anota em
+ * "last_used" o momento do bloco, para que um pedaço lento, limitado pela
+ * banda do usuário, não faça a transferência parecer abandonada.
+ * ----------------------------------------------------------------------------
+ */
+class ChunkGate : public TransferGate {
+public:
+    ChunkGate(TransferGate &inner, std::atomic<time_t> &last_used);
+
+    void acquire(size_t bytes) override;
+    void release(size_t bytes) override;
+
+private:
+    TransferGate &inner_;
+    std::atomic<time_t> &last_used_;
+};
+
+#endif
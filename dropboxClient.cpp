@@ -6,8 +6,13 @@
 #include <sys/socket.h>
 #include <strings.h>
 #include "dropboxServer.h"
+#include "dropboxRelay.h"
+#include "dropboxExpected.h"
+#include "dropboxSnapshot.h"
+#include "dropboxTransfer.h"
+#include "dropboxJournal.h"
+#include "dropboxIgnore.h"
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 #include "Inotify-master/FileSystemEvent.h"
 #include "Inotify-master/Inotify.h"
 #include <sstream>
@@ -15,6 +20,10 @@
 #include <chrono>
 #include <netdb.h>
 #include <set>
+#include <sys/stat.h>
+#include <csignal>
+#include <atomic>
+#include <random>
 
 namespace fs = boost::filesystem;
 
@@ -41,6 +50,31 @@ namespace fs = boost::filesystem;
 std::mutex command_mutex;
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * transfer_queue
+ * ----------------------------------------------------------------------------
+ * Fila de uploads, downloads e deletes, atendida por workers com conexões
+ * próprias.  A interface, a thread do inotify e a sincronização apenas
+ * enfileiram transferências, sem esperar que elas terminem.
+ * ----------------------------------------------------------------------------
+ */
+TransferQueue transfer_queue;
+size_t transfer_workers = DEFAULT_TRANSFER_WORKERS;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * transfer_streams
+ * ----------------------------------------------------------------------------
+ * Conexões usadas ao mesmo tempo por cada transferência de um arquivo a
+ * partir de CHUNKED_TRANSFER_THRESHOLD bytes, que é dividido em pedaços.
+ * Com 1, todo arquivo é transferido por uma única conexão.
+ * ----------------------------------------------------------------------------
+ */
+size_t transfer_streams = DEFAULT_TRANSFER_STREAMS;
+
+
 /*
  * ----------------------------------------------------------------------------
  * user_id
@@ -63,6 +97,30 @@ std::string user_id;
 fs::path user_dir;
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * ignore_patterns
+ * ----------------------------------------------------------------------------
+ * Padrões do SYNC_IGNORE_FILE do diretório de sincronização.  Os arquivos
+ * ignorados não são enviados nem baixados.  O matcher é recompilado quando o
+ * arquivo muda, e trocado inteiro, então quem o está usando continua com o
+ * anterior.
+ * ----------------------------------------------------------------------------
+ */
+std::shared_ptr<const IgnoreMatcher> ignore_patterns = std::make_shared<IgnoreMatcher>();
+std::mutex ignore_patterns_mutex;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * server_hostname
+ * ----------------------------------------------------------------------------
+ * O nome do servidor, guardado para as reconexões.
+ * ----------------------------------------------------------------------------
+ */
+std::string server_hostname;
+
+
 /*
  * ----------------------------------------------------------------------------
  * port_number
@@ -93,6 +151,92 @@ sockaddr_in server_address{};
 int socket_fd;
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * session_id
+ * ----------------------------------------------------------------------------
+ * O identificador da sessão, enviado pelo servidor quando a conexão é aceita.
+ * ----------------------------------------------------------------------------
+ */
+uint64_t session_id;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * sync_socket_fd
+ * ----------------------------------------------------------------------------
+ * O socket do canal de sincronização, por onde o servidor repassa os arquivos
+ * enviados pelos outros dispositivos do usuário.
+ * ----------------------------------------------------------------------------
+ */
+int sync_socket_fd = -1;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * connected
+ * ----------------------------------------------------------------------------
+ * Indica se o cliente está conectado ao servidor.  Quando uma conexão cai,
+ * "connection_lost" acorda a thread de reconexão, que pausa a fila de
+ * transferências e tenta reconectar com esperas cada vez maiores.
+ *
+ * "exiting" impede novas reconexões quando o programa está terminando.
+ * ----------------------------------------------------------------------------
+ */
+std::atomic<bool> connected(false);
+bool exiting = false;
+std::mutex connection_mutex;
+std::condition_variable connection_condition;
+
+std::thread relay_thread;
+std::thread reconnect_thread;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * device_name
+ * ----------------------------------------------------------------------------
+ * Nome deste dispositivo, enviado ao servidor depois de cada conexão.  O
+ * servidor usa o nome para encontrar as regras de sincronização seletiva do
+ * dispositivo.  Por padrão é o hostname da máquina.
+ * ----------------------------------------------------------------------------
+ */
+std::string device_name;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * replica_addresses
+ * ----------------------------------------------------------------------------
+ * Réplicas do servidor, no formato host:porta, que atendem os downloads e as
+ * listagens pedidos pelo usuário.  A sessão com a réplica é aberta no
+ * primeiro uso e usada por uma leitura de cada vez.  Se a réplica falhar ou
+ * recusar a sessão por estar atrasada, a leitura é feita no servidor, e a
+ * próxima réplica é tentada depois de REPLICA_RETRY_DELAY_MS.
+ *
+ * As escritas, as versões anteriores e os downloads do diretório de
+ * sincronização sempre usam o servidor, que tem as mudanças mais recentes.
+ * ----------------------------------------------------------------------------
+ */
+std::vector<std::string> replica_addresses;
+size_t next_replica = 0;
+int replica_socket_fd = -1;
+std::chrono::steady_clock::time_point replica_retry_at;
+std::mutex replica_mutex;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * journal
+ * ----------------------------------------------------------------------------
+ * Mudanças do diretório de sincronização feitas sem conexão com o servidor,
+ * ou cujas transferências falharam por causa de uma queda.  São enviadas
+ * depois da reconexão, ou na próxima execução do cliente.
+ * ----------------------------------------------------------------------------
+ */
+ChangeJournal journal;
+
+
 /*
  * ----------------------------------------------------------------------------
  * inotify
@@ -104,6 +248,49 @@ Inotify inotify(IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO |
                 IN_DELETE | IN_CLOSE_WRITE);
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * local_hashes
+ * ----------------------------------------------------------------------------
+ * Cache dos hashes de conteúdo dos arquivos locais, indexada pelo inode.
+ *
+ * Uma entrada só é válida enquanto o tamanho e a data de modificação do
+ * arquivo forem os mesmos de quando o hash foi calculado.  Assim, o arquivo
+ * só precisa ser lido de novo quando realmente for alterado.
+ * ----------------------------------------------------------------------------
+ */
+struct LocalHash {
+    off_t size;
+    timespec modified;
+    ContentHash hash;
+};
+
+std::map<ino_t, LocalHash> local_hashes;
+std::mutex local_hashes_mutex;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * expected_writes
+ * ----------------------------------------------------------------------------
+ * Escritas feitas pelo próprio cliente no diretório de sincronização.  Os
+ * eventos do inotify causados por elas não são enviados ao servidor.
+ * ----------------------------------------------------------------------------
+ */
+ExpectedWrites expected_writes;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * local_snapshot
+ * ----------------------------------------------------------------------------
+ * Último estado conhecido do diretório de sincronização, usado para
+ * recuperar as mudanças perdidas quando a fila do inotify transborda.
+ * ----------------------------------------------------------------------------
+ */
+DirectorySnapshot local_snapshot;
+
+
 //=============================================================================
 // Funções
 //=============================================================================
@@ -135,20 +322,75 @@ int main(int argc, char **argv) {
     char *end;
     port_number = static_cast<uint16_t>(std::strtol(argv[3], &end, 10));
 
+    // Opções no formato --chave=valor
+    for (int i = 4; i < argc; ++i) {
+        std::string option(argv[i]);
+        if (option.compare(0, 19, "--transfer-workers=") == 0) {
+            transfer_workers = std::strtoul(option.c_str() + 19, nullptr, 10);
+        }
+        else if (option.compare(0, 10, "--replica=") == 0) {
+            replica_addresses.push_back(option.substr(10));
+        }
+        else if (option.compare(0, 9, "--device=") == 0) {
+            device_name = option.substr(9);
+        }
+        else if (option.compare(0, 10, "--streams=") == 0) {
+            transfer_streams = std::strtoul(option.c_str() + 10, nullptr, 10);
+        }
+        else {
+            std::cerr << "Opção desconhecida: " << option << "\n";
+        }
+    }
+
+    if (device_name.empty()) {
+        char host[256] = {};
+        gethostname(host, sizeof(host) - 1);
+        device_name = host;
+    }
+
+    // Um servidor que cai no meio de uma escrita não deve derrubar o cliente
+    signal(SIGPIPE, SIG_IGN);
+
     // Tenta se conectar ao servidor.
+    server_hostname = hostname;
     if (connect_server(hostname, port_number) == ConnectionResult::Error) {
         std::cerr << "Erro ao se conectar com o servidor\n";
         std::exit(1);
     }
+    connected = true;
+
+    // Abre o canal de sincronização.  Sem ele o cliente continua funcionando,
+    // mas só recebe as mudanças dos outros dispositivos com "get_sync_dir".
+    if (connect_sync_channel() == ConnectionResult::Error) {
+        std::cerr << "Erro ao abrir o canal de sincronização\n";
+    }
 
     // Cria o diretório de sincronização
     create_sync_dir();
+    load_ignore_patterns();
+
+    // O journal fica fora do diretório de sincronização, para não ser
+    // enviado ao servidor
+    journal.open(user_dir.parent_path() / fs::path("." + user_dir.filename().string() + ".journal"));
 
-    // Sincroniza arquivos com o servidor
+    // Inicia os workers de transferência.  Sem workers, as transferências são
+    // feitas por uma única thread pela conexão principal.
+    transfer_queue.start(std::max<size_t>(transfer_workers, 1),
+                         transfer_workers > 0 ? WorkerConnector(connect_worker) : WorkerConnector([] { return -1; }),
+                         execute_transfer, transfer_finished);
+
+    // Sincroniza arquivos com o servidor, e envia as mudanças que ficaram no
+    // journal da última execução
     sync_client();
+    replay_journal();
 
     // Manda a global inotify cuidar do diretório de sincronização
     inotify.watchDirectoryRecursively(user_dir);
+    report_watch_usage();
+
+    // O snapshot é tirado depois do watch, para que nenhuma mudança fique
+    // entre os dois.
+    local_snapshot.capture(user_dir);
 
     // Cria thread para mater o cliente sincronizado com o servidor.
     // std::thread get_dir_sync_thread;
@@ -171,6 +413,14 @@ int main(int argc, char **argv) {
     }
     sync_thread.detach();
 
+    // Cria a thread que recebe os arquivos repassados pelo servidor
+    if (sync_socket_fd != -1) {
+        relay_thread = std::thread(run_relay_thread);
+    }
+
+    // Cria a thread que reconecta o cliente quando o servidor cai
+    reconnect_thread = std::thread(run_reconnect_thread);
+
 
     // Exibe a interface de comandos ao usuário
     run_interface();
@@ -193,47 +443,93 @@ int main(int argc, char **argv) {
  * ----------------------------------------------------------------------------
  */
 void run_sync_thread() {
+    fs::path ignore_file = user_dir / fs::path(SYNC_IGNORE_FILE);
 
-    // Padrão regex de arquivos que não queremos enviar ao servidor, pois são
-    // usados pelos programas para armazenar mudanças temporárias nos arquivos
-    // que estão sendo manipulados.
-    //
-    // Não queremos enviar qualquer arquivo do tipo .goutputstream-*,
-    // nem arquivos que comecem com "~"
-    boost::regex invalid_files_pattern{"^(\\.goutputstream|~)"};
+    // Um IN_MOVED_FROM esperando o IN_MOVED_TO do mesmo rename
+    bool move_pending = false;
+    FileSystemEvent moved_from(-1, 0, fs::path());
 
     while (true) {
+        // Sem o IN_MOVED_TO, o arquivo saiu do diretório de sincronização
+        if (move_pending && !inotify.hasEvent(MOVE_PAIR_WINDOW_MS)) {
+            submit_change(moved_from.path, JournalDelete);
+            move_pending = false;
+        }
+
         FileSystemEvent event = inotify.getNextEvent();
         auto mask = event.mask;
 
+        // Os dois eventos de um rename têm o mesmo cookie.  Qualquer outro
+        // evento entre eles também indica que o arquivo saiu do diretório.
+        bool paired = move_pending && mask & IN_MOVED_TO && event.cookie == moved_from.cookie;
+        if (move_pending && !paired) {
+            submit_change(moved_from.path, JournalDelete);
+        }
+        move_pending = false;
+
+        // O kernel descartou eventos: as mudanças são recuperadas comparando
+        // o diretório com o último estado conhecido.
+        if (mask & IN_Q_OVERFLOW) {
+            std::cerr << "Fila do inotify transbordou, verificando o diretório\n";
+            rescan_sync_dir();
+            continue;
+        }
+
         // O nome do arquivo que causou o evento, sem o caminho absoluto
         std::string filename = event.path.filename().string();
 
         std::cout << filename << " causou o evento\n";
 
+        // Os padrões mudaram, inclusive quando o arquivo foi baixado do
+        // servidor.  O arquivo em si continua sendo sincronizado.
+        if (event.path == ignore_file) {
+            load_ignore_patterns();
+        }
+
+        if (paired) {
+            submit_move(moved_from.path, event.path);
+            continue;
+        }
+
         if (mask & IN_MOVED_FROM ||
             mask & IN_DELETE ||
             mask & IN_MOVED_TO ||
             mask & IN_CREATE ||
-            mask & IN_MODIFY) {
+            mask & IN_MODIFY ||
+            mask & IN_CLOSE_WRITE) {
 
-            if (boost::regex_search(filename, invalid_files_pattern)) {
-                // Se o arquivo que causou o evento for temporário, pular o evento.
+            if (is_ignored(event.path)) {
+                // Se o arquivo que causou o evento for temporário ou ignorado,
+                // pular o evento.
                 //std::cout << "Arquivo " << event.path.string() << " não será enviado ao servidor\n";
                 continue;
             }
         }
 
-        if (mask & IN_MOVED_FROM || mask & IN_DELETE) {
-            std::lock_guard<std::mutex> lock(command_mutex);
-            send_delete_command(filename);
+        // Arquivos que acabaram de ser baixados não precisam voltar ao servidor
+        if ((mask & IN_MOVED_TO || mask & IN_CREATE || mask & IN_MODIFY || mask & IN_CLOSE_WRITE) &&
+            expected_writes.is_expected(event.path)) {
+            local_snapshot.update(event.path);
+            continue;
+        }
+
+        if (mask & IN_MOVED_FROM && !(mask & IN_ISDIR)) {
+            // O arquivo pode ter sido apenas renomeado
+            moved_from = event;
+            move_pending = true;
+            local_snapshot.remove(event.path);
         }
-        else if (mask & IN_MOVED_TO || mask & IN_CREATE || mask & IN_MODIFY) {
+        else if (mask & IN_MOVED_FROM || mask & IN_DELETE) {
+            submit_change(event.path, JournalDelete);
+            local_snapshot.remove(event.path);
+        }
+        else if (mask & IN_MOVED_TO || mask & IN_CREATE || mask & IN_MODIFY || mask & IN_CLOSE_WRITE) {
+            // Um arquivo existente que foi reescrito gera apenas IN_CLOSE_WRITE.
             // O evento deve ser causado por um arquivo comum, e não um link simbólico ou diretório.
             if (fs::is_regular_file(event.path)) {
-                std::lock_guard<std::mutex> lock(command_mutex);
                 // O caminho absoluto é necessário na hora de enviar arquivos.
-                send_file(event.path.string());
+                submit_change(event.path, JournalUpload);
+                local_snapshot.update(event.path);
             }
         }
 
@@ -246,6 +542,106 @@ void run_sync_thread() {
 #pragma clang diagnostic pop
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * load_ignore_patterns
+ * ----------------------------------------------------------------------------
+ * Compila os padrões do SYNC_IGNORE_FILE do diretório de sincronização.  Sem
+ * o arquivo, apenas os arquivos temporários são ignorados.
+ * ----------------------------------------------------------------------------
+ */
+void load_ignore_patterns() {
+    auto matcher = std::make_shared<IgnoreMatcher>();
+    matcher->load(user_dir / fs::path(SYNC_IGNORE_FILE));
+
+    std::lock_guard<std::mutex> lock(ignore_patterns_mutex);
+    ignore_patterns = matcher;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * is_ignored
+ * ----------------------------------------------------------------------------
+ * Verifica se um arquivo do diretório de sincronização é ignorado.
+ * ----------------------------------------------------------------------------
+ */
+bool is_ignored(const fs::path &absolute_path) {
+    std::shared_ptr<const IgnoreMatcher> matcher;
+    {
+        std::lock_guard<std::mutex> lock(ignore_patterns_mutex);
+        matcher = ignore_patterns;
+    }
+
+    std::string root = user_dir.string() + "/";
+    std::string path = absolute_path.string();
+    if (path.compare(0, root.size(), root) == 0) {
+        path.erase(0, root.size());
+    }
+    return matcher->ignored(path);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * rescan_sync_dir
+ * ----------------------------------------------------------------------------
+ * Compara o diretório de sincronização com o snapshot e envia ao servidor as
+ * mudanças encontradas, como se os eventos perdidos tivessem chegado.
+ *
+ * Apenas os metadados dos arquivos são lidos.  Arquivos alterados cujo
+ * conteúdo é o mesmo do servidor são resolvidos pelo hash, sem transferência.
+ * ----------------------------------------------------------------------------
+ */
+void rescan_sync_dir() {
+    std::vector<fs::path> changed;
+    std::vector<fs::path> removed;
+    local_snapshot.rescan(changed, removed);
+
+    std::cout << "Varredura: " << changed.size() << " alterados, " << removed.size() << " removidos\n";
+
+    for (const fs::path &path : removed) {
+        if (is_ignored(path)) {
+            continue;
+        }
+        submit_change(path, JournalDelete);
+    }
+
+    for (const fs::path &path : changed) {
+        if (is_ignored(path) || expected_writes.is_expected(path)) {
+            continue;
+        }
+        submit_change(path, JournalUpload);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * report_watch_usage
+ * ----------------------------------------------------------------------------
+ * Mostra quantos diretórios estão sendo observados e avisa quando o número
+ * se aproxima do limite de watches do usuário no kernel, pois diretórios
+ * criados depois disso não serão sincronizados automaticamente.
+ * ----------------------------------------------------------------------------
+ */
+void report_watch_usage() {
+    size_t watches = inotify.watchCount();
+    size_t limit = Inotify::maxUserWatches();
+
+    std::cout << "Observando " << watches << " diretórios";
+    if (limit > 0) {
+        std::cout << " (limite de " << limit << " watches)";
+    }
+    std::cout << "\n";
+
+    if (limit > 0 && watches * 10 > limit * 9) {
+        std::cerr << "Atenção: quase todos os watches do inotify estão em uso.  Aumente "
+                     "/proc/sys/fs/inotify/max_user_watches para observar mais diretórios\n";
+    }
+}
+
+
 #pragma clang diagnostic push // Desbilita warnings sobre loop infinito
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
 /*
@@ -265,6 +661,169 @@ void run_get_sync_dir_thread() {
 #pragma clang diagnostic pop
 
 
+/*
+ * ----------------------------------------------------------------------------
+ * run_relay_thread
+ * ----------------------------------------------------------------------------
+ * Recebe pelo canal de sincronização os arquivos que outros dispositivos do
+ * usuário estão enviando ao servidor.
+ *
+ * Cada arquivo é escrito num arquivo temporário começado por "~", que é
+ * ignorado pela thread do inotify.  Quando o servidor confirma o upload, o
+ * temporário recebe a data de modificação correta e é renomeado para o nome
+ * final.  Se o upload for abortado, o temporário é apagado.
+ *
+ * Se o servidor avisar que um arquivo mudou sem repassá-lo, ele é baixado
+ * normalmente.
+ *
+ * O canal só é encerrado pelo servidor se ele cair, então o fim do canal é
+ * tratado como uma queda da conexão.
+ * ----------------------------------------------------------------------------
+ */
+void run_relay_thread() {
+    struct RelayDownload {
+        FILE *file;
+        fs::path temp_path;
+        fs::path final_path;
+        uint64_t file_size;
+        time_t time;
+    };
+
+    std::map<uint64_t, RelayDownload> downloads;
+    std::vector<char> buffer;
+
+    while (true) {
+        RelayMessageType type;
+        if (!read_socket(sync_socket_fd, (void *) &type, sizeof(type))) {
+            std::cerr << "Canal de sincronização encerrado\n";
+            break;
+        }
+
+        uint64_t transfer_id = 0;
+        if (type != RelayChanged && type != RelayMoved) {
+            read_socket(sync_socket_fd, (void *) &transfer_id, sizeof(transfer_id));
+        }
+
+        switch (type) {
+        case RelayBegin: {
+            std::string filename = receive_string(sync_socket_fd);
+
+            RelayDownload download{};
+            read_socket(sync_socket_fd, (void *) &download.file_size, sizeof(download.file_size));
+            read_socket(sync_socket_fd, (void *) &download.time, sizeof(download.time));
+            download.final_path = user_dir / fs::path(filename);
+            download.temp_path = user_dir / fs::path("~" + filename + ".relay");
+            download.file = fopen(download.temp_path.c_str(), "wb");
+
+            if (download.file == nullptr) {
+                std::cerr << "Erro ao criar " << download.temp_path.string() << "\n";
+            }
+            downloads[transfer_id] = download;
+            break;
+        }
+
+        case RelayData: {
+            uint64_t offset = 0;
+            uint64_t size = 0;
+            read_socket(sync_socket_fd, (void *) &offset, sizeof(offset));
+            read_socket(sync_socket_fd, (void *) &size, sizeof(size));
+            buffer.resize(size);
+            read_socket(sync_socket_fd, (void *) buffer.data(), size);
+
+            // Cada bloco é escrito na sua posição; os trechos pulados ficam
+            // como buracos no arquivo temporário.
+            auto it = downloads.find(transfer_id);
+            if (it != downloads.end() && it->second.file != nullptr) {
+                if (pwrite(fileno(it->second.file), buffer.data(), size, (off_t) offset) != (ssize_t) size) {
+                    std::cerr << "Erro ao escrever " << it->second.temp_path.string() << "\n";
+                }
+            }
+            break;
+        }
+
+        case RelayCommit: {
+            ContentHash hash;
+            read_socket(sync_socket_fd, (void *) &hash, sizeof(hash));
+
+            auto it = downloads.find(transfer_id);
+            if (it != downloads.end() && it->second.file != nullptr) {
+                if (ftruncate(fileno(it->second.file), (off_t) it->second.file_size) != 0) {
+                    std::cerr << "Erro ao ajustar o tamanho de " << it->second.temp_path.string() << "\n";
+                }
+                fclose(it->second.file);
+                fs::last_write_time(it->second.temp_path, it->second.time);
+
+                expected_writes.expect(it->second.final_path);
+                fs::rename(it->second.temp_path, it->second.final_path);
+                expected_writes.complete(it->second.final_path);
+
+                remember_local_hash(it->second.final_path, hash);
+                std::cout << "Arquivo " << it->second.final_path.filename().string()
+                          << " recebido de outro dispositivo\n";
+            }
+            downloads.erase(transfer_id);
+            break;
+        }
+
+        case RelayAbort: {
+            auto it = downloads.find(transfer_id);
+            if (it != downloads.end() && it->second.file != nullptr) {
+                fclose(it->second.file);
+                fs::remove(it->second.temp_path);
+            }
+            downloads.erase(transfer_id);
+            break;
+        }
+
+        case RelayChanged: {
+            std::string filename = receive_string(sync_socket_fd);
+            queue_download(filename, user_dir / fs::path(filename), true, 0, Background);
+            break;
+        }
+
+        case RelayMoved: {
+            std::string from = receive_string(sync_socket_fd);
+            std::string to = receive_string(sync_socket_fd);
+            fs::path from_path = user_dir / fs::path(from);
+            fs::path to_path = user_dir / fs::path(to);
+            if (is_ignored(to_path)) {
+                break;
+            }
+
+            // Sem a cópia local, o arquivo é baixado com o novo nome
+            bool renamed = false;
+            if (fs::is_regular_file(from_path)) {
+                boost::system::error_code error;
+                expected_writes.expect(to_path);
+                fs::rename(from_path, to_path, error);
+                renamed = !error;
+                if (renamed) {
+                    expected_writes.complete(to_path);
+                }
+                else {
+                    expected_writes.cancel(to_path);
+                }
+            }
+            if (!renamed) {
+                queue_download(to, to_path, true, 0, Background);
+            }
+            break;
+        }
+        }
+    }
+
+    // Descarta os repasses que ficaram pela metade
+    for (auto &entry : downloads) {
+        if (entry.second.file != nullptr) {
+            fclose(entry.second.file);
+            fs::remove(entry.second.temp_path);
+        }
+    }
+
+    connection_lost();
+}
+
+
 /*
  * ----------------------------------------------------------------------------
  * connect_server
@@ -273,8 +832,8 @@ void run_get_sync_dir_thread() {
  *
  * Envia o user_id e espera a resposta.
  *
- * Se não houver 2 outros dispositivos do mesmo user_id conectados, a conexão
- * provavelmente será bem sucedida.
+ * Se o usuário ainda não tiver atingido o limite de dispositivos conectados
+ * definido no servidor, a conexão provavelmente será bem sucedida.
  *
  * Retorna um enum ConnectionResult com o resultado.
  * ----------------------------------------------------------------------------
@@ -301,89 +860,343 @@ ConnectionResult connect_server(std::string hostname, uint16_t port) {
     std::cout << "Tentando se conecar com o servidor (UserId: " << user_id << ")\n";
     if (connect(socket_fd, (sockaddr *) &server_address, sizeof(server_address)) < 0) {
         std::cerr << "Erro ao conectar com o servidor\n";
+        close(socket_fd);
+        socket_fd = -1;
         return ConnectionResult::Error;
     }
+    configure_socket(socket_fd);
 
     // Envia o tipo de conexão ao servidor
     ConnectionType type = ConnectionType::Normal;
     ssize_t bytes = write_socket(socket_fd, (const void *) &type, sizeof(type));
     if (bytes == -1) {
         std::cerr << "Erro enviando o tipo de conexão ao servidor";
+        close_socket(socket_fd);
+        socket_fd = -1;
         return ConnectionResult::Error;
     }
 
     send_string(socket_fd, user_id);
 
-    // Recebe o sinal de ok do servidor
+    // Recebe o sinal de ok do servidor e o identificador da sessão
     bool ok = false;
-    read_socket(socket_fd, (void *) &ok, sizeof(ok));
-
-    if (!ok) {
+    if (!read_socket(socket_fd, (void *) &ok, sizeof(ok)) || !ok ||
+        !read_socket(socket_fd, (void *) &session_id, sizeof(session_id))) {
+        close_socket(socket_fd);
+        socket_fd = -1;
         return ConnectionResult::Error;
     }
 
+    send_device_name(socket_fd);
     return ConnectionResult::Success;
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * print_interface
+ * send_device_name
  * ----------------------------------------------------------------------------
- * Imprime os comandos possíveis ao usuário.
+ * Informa o nome do dispositivo à sessão recém aberta, para que o servidor
+ * aplique as regras de sincronização seletiva dele.  O comando não tem
+ * resposta.
  * ----------------------------------------------------------------------------
  */
-void print_interface() {
-    std::cout << "Digite o comando:\n";
-    std::cout << "\tupload <path/filename.ext>\n";
-    std::cout << "\tdownload <filename.ext>\n";
-    std::cout << "\tdelete <filename.ext>\n";
-    std::cout << "\tlist_server\n";
-    std::cout << "\tlist_client\n";
-    std::cout << "\tget_sync_dir\n";
-    std::cout << "\texit\n";
+void send_device_name(int fd) {
+    Command command = SetDevice;
+    write_socket(fd, (const void *) &command, sizeof(command));
+    send_string(fd, device_name);
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * run_interface
+ * connect_sync_channel
  * ----------------------------------------------------------------------------
- * Fica esperando os comandos do usuário e envia esses comandos ao servidor.
+ * Abre o canal de sincronização com o servidor.
  *
- * Se o comando precisar de um argumento e ele não for fornecido, não haverá
- * tratamento de exceções e o programa irá falhar.
- *
- * A cada iteração a interface será imprimida na tela.
+ * É uma segunda conexão, do tipo Sync, identificada pelo user_id e pela
+ * sessão obtida em "connect_server".  O servidor só escreve nesse canal.
  *
- * Uma vez que um comando for digitado, o mutex de comandos será travado até
- * que o comando seja concluído.
+ * Retorna um enum ConnectionResult com o resultado.
  * ----------------------------------------------------------------------------
  */
-void run_interface() {
-    std::string delim(" ");
-    std::string input;
-    std::string command;
-    std::string argument;
+ConnectionResult connect_sync_channel() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return ConnectionResult::Error;
+    }
 
-    do {
-        print_interface();
-        std::getline(std::cin, input);
+    if (connect(fd, (sockaddr *) &server_address, sizeof(server_address)) < 0) {
+        close(fd);
+        return ConnectionResult::Error;
+    }
+    configure_socket(fd);
+
+    ConnectionType type = ConnectionType::Sync;
+    write_socket(fd, (const void *) &type, sizeof(type));
+    send_string(fd, user_id);
+    write_socket(fd, (const void *) &session_id, sizeof(session_id));
+
+    if (!read_bool(fd)) {
+        close_socket(fd);
+        return ConnectionResult::Error;
+    }
+
+    sync_socket_fd = fd;
+    return ConnectionResult::Success;
+}
+
+
+#pragma clang diagnostic push // Não precisamos de warnings para loops infinitos
+#pragma clang diagnostic ignored "-Wmissing-noreturn"
+/*
+ * ----------------------------------------------------------------------------
+ * run_reconnect_thread
+ * ----------------------------------------------------------------------------
+ * Espera a conexão com o servidor cair e reconecta o cliente.
+ *
+ * A fila de transferências é pausada, e as conexões antigas são derrubadas
+ * para que nenhum comando fique preso nelas.  As tentativas de reconexão
+ * esperam o dobro do tempo da anterior, até RECONNECT_MAX_DELAY_MS, mais
+ * uma parcela aleatória para que os clientes de um servidor que reiniciou
+ * não tentem todos ao mesmo tempo.
+ *
+ * Depois da reconexão são enviadas apenas as mudanças do journal, e baixados
+ * apenas os arquivos que mudaram no servidor, em vez de uma sincronização
+ * completa.
+ * ----------------------------------------------------------------------------
+ */
+void run_reconnect_thread() {
+    std::minstd_rand random(std::random_device{}());
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(connection_mutex);
+            connection_condition.wait(lock, [] { return !connected || exiting; });
+            if (exiting) {
+                return;
+            }
+        }
+
+        std::cerr << "Conexão com o servidor perdida\n";
+        transfer_queue.pause();
+
+        // Interrompe os comandos e as transferências que usam as conexões
+        // antigas.  As transferências que falharem vão para o journal.
+        shutdown(socket_fd, SHUT_RDWR);
+        if (sync_socket_fd != -1) {
+            shutdown(sync_socket_fd, SHUT_RDWR);
+        }
+        transfer_queue.reset_connections();
+
+        if (relay_thread.joinable()) {
+            relay_thread.join();
+        }
+        if (sync_socket_fd != -1) {
+            close_socket(sync_socket_fd);
+            sync_socket_fd = -1;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(command_mutex);
+            close_socket(socket_fd);
+            socket_fd = -1;
+        }
+
+        uint64_t delay = RECONNECT_MIN_DELAY_MS;
+        while (true) {
+            uint64_t wait = delay + random() % (delay / 2 + 1);
+            std::cout << "Reconectando em " << wait << " ms\n";
+            {
+                std::unique_lock<std::mutex> lock(connection_mutex);
+                if (connection_condition.wait_for(lock, std::chrono::milliseconds(wait), [] { return exiting; })) {
+                    return;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(command_mutex);
+            if (connect_server(server_hostname, port_number) == ConnectionResult::Success) {
+                break;
+            }
+            delay = std::min<uint64_t>(delay * 2, RECONNECT_MAX_DELAY_MS);
+        }
+
+        if (connect_sync_channel() == ConnectionResult::Error) {
+            std::cerr << "Erro ao abrir o canal de sincronização\n";
+        }
+        else {
+            relay_thread = std::thread(run_relay_thread);
+        }
+
+        std::cout << "Reconectado ao servidor\n";
+        connected = true;
+        transfer_queue.resume();
 
-        // Trava o mutex de comando
         std::lock_guard<std::mutex> lock(command_mutex);
+        replay_journal();
+        pull_server_changes();
+    }
+}
+#pragma clang diagnostic pop
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * connection_lost
+ * ----------------------------------------------------------------------------
+ * Avisa a thread de reconexão que uma conexão com o servidor falhou.
+ * ----------------------------------------------------------------------------
+ */
+void connection_lost() {
+    std::lock_guard<std::mutex> lock(connection_mutex);
+    connected = false;
+    connection_condition.notify_all();
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * require_connection
+ * ----------------------------------------------------------------------------
+ * Verifica se um comando que depende do servidor pode ser executado agora.
+ * ----------------------------------------------------------------------------
+ */
+bool require_connection() {
+    if (!connected) {
+        std::cout << "Sem conexão com o servidor\n";
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * print_interface
+ * ----------------------------------------------------------------------------
+ * Imprime os comandos possíveis ao usuário.
+ * ----------------------------------------------------------------------------
+ */
+void print_interface() {
+    std::cout << "Digite o comando:\n";
+    std::cout << "\tupload <path/filename.ext>\n";
+    std::cout << "\tdownload <filename.ext>\n";
+    std::cout << "\tdownload <filename.ext> <início-fim,...>\n";
+    std::cout << "\tversions <filename.ext>\n";
+    std::cout << "\tdownload_version <número> <filename.ext>\n";
+    std::cout << "\tdelete <filename.ext>\n";
+    std::cout << "\tlist_server\n";
+    std::cout << "\tlist_client\n";
+    std::cout << "\tget_sync_dir\n";
+    std::cout << "\tjobs\n";
+    std::cout << "\tcancel <id>\n";
+    std::cout << "\texit\n";
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * run_interface
+ * ----------------------------------------------------------------------------
+ * Fica esperando os comandos do usuário e envia esses comandos ao servidor.
+ *
+ * Se o comando precisar de um argumento e ele não for fornecido, não haverá
+ * tratamento de exceções e o programa irá falhar.
+ *
+ * A cada iteração a interface será imprimida na tela.
+ *
+ * Uma vez que um comando for digitado, o mutex de comandos será travado até
+ * que o comando seja concluído.
+ * ----------------------------------------------------------------------------
+ */
+void run_interface() {
+    std::string delim(" ");
+    std::string input;
+    std::string command;
+    std::string argument;
+
+    do {
+        print_interface();
+        std::getline(std::cin, input);
+
+        // Trava o mutex de comando
+        std::unique_lock<std::mutex> lock(command_mutex);
 
         command = input.substr(0, input.find(delim));
 
         if (command == "upload") {
             argument = input.substr(command.size() + 1);
-            std::cout << "Upload " << argument << "\n";
-            send_file(argument);
+            fs::path path = fs::absolute(fs::path(argument));
+
+            // Um arquivo de fora do diretório de sincronização não é uma
+            // mudança desse diretório: não substitui a transferência
+            // pendente de um arquivo com o mesmo nome, nem entra no journal
+            boost::system::error_code error;
+            bool in_sync_dir = fs::equivalent(path.parent_path(), user_dir, error);
+
+            uint64_t id = queue_upload(path, in_sync_dir, Interactive);
+            std::cout << "Upload " << argument << " (transferência " << id << ")\n";
         }
         else if (command == "download") {
             argument = input.substr(command.size() + 1);
-            std::cout << "Download " << argument << "\n";
-            get_file(argument);
+
+            // Um último argumento no formato de trechos (ver "parse_ranges")
+            // baixa apenas esses bytes do arquivo, para "<filename>.ranges".
+            // Os trechos não são o arquivo, e não podem ir para o diretório
+            // de sincronização.
+            size_t space = argument.rfind(delim);
+            std::vector<ByteRange> ranges;
+            if (space != std::string::npos && parse_ranges(argument.substr(space + 1), ranges)) {
+                std::string filename = argument.substr(0, space);
+                fs::path output = fs::current_path() / fs::path(filename + ".ranges");
+                std::string root = user_dir.string() + "/";
+                if (output.string().compare(0, root.size(), root) == 0) {
+                    std::cout << "Os trechos não podem ser baixados dentro do diretório de sincronização\n";
+                }
+                else {
+                    uint64_t id = queue_ranges(filename, ranges, output);
+                    std::cout << "Trechos de " << filename << " para " << output.string() << " (transferência "
+                              << id << ")\n";
+                }
+            }
+            else {
+                uint64_t id = queue_download(argument, fs::current_path() / fs::path(argument), false, 0,
+                                             Interactive);
+                std::cout << "Download " << argument << " (transferência " << id << ")\n";
+            }
+        }
+        else if (command == "versions") {
+            argument = input.substr(command.size() + 1);
+            if (require_connection()) {
+                list_file_versions(argument);
+            }
+        }
+        else if (command == "download_version") {
+            // O número da versão vem antes do nome, que pode ter espaços
+            argument = input.substr(command.size() + 1);
+            size_t space = argument.find(delim);
+            uint64_t version = std::strtoull(argument.substr(0, space).c_str(), nullptr, 10);
+            std::string filename = space == std::string::npos ? "" : argument.substr(space + 1);
+
+            if (version == 0 || filename.empty()) {
+                std::cout << "Uso: download_version <número> <filename.ext>\n";
+            }
+            else {
+                uint64_t id = queue_download(filename, fs::current_path() / fs::path(filename), false, 0,
+                                             Interactive, version);
+                std::cout << "Download " << filename << " versão " << version
+                          << " (transferência " << id << ")\n";
+            }
+        }
+        else if (command == "jobs") {
+            list_transfers();
+        }
+        else if (command == "cancel") {
+            argument = input.substr(command.size() + 1);
+            uint64_t id = std::strtoull(argument.c_str(), nullptr, 10);
+            if (!transfer_queue.cancel(id)) {
+                std::cout << "Transferência " << argument << " não encontrada\n";
+            }
         }
         else if (command == "delete") {
             argument = input.substr(command.size() + 1);
@@ -391,199 +1204,1134 @@ void run_interface() {
             delete_file(argument);
         }
         else if (command == "exit") {
+            // Sem workers, as transferências pendentes usam a conexão
+            // principal e precisam do mutex para terminar.
+            lock.unlock();
             close_connection();
         }
-        else if (command == "list_server") {
-            std::cout << "ListServer\n";
-            list_server_files();
+        else if (command == "list_server") {
+            std::cout << "ListServer\n";
+            if (require_connection()) {
+                list_server_files();
+            }
+        }
+        else if (command == "list_client") {
+            std::cout << "ListClient\n";
+            list_local_files();
+        }
+        else if (command == "get_sync_dir") {
+            std::cout << "GetSyncDir\n";
+            if (require_connection()) {
+                sync_client();
+            }
+        }
+        else {
+            std::cout << "Comando não reconhecido\n";
+        }
+
+        // Destrava o mutex de comando
+    }
+    while (command != "exit");
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_file
+ * ----------------------------------------------------------------------------
+ * Envia o arquivo ao servidor pela conexão principal.
+ *
+ * O caminho absoluto do arquivo deverá ser fornecido.
+ * ----------------------------------------------------------------------------
+ */
+void send_file(std::string absolute_filename) {
+    upload_file(socket_fd, fs::path(absolute_filename));
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * upload_file
+ * ----------------------------------------------------------------------------
+ * Envia o arquivo ao servidor pelo socket fornecido.
+ *
+ * São enviados o tamanho do arquivo, sua data de modificação e o hash do
+ * conteúdo.  O servidor responde se precisa do arquivo.  Em caso positivo, seus
+ * bytes são enviados.
+ *
+ * Retorna falso se a conexão falhou no meio do comando.
+ * ----------------------------------------------------------------------------
+ */
+bool upload_file(int fd, const fs::path &absolute_path) {
+    FILE *file;
+
+    if (!fs::exists(absolute_path) || !fs::is_regular_file(absolute_path)) {
+        std::cerr << "Arquivo " << absolute_path.string() << " não existe\n";
+        return true;
+    }
+
+    if ((file = fopen(absolute_path.c_str(), "rb")) == nullptr) {
+        std::cerr << "Arquivo " << absolute_path.string() << " não pode ser aberto\n";
+        return true;
+    }
+
+    // Envia o comando
+    Command command = Upload;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        fclose(file);
+        return false;
+    }
+
+    // Envia o nome do arquivo
+    std::string filename = absolute_path.filename().string();
+    send_string(fd, filename);
+
+    // Envia o tanho do arquivo
+    uint64_t file_size = fs::file_size(absolute_path);
+    write_socket(fd, (const void *) &file_size, sizeof(file_size));
+
+    // Envia a data de modificação do arquivo
+    time_t time = fs::last_write_time(absolute_path);
+    write_socket(fd, (const void *) &time, sizeof(time));
+
+    // Envia o hash do conteúdo, para que o servidor possa evitar a
+    // transferência caso já tenha os mesmos bytes.
+    ContentHash hash = local_file_hash(absolute_path);
+    write_socket(fd, (const void *) &hash, sizeof(hash));
+
+    // Recebe a confirmação de upload do servidor.
+    bool wanted = false;
+    if (!read_socket(fd, (void *) &wanted, sizeof(wanted))) {
+        fclose(file);
+        return false;
+    }
+    if (!wanted) {
+        std::cout << "Arquivo " << absolute_path.string() << " não precisa ser enviado\n";
+        fclose(file);
+        return true;
+    }
+
+    bool file_open_ok = false;
+    if (!read_socket(fd, (void *) &file_open_ok, sizeof(file_open_ok))) {
+        fclose(file);
+        return false;
+    }
+    if (!file_open_ok) {
+        std::cerr << "O arquivo não conseguiu ser aberto no servidor\n";
+        fclose(file);
+        return true;
+    }
+
+    // Se o servidor quiser o arquivo, envia os bytes
+    bool sent = send_file(fd, file, file_size);
+    fclose(file);
+
+    if (sent) {
+        std::cout << "Arquivo " << absolute_path.string() << " enviado\n";
+    }
+    return sent;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * upload_chunked
+ * ----------------------------------------------------------------------------
+ * Envia um arquivo grande em pedaços, por várias conexões ao mesmo tempo.
+ *
+ * O comando ChunkedUpload envia os mesmos metadados de "upload_file", e o
+ * servidor responde se precisa do arquivo.  Os pedaços são enviados por
+ * "run_chunk_streams", cada um com um UploadChunk, e o ChunkedCommit faz o
+ * arquivo substituir o do servidor.  Se algum pedaço não chegou, ou o
+ * servidor recusou o arquivo no final, o arquivo é enviado de novo por
+ * "upload_file", que pergunta outra vez se o servidor precisa dele.
+ *
+ * Retorna falso se a conexão falhou no meio do comando.
+ * ----------------------------------------------------------------------------
+ */
+bool upload_chunked(int fd, const fs::path &absolute_path) {
+    FILE *file;
+
+    if (!fs::exists(absolute_path) || !fs::is_regular_file(absolute_path)) {
+        std::cerr << "Arquivo " << absolute_path.string() << " não existe\n";
+        return true;
+    }
+
+    if ((file = fopen(absolute_path.c_str(), "rb")) == nullptr) {
+        std::cerr << "Arquivo " << absolute_path.string() << " não pode ser aberto\n";
+        return true;
+    }
+
+    Command command = ChunkedUpload;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        fclose(file);
+        return false;
+    }
+
+    send_string(fd, absolute_path.filename().string());
+
+    uint64_t file_size = fs::file_size(absolute_path);
+    write_socket(fd, (const void *) &file_size, sizeof(file_size));
+
+    time_t time = fs::last_write_time(absolute_path);
+    write_socket(fd, (const void *) &time, sizeof(time));
+
+    ContentHash hash = local_file_hash(absolute_path);
+    write_socket(fd, (const void *) &hash, sizeof(hash));
+
+    bool wanted = false;
+    if (!read_socket(fd, (void *) &wanted, sizeof(wanted))) {
+        fclose(file);
+        return false;
+    }
+    if (!wanted) {
+        std::cout << "Arquivo " << absolute_path.string() << " não precisa ser enviado\n";
+        fclose(file);
+        return true;
+    }
+
+    bool file_open_ok = false;
+    if (!read_socket(fd, (void *) &file_open_ok, sizeof(file_open_ok))) {
+        fclose(file);
+        return false;
+    }
+    if (!file_open_ok) {
+        std::cerr << "O arquivo não conseguiu ser aberto no servidor\n";
+        fclose(file);
+        return true;
+    }
+
+    uint64_t id = 0;
+    uint64_t chunk_size = 0;
+    read_socket(fd, (void *) &id, sizeof(id));
+    if (!read_socket(fd, (void *) &chunk_size, sizeof(chunk_size))) {
+        fclose(file);
+        return false;
+    }
+
+    ChunkTracker chunks(file_size, chunk_size);
+    DescriptorSource source(fileno(file));
+
+    bool ok = run_chunk_streams(fd, chunks, [&](int stream_fd, size_t index) {
+        Command chunk_command = UploadChunk;
+        uint64_t chunk_index = index;
+        write_socket(stream_fd, (const void *) &chunk_command, sizeof(chunk_command));
+        write_socket(stream_fd, (const void *) &id, sizeof(id));
+        write_socket(stream_fd, (const void *) &chunk_index, sizeof(chunk_index));
+
+        bool accepted = false;
+        if (!read_socket(stream_fd, (void *) &accepted, sizeof(accepted))) {
+            return false;
+        }
+        if (!accepted) {
+            return true;
+        }
+
+        // Só os bytes do pedaço são enviados; o resto do arquivo é um buraco
+        RangeSource ranged(source, {chunks.range(index)});
+        if (!send_file(stream_fd, ranged, file_size)) {
+            return false;
+        }
+        chunks.done(index);
+        return true;
+    });
+    fclose(file);
+
+    if (!ok) {
+        return false;
+    }
+
+    command = ChunkedCommit;
+    write_socket(fd, (const void *) &command, sizeof(command));
+    write_socket(fd, (const void *) &id, sizeof(id));
+
+    bool committed = false;
+    if (!read_socket(fd, (void *) &committed, sizeof(committed))) {
+        return false;
+    }
+    if (!committed) {
+        std::cerr << "Upload em pedaços de " << absolute_path.string() << " não foi aceito, enviando de novo\n";
+        return upload_file(fd, absolute_path);
+    }
+
+    std::cout << "Arquivo " << absolute_path.string() << " enviado em " << chunks.count() << " pedaços\n";
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * download_chunked
+ * ----------------------------------------------------------------------------
+ * Baixa um arquivo grande em pedaços, por várias conexões ao mesmo tempo.
+ *
+ * O comando ChunkedDownload responde o tamanho e a data de modificação do
+ * arquivo.  O arquivo temporário é criado com o tamanho final, e cada pedaço
+ * pedido com um DownloadChunk é escrito na sua posição.  O ChunkedCommit
+ * libera o arquivo no servidor.  Se algum pedaço não chegou, o arquivo é
+ * baixado de novo por "download_file".
+ *
+ * Retorna falso se a conexão falhou no meio do comando.
+ * ----------------------------------------------------------------------------
+ */
+bool download_chunked(int fd, const std::string &filename, const fs::path &absolute_path, bool to_sync_dir) {
+    Command command = ChunkedDownload;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        return false;
+    }
+    send_string(fd, filename);
+
+    bool exists = false;
+    if (!read_socket(fd, (void *) &exists, sizeof(exists))) {
+        return false;
+    }
+    if (!exists) {
+        std::cerr << "Servidor informou que arquivo não existe\n";
+        return true;
+    }
+
+    uint64_t id = 0;
+    uint64_t file_size = 0;
+    time_t time = 0;
+    uint64_t chunk_size = 0;
+    read_socket(fd, (void *) &id, sizeof(id));
+    read_socket(fd, (void *) &file_size, sizeof(file_size));
+    read_socket(fd, (void *) &time, sizeof(time));
+    if (!read_socket(fd, (void *) &chunk_size, sizeof(chunk_size))) {
+        return false;
+    }
+
+    fs::path temp_path = absolute_path.parent_path() / fs::path("~" + filename + ".part");
+
+    FILE *file = fopen(temp_path.c_str(), "w+b");
+    if (file != nullptr && ftruncate(fileno(file), (off_t) file_size) != 0) {
+        fclose(file);
+        file = nullptr;
+    }
+
+    ChunkTracker chunks(file_size, chunk_size);
+    ContentHash hash;
+    bool ok = true;
+
+    if (file == nullptr) {
+        std::cout << "Erro ao abrir o arquivo para escrita\n";
+    }
+    else {
+        DescriptorSink target(fileno(file));
+
+        ok = run_chunk_streams(fd, chunks, [&](int stream_fd, size_t index) {
+            Command chunk_command = DownloadChunk;
+            uint64_t chunk_index = index;
+            write_socket(stream_fd, (const void *) &chunk_command, sizeof(chunk_command));
+            write_socket(stream_fd, (const void *) &id, sizeof(id));
+            write_socket(stream_fd, (const void *) &chunk_index, sizeof(chunk_index));
+
+            bool accepted = false;
+            if (!read_socket(stream_fd, (void *) &accepted, sizeof(accepted))) {
+                return false;
+            }
+            if (!accepted) {
+                return true;
+            }
+
+            ChunkSink sink(target, chunks.range(index));
+            if (!read_file(stream_fd, sink, file_size)) {
+                return false;
+            }
+            chunks.done(index);
+            return true;
+        });
+
+        // Os pedaços chegam fora de ordem, então o hash é calculado sobre o
+        // arquivo já montado
+        if (ok && chunks.complete()) {
+            rewind(file);
+            hash = hash_file(file);
+        }
+        fclose(file);
+    }
+
+    // O servidor libera o arquivo mesmo que o download não tenha terminado
+    bool released = false;
+    if (ok) {
+        command = ChunkedCommit;
+        write_socket(fd, (const void *) &command, sizeof(command));
+        write_socket(fd, (const void *) &id, sizeof(id));
+        ok = read_socket(fd, (void *) &released, sizeof(released));
+    }
+
+    if (file == nullptr) {
+        return ok;
+    }
+    if (!ok || !chunks.complete()) {
+        fs::remove(temp_path);
+        if (!ok) {
+            return false;
+        }
+        std::cerr << "Download em pedaços de " << filename << " incompleto, baixando de novo\n";
+        return download_file(fd, filename, absolute_path, to_sync_dir, 0);
+    }
+
+    fs::last_write_time(temp_path, time);
+
+    if (to_sync_dir) {
+        expected_writes.expect(absolute_path);
+    }
+    fs::rename(temp_path, absolute_path);
+    if (to_sync_dir) {
+        expected_writes.complete(absolute_path);
+    }
+
+    remember_local_hash(absolute_path, hash);
+
+    if (chunks.count() > 1) {
+        std::cout << "Arquivo " << filename << " recebido em " << chunks.count() << " pedaços\n";
+    }
+    else {
+        std::cout << "Arquivo " << filename << " recebido com sucesso\n";
+    }
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * run_chunk_streams
+ * ----------------------------------------------------------------------------
+ * Transfere os pedaços de "chunks" por até "transfer_streams" conexões ao
+ * mesmo tempo: "fd" e conexões de worker abertas só para a transferência.
+ * Cada conexão pede o próximo pedaço livre e o transfere com "transfer",
+ * que retorna falso se a conexão falhou.  O pedaço de uma conexão que falhou
+ * volta para as outras.
+ *
+ * Retorna falso se a conexão "fd" falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool run_chunk_streams(int fd, ChunkTracker &chunks, const std::function<bool(int, size_t)> &transfer) {
+    std::vector<int> streams{fd};
+    size_t wanted = std::min(std::max<size_t>(transfer_streams, 1), chunks.count());
+    while (streams.size() < wanted) {
+        int stream_fd = connect_worker();
+        if (stream_fd == -1) {
+            break;
+        }
+        streams.push_back(stream_fd);
+    }
+
+    std::atomic<bool> fd_ok(true);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        threads.emplace_back([&, i] {
+            size_t index;
+            while (chunks.next(&index)) {
+                if (!transfer(streams[i], index)) {
+                    chunks.failed(index);
+                    if (i == 0) {
+                        fd_ok = false;
+                    }
+                    return;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 1; i < streams.size(); ++i) {
+        Command command = Exit;
+        write_socket(streams[i], (const void *) &command, sizeof(command));
+        close_socket(streams[i]);
+    }
+    return fd_ok;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * get_file
+ * ----------------------------------------------------------------------------
+ * Função auxiliar para baixar o arquivo para o diretório de execução do
+ * cliente.
+ * ----------------------------------------------------------------------------
+ */
+void get_file(std::string filename) {
+    get_file(filename, true);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * get_file
+ * ----------------------------------------------------------------------------
+ * Obtém o arquivo do servidor pela conexão principal.
+ *
+ * Caso "current_path" seja verdadeior, o arquivo será baixado no diretório
+ * onde o cliente está sendo executado.
+ *
+ * Caso "current_path" seja falso, esse arquivo será baixado no diretório de
+ * sincronização do cliente.
+ * ----------------------------------------------------------------------------
+ */
+void get_file(std::string filename, bool current_path) {
+    fs::path directory = current_path ? fs::current_path() : user_dir;
+    download_file(socket_fd, filename, directory / fs::path(filename), !current_path, 0);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * download_file
+ * ----------------------------------------------------------------------------
+ * Baixa o arquivo "filename" do servidor para "absolute_path" pelo socket
+ * fornecido.
+ *
+ * Os bytes são escritos num arquivo temporário começado por "~", que só é
+ * renomeado para o nome final depois que o download termina.  Assim um
+ * download interrompido ou cancelado não deixa um arquivo pela metade.
+ *
+ * Se "to_sync_dir" for verdadeiro, os eventos causados pelo download no
+ * diretório de sincronização não geram um upload do mesmo arquivo.
+ *
+ * Se "version" não for 0, é baixada a versão anterior com esse número.
+ *
+ * Retorna falso se a conexão falhou no meio do comando.
+ * ----------------------------------------------------------------------------
+ */
+bool download_file(int fd, const std::string &filename, const fs::path &absolute_path, bool to_sync_dir,
+                   uint64_t version) {
+
+    Command command = Download;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        return false;
+    }
+
+    send_string(fd, filename);
+    write_socket(fd, (const void *) &version, sizeof(version));
+
+    bool exists = false;
+    if (!read_socket(fd, (void *) &exists, sizeof(exists))) {
+        return false;
+    }
+    if (!exists) {
+        std::cerr << "Servidor informou que arquivo não existe\n";
+        return true;
+    }
+
+    uint64_t file_size;
+    if (!read_socket(fd, (void *) &file_size, sizeof(file_size))) {
+        return false;
+    }
+
+    fs::path temp_path = absolute_path.parent_path() / fs::path("~" + filename + ".part");
+
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    send_bool(fd, file != nullptr);
+
+    if (file == nullptr) {
+        std::cout << "Erro ao abrir o arquivo para escrita\n";
+
+        // O servidor ainda envia a data de modificação
+        time_t time;
+        return read_socket(fd, (void *) &time, sizeof(time));
+    }
+
+    // O hash é calculado durante o download, para não reler o arquivo depois.
+    // Os buracos do arquivo entram no hash como zeros.
+    ContentHasher hasher;
+    uint64_t hashed_bytes = 0;
+    bool received = read_file(fd, file, file_size, [&](uint64_t offset, const char *chunk, size_t size) {
+        hasher.update_zeros(offset - hashed_bytes);
+        hasher.update(chunk, size);
+        hashed_bytes = offset + size;
+    });
+    fclose(file);
+
+    time_t time;
+    if (!received || !read_socket(fd, (void *) &time, sizeof(time))) {
+        fs::remove(temp_path);
+        return false;
+    }
+
+    hasher.update_zeros(file_size - hashed_bytes);
+    fs::last_write_time(temp_path, time);
+
+    if (to_sync_dir) {
+        expected_writes.expect(absolute_path);
+    }
+    fs::rename(temp_path, absolute_path);
+    if (to_sync_dir) {
+        expected_writes.complete(absolute_path);
+    }
+
+    remember_local_hash(absolute_path, hasher.digest());
+
+    std::cout << "Arquivo " << filename << " recebido com sucesso\n";
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * connect_worker
+ * ----------------------------------------------------------------------------
+ * Abre a conexão de um worker de transferências.  É uma conexão do tipo
+ * Worker, identificada pelo user_id e pela sessão obtida em
+ * "connect_server", que não conta no limite de dispositivos do usuário.
+ *
+ * Retorna o socket, ou -1 em caso de erro.
+ * ----------------------------------------------------------------------------
+ */
+int connect_worker() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (sockaddr *) &server_address, sizeof(server_address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    configure_socket(fd);
+
+    ConnectionType type = ConnectionType::Worker;
+    write_socket(fd, (const void *) &type, sizeof(type));
+    send_string(fd, user_id);
+    write_socket(fd, (const void *) &session_id, sizeof(session_id));
+
+    if (!read_bool(fd)) {
+        close_socket(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * execute_transfer
+ * ----------------------------------------------------------------------------
+ * Executa uma transferência da fila no socket do worker.  Se o worker não
+ * conseguiu abrir sua conexão, a transferência é feita pela conexão
+ * principal, travando o mutex de comandos.
+ * ----------------------------------------------------------------------------
+ */
+bool execute_transfer(int fd, const TransferJob &job) {
+    std::unique_lock<std::mutex> lock(command_mutex, std::defer_lock);
+    if (fd == -1) {
+        lock.lock();
+        fd = socket_fd;
+    }
+
+    // Arquivos grandes são divididos em pedaços, transferidos por várias
+    // conexões ao mesmo tempo
+    bool chunked = transfer_streams > 1 && job.size >= CHUNKED_TRANSFER_THRESHOLD;
+
+    switch (job.kind) {
+    case UploadJob:
+        if (chunked) {
+            return upload_chunked(fd, job.path);
+        }
+        return upload_file(fd, job.path);
+
+    case DownloadJob:
+        if (!job.to_sync_dir && job.version == 0 && download_from_replica(job)) {
+            return true;
+        }
+        // Sem o tamanho, o arquivo vem por uma única conexão
+        if (chunked && job.version == 0) {
+            return download_chunked(fd, job.name, job.path, job.to_sync_dir);
+        }
+        return download_file(fd, job.name, job.path, job.to_sync_dir, job.version);
+
+    case DeleteJob:
+        return delete_remote(fd, job.name);
+
+    case MoveJob:
+        return move_remote(fd, job.source, job.path);
+
+    case RangesJob:
+        return download_ranges(fd, job.name, job.ranges, job.path);
+    }
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * queue_upload, queue_download, queue_delete, queue_move, queue_ranges
+ * ----------------------------------------------------------------------------
+ * Enfileiram transferências na fila de transferências.  Retornam o
+ * identificador da transferência.
+ * ----------------------------------------------------------------------------
+ */
+uint64_t queue_upload(const fs::path &absolute_path, bool to_sync_dir, TransferPriority priority) {
+    TransferJob job{};
+    job.kind = UploadJob;
+    job.priority = priority;
+    job.name = absolute_path.filename().string();
+    job.path = absolute_path;
+
+    boost::system::error_code error;
+    job.size = fs::file_size(absolute_path, error);
+    if (error) {
+        job.size = 0;
+    }
+
+    job.to_sync_dir = to_sync_dir;
+    return transfer_queue.submit(job);
+}
+
+
+uint64_t queue_download(const std::string &filename, const fs::path &absolute_path, bool to_sync_dir,
+                        uint64_t size, TransferPriority priority, uint64_t version) {
+    TransferJob job{};
+    job.kind = DownloadJob;
+    job.priority = priority;
+    job.name = filename;
+    job.path = absolute_path;
+    job.size = size;
+    job.to_sync_dir = to_sync_dir;
+    job.version = version;
+    return transfer_queue.submit(job);
+}
+
+
+uint64_t queue_delete(const std::string &filename) {
+    TransferJob job{};
+    job.kind = DeleteJob;
+    job.priority = Background;
+    job.name = filename;
+    job.size = 0;
+    job.to_sync_dir = true;
+    return transfer_queue.submit(job);
+}
+
+
+uint64_t queue_move(const std::string &from, const fs::path &absolute_path) {
+    TransferJob job{};
+    job.kind = MoveJob;
+    job.priority = Background;
+    job.name = absolute_path.filename().string();
+    job.source = from;
+    job.path = absolute_path;
+    job.size = 0;
+    job.to_sync_dir = true;
+    return transfer_queue.submit(job);
+}
+
+
+uint64_t queue_ranges(const std::string &filename, const std::vector<ByteRange> &ranges, const fs::path &absolute_path) {
+    TransferJob job{};
+    job.kind = RangesJob;
+    job.priority = Interactive;
+    job.name = filename;
+    job.path = absolute_path;
+    job.size = 0;
+    job.to_sync_dir = false;
+    job.ranges = ranges;
+    return transfer_queue.submit(job);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * submit_change
+ * ----------------------------------------------------------------------------
+ * Envia ao servidor uma mudança do diretório de sincronização.  Sem conexão,
+ * a mudança é guardada no journal até a reconexão.
+ * ----------------------------------------------------------------------------
+ */
+void submit_change(const fs::path &absolute_path, JournalChange change) {
+    std::string filename = absolute_path.filename().string();
+
+    if (!connected) {
+        journal.record(filename, change);
+        return;
+    }
+
+    if (change == JournalDelete) {
+        queue_delete(filename);
+    }
+    else {
+        queue_upload(absolute_path, true, Background);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * submit_move
+ * ----------------------------------------------------------------------------
+ * Envia ao servidor a mudança de nome de um arquivo do diretório de
+ * sincronização, sem enviar o conteúdo.  Um arquivo renomeado para um nome
+ * ignorado é apagado no servidor.  Sem conexão, o journal guarda a mudança
+ * como um delete do nome anterior e um upload do novo.
+ *
+ * Os nomes no servidor não incluem os diretórios, então mover um arquivo de
+ * um diretório para outro, mantendo o nome, não muda nada no servidor.
+ * ----------------------------------------------------------------------------
+ */
+void submit_move(const fs::path &from_path, const fs::path &to_path) {
+    // Renomes feitos pelo próprio cliente não voltam ao servidor
+    if (expected_writes.is_expected(to_path)) {
+        local_snapshot.update(to_path);
+        return;
+    }
+
+    if (is_ignored(to_path) || !fs::is_regular_file(to_path)) {
+        submit_change(from_path, JournalDelete);
+        return;
+    }
+    local_snapshot.update(to_path);
+
+    std::string from = from_path.filename().string();
+    std::string to = to_path.filename().string();
+    if (from == to) {
+        return;
+    }
+
+    if (!connected) {
+        journal.record(from, JournalDelete);
+        journal.record(to, JournalUpload);
+        return;
+    }
+
+    queue_move(from, to_path);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * replay_journal
+ * ----------------------------------------------------------------------------
+ * Enfileira as mudanças guardadas no journal.  Cada uma sai do journal
+ * quando sua transferência termina com sucesso.
+ * ----------------------------------------------------------------------------
+ */
+void replay_journal() {
+    std::vector<std::pair<std::string, JournalChange>> changes = journal.changes();
+    if (changes.empty()) {
+        return;
+    }
+
+    std::cout << "Enviando " << changes.size() << " mudanças feitas sem conexão\n";
+    for (auto &change : changes) {
+        if (change.second == JournalDelete) {
+            queue_delete(change.first);
+        }
+        else {
+            queue_upload(user_dir / fs::path(change.first), true, Background);
+        }
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * pull_server_changes
+ * ----------------------------------------------------------------------------
+ * Baixa os arquivos que mudaram no servidor enquanto o cliente estava
+ * desconectado.  Só os metadados dos arquivos são comparados; os arquivos
+ * com mudanças locais pendentes no journal são ignorados, pois a mudança
+ * local é mais recente.
+ * ----------------------------------------------------------------------------
+ */
+void pull_server_changes() {
+    std::vector<FileInfo> server_files;
+    if (!get_server_files(server_files)) {
+        return;
+    }
+
+    size_t pulled = 0;
+    for (FileInfo &file_info : server_files) {
+        fs::path absolute_path = user_dir / fs::path(file_info.filename());
+        if (journal.contains(file_info.filename()) || is_ignored(absolute_path)) {
+            continue;
+        }
+
+        bool exists = fs::exists(absolute_path);
+        if (exists && fs::last_write_time(absolute_path) >= file_info.last_modified()) {
+            continue;
         }
-        else if (command == "list_client") {
-            std::cout << "ListClient\n";
-            list_local_files();
+
+        // O conteúdo é o mesmo, basta copiar a data do servidor
+        if (exists && file_info.hash().valid() && local_file_hash(absolute_path) == file_info.hash()) {
+            fs::last_write_time(absolute_path, file_info.last_modified());
+            remember_local_hash(absolute_path, file_info.hash());
+            continue;
         }
-        else if (command == "get_sync_dir") {
-            std::cout << "GetSyncDir\n";
-            sync_client();
+
+        queue_download(file_info.filename(), absolute_path, true, file_info.bytes(), Background);
+        ++pulled;
+    }
+
+    std::cout << pulled << " arquivos mudaram no servidor durante a desconexão\n";
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * transfer_finished
+ * ----------------------------------------------------------------------------
+ * Chamada quando uma transferência termina.  Uma mudança do diretório de
+ * sincronização que chegou ao servidor sai do journal; uma que falhou entra
+ * nele, e o cliente passa a reconectar.
+ * ----------------------------------------------------------------------------
+ */
+void transfer_finished(const TransferJob &job, bool ok) {
+    if (job.to_sync_dir && job.kind != DownloadJob) {
+        JournalChange change = job.kind == DeleteJob ? JournalDelete : JournalUpload;
+        if (ok) {
+            journal.resolve(job.name, change);
         }
         else {
-            std::cout << "Comando não reconhecido\n";
+            journal.record(job.name, change);
         }
 
-        // Destrava o mutex de comando
+        // Uma mudança de nome também apaga o nome anterior
+        if (job.kind == MoveJob && !ok) {
+            journal.record(job.source, JournalDelete);
+        }
+    }
+
+    if (!ok) {
+        connection_lost();
     }
-    while (command != "exit");
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * send_file
+ * list_transfers
  * ----------------------------------------------------------------------------
- * Envia o arquivo ao servidor.
- *
- * O caminho absoluto do arquivo deverá ser fornecido.
- *
- * São enviados o tamanho do arquivo, bem como sua data de modificação.  O
- * servidor responde se precisa do arquivo.  Em caso positivo, seus bytes são
- * enviados.
+ * Imprime as transferências em andamento e as que estão na fila.
  * ----------------------------------------------------------------------------
  */
-void send_file(std::string absolute_filename) {
-    ssize_t bytes;
-    FILE *file;
+void list_transfers() {
+    static const char *kinds[] = {"upload", "download", "delete", "move", "ranges"};
 
-    fs::path absolute_path(absolute_filename);
-
-    if (fs::exists(absolute_path) && fs::is_regular_file(absolute_path)) {
-        if ((file = fopen(absolute_filename.c_str(), "rb")) != nullptr) {
+    size_t offline_changes = journal.size();
+    if (offline_changes > 0) {
+        std::cout << offline_changes << " mudanças aguardando a conexão com o servidor\n";
+    }
 
-            // Envia o comando
-            Command command = Upload;
-            write_socket(socket_fd, (const void *) &command, sizeof(command));
+    std::vector<TransferStatus> transfers = transfer_queue.status();
+    if (transfers.empty()) {
+        std::cout << "Nenhuma transferência pendente\n";
+        return;
+    }
 
-            // Envia o nome do arquivo
-            std::string filename = absolute_path.filename().string();
-            send_string(socket_fd, filename);
+    for (const TransferStatus &transfer : transfers) {
+        std::cout << transfer.job.id << "\t"
+                  << (transfer.running ? "em andamento" : "na fila") << "\t"
+                  << (transfer.job.priority == Interactive ? "interativa" : "sincronização") << "\t"
+                  << kinds[transfer.job.kind] << " " << transfer.job.name << "\n";
+    }
+}
 
-            // Envia o tanho do arquivo
-            size_t file_size = fs::file_size(absolute_path);
-            write_socket(socket_fd, (const void *) &file_size, sizeof(file_size));
 
-            // Envia a data de modificação do arquivo
-            time_t time = fs::last_write_time(absolute_path);
-            write_socket(socket_fd, (const void *) &time, sizeof(time));
+/*
+ * ----------------------------------------------------------------------------
+ * close_connection
+ * ----------------------------------------------------------------------------
+ * Desconecta o usuário do servidor e fecha os sockets.  Encerra o programa.
+ *
+ * Espera as transferências pendentes, e por isso não pode ser chamada com o
+ * "command_mutex" travado.  Sem conexão, as transferências da fila que
+ * alteram o diretório de sincronização ficam no journal para a próxima
+ * execução, e as outras são descartadas.
+ * ----------------------------------------------------------------------------
+ */
+void close_connection() {
+    {
+        std::lock_guard<std::mutex> lock(connection_mutex);
+        exiting = true;
+        connection_condition.notify_all();
+    }
+    if (reconnect_thread.joinable()) {
+        reconnect_thread.join();
+    }
 
-            // Recebe a confirmação de upload do servidor.
-            if (!read_bool(socket_fd)) {
-                std::cout << "Arquivo " << absolute_path.string() << " não precisa ser enviado\n";
-                fclose(file);
-                return;
+    if (!connected) {
+        for (const TransferStatus &transfer : transfer_queue.status()) {
+            if (transfer.running) {
+                continue;
             }
-
-            bool file_open_ok = read_bool(socket_fd);
-            if (!file_open_ok) {
-                std::cerr << "O arquivo não conseguiu ser aberto no servidor\n";
-                fclose(file);
-                return;
+            if (transfer.job.to_sync_dir && transfer.job.kind != DownloadJob) {
+                journal.record(transfer.job.name, transfer.job.kind == DeleteJob ? JournalDelete : JournalUpload);
+            }
+            if (transfer.job.kind == MoveJob) {
+                journal.record(transfer.job.source, JournalDelete);
             }
-            //std::cout << "Preparando para enviar os bytes do arquivo\n";
+            transfer_queue.cancel(transfer.job.id);
+        }
+    }
+
+    // As transferências pendentes terminam antes da desconexão
+    if (!transfer_queue.status().empty()) {
+        std::cout << "Aguardando as transferências pendentes\n";
+    }
+    transfer_queue.drain();
+
+    if (journal.size() > 0) {
+        std::cout << journal.size() << " mudanças serão enviadas na próxima conexão\n";
+    }
 
-            // Se o servidor quiser o arquivo, envia os bytes
-            send_file(socket_fd, file, file_size);
+    if (socket_fd != -1) {
+        if (connected) {
+            Command command = Exit;
+            write_socket(socket_fd, (const void *) &command, sizeof(command));
+        }
+        close_socket(socket_fd);
+    }
 
-            fclose(file);
+    {
+        std::lock_guard<std::mutex> lock(replica_mutex);
+        if (replica_socket_fd != -1) {
+            Command command = Exit;
+            write_socket(replica_socket_fd, (const void *) &command, sizeof(command));
+            close_socket(replica_socket_fd);
+            replica_socket_fd = -1;
         }
-        std::cout << "Arquivo " << absolute_path.string() << " enviado\n";
     }
-    else {
-        std::cerr << "Arquivo " << absolute_filename << " não existe\n";
+
+    if (sync_socket_fd != -1) {
+        shutdown(sync_socket_fd, SHUT_RDWR);
+    }
+    if (relay_thread.joinable()) {
+        relay_thread.join();
     }
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * get_file
+ * list_server_files
  * ----------------------------------------------------------------------------
- * Função auxiliar para baixar o arquivo para o diretório de execução do
- * cliente.
+ * Imprime informações dos arquivos presentes no diretório do usuário no
+ * servidor.
  * ----------------------------------------------------------------------------
  */
-void get_file(std::string filename) {
-    get_file(filename, true);
+void list_server_files() {
+
+    // Obtém o vetor com os FileInfo, de uma réplica se possível
+    std::vector<FileInfo> server_files;
+    if (!get_replica_files(server_files) && !get_server_files(server_files)) {
+        return;
+    }
+
+    std::cout << "=====================\n";
+    std::cout << "Arquivos no servidor:\n";
+    std::cout << "=====================\n\n";
+    for (auto &file : server_files) {
+        std::cout << file.string() << "\n";
+    }
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * get_file
+ * download_ranges
  * ----------------------------------------------------------------------------
- * Obtém o arquivo do servidor.
- *
- * Caso "current_path" seja verdadeior, o arquivo será baixado no diretório
- * onde o cliente está sendo executado.
+ * Baixa apenas alguns trechos do arquivo "filename" para "absolute_path",
+ * que não deve ter o nome do próprio arquivo.  O arquivo baixado tem os
+ * trechos concatenados, na ordem em que foram pedidos, e só os bytes pedidos
+ * passam pela rede.  Os trechos que passam do fim do arquivo são cortados.
  *
- * Caso "current_path" seja falso, esse arquivo será baixado no diretório de
- * sincronização do cliente.
+ * Retorna falso se a conexão falhou no meio do comando.
  * ----------------------------------------------------------------------------
  */
-void get_file(std::string filename, bool current_path) {
+bool download_ranges(int fd, const std::string &filename, const std::vector<ByteRange> &ranges,
+                     const fs::path &absolute_path) {
 
-    Command command = Download;
-    write_socket(socket_fd, (const void *) &command, sizeof(command));
+    Command command = DownloadRanges;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        return false;
+    }
 
-    send_string(socket_fd, filename);
+    send_string(fd, filename);
+    uint32_t count = (uint32_t) ranges.size();
+    write_socket(fd, (const void *) &count, sizeof(count));
+    write_socket(fd, (const void *) ranges.data(), ranges.size() * sizeof(ByteRange));
 
-    bool exists = read_bool(socket_fd);
+    bool exists = false;
+    if (!read_socket(fd, (void *) &exists, sizeof(exists))) {
+        return false;
+    }
     if (!exists) {
         std::cerr << "Servidor informou que arquivo não existe\n";
-        return;
+        return true;
     }
 
-    size_t file_size;
-    read_socket(socket_fd, (void *) &file_size, sizeof(file_size));
-
-    fs::path absolute_path;
-    if (current_path) {
-        absolute_path = fs::current_path() / fs::path(filename);
-    }
-    else {
-        absolute_path = user_dir / fs::path(filename);
+    uint64_t file_size;
+    time_t time;
+    if (!read_socket(fd, (void *) &file_size, sizeof(file_size)) || !read_socket(fd, (void *) &time, sizeof(time))) {
+        return false;
     }
 
-    FILE *file = fopen(absolute_path.c_str(), "wb");
+    fs::path temp_path = absolute_path.parent_path() / fs::path("~" + absolute_path.filename().string() + ".part");
+
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    send_bool(fd, file != nullptr);
+
     if (file == nullptr) {
         std::cout << "Erro ao abrir o arquivo para escrita\n";
-        send_bool(socket_fd, false);
-        return;
+        return true;
     }
-    send_bool(socket_fd, true);
 
-    read_file(socket_fd, file, file_size);
+    std::vector<ByteRange> resolved = resolve_ranges(ranges, file_size);
+    RangeSink sink(fileno(file), resolved);
+    bool received = read_file(fd, sink, file_size);
     fclose(file);
 
+    if (!received) {
+        fs::remove(temp_path);
+        return false;
+    }
+    fs::rename(temp_path, absolute_path);
 
-    time_t time;
-    read_socket(socket_fd, (void *) &time, sizeof(time));
-
-    fs::last_write_time(absolute_path, time);
-
-    std::cout << "Arquivo " << filename << " recebido com sucesso\n";
+    std::cout << "Recebidos " << total_length(resolved) << " de " << file_size << " bytes de " << filename
+              << " em " << absolute_path.string() << "\n";
+    return true;
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * close_connection
+ * list_file_versions
  * ----------------------------------------------------------------------------
- * Desconecta o usuário do servidor e fecha o socket.  Encerra o programa.
+ * Imprime as versões anteriores de um arquivo guardadas no servidor.  Cada
+ * uma pode ser baixada com "download_version".
  * ----------------------------------------------------------------------------
  */
-void close_connection() {
-    Command command = Exit;
+void list_file_versions(std::string filename) {
+    Command command = ListVersions;
     write_socket(socket_fd, (const void *) &command, sizeof(command));
-    close(socket_fd);
-}
+    send_string(socket_fd, filename);
 
+    uint64_t n = 0;
+    if (!read_socket(socket_fd, (void *) &n, sizeof(n))) {
+        connection_lost();
+        return;
+    }
 
-/*
- * ----------------------------------------------------------------------------
- * list_server_files
- * ----------------------------------------------------------------------------
- * Imprime informações dos arquivos presentes no diretório do usuário no
- * servidor.
- * ----------------------------------------------------------------------------
- */
-void list_server_files() {
+    char date_buffer[20];
 
-    // Obtém o vetor com os FileInfo
-    std::vector<FileInfo> server_files = get_server_files();
+    std::cout << "Versões anteriores de " << filename << ":\n\n";
+    for (uint64_t i = 0; i < n; ++i) {
+        FileVersion version{};
+        read_socket(socket_fd, (void *) &version, sizeof(version));
 
-    std::cout << "=====================\n";
-    std::cout << "Arquivos no servidor:\n";
-    std::cout << "=====================\n\n";
-    for (auto &file : server_files) {
-        std::cout << file.string() << "\n";
+        strftime(date_buffer, 20, "%Y-%m-%d %H:%M:%S", localtime(&version.last_modified));
+
+        std::cout << "Versão: " << version.number << "\n";
+        std::cout << "Tamanho: " << version.bytes << " bytes\n";
+        std::cout << "Modificado: " << date_buffer << "\n\n";
+    }
+
+    if (n == 0) {
+        std::cout << "Nenhuma versão anterior\n";
     }
 }
 
@@ -657,31 +2405,157 @@ void create_sync_dir() {
  * Esse vetor pode ser usado para o cliente fazer a sincronização ou
  * simplesmente imprimir os arquivos do servidor.
  *
- * Retorna o vetor de FileInfo
+ * Retorna falso se a conexão com o servidor falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool get_server_files(std::vector<FileInfo> &files) {
+    if (!read_server_files(socket_fd, files)) {
+        connection_lost();
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * read_server_files
+ * ----------------------------------------------------------------------------
+ * Envia o comando de ListServer pelo socket fornecido e lê os FileInfo.
+ * Retorna falso se a conexão falhou.
  * ----------------------------------------------------------------------------
  */
-std::vector<FileInfo> get_server_files() {
+bool read_server_files(int fd, std::vector<FileInfo> &files) {
 
     // Envia o comando para listar os arquivos.
     Command command = ListServer;
-    write_socket(socket_fd, (const void *) &command, sizeof(command));
+    write_socket(fd, (const void *) &command, sizeof(command));
 
     // Lê o tamanho do vetor
-    size_t n;
-    read_socket(socket_fd, (void *) &n, sizeof(n));
+    size_t n = 0;
+    if (!read_socket(fd, (void *) &n, sizeof(n))) {
+        return false;
+    }
 
-    std::vector<FileInfo> files;
+    files.clear();
     files.reserve(n);
 
     // Recebe os membros do vetor e o recria localmente.
-    for (int i = 0; i < n; ++i) {
+    for (size_t i = 0; i < n; ++i) {
         FileInfo file_info;
-        read_socket(socket_fd, (void *) &file_info, sizeof(file_info));
+        if (!read_socket(fd, (void *) &file_info, sizeof(file_info))) {
+            return false;
+        }
         files.push_back(file_info);
     }
 
-    // Retorna o vetor.
-    return std::move(files);
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * connect_replica
+ * ----------------------------------------------------------------------------
+ * Retorna a sessão com uma réplica, abrindo-a se necessário, ou -1 se não há
+ * réplica disponível.  Deve ser chamada com o "replica_mutex" travado.
+ *
+ * As réplicas são tentadas em sequência, a partir da seguinte à última que
+ * falhou.  Se nenhuma aceitar, elas só são tentadas de novo depois de
+ * REPLICA_RETRY_DELAY_MS.
+ * ----------------------------------------------------------------------------
+ */
+int connect_replica() {
+    if (replica_socket_fd != -1 || replica_addresses.empty() ||
+        std::chrono::steady_clock::now() < replica_retry_at) {
+        return replica_socket_fd;
+    }
+
+    for (size_t attempt = 0; attempt < replica_addresses.size(); ++attempt) {
+        const std::string &address = replica_addresses[next_replica % replica_addresses.size()];
+
+        int fd = connect_address(address);
+        if (fd == -1) {
+            ++next_replica;
+            continue;
+        }
+        configure_socket(fd);
+
+        ConnectionType type = ConnectionType::Normal;
+        write_socket(fd, (const void *) &type, sizeof(type));
+        send_string(fd, user_id);
+
+        // A réplica recusa a sessão quando está atrasada
+        bool ok = false;
+        uint64_t replica_session_id;
+        if (read_socket(fd, (void *) &ok, sizeof(ok)) && ok &&
+            read_socket(fd, (void *) &replica_session_id, sizeof(replica_session_id))) {
+            std::cout << "Usando a réplica " << address << "\n";
+            send_device_name(fd);
+            replica_socket_fd = fd;
+            return fd;
+        }
+
+        close_socket(fd);
+        ++next_replica;
+    }
+
+    replica_retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(REPLICA_RETRY_DELAY_MS);
+    return -1;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * drop_replica
+ * ----------------------------------------------------------------------------
+ * Fecha a sessão com a réplica depois de uma falha.  Deve ser chamada com o
+ * "replica_mutex" travado.
+ * ----------------------------------------------------------------------------
+ */
+void drop_replica() {
+    std::cerr << "Réplica indisponível, usando o servidor\n";
+    close_socket(replica_socket_fd);
+    replica_socket_fd = -1;
+    ++next_replica;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * get_replica_files, download_from_replica
+ * ----------------------------------------------------------------------------
+ * Fazem a leitura numa réplica.  Retornam falso se não há réplica disponível
+ * ou se ela falhou, e então a leitura deve ser feita no servidor.
+ * ----------------------------------------------------------------------------
+ */
+bool get_replica_files(std::vector<FileInfo> &files) {
+    std::lock_guard<std::mutex> lock(replica_mutex);
+
+    int fd = connect_replica();
+    if (fd == -1) {
+        return false;
+    }
+    if (!read_server_files(fd, files)) {
+        drop_replica();
+        return false;
+    }
+    return true;
+}
+
+
+bool download_from_replica(const TransferJob &job) {
+    std::lock_guard<std::mutex> lock(replica_mutex);
+
+    int fd = connect_replica();
+    if (fd == -1) {
+        return false;
+    }
+    if (!download_file(fd, job.name, job.path, job.to_sync_dir, job.version)) {
+        drop_replica();
+        return false;
+    }
+    return true;
 }
 
 
@@ -720,12 +2594,70 @@ void delete_file(std::string filename) {
  * ----------------------------------------------------------------------------
  */
 void send_delete_command(std::string filename) {
+    delete_remote(socket_fd, filename);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * delete_remote
+ * ----------------------------------------------------------------------------
+ * Envia o comando Delete ao servidor pelo socket fornecido.  Retorna falso
+ * se a conexão falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool delete_remote(int fd, const std::string &filename) {
     Command command = Delete;
 
-    // Envia o comando de Delete para o servidor
-    if (write_socket(socket_fd, (void *) &command, sizeof(command))) {
-        send_string(socket_fd, filename);
+    // Envia o comando de Delete para o servidor.  Não há resposta, então o
+    // comando é enviado imediatamente.
+    if (!write_socket(fd, (void *) &command, sizeof(command))) {
+        return false;
+    }
+    send_string(fd, filename);
+    return flush_socket(fd);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * move_remote
+ * ----------------------------------------------------------------------------
+ * Envia o comando Move ao servidor pelo socket fornecido, junto com o tamanho
+ * e a data de modificação do arquivo renomeado.  Se o servidor não tiver essa
+ * versão do arquivo com o nome anterior, o nome anterior é apagado e o
+ * arquivo é enviado com um Upload.  Retorna falso se a conexão falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool move_remote(int fd, const std::string &from, const fs::path &absolute_path) {
+    boost::system::error_code error;
+    uint64_t file_size = fs::file_size(absolute_path, error);
+    time_t time = error ? 0 : fs::last_write_time(absolute_path, error);
+
+    // O arquivo já foi apagado ou renomeado de novo
+    if (error) {
+        return delete_remote(fd, from);
+    }
+
+    Command command = Move;
+    if (!write_socket(fd, (const void *) &command, sizeof(command))) {
+        return false;
     }
+    send_string(fd, from);
+    send_string(fd, absolute_path.filename().string());
+    write_socket(fd, (const void *) &file_size, sizeof(file_size));
+    write_socket(fd, (const void *) &time, sizeof(time));
+
+    bool moved = false;
+    if (!read_socket(fd, (void *) &moved, sizeof(moved))) {
+        return false;
+    }
+    if (moved) {
+        std::cout << "Arquivo " << from << " renomeado para " << absolute_path.filename().string() << "\n";
+        return true;
+    }
+
+    return delete_remote(fd, from) && upload_file(fd, absolute_path);
 }
 
 
@@ -741,7 +2673,10 @@ void send_delete_command(std::string filename) {
 void sync_client() {
 
     // Obtém a lista de arquivos do servidor.
-    std::vector<FileInfo> server_files = get_server_files();
+    std::vector<FileInfo> server_files;
+    if (!get_server_files(server_files)) {
+        return;
+    }
 
     // Conjunto dos nomes dos arquivos do presentes no servidor.
     //
@@ -758,9 +2693,33 @@ void sync_client() {
         // Acrescenta ao conjuto dos arquivos do servidor.
         files_on_server.insert(file_info.filename());
 
+        // Arquivos ignorados não são baixados, nem consultados no disco
+        if (is_ignored(absolute_path)) {
+            continue;
+        }
+
+        // As mudanças locais feitas sem conexão são enviadas pelo journal
+        if (journal.contains(file_info.filename())) {
+            continue;
+        }
+
         bool exists = fs::exists(absolute_path);
-        if ((exists && (fs::last_write_time(absolute_path) < file_info.last_modified())) || !exists) {
-            get_file(file_info.filename(), false);
+        if (exists && fs::last_write_time(absolute_path) != file_info.last_modified() &&
+            file_info.hash().valid() && local_file_hash(absolute_path) == file_info.hash()) {
+            // O conteúdo é o mesmo, apenas a data de modificação difere.  Se
+            // o servidor for mais recente, basta copiar sua data.  Se o
+            // arquivo local for mais recente, o upload será resolvido pelo
+            // servidor sem transferir os bytes.
+            if (fs::last_write_time(absolute_path) < file_info.last_modified()) {
+                fs::last_write_time(absolute_path, file_info.last_modified());
+                remember_local_hash(absolute_path, file_info.hash());
+            }
+            else {
+                files_to_send_to_server.insert(absolute_path.string());
+            }
+        }
+        else if ((exists && (fs::last_write_time(absolute_path) < file_info.last_modified())) || !exists) {
+            queue_download(file_info.filename(), absolute_path, true, file_info.bytes(), Background);
 
         }
         else if (fs::last_write_time(absolute_path) > file_info.last_modified()) {
@@ -776,13 +2735,14 @@ void sync_client() {
     fs::directory_iterator end_iter;
     fs::directory_iterator dir_iter(user_dir);
     while (dir_iter != end_iter) {
-        if (fs::is_regular_file(dir_iter->path())) {
+        // Os arquivos ignorados são descartados antes de qualquer stat
+        if (!is_ignored(dir_iter->path()) && fs::is_regular_file(dir_iter->path())) {
             std::string filename = dir_iter->path().filename().string();
 
             // Se o arquivo no diretório do cliente não existe nos arquivos
             // enviados pelo servidor, devemos inserir seu nome para enviar.
             auto it = files_on_server.find(filename);
-            if (it == files_on_server.end()) {
+            if (it == files_on_server.end() && !journal.contains(filename)) {
                 files_to_send_to_server.insert(dir_iter->path().string());
             }
         }
@@ -792,6 +2752,73 @@ void sync_client() {
     //std::cout << "\n\nArquivo para enviar para o servidor\n";
     for (auto &filename : files_to_send_to_server) {
         //std::cout << "Enviando " << filename << " para o servidor\n";
-        send_file(filename);
+        queue_upload(fs::path(filename), true, Background);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * local_file_hash
+ * ----------------------------------------------------------------------------
+ * Retorna o hash do conteúdo de um arquivo local.
+ *
+ * O hash é buscado na cache "local_hashes".  Se o arquivo mudou desde que o
+ * hash foi calculado (ou se ele nunca foi calculado) o arquivo é lido e a
+ * cache atualizada.
+ *
+ * Retorna um hash inválido se o arquivo não puder ser lido.
+ * ----------------------------------------------------------------------------
+ */
+ContentHash local_file_hash(const fs::path &path) {
+    struct stat info{};
+    if (stat(path.c_str(), &info) != 0) {
+        return ContentHash();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(local_hashes_mutex);
+        auto it = local_hashes.find(info.st_ino);
+        if (it != local_hashes.end() &&
+            it->second.size == info.st_size &&
+            it->second.modified.tv_sec == info.st_mtim.tv_sec &&
+            it->second.modified.tv_nsec == info.st_mtim.tv_nsec) {
+            return it->second.hash;
+        }
+    }
+
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return ContentHash();
+    }
+    ContentHash hash = hash_file(file);
+    fclose(file);
+
+    remember_local_hash(path, hash);
+    return hash;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * remember_local_hash
+ * ----------------------------------------------------------------------------
+ * Guarda na cache "local_hashes" o hash de um arquivo cujo conteúdo já é
+ * conhecido, por exemplo um arquivo que acabou de ser baixado.  Deve ser
+ * chamada depois que a data de modificação do arquivo for ajustada.
+ * ----------------------------------------------------------------------------
+ */
+void remember_local_hash(const fs::path &path, const ContentHash &hash) {
+    struct stat info{};
+    if (stat(path.c_str(), &info) != 0) {
+        return;
     }
+
+    LocalHash entry{};
+    entry.size = info.st_size;
+    entry.modified = info.st_mtim;
+    entry.hash = hash;
+
+    std::lock_guard<std::mutex> lock(local_hashes_mutex);
+    local_hashes[info.st_ino] = entry;
 }
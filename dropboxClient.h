@@ -3,7 +3,15 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 #include "dropboxUtil.h"
+#include "dropboxTransfer.h"
+#include "dropboxJournal.h"
+#include "dropboxRanges.h"
+#include "dropboxChunked.h"
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
 
 #define CONNECTION_SUCCESS = 0
 #define CONNECTION_ERROR = (-1)
@@ -11,21 +19,75 @@
 // Possíveis resultados da tentativa de conexão
 enum ConnectionResult { Success, Error };
 
+// Espera antes da primeira tentativa de reconexão.  A espera dobra a cada
+// tentativa que falha, até RECONNECT_MAX_DELAY_MS.
+#define RECONNECT_MIN_DELAY_MS 500
+#define RECONNECT_MAX_DELAY_MS (30 * 1000)
+
+// Espera antes de tentar de novo as réplicas depois que todas falharam
+#define REPLICA_RETRY_DELAY_MS (5 * 1000)
+
+// Espera pelo IN_MOVED_TO de um arquivo renomeado.  Sem ele, o arquivo saiu
+// do diretório de sincronização e é apagado no servidor.
+#define MOVE_PAIR_WINDOW_MS 100
+
 void print_interface();
 void run_interface();
 void run_sync_thread();
+void rescan_sync_dir();
+void load_ignore_patterns();
+bool is_ignored(const fs::path &absolute_path);
+void report_watch_usage();
 void run_get_sync_dir_thread();
 void create_sync_dir();
 void list_local_files();
 void list_server_files();
-std::vector<FileInfo> get_server_files();
+void list_file_versions(std::string filename);
+bool get_server_files(std::vector<FileInfo> &files);
+bool read_server_files(int fd, std::vector<FileInfo> &files);
+int connect_replica();
+void drop_replica();
+bool get_replica_files(std::vector<FileInfo> &files);
+bool download_from_replica(const TransferJob &job);
 ConnectionResult connect_server(std::string host, uint16_t port);
+void send_device_name(int fd);
+ConnectionResult connect_sync_channel();
+void run_relay_thread();
+void run_reconnect_thread();
+void connection_lost();
+bool require_connection();
 void sync_client();
+void submit_change(const fs::path &absolute_path, JournalChange change);
+void submit_move(const fs::path &from_path, const fs::path &to_path);
+void replay_journal();
+void pull_server_changes();
+void transfer_finished(const TransferJob &job, bool ok);
 void send_file(std::string filename);
+bool upload_file(int fd, const fs::path &absolute_path);
 void get_file(std::string filename);
+bool download_file(int fd, const std::string &filename, const fs::path &absolute_path, bool to_sync_dir,
+                   uint64_t version);
+bool download_ranges(int fd, const std::string &filename, const std::vector<ByteRange> &ranges,
+                     const fs::path &absolute_path);
+bool upload_chunked(int fd, const fs::path &absolute_path);
+bool download_chunked(int fd, const std::string &filename, const fs::path &absolute_path, bool to_sync_dir);
+bool run_chunk_streams(int fd, ChunkTracker &chunks, const std::function<bool(int, size_t)> &transfer);
+bool delete_remote(int fd, const std::string &filename);
+int connect_worker();
+bool execute_transfer(int fd, const TransferJob &job);
+uint64_t queue_upload(const fs::path &absolute_path, bool to_sync_dir, TransferPriority priority);
+uint64_t queue_download(const std::string &filename, const fs::path &absolute_path, bool to_sync_dir,
+                        uint64_t size, TransferPriority priority, uint64_t version = 0);
+uint64_t queue_delete(const std::string &filename);
+uint64_t queue_move(const std::string &from, const fs::path &absolute_path);
+uint64_t queue_ranges(const std::string &filename, const std::vector<ByteRange> &ranges, const fs::path &absolute_path);
+bool move_remote(int fd, const std::string &from, const fs::path &absolute_path);
+void list_transfers();
 void delete_file(std::string filename);
 void send_delete_command(std::string filename);
 void close_connection();
 void get_file(std::string filename, bool current_path);
+ContentHash local_file_hash(const fs::path &path);
+void remember_local_hash(const fs::path &path, const ContentHash &hash);
 
 #endif
@@ -0,0 +1,365 @@
+#include "dropboxDisk.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+//=============================================================================
+// DiskPool
+//=============================================================================
+DiskPool::DiskPool() {
+    threads_ = DEFAULT_DISK_THREADS;
+    depth_ = DEFAULT_DISK_DEPTH;
+    stopping_ = false;
+}
+
+
+DiskPool::~DiskPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        condition_.notify_all();
+    }
+    for (std::thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+
+// Deve ser chamada antes de "start"
+void DiskPool::configure(size_t threads, size_t depth) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_ = threads;
+    depth_ = depth > 0 ? depth : 1;
+}
+
+
+/*
+ * Cria as threads.  No servidor com vários processos, cada worker chama
+ * "start" depois do fork, já que as threads não sobrevivem a ele.
+ */
+void DiskPool::start() {
+    for (size_t i = 0; i < threads_; ++i) {
+        workers_.emplace_back(&DiskPool::run_thread, this, i);
+    }
+}
+
+
+void DiskPool::submit(dev_t device, const DiskTask &task) {
+    if (workers_.empty()) {
+        task();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(device);
+    if (it == devices_.end()) {
+        queues_.emplace_back(new DeviceQueue{device, std::deque<DiskTask>(), 0});
+        it = devices_.emplace(device, queues_.back().get()).first;
+    }
+    it->second->tasks.push_back(task);
+
+    // As threads têm preferências diferentes, então todas são acordadas
+    condition_.notify_all();
+}
+
+
+void DiskPool::run(dev_t device, const DiskTask &task) {
+    if (workers_.empty()) {
+        task();
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool done = false;
+
+    submit(device, [&] {
+        task();
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        condition.notify_all();
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return done; });
+}
+
+
+// Dispositivo do arquivo, ou do diretório onde ele vai ser criado
+dev_t DiskPool::device_of(const fs::path &path) {
+    struct stat status{};
+    if (stat(path.c_str(), &status) != 0 && stat(path.parent_path().c_str(), &status) != 0) {
+        return 0;
+    }
+    return status.st_dev;
+}
+
+
+dev_t DiskPool::device_of(int fd) {
+    struct stat status{};
+    if (fstat(fd, &status) != 0) {
+        return 0;
+    }
+    return status.st_dev;
+}
+
+
+void DiskPool::run_thread(size_t index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        DeviceQueue *queue = nullptr;
+        condition_.wait(lock, [&] { return stopping_ || (queue = next_queue(index)) != nullptr; });
+        if (stopping_) {
+            return;
+        }
+
+        DiskTask task = std::move(queue->tasks.front());
+        queue->tasks.pop_front();
+        ++queue->running;
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        --queue->running;
+        condition_.notify_all();
+    }
+}
+
+
+/*
+ * Fila de onde a thread "index" deve tirar a próxima operação: a do seu
+ * dispositivo preferido, ou a primeira das seguintes que tenha operações e
+ * não esteja na profundidade máxima.  Deve ser chamada com o mutex travado.
+ */
+DiskPool::DeviceQueue *DiskPool::next_queue(size_t index) {
+    size_t count = queues_.size();
+    for (size_t i = 0; i < count; ++i) {
+        DeviceQueue *queue = queues_[(index + i) % count].get();
+        if (!queue->tasks.empty() && queue->running < depth_) {
+            return queue;
+        }
+    }
+    return nullptr;
+}
+
+
+//=============================================================================
+// PooledWriter
+//=============================================================================
+PooledWriter::PooledWriter(DiskPool &pool, int fd, TransferGate *gate) : pool_(pool) {
+    fd_ = fd;
+    device_ = DiskPool::device_of(fd);
+    gate_ = gate;
+    pending_ = 0;
+    failed_ = false;
+}
+
+
+// As escritas pendentes usam o descritor, que o chamador fecha depois
+PooledWriter::~PooledWriter() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_below(1, lock);
+}
+
+
+bool PooledWriter::write(uint64_t offset, const char *data, size_t size) {
+    auto bytes = std::make_shared<std::vector<char>>(data, data + size);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait_below(DISK_WRITE_WINDOW, lock);
+        if (failed_) {
+            return false;
+        }
+        ++pending_;
+    }
+
+    if (gate_) {
+        gate_->acquire(size);
+    }
+
+    pool_.submit(device_, [this, offset, bytes] {
+        const char *data = bytes->data();
+        size_t remaining = bytes->size();
+        off_t position = (off_t) offset;
+
+        bool ok = true;
+        while (remaining > 0) {
+            ssize_t written = pwrite(fd_, data, remaining, position);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                std::cerr << "Erro na escrita do arquivo: " << strerror(errno) << "\n";
+                ok = false;
+                break;
+            }
+            data += written;
+            remaining -= written;
+            position += written;
+        }
+
+        if (gate_) {
+            gate_->release(bytes->size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = failed_ || !ok;
+        --pending_;
+        condition_.notify_all();
+    });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !failed_;
+}
+
+
+// Espera as escritas pendentes e ajusta o tamanho final do arquivo
+bool PooledWriter::finish(uint64_t file_size) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wait_below(1, lock);
+    }
+
+    bool ok = true;
+    pool_.run(device_, [&] {
+        if (ftruncate(fd_, (off_t) file_size) != 0) {
+            std::cerr << "Erro ao ajustar o tamanho do arquivo.\n";
+            ok = false;
+        }
+    });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ok && !failed_;
+}
+
+
+void PooledWriter::wait_below(size_t pending, std::unique_lock<std::mutex> &lock) {
+    condition_.wait(lock, [&] { return pending_ < pending; });
+}
+
+
+//=============================================================================
+// PooledReader
+//=============================================================================
+PooledReader::PooledReader(DiskPool &pool, int fd, TransferGate *gate) : pool_(pool) {
+    fd_ = fd;
+    device_ = DiskPool::device_of(fd);
+    gate_ = gate;
+    extent_end_ = 0;
+    running_ = 0;
+}
+
+
+// As leituras antecipadas usam o descritor, que o chamador fecha depois
+PooledReader::~PooledReader() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [&] { return running_ == 0; });
+}
+
+
+bool PooledReader::next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) {
+    bool found = false;
+    pool_.run(device_, [&] { found = next_data_extent(fd_, file_size, offset, end); });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.clear();
+    extent_end_ = found ? *end : 0;
+    return found;
+}
+
+
+/*
+ * Entrega o bloco lido antecipadamente, e pede os seguintes.  Uma leitura
+ * fora da sequência esperada é feita na hora.
+ */
+ssize_t PooledReader::read(uint64_t offset, char *data, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (!blocks_.empty() && blocks_.front()->offset != offset) {
+        blocks_.pop_front();
+    }
+    read_ahead(offset, size, lock);
+
+    if (blocks_.empty() || blocks_.front()->bytes.size() != size) {
+        blocks_.clear();
+        lock.unlock();
+
+        ssize_t result = -1;
+        if (gate_) {
+            gate_->acquire(size);
+        }
+        pool_.run(device_, [&] { result = pread(fd_, data, size, (off_t) offset); });
+        if (gate_) {
+            gate_->release(size);
+        }
+        return result;
+    }
+
+    std::shared_ptr<Block> block = blocks_.front();
+    blocks_.pop_front();
+    condition_.wait(lock, [&] { return block->done; });
+
+    if (block->result > 0) {
+        memcpy(data, block->bytes.data(), (size_t) block->result);
+    }
+    read_ahead(offset + size, size, lock);
+    return block->result;
+}
+
+
+/*
+ * Pede a leitura dos blocos seguintes ao último pedido (ou a partir de
+ * "offset"), até DISK_READ_AHEAD blocos ou o fim do extent.  As operações
+ * são entregues ao pool sem o mutex travado, já que sem threads elas rodam
+ * na hora, e o "gate" pode esperar por uma vaga.
+ */
+void PooledReader::read_ahead(uint64_t offset, size_t size, std::unique_lock<std::mutex> &lock) {
+    uint64_t next = blocks_.empty() ? offset : blocks_.back()->offset + blocks_.back()->bytes.size();
+
+    std::vector<std::shared_ptr<Block>> requested;
+    while (blocks_.size() < DISK_READ_AHEAD && next < extent_end_) {
+        auto block = std::make_shared<Block>();
+        block->offset = next;
+        block->bytes.resize((size_t) std::min<uint64_t>(size, extent_end_ - next));
+        block->result = -1;
+        block->done = false;
+
+        blocks_.push_back(block);
+        requested.push_back(block);
+        next += block->bytes.size();
+        ++running_;
+    }
+
+    if (requested.empty()) {
+        return;
+    }
+
+    lock.unlock();
+    for (auto &block : requested) {
+        if (gate_) {
+            gate_->acquire(block->bytes.size());
+        }
+
+        pool_.submit(device_, [this, block] {
+            ssize_t result = pread(fd_, block->bytes.data(), block->bytes.size(), (off_t) block->offset);
+            if (gate_) {
+                gate_->release(block->bytes.size());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            block->result = result;
+            block->done = true;
+            --running_;
+            condition_.notify_all();
+        });
+    }
+    lock.lock();
+}
@@ -0,0 +1,171 @@
+#ifndef __DROPBOX_DISK_H__
+#define __DROPBOX_DISK_H__
+
+#include <sys/types.h>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include "dropboxUtil.h"
+
+// Threads de disco padrão de cada processo do servidor (0 faz as operações
+// na thread da conexão)
+#define DEFAULT_DISK_THREADS 8
+
+// Operações em andamento ao mesmo tempo em cada dispositivo
+#define DEFAULT_DISK_DEPTH 4
+
+// Blocos de um upload esperando para serem escritos.  Quando a janela
+// enche, a recepção espera o disco.
+#define DISK_WRITE_WINDOW 8
+
+// Blocos de um download lidos antes de serem enviados
+#define DISK_READ_AHEAD 4
+
+typedef std::function<void()> DiskTask;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * DiskPool
+ * ----------------------------------------------------------------------------
+ * Threads que fazem as operações de disco do servidor, separadas das threads
+ * das conexões.
+ *
+ * - Cada dispositivo (st_dev) tem sua própria fila, e no máximo "depth"
+ *   operações em andamento.  Assim a profundidade da fila de cada disco é
+ *   ajustada independente da quantidade de conexões.
+ *
+ * - Cada thread tem um dispositivo preferido, e quando a fila dele está
+ *   vazia ou cheia rouba operações das filas dos outros dispositivos.  Um
+ *   disco lento ocupa no máximo "depth" threads, e os outros continuam
+ *   sendo atendidos.
+ *
+ * "submit" retorna imediatamente, e "run" espera a operação terminar.  Sem
+ * threads, as operações são feitas na thread de quem as pediu.
+ * ----------------------------------------------------------------------------
+ */
+class DiskPool {
+public:
+    DiskPool();
+    ~DiskPool();
+
+    DiskPool(const DiskPool &) = delete;
+    DiskPool &operator=(const DiskPool &) = delete;
+
+    void configure(size_t threads, size_t depth);
+    void start();
+
+    void submit(dev_t device, const DiskTask &task);
+    void run(dev_t device, const DiskTask &task);
+
+    static dev_t device_of(const boost::filesystem::path &path);
+    static dev_t device_of(int fd);
+
+private:
+    struct DeviceQueue {
+        dev_t device;
+        std::deque<DiskTask> tasks;
+        size_t running;
+    };
+
+    void run_thread(size_t index);
+    DeviceQueue *next_queue(size_t index);
+
+    size_t threads_;
+    size_t depth_;
+    bool stopping_;
+
+    std::vector<std::unique_ptr<DeviceQueue>> queues_;
+    std::map<dev_t, DeviceQueue *> devices_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * PooledWriter
+ * ----------------------------------------------------------------------------
+ * Escreve um arquivo recebido pelo DiskPool.  Cada bloco é copiado e sua
+ * escrita é entregue ao pool, e a thread da conexão volta a ler o socket.
+ * No máximo DISK_WRITE_WINDOW blocos ficam esperando o disco.
+ *
+ * Se houver um "gate", cada escrita passa por ele: "acquire" antes de ser
+ * entregue ao pool e "release" quando termina, na thread de disco.
+ * ----------------------------------------------------------------------------
+ */
+class PooledWriter : public FileSink {
+public:
+    PooledWriter(DiskPool &pool, int fd, TransferGate *gate = nullptr);
+    ~PooledWriter() override;
+
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+private:
+    void wait_below(size_t pending, std::unique_lock<std::mutex> &lock);
+
+    DiskPool &pool_;
+    int fd_;
+    dev_t device_;
+    TransferGate *gate_;
+
+    size_t pending_;
+    bool failed_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * PooledReader
+ * ----------------------------------------------------------------------------
+ * Lê um arquivo enviado pelo DiskPool.  Enquanto um bloco é enviado, os
+ * DISK_READ_AHEAD blocos seguintes do mesmo extent já estão sendo lidos.
+ * Cada leitura de um bloco passa pelo "gate", como no PooledWriter.
+ * ----------------------------------------------------------------------------
+ */
+class PooledReader : public FileSource {
+public:
+    PooledReader(DiskPool &pool, int fd, TransferGate *gate = nullptr);
+    ~PooledReader() override;
+
+    bool next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) override;
+    ssize_t read(uint64_t offset, char *data, size_t size) override;
+
+private:
+    struct Block {
+        uint64_t offset;
+        std::vector<char> bytes;
+        ssize_t result;
+        bool done;
+    };
+
+    void read_ahead(uint64_t offset, size_t size, std::unique_lock<std::mutex> &lock);
+
+    DiskPool &pool_;
+    int fd_;
+    dev_t device_;
+    TransferGate *gate_;
+
+    // Fim do extent atual, até onde os blocos são lidos antecipadamente
+    uint64_t extent_end_;
+
+    std::deque<std::shared_ptr<Block>> blocks_;
+    size_t running_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+#endif
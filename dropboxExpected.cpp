@@ -0,0 +1,90 @@
+#include "dropboxExpected.h"
+
+//=============================================================================
+// ExpectedWrites
+//=============================================================================
+void ExpectedWrites::expect(const boost::filesystem::path &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Entry entry{};
+    entry.pending = true;
+    entries_[path.string()] = entry;
+}
+
+
+/*
+ * Marca a escrita como concluída, guardando os dados atuais do arquivo.  Se o
+ * arquivo não existir mais, o registro é descartado.
+ */
+void ExpectedWrites::complete(const boost::filesystem::path &path) {
+    struct stat info{};
+    bool exists = stat(path.c_str(), &info) == 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!exists) {
+        entries_.erase(path.string());
+        return;
+    }
+
+    Entry entry{};
+    entry.pending = false;
+    entry.inode = info.st_ino;
+    entry.size = info.st_size;
+    entry.modified = info.st_mtim;
+    entry.expires = time(nullptr) + EXPECTED_WRITE_TTL;
+    entries_[path.string()] = entry;
+}
+
+
+void ExpectedWrites::cancel(const boost::filesystem::path &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(path.string());
+}
+
+
+/*
+ * Verifica se um evento no caminho foi causado por uma escrita do próprio
+ * cliente.
+ */
+bool ExpectedWrites::is_expected(const boost::filesystem::path &path) {
+    struct stat info{};
+    bool exists = stat(path.c_str(), &info) == 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    expire(time(nullptr));
+
+    auto it = entries_.find(path.string());
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    const Entry &entry = it->second;
+    if (entry.pending) {
+        return true;
+    }
+
+    if (exists &&
+        info.st_ino == entry.inode &&
+        info.st_size == entry.size &&
+        info.st_mtim.tv_sec == entry.modified.tv_sec &&
+        info.st_mtim.tv_nsec == entry.modified.tv_nsec) {
+        return true;
+    }
+
+    // O arquivo mudou depois da nossa escrita
+    entries_.erase(it);
+    return false;
+}
+
+
+void ExpectedWrites::expire(time_t now) {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (!it->second.pending && it->second.expires <= now) {
+            it = entries_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
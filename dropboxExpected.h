@@ -0,0 +1,58 @@
+#ifndef __DROPBOX_EXPECTED_H__
+#define __DROPBOX_EXPECTED_H__
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <ctime>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+// Tempo, em segundos, que uma escrita concluída continua sendo esperada
+#define EXPECTED_WRITE_TTL 60
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ExpectedWrites
+ * ----------------------------------------------------------------------------
+ * Registro das escritas que o próprio cliente faz no diretório de
+ * sincronização (downloads e repasses), para que os eventos do inotify
+ * causados por elas não sejam enviados de volta ao servidor.
+ *
+ * - "expect" é chamada antes da escrita começar.  Enquanto ela não termina,
+ *   todos os eventos do caminho são ignorados.
+ *
+ * - "complete" é chamada depois que o arquivo recebe sua data de
+ *   modificação final, e guarda o inode, a data e o tamanho do arquivo.  Os
+ *   eventos que chegarem depois só são ignorados se o arquivo ainda tiver
+ *   exatamente esses dados; se o usuário o alterou, o evento segue
+ *   normalmente e o registro é descartado.
+ *
+ * Registros concluídos expiram depois de EXPECTED_WRITE_TTL segundos.
+ * ----------------------------------------------------------------------------
+ */
+class ExpectedWrites {
+public:
+    void expect(const boost::filesystem::path &path);
+    void complete(const boost::filesystem::path &path);
+    void cancel(const boost::filesystem::path &path);
+
+    bool is_expected(const boost::filesystem::path &path);
+
+private:
+    struct Entry {
+        bool pending;
+        ino_t inode;
+        off_t size;
+        timespec modified;
+        time_t expires;
+    };
+
+    void expire(time_t now);
+
+    std::map<std::string, Entry> entries_;
+    std::mutex mutex_;
+};
+
+#endif
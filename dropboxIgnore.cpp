@@ -0,0 +1,317 @@
+#include "dropboxIgnore.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+namespace fs = boost::filesystem;
+
+//=============================================================================
+// GlobAutomaton
+//=============================================================================
+void GlobAutomaton::add(const std::string &glob, bool directory_only) {
+    std::bitset<256> any_char;
+    any_char.set();
+    any_char.reset('/');
+
+    starts_.push_back((uint32_t) tokens_.size());
+
+    for (size_t i = 0; i < glob.size(); ++i) {
+        Token token{};
+        unsigned char c = (unsigned char) glob[i];
+
+        // Uma classe sem o ']' final é um '[' comum.  Um ']' logo no começo
+        // da classe faz parte dela.
+        size_t first = i + 1;
+        bool negated = c == '[' && first < glob.size() && (glob[first] == '!' || glob[first] == '^');
+        if (negated) {
+            ++first;
+        }
+        size_t close = c == '[' && first < glob.size() ? glob.find(']', first + 1) : std::string::npos;
+
+        if (c == '*') {
+            // "**" é o mesmo que "*" dentro de um componente
+            if (tokens_.size() > starts_.back() && tokens_.back().kind == Star) {
+                continue;
+            }
+            token.kind = Star;
+            token.chars = any_char;
+        }
+        else if (c == '?') {
+            token.kind = Chars;
+            token.chars = any_char;
+        }
+        else if (close != std::string::npos) {
+            for (size_t j = first; j < close; ++j) {
+                unsigned char low = (unsigned char) glob[j];
+                if (j + 2 < close && glob[j + 1] == '-') {
+                    unsigned char high = (unsigned char) glob[j + 2];
+                    for (unsigned int k = low; k <= high; ++k) {
+                        token.chars.set(k);
+                    }
+                    j += 2;
+                }
+                else {
+                    token.chars.set(low);
+                }
+            }
+            if (negated) {
+                token.chars.flip();
+            }
+            token.chars.reset('/');
+            token.kind = Chars;
+            i = close;
+        }
+        else {
+            token.kind = Chars;
+            token.chars.set(c);
+        }
+        tokens_.push_back(token);
+    }
+
+    Token accept{};
+    accept.kind = Accept;
+    accept.directory_only = directory_only;
+    tokens_.push_back(accept);
+}
+
+
+bool GlobAutomaton::empty() const {
+    return starts_.empty();
+}
+
+
+/*
+ * Percorre "text" uma vez, com o conjunto das posições ativas de todos os
+ * globs.  O texto casa se, no fim, alguma das posições ativas for o fim de
+ * um glob.
+ */
+bool GlobAutomaton::matches(const std::string &text, bool directory) const {
+    if (starts_.empty()) {
+        return false;
+    }
+
+    std::vector<uint32_t> current;
+    std::vector<uint32_t> next;
+    std::vector<char> seen(tokens_.size(), 0);
+
+    for (uint32_t start : starts_) {
+        add_state(start, current, seen);
+    }
+
+    for (char character : text) {
+        unsigned char c = (unsigned char) character;
+
+        next.clear();
+        std::fill(seen.begin(), seen.end(), 0);
+        for (uint32_t state : current) {
+            const Token &token = tokens_[state];
+            if (token.kind == Star && token.chars[c]) {
+                add_state(state, next, seen);
+            }
+            else if (token.kind == Chars && token.chars[c]) {
+                add_state(state + 1, next, seen);
+            }
+        }
+
+        current.swap(next);
+        if (current.empty()) {
+            return false;
+        }
+    }
+
+    for (uint32_t state : current) {
+        if (tokens_[state].kind == Accept && (directory || !tokens_[state].directory_only)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Ativa a posição e, se ela for um '*', também a seguinte, pois '*' pode
+// casar com nada
+void GlobAutomaton::add_state(uint32_t state, std::vector<uint32_t> &states, std::vector<char> &seen) const {
+    if (seen[state]) {
+        return;
+    }
+    seen[state] = 1;
+    states.push_back(state);
+
+    if (tokens_[state].kind == Star) {
+        add_state(state + 1, states, seen);
+    }
+}
+
+
+//=============================================================================
+// IgnoreMatcher
+//=============================================================================
+IgnoreMatcher::IgnoreMatcher() {
+    add(".goutputstream*");
+    add("~*");
+}
+
+
+void IgnoreMatcher::add(std::string pattern) {
+    while (!pattern.empty() && isspace((unsigned char) pattern.back())) {
+        pattern.pop_back();
+    }
+    if (pattern.empty() || pattern[0] == '#') {
+        return;
+    }
+
+    bool directory_only = pattern.back() == '/';
+    if (directory_only) {
+        pattern.pop_back();
+    }
+
+    bool anchored = pattern[0] == '/';
+    if (anchored) {
+        pattern.erase(0, 1);
+    }
+    if (pattern.empty()) {
+        return;
+    }
+
+    if (anchored || pattern.find('/') != std::string::npos) {
+        path_globs_.add(pattern, directory_only);
+        return;
+    }
+
+    size_t wildcard = pattern.find_first_of("*?[");
+    if (wildcard == std::string::npos) {
+        names_[directory_only].insert(pattern);
+    }
+    else if (wildcard == pattern.size() - 1 && pattern.back() == '*') {
+        insert(prefixes_, pattern.substr(0, pattern.size() - 1), directory_only);
+    }
+    else if (pattern[0] == '*' && pattern.find_first_of("*?[", 1) == std::string::npos) {
+        std::string suffix = pattern.substr(1);
+        std::reverse(suffix.begin(), suffix.end());
+        insert(suffixes_, suffix, directory_only);
+    }
+    else {
+        name_globs_.add(pattern, directory_only);
+    }
+}
+
+
+// Um padrão por linha
+void IgnoreMatcher::add_patterns(const std::string &text) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        add(line);
+    }
+}
+
+
+bool IgnoreMatcher::load(const fs::path &path) {
+    std::ifstream file(path.string());
+    if (!file) {
+        return false;
+    }
+
+    std::stringstream text;
+    text << file.rdbuf();
+    add_patterns(text.str());
+    return true;
+}
+
+
+/*
+ * Verifica um caminho relativo à raiz do diretório de sincronização.  Um
+ * caminho terminado em '/' é um diretório.  O caminho é ignorado se qualquer
+ * um dos seus componentes for.
+ */
+bool IgnoreMatcher::ignored(const std::string &relative_path) const {
+    size_t root = relative_path.find_first_not_of('/');
+    if (root == std::string::npos) {
+        return false;
+    }
+
+    size_t begin = root;
+    while (begin < relative_path.size()) {
+        size_t end = relative_path.find('/', begin);
+        bool directory = end != std::string::npos;
+        if (!directory) {
+            end = relative_path.size();
+        }
+
+        if (end > begin) {
+            if (name_ignored(relative_path.substr(begin, end - begin), directory)) {
+                return true;
+            }
+            if (!path_globs_.empty() && path_globs_.matches(relative_path.substr(root, end - root), directory)) {
+                return true;
+            }
+        }
+        begin = end + 1;
+    }
+    return false;
+}
+
+
+bool IgnoreMatcher::name_ignored(const std::string &name, bool directory) const {
+    return names_[0].count(name) > 0 || (directory && names_[1].count(name) > 0) ||
+           trie_matches(prefixes_, name, false, directory) || trie_matches(suffixes_, name, true, directory) ||
+           name_globs_.matches(name, directory);
+}
+
+
+void IgnoreMatcher::insert(std::vector<TrieNode> &trie, const std::string &key, bool directory_only) {
+    if (trie.empty()) {
+        trie.push_back(TrieNode{});
+    }
+
+    uint32_t node = 0;
+    for (char character : key) {
+        unsigned char c = (unsigned char) character;
+        auto &children = trie[node].children;
+        auto it = std::find_if(children.begin(), children.end(),
+                               [c](const std::pair<unsigned char, uint32_t> &child) { return child.first == c; });
+        if (it != children.end()) {
+            node = it->second;
+        }
+        else {
+            uint32_t child = (uint32_t) trie.size();
+            trie[node].children.emplace_back(c, child);
+            trie.push_back(TrieNode{});
+            node = child;
+        }
+    }
+    trie[node].terminal[directory_only] = true;
+}
+
+
+/*
+ * Procura na trie uma chave que seja prefixo de "name" (ou sufixo, com a trie
+ * de sufixos invertidos).
+ */
+bool IgnoreMatcher::trie_matches(const std::vector<TrieNode> &trie, const std::string &name, bool reversed,
+                                 bool directory) const {
+    if (trie.empty()) {
+        return false;
+    }
+
+    uint32_t node = 0;
+    for (size_t i = 0;; ++i) {
+        if (trie[node].terminal[0] || (directory && trie[node].terminal[1])) {
+            return true;
+        }
+        if (i == name.size()) {
+            return false;
+        }
+
+        unsigned char c = (unsigned char) (reversed ? name[name.size() - 1 - i] : name[i]);
+        const auto &children = trie[node].children;
+        auto it = std::find_if(children.begin(), children.end(),
+                               [c](const std::pair<unsigned char, uint32_t> &child) { return child.first == c; });
+        if (it == children.end()) {
+            return false;
+        }
+        node = it->second;
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef __DROPBOX_IGNORE_H__
+#define __DROPBOX_IGNORE_H__
+
+#include <string>
+#include <vector>
+#include <bitset>
+#include <unordered_set>
+#include <cstdint>
+#include <boost/filesystem.hpp>
+
+// Arquivo, na raiz do diretório de sincronização, com os padrões de arquivos
+// que não são sincronizados.  Ele próprio é sincronizado, então o servidor e
+// todos os dispositivos do usuário usam os mesmos padrões.
+#define SYNC_IGNORE_FILE ".syncignore"
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * GlobAutomaton
+ * ----------------------------------------------------------------------------
+ * Vários globs compilados num único autômato não determinístico.  Um nome é
+ * percorrido uma única vez, acompanhando ao mesmo tempo as posições de todos
+ * os globs, em vez de ser testado contra cada glob separadamente.
+ *
+ * Aceita '*', '?' e classes como "[a-z]" ou "[!0-9]".  '*' e '?' não casam
+ * com '/'.
+ * ----------------------------------------------------------------------------
+ */
+class GlobAutomaton {
+public:
+    void add(const std::string &glob, bool directory_only);
+    bool matches(const std::string &text, bool directory) const;
+    bool empty() const;
+
+private:
+    // Chars casa com um caractere do conjunto, Star com zero ou mais
+    enum TokenKind { Chars, Star, Accept };
+
+    struct Token {
+        TokenKind kind;
+        std::bitset<256> chars;
+        bool directory_only;
+    };
+
+    void add_state(uint32_t state, std::vector<uint32_t> &states, std::vector<char> &seen) const;
+
+    std::vector<Token> tokens_;
+    std::vector<uint32_t> starts_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * IgnoreMatcher
+ * ----------------------------------------------------------------------------
+ * Padrões de arquivos ignorados pela sincronização, compilados uma vez.  O
+ * formato é o de um .gitignore simplificado, um padrão por linha:
+ *
+ *  - linhas vazias ou começadas por '#' são ignoradas;
+ *  - um padrão terminado em '/' casa apenas com diretórios;
+ *  - um padrão sem '/' casa com qualquer componente do caminho, então
+ *    "node_modules/" ignora tudo dentro de qualquer node_modules;
+ *  - um padrão com '/' casa com o caminho relativo à raiz, ou com um
+ *    diretório que contém o arquivo.
+ *
+ * Cada padrão vai para a estrutura mais barata que o resolve: nomes exatos
+ * numa tabela hash, "prefixo*" e "*sufixo" em tries de prefixos e de sufixos
+ * invertidos, e os outros globs num GlobAutomaton.  Os arquivos temporários
+ * dos editores e do próprio cliente (".goutputstream*" e "~*") são sempre
+ * ignorados.
+ *
+ * Depois de montado, o matcher só é lido, e pode ser compartilhado entre
+ * threads.
+ * ----------------------------------------------------------------------------
+ */
+class IgnoreMatcher {
+public:
+    IgnoreMatcher();
+
+    void add(std::string pattern);
+    void add_patterns(const std::string &text);
+    bool load(const boost::filesystem::path &path);
+
+    bool ignored(const std::string &relative_path) const;
+
+private:
+    struct TrieNode {
+        std::vector<std::pair<unsigned char, uint32_t>> children;
+        bool terminal[2];
+    };
+
+    void insert(std::vector<TrieNode> &trie, const std::string &key, bool directory_only);
+    bool trie_matches(const std::vector<TrieNode> &trie, const std::string &name, bool reversed,
+                      bool directory) const;
+    bool name_ignored(const std::string &name, bool directory) const;
+
+    std::unordered_set<std::string> names_[2];
+    std::vector<TrieNode> prefixes_;
+    std::vector<TrieNode> suffixes_;
+    GlobAutomaton name_globs_;
+    GlobAutomaton path_globs_;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "dropboxIngest.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+//=============================================================================
+// IngestWriter
+//=============================================================================
+IngestWriter::IngestWriter(int fd, TransferGate *gate) {
+    fd_ = fd;
+    gate_ = gate;
+    preallocate_ = true;
+    buffer_.reserve(INGEST_BLOCK_BYTES);
+    buffer_offset_ = 0;
+    behind_start_ = 0;
+    window_start_ = 0;
+}
+
+
+/*
+ * Reserva o espaço do extent sem alterar o tamanho do arquivo.  Se o sistema
+ * de arquivos não suportar fallocate, a reserva é abandonada.
+ */
+void IngestWriter::extent(uint64_t offset, uint64_t length) {
+    if (!preallocate_) {
+        return;
+    }
+
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) length) != 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            std::cerr << "Erro ao reservar espaço para o arquivo: " << strerror(errno) << "\n";
+        }
+        preallocate_ = false;
+    }
+}
+
+
+/*
+ * Acrescenta os bytes ao bloco em construção.  O bloco é escrito quando
+ * enche ou quando os bytes não são contíguos aos anteriores.
+ */
+bool IngestWriter::write(uint64_t offset, const char *data, size_t size) {
+    bool ok = true;
+
+    if (!buffer_.empty() && buffer_offset_ + buffer_.size() != offset) {
+        ok = flush();
+    }
+
+    while (size > 0) {
+        if (buffer_.empty()) {
+            buffer_offset_ = offset;
+        }
+
+        size_t count = std::min(size, INGEST_BLOCK_BYTES - buffer_.size());
+        buffer_.insert(buffer_.end(), data, data + count);
+        data += count;
+        offset += count;
+        size -= count;
+
+        if (buffer_.size() == INGEST_BLOCK_BYTES) {
+            ok = flush() && ok;
+        }
+    }
+    return ok;
+}
+
+
+/*
+ * Escreve o que falta, ajusta o tamanho final do arquivo e descarta do page
+ * cache o que foi escrito.
+ */
+bool IngestWriter::finish(uint64_t file_size) {
+    bool ok = flush();
+
+    if (ftruncate(fd_, (off_t) file_size) != 0) {
+        std::cerr << "Erro ao ajustar o tamanho do arquivo.\n";
+        ok = false;
+    }
+
+    sync_file_range(fd_, (off_t) behind_start_, 0,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd_, (off_t) behind_start_, 0, POSIX_FADV_DONTNEED);
+    return ok;
+}
+
+
+bool IngestWriter::flush() {
+    const char *data = buffer_.data();
+    size_t remaining = buffer_.size();
+    uint64_t offset = buffer_offset_;
+
+    if (remaining > 0 && gate_) {
+        gate_->acquire(buffer_.size());
+    }
+
+    bool ok = true;
+    while (remaining > 0) {
+        ssize_t written = pwrite(fd_, data, remaining, (off_t) offset);
+        if (written <= 0) {
+            std::cerr << "Erro na escrita do arquivo: " << strerror(errno) << "\n";
+            ok = false;
+            break;
+        }
+        data += written;
+        remaining -= written;
+        offset += written;
+    }
+
+    if (!buffer_.empty() && gate_) {
+        gate_->release(buffer_.size());
+    }
+
+    buffer_.clear();
+    if (!ok) {
+        return false;
+    }
+    write_behind(offset);
+    return true;
+}
+
+
+/*
+ * Quando a janela atual atinge INGEST_WINDOW_BYTES, inicia sua gravação sem
+ * esperar.  A janela anterior, cuja gravação já foi iniciada, é aguardada e
+ * descartada do page cache.
+ */
+void IngestWriter::write_behind(uint64_t end) {
+    if (end - window_start_ < INGEST_WINDOW_BYTES) {
+        return;
+    }
+
+    sync_file_range(fd_, (off_t) window_start_, (off_t) (end - window_start_), SYNC_FILE_RANGE_WRITE);
+
+    if (window_start_ > behind_start_) {
+        off_t length = (off_t) (window_start_ - behind_start_);
+        sync_file_range(fd_, (off_t) behind_start_, length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_, (off_t) behind_start_, length, POSIX_FADV_DONTNEED);
+    }
+
+    behind_start_ = window_start_;
+    window_start_ = end;
+}
@@ -0,0 +1,66 @@
+#ifndef __DROPBOX_INGEST_H__
+#define __DROPBOX_INGEST_H__
+
+#include <vector>
+#include <cstdint>
+#include "dropboxUtil.h"
+
+// Arquivos a partir desse tamanho são recebidos pelo IngestWriter
+#define DEFAULT_INGEST_THRESHOLD (64 * 1024 * 1024)
+
+// Tamanho das escritas feitas no disco
+#define INGEST_BLOCK_BYTES (1024 * 1024)
+
+// A cada janela escrita, a gravação dela no disco é iniciada e a janela
+// anterior é descartada do page cache.
+#define INGEST_WINDOW_BYTES (8 * 1024 * 1024)
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * IngestWriter
+ * ----------------------------------------------------------------------------
+ * Escreve arquivos grandes recebidos pelo servidor sem poluir o page cache.
+ *
+ * - O espaço de cada extent é reservado com fallocate antes dos seus bytes
+ *   chegarem, para que o arquivo fique contíguo no disco.  Os buracos de
+ *   arquivos esparsos continuam sem ocupar espaço.
+ *
+ * - Os blocos recebidos do socket são agrupados e escritos em blocos de
+ *   INGEST_BLOCK_BYTES.
+ *
+ * - As páginas escritas são enviadas ao disco com sync_file_range em janelas
+ *   de INGEST_WINDOW_BYTES.  Quando uma janela termina de ser gravada, suas
+ *   páginas são descartadas com posix_fadvise, de forma que um upload de
+ *   vários GB não expulsa do page cache os arquivos dos outros usuários.
+ *
+ * - Cada escrita de um bloco passa pelo "gate", se houver, entre "acquire" e
+ *   "release".
+ * ----------------------------------------------------------------------------
+ */
+class IngestWriter : public FileSink {
+public:
+    explicit IngestWriter(int fd, TransferGate *gate = nullptr);
+
+    void extent(uint64_t offset, uint64_t length) override;
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+private:
+    bool flush();
+    void write_behind(uint64_t end);
+
+    int fd_;
+    TransferGate *gate_;
+    bool preallocate_;
+
+    std::vector<char> buffer_;
+    uint64_t buffer_offset_;
+
+    // [behind_start_, window_start_) está sendo gravado no disco e
+    // [window_start_, ...) ainda está apenas no page cache.
+    uint64_t behind_start_;
+    uint64_t window_start_;
+};
+
+#endif
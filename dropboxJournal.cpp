@@ -0,0 +1,202 @@
+#include "dropboxJournal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+// Registro do log, seguido pelos "name_length" bytes do nome.  "kind" é um
+// JournalChange, ou JOURNAL_RESOLVED para uma mudança que chegou ao servidor.
+struct JournalRecord {
+    uint8_t kind;
+    uint8_t padding;
+    uint16_t name_length;
+};
+
+#define JOURNAL_RESOLVED 0xff
+
+
+//=============================================================================
+// ChangeJournal
+//=============================================================================
+ChangeJournal::ChangeJournal() {
+    fd_ = -1;
+    records_ = 0;
+}
+
+
+ChangeJournal::~ChangeJournal() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+
+/*
+ * Abre o journal, criando o arquivo se necessário, e recupera as mudanças
+ * pendentes de uma execução anterior.
+ */
+bool ChangeJournal::open(const fs::path &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    path_ = path;
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ == -1) {
+        std::cerr << "Erro ao abrir o journal " << path_.string() << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    std::vector<char> log(fs::file_size(path_));
+    if (!log.empty() && pread(fd_, log.data(), log.size(), 0) != (ssize_t) log.size()) {
+        std::cerr << "Erro ao ler o journal " << path_.string() << "\n";
+        return false;
+    }
+
+    size_t position = 0;
+    while (position + sizeof(JournalRecord) <= log.size()) {
+        JournalRecord record{};
+        memcpy(&record, log.data() + position, sizeof(record));
+        if (position + sizeof(record) + record.name_length > log.size()) {
+            break;
+        }
+
+        std::string filename(log.data() + position + sizeof(record), record.name_length);
+        position += sizeof(record) + record.name_length;
+
+        if (record.kind == JOURNAL_RESOLVED) {
+            changes_.erase(filename);
+        }
+        else {
+            changes_[filename] = (JournalChange) record.kind;
+        }
+    }
+
+    if (position < log.size()) {
+        std::cerr << "Journal " << path_.string() << " tinha um registro incompleto\n";
+    }
+
+    // O log reescrito já não tem o registro incompleto
+    return rewrite();
+}
+
+
+// Registra uma mudança, substituindo a anterior do mesmo arquivo
+void ChangeJournal::record(const std::string &filename, JournalChange change) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = changes_.find(filename);
+    if (it != changes_.end() && it->second == change) {
+        return;
+    }
+
+    changes_[filename] = change;
+    append_record((uint8_t) change, filename);
+}
+
+
+/*
+ * Marca a mudança do arquivo como enviada ao servidor.  Não faz nada se a
+ * mudança pendente for outra, registrada depois.
+ */
+void ChangeJournal::resolve(const std::string &filename, JournalChange change) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = changes_.find(filename);
+    if (it == changes_.end() || it->second != change) {
+        return;
+    }
+
+    changes_.erase(it);
+    if (changes_.empty() || records_ > 2 * changes_.size() + JOURNAL_REWRITE_SLACK) {
+        rewrite();
+    }
+    else {
+        append_record(JOURNAL_RESOLVED, filename);
+    }
+}
+
+
+bool ChangeJournal::contains(const std::string &filename) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return changes_.count(filename) > 0;
+}
+
+
+std::vector<std::pair<std::string, JournalChange>> ChangeJournal::changes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::vector<std::pair<std::string, JournalChange>>(changes_.begin(), changes_.end());
+}
+
+
+size_t ChangeJournal::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return changes_.size();
+}
+
+
+bool ChangeJournal::append_record(uint8_t kind, const std::string &filename) {
+    if (fd_ == -1) {
+        return false;
+    }
+
+    JournalRecord record{};
+    record.kind = kind;
+    record.name_length = (uint16_t) filename.size();
+
+    // Registro e nome numa única escrita
+    std::vector<char> buffer(sizeof(record) + filename.size());
+    memcpy(buffer.data(), &record, sizeof(record));
+    memcpy(buffer.data() + sizeof(record), filename.data(), filename.size());
+
+    if (::write(fd_, buffer.data(), buffer.size()) != (ssize_t) buffer.size()) {
+        std::cerr << "Erro ao escrever no journal " << path_.string() << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    ++records_;
+    return true;
+}
+
+
+/*
+ * Substitui o log por um com apenas as mudanças pendentes.  Um journal sem
+ * mudanças é apenas truncado.
+ */
+bool ChangeJournal::rewrite() {
+    if (changes_.empty()) {
+        records_ = 0;
+        return ftruncate(fd_, 0) == 0;
+    }
+
+    fs::path temp_path = path_.string() + ".tmp";
+
+    int old_fd = fd_;
+    fd_ = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd_ == -1) {
+        fd_ = old_fd;
+        return false;
+    }
+
+    size_t old_records = records_;
+    records_ = 0;
+
+    bool ok = true;
+    for (auto &change : changes_) {
+        ok = ok && append_record((uint8_t) change.second, change.first);
+    }
+    ok = ok && fsync(fd_) == 0;
+
+    if (!ok || rename(temp_path.c_str(), path_.c_str()) != 0) {
+        std::cerr << "Erro ao reescrever o journal " << path_.string() << "\n";
+        close(fd_);
+        unlink(temp_path.c_str());
+        fd_ = old_fd;
+        records_ = old_records;
+        return false;
+    }
+
+    close(old_fd);
+    return true;
+}
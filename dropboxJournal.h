@@ -0,0 +1,66 @@
+#ifndef __DROPBOX_JOURNAL_H__
+#define __DROPBOX_JOURNAL_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <boost/filesystem.hpp>
+
+// O log é reescrito quando tiver essa quantidade de registros além do dobro
+// das mudanças pendentes
+#define JOURNAL_REWRITE_SLACK 256
+
+enum JournalChange { JournalUpload, JournalDelete };
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ChangeJournal
+ * ----------------------------------------------------------------------------
+ * Mudanças do diretório de sincronização que ainda não chegaram ao servidor,
+ * guardadas em disco enquanto o cliente está desconectado.
+ *
+ * - Apenas o efeito final de cada arquivo é mantido: um arquivo criado,
+ *   alterado várias vezes e apagado fica como um único delete.
+ *
+ * - O arquivo é um log: cada mudança acrescenta um registro, e cada mudança
+ *   que chega ao servidor acrescenta um registro que a resolve.  Ao abrir, o
+ *   log é relido e reescrito apenas com as mudanças pendentes.  Um registro
+ *   incompleto no fim, deixado por uma queda, é descartado.
+ *
+ * Os registros não são sincronizados com o disco a cada escrita: o journal
+ * sobrevive a uma queda do cliente, mas não necessariamente do sistema.
+ * ----------------------------------------------------------------------------
+ */
+class ChangeJournal {
+public:
+    ChangeJournal();
+    ~ChangeJournal();
+
+    ChangeJournal(const ChangeJournal &) = delete;
+    ChangeJournal &operator=(const ChangeJournal &) = delete;
+
+    bool open(const boost::filesystem::path &path);
+
+    void record(const std::string &filename, JournalChange change);
+    void resolve(const std::string &filename, JournalChange change);
+
+    bool contains(const std::string &filename) const;
+    std::vector<std::pair<std::string, JournalChange>> changes() const;
+    size_t size() const;
+
+private:
+    bool append_record(uint8_t kind, const std::string &filename);
+    bool rewrite();
+
+    boost::filesystem::path path_;
+    int fd_;
+
+    std::map<std::string, JournalChange> changes_;
+    size_t records_;
+
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,461 @@
+#include "dropboxPack.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+// Registro do log do índice.  É seguido pelos "name_length" bytes do nome.
+struct PackRecord {
+    uint8_t remove;
+    uint8_t padding;
+    uint16_t name_length;
+    uint32_t pack;
+    uint64_t offset;
+    uint64_t length;
+    int64_t last_modified;
+    ContentHash hash;
+};
+
+
+//=============================================================================
+// BufferSink
+//=============================================================================
+BufferSink::BufferSink(uint64_t file_size) : bytes_(file_size) {}
+
+
+bool BufferSink::write(uint64_t offset, const char *data, size_t size) {
+    std::copy(data, data + size, bytes_.begin() + offset);
+    return true;
+}
+
+
+// Os buracos já estão zerados no vetor
+bool BufferSink::finish(uint64_t) {
+    return true;
+}
+
+
+std::vector<char> &BufferSink::bytes() {
+    return bytes_;
+}
+
+
+//=============================================================================
+// PackStore
+//=============================================================================
+PackStore::PackStore(const fs::path &user_dir) {
+    dir_ = user_dir / fs::path(PACK_DIR);
+    active_pack_ = 0;
+    index_fd_ = -1;
+    index_records_ = 0;
+}
+
+
+PackStore::~PackStore() {
+    for (auto &pack : fds_) {
+        close(pack.second);
+    }
+    if (index_fd_ != -1) {
+        close(index_fd_);
+    }
+}
+
+
+bool PackStore::exists(const fs::path &user_dir) {
+    return fs::is_directory(user_dir / fs::path(PACK_DIR));
+}
+
+
+/*
+ * Abre o armazenamento, criando o diretório se necessário, e reconstrói o
+ * mapa de arquivos a partir do índice.
+ */
+bool PackStore::open() {
+    boost::system::error_code error;
+    fs::create_directories(dir_, error);
+    if (error) {
+        std::cerr << "Erro ao criar " << dir_.string() << ": " << error.message() << "\n";
+        return false;
+    }
+
+    // Todos os packfiles existentes, inclusive os que só têm bytes mortos
+    for (fs::directory_iterator it(dir_, error), end; !error && it != end; it.increment(error)) {
+        if (it->path().extension() == ".pack") {
+            uint32_t pack = (uint32_t) std::strtoul(it->path().stem().c_str(), nullptr, 10);
+            if (pack > 0) {
+                usage_[pack] = PackUsage{fs::file_size(it->path()), 0};
+                active_pack_ = std::max(active_pack_, pack);
+            }
+        }
+    }
+
+    if (!load_index()) {
+        return false;
+    }
+
+    for (auto &entry : entries_) {
+        usage_[entry.second.pack].live += entry.second.length;
+    }
+
+    return active_pack_ != 0 || start_pack(1);
+}
+
+
+bool PackStore::find(const std::string &filename, PackEntry *entry) const {
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+        return false;
+    }
+    if (entry != nullptr) {
+        *entry = it->second;
+    }
+    return true;
+}
+
+
+std::vector<std::pair<std::string, PackEntry>> PackStore::entries() const {
+    return std::vector<std::pair<std::string, PackEntry>>(entries_.begin(), entries_.end());
+}
+
+
+bool PackStore::read(const std::string &filename, std::vector<char> &bytes) {
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    const PackEntry &entry = it->second;
+    int fd = pack_fd(entry.pack);
+    if (fd == -1) {
+        return false;
+    }
+
+    bytes.resize(entry.length);
+    uint64_t done = 0;
+    while (done < entry.length) {
+        ssize_t count = pread(fd, bytes.data() + done, entry.length - done, (off_t) (entry.offset + done));
+        if (count <= 0) {
+            std::cerr << "Erro ao ler " << filename << " do packfile " << entry.pack << "\n";
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+
+/*
+ * Grava um arquivo no fim do packfile ativo.  A versão anterior do arquivo,
+ * se houver, passa a contar como bytes mortos.
+ */
+bool PackStore::put(const std::string &filename, const char *data, uint64_t size, time_t time,
+                    const ContentHash &hash) {
+    PackEntry entry{};
+    entry.last_modified = time;
+    entry.hash = hash;
+
+    if (!append_bytes(data, size, &entry) || !append_record(false, filename, entry)) {
+        return false;
+    }
+
+    forget(filename);
+    entries_[filename] = entry;
+    usage_[entry.pack].live += entry.length;
+    return true;
+}
+
+
+// Altera apenas a data de modificação, sem regravar os bytes
+bool PackStore::touch(const std::string &filename, time_t time) {
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    PackEntry entry = it->second;
+    entry.last_modified = time;
+    if (!append_record(false, filename, entry)) {
+        return false;
+    }
+    it->second = entry;
+    return true;
+}
+
+
+bool PackStore::remove(const std::string &filename) {
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    if (!append_record(true, filename, it->second)) {
+        return false;
+    }
+    forget(filename);
+    return true;
+}
+
+
+/*
+ * Verifica se algum packfile tem bytes mortos suficientes, ou se o log do
+ * índice cresceu muito além da quantidade de arquivos vivos.
+ */
+bool PackStore::needs_compaction() const {
+    for (auto &pack : usage_) {
+        uint64_t dead = pack.second.total - pack.second.live;
+
+        if (pack.first != active_pack_ && pack.second.live == 0) {
+            return true;
+        }
+        if (dead >= PACK_COMPACT_MIN_BYTES && dead * 100 >= pack.second.total * PACK_COMPACT_PERCENT) {
+            return true;
+        }
+    }
+    return index_records_ > 2 * entries_.size() + 1024;
+}
+
+
+/*
+ * Copia os arquivos vivos dos packfiles com muitos bytes mortos para um novo
+ * packfile ativo, reescreve o índice e só então apaga os packfiles antigos.
+ * Uma queda no meio da compactação deixa o índice antigo ou o novo, ambos
+ * completos.
+ */
+bool PackStore::compact() {
+    std::vector<uint32_t> victims;
+    for (auto &pack : usage_) {
+        uint64_t dead = pack.second.total - pack.second.live;
+
+        if ((pack.first != active_pack_ && pack.second.live == 0) ||
+            (dead >= PACK_COMPACT_MIN_BYTES && dead * 100 >= pack.second.total * PACK_COMPACT_PERCENT)) {
+            victims.push_back(pack.first);
+        }
+    }
+
+    // Os arquivos copiados não podem cair num packfile que vai ser apagado
+    if (std::find(victims.begin(), victims.end(), active_pack_) != victims.end() &&
+        !start_pack(usage_.rbegin()->first + 1)) {
+        return false;
+    }
+
+    uint64_t moved = 0;
+    std::vector<char> bytes;
+    for (auto &item : entries_) {
+        PackEntry &entry = item.second;
+        if (std::find(victims.begin(), victims.end(), entry.pack) == victims.end()) {
+            continue;
+        }
+
+        PackEntry copy = entry;
+        if (!read(item.first, bytes) || !append_bytes(bytes.data(), bytes.size(), &copy)) {
+            return false;
+        }
+
+        usage_[entry.pack].live -= entry.length;
+        usage_[copy.pack].live += copy.length;
+        entry = copy;
+        moved += copy.length;
+    }
+
+    if (fdatasync(pack_fd(active_pack_)) != 0 || !rewrite_index()) {
+        return false;
+    }
+
+    for (uint32_t pack : victims) {
+        auto fd = fds_.find(pack);
+        if (fd != fds_.end()) {
+            close(fd->second);
+            fds_.erase(fd);
+        }
+        boost::system::error_code error;
+        fs::remove(pack_path(pack), error);
+        usage_.erase(pack);
+    }
+
+    std::cout << "Compactação de " << dir_.string() << ": " << victims.size() << " packfiles, "
+              << moved << " bytes copiados\n";
+    return true;
+}
+
+
+fs::path PackStore::pack_path(uint32_t pack) const {
+    return dir_ / fs::path(std::to_string(pack) + ".pack");
+}
+
+
+// Descritor do packfile, aberto na primeira vez que é usado
+int PackStore::pack_fd(uint32_t pack) {
+    auto it = fds_.find(pack);
+    if (it != fds_.end()) {
+        return it->second;
+    }
+
+    int fd = ::open(pack_path(pack).c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        std::cerr << "Erro ao abrir o packfile " << pack_path(pack).string() << ": " << strerror(errno) << "\n";
+        return -1;
+    }
+    fds_[pack] = fd;
+    return fd;
+}
+
+
+/*
+ * Relê o log do índice.  Um registro incompleto no fim é cortado, para que os
+ * próximos registros sejam acrescentados numa posição válida.
+ */
+bool PackStore::load_index() {
+    fs::path index_path = dir_ / fs::path("index");
+    index_fd_ = ::open(index_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (index_fd_ == -1) {
+        std::cerr << "Erro ao abrir o índice " << index_path.string() << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    std::vector<char> log(fs::file_size(index_path));
+    if (!log.empty() && pread(index_fd_, log.data(), log.size(), 0) != (ssize_t) log.size()) {
+        std::cerr << "Erro ao ler o índice " << index_path.string() << "\n";
+        return false;
+    }
+
+    size_t position = 0;
+    while (position + sizeof(PackRecord) <= log.size()) {
+        PackRecord record{};
+        memcpy(&record, log.data() + position, sizeof(record));
+        if (position + sizeof(record) + record.name_length > log.size()) {
+            break;
+        }
+
+        std::string filename(log.data() + position + sizeof(record), record.name_length);
+        position += sizeof(record) + record.name_length;
+        ++index_records_;
+
+        if (record.remove) {
+            entries_.erase(filename);
+        }
+        else {
+            entries_[filename] = PackEntry{record.pack, record.offset, record.length,
+                                           (time_t) record.last_modified, record.hash};
+        }
+    }
+
+    if (position < log.size()) {
+        std::cerr << "Índice " << index_path.string() << " tinha um registro incompleto\n";
+        if (ftruncate(index_fd_, (off_t) position) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool PackStore::append_record(bool remove, const std::string &filename, const PackEntry &entry) {
+    PackRecord record{};
+    record.remove = remove ? 1 : 0;
+    record.name_length = (uint16_t) filename.size();
+    record.pack = entry.pack;
+    record.offset = entry.offset;
+    record.length = entry.length;
+    record.last_modified = entry.last_modified;
+    record.hash = entry.hash;
+
+    // Registro e nome numa única escrita, para que o registro nunca fique
+    // intercalado com outro
+    std::vector<char> buffer(sizeof(record) + filename.size());
+    memcpy(buffer.data(), &record, sizeof(record));
+    memcpy(buffer.data() + sizeof(record), filename.data(), filename.size());
+
+    if (::write(index_fd_, buffer.data(), buffer.size()) != (ssize_t) buffer.size()) {
+        std::cerr << "Erro ao escrever no índice de " << dir_.string() << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    ++index_records_;
+    return true;
+}
+
+
+// Acrescenta os bytes ao packfile ativo e preenche a posição deles em "entry"
+bool PackStore::append_bytes(const char *data, uint64_t size, PackEntry *entry) {
+    if (usage_[active_pack_].total >= PACK_FILE_BYTES && !start_pack(active_pack_ + 1)) {
+        return false;
+    }
+
+    int fd = pack_fd(active_pack_);
+    if (fd == -1) {
+        return false;
+    }
+
+    PackUsage &usage = usage_[active_pack_];
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t count = pwrite(fd, data + done, size - done, (off_t) (usage.total + done));
+        if (count <= 0) {
+            std::cerr << "Erro ao escrever no packfile " << active_pack_ << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        done += count;
+    }
+
+    entry->pack = active_pack_;
+    entry->offset = usage.total;
+    entry->length = size;
+    usage.total += size;
+    return true;
+}
+
+
+bool PackStore::start_pack(uint32_t pack) {
+    active_pack_ = pack;
+    usage_[pack] = PackUsage{0, 0};
+    return pack_fd(pack) != -1;
+}
+
+
+// Os bytes do arquivo passam a contar como mortos
+void PackStore::forget(const std::string &filename) {
+    auto it = entries_.find(filename);
+    if (it != entries_.end()) {
+        usage_[it->second.pack].live -= it->second.length;
+        entries_.erase(it);
+    }
+}
+
+
+// Substitui o log do índice por um com apenas os arquivos vivos
+bool PackStore::rewrite_index() {
+    fs::path index_path = dir_ / fs::path("index");
+    fs::path temp_path = dir_ / fs::path("index.tmp");
+
+    int old_fd = index_fd_;
+    index_fd_ = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (index_fd_ == -1) {
+        index_fd_ = old_fd;
+        return false;
+    }
+
+    size_t old_records = index_records_;
+    index_records_ = 0;
+
+    bool ok = true;
+    for (auto &entry : entries_) {
+        ok = ok && append_record(false, entry.first, entry.second);
+    }
+    ok = ok && fsync(index_fd_) == 0;
+
+    if (!ok || rename(temp_path.c_str(), index_path.c_str()) != 0) {
+        std::cerr << "Erro ao reescrever o índice de " << dir_.string() << "\n";
+        close(index_fd_);
+        unlink(temp_path.c_str());
+        index_fd_ = old_fd;
+        index_records_ = old_records;
+        return false;
+    }
+
+    close(old_fd);
+    return true;
+}
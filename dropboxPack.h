@@ -0,0 +1,142 @@
+#ifndef __DROPBOX_PACK_H__
+#define __DROPBOX_PACK_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <boost/filesystem.hpp>
+#include "dropboxUtil.h"
+
+// Arquivos até esse tamanho são guardados nos packfiles dos usuários que
+// usam esse formato de armazenamento
+#define DEFAULT_PACK_MAX_FILE_BYTES (4 * 1024)
+
+// Tamanho a partir do qual um novo packfile é começado
+#define PACK_FILE_BYTES (64 * 1024 * 1024)
+
+// Um packfile é compactado quando essa porcentagem dos seus bytes pertence a
+// arquivos apagados ou substituídos
+#define PACK_COMPACT_PERCENT 50
+
+// Mas só se esses bytes mortos somarem pelo menos esse tamanho, para que o
+// packfile ativo não seja compactado a cada poucos arquivos apagados
+#define PACK_COMPACT_MIN_BYTES (1024 * 1024)
+
+// Intervalo entre as verificações da thread de compactação
+#define PACK_COMPACT_INTERVAL_SECONDS 30
+
+// Diretório, dentro do diretório do usuário, com os packfiles e o índice
+#define PACK_DIR "~pack"
+
+
+// Posição de um arquivo dentro dos packfiles
+struct PackEntry {
+    uint32_t pack;
+    uint64_t offset;
+    uint64_t length;
+    time_t last_modified;
+    ContentHash hash;
+};
+
+
+/*
+ * Recebe os bytes de um arquivo na memória, para arquivos que não vão para o
+ * disco como arquivos comuns.
+ */
+class BufferSink : public FileSink {
+public:
+    explicit BufferSink(uint64_t file_size);
+
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+    std::vector<char> &bytes();
+
+private:
+    std::vector<char> bytes_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * PackStore
+ * ----------------------------------------------------------------------------
+ * Armazena os arquivos pequenos de um usuário concatenados em packfiles
+ * (PACK_DIR/<n>.pack), em vez de um arquivo comum para cada um.  Assim cada
+ * arquivo pequeno não custa um inode, uma entrada de diretório e várias
+ * chamadas de sistema, e ler muitos arquivos pequenos é quase uma leitura
+ * sequencial.
+ *
+ * - Os arquivos novos são acrescentados ao fim do packfile ativo.  Quando ele
+ *   passa de PACK_FILE_BYTES, um novo packfile é começado.
+ *
+ * - O índice (PACK_DIR/index) é um log: cada gravação ou remoção acrescenta
+ *   um registro com o nome, o packfile, a posição, o tamanho, a data de
+ *   modificação e o hash.  Ao abrir, o log é relido para reconstruir o mapa
+ *   de arquivos.  Um registro incompleto no fim, deixado por uma queda, é
+ *   descartado.
+ *
+ * - Os bytes de arquivos apagados ou substituídos continuam nos packfiles até
+ *   a compactação, que copia os arquivos ainda vivos dos packfiles com
+ *   PACK_COMPACT_PERCENT de bytes mortos para o packfile ativo, apaga os
+ *   packfiles antigos e reescreve o índice apenas com os arquivos vivos.
+ *
+ * As funções devem ser chamadas com o usuário travado.
+ * ----------------------------------------------------------------------------
+ */
+class PackStore {
+public:
+    explicit PackStore(const boost::filesystem::path &user_dir);
+    ~PackStore();
+
+    PackStore(const PackStore &) = delete;
+    PackStore &operator=(const PackStore &) = delete;
+
+    static bool exists(const boost::filesystem::path &user_dir);
+
+    bool open();
+
+    bool find(const std::string &filename, PackEntry *entry) const;
+    std::vector<std::pair<std::string, PackEntry>> entries() const;
+
+    bool read(const std::string &filename, std::vector<char> &bytes);
+    bool put(const std::string &filename, const char *data, uint64_t size, time_t time, const ContentHash &hash);
+    bool touch(const std::string &filename, time_t time);
+    bool remove(const std::string &filename);
+
+    bool needs_compaction() const;
+    bool compact();
+
+private:
+    // Bytes guardados em cada packfile, e quantos deles são de arquivos vivos
+    struct PackUsage {
+        uint64_t total;
+        uint64_t live;
+    };
+
+    boost::filesystem::path pack_path(uint32_t pack) const;
+    int pack_fd(uint32_t pack);
+
+    bool load_index();
+    bool append_record(bool remove, const std::string &filename, const PackEntry &entry);
+    bool append_bytes(const char *data, uint64_t size, PackEntry *entry);
+    bool start_pack(uint32_t pack);
+    void forget(const std::string &filename);
+    bool rewrite_index();
+
+    boost::filesystem::path dir_;
+
+    std::unordered_map<std::string, PackEntry> entries_;
+    std::map<uint32_t, PackUsage> usage_;
+    std::map<uint32_t, int> fds_;
+
+    uint32_t active_pack_;
+    int index_fd_;
+
+    // Registros no log do índice, para saber quando reescrevê-lo
+    size_t index_records_;
+};
+
+#endif
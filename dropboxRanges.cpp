@@ -0,0 +1,231 @@
+#include "dropboxRanges.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+/*
+ * Lê trechos no formato dos cabeçalhos Range do HTTP, separados por
+ * vírgulas:
+ *
+ *  A-B     do byte A ao byte B, inclusive
+ *  A-      do byte A até o fim do arquivo
+ *  -N      os últimos N bytes do arquivo
+ *
+ * Retorna falso se o texto não estiver nesse formato.
+ */
+bool parse_ranges(const std::string &text, std::vector<ByteRange> &ranges) {
+    ranges.clear();
+
+    std::istringstream items(text);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t dash = item.find('-');
+        if (dash == std::string::npos || item.find_first_not_of("0123456789-") != std::string::npos ||
+            item.find('-', dash + 1) != std::string::npos) {
+            return false;
+        }
+
+        std::string first = item.substr(0, dash);
+        std::string last = item.substr(dash + 1);
+        if (first.empty() && last.empty()) {
+            return false;
+        }
+
+        ByteRange range{};
+        if (first.empty()) {
+            range.length = std::strtoull(last.c_str(), nullptr, 10);
+            range.from_end = true;
+        }
+        else {
+            range.offset = std::strtoull(first.c_str(), nullptr, 10);
+            if (last.empty()) {
+                range.length = RANGE_TO_END;
+            }
+            else {
+                uint64_t end = std::strtoull(last.c_str(), nullptr, 10);
+                if (end < range.offset) {
+                    return false;
+                }
+                range.length = end - range.offset + 1;
+            }
+        }
+        ranges.push_back(range);
+    }
+
+    return !ranges.empty() && ranges.size() <= MAX_DOWNLOAD_RANGES;
+}
+
+
+/*
+ * Converte os trechos em posições absolutas dentro de um arquivo de
+ * "file_size" bytes, cortando o que passar do fim.  A ordem é mantida, e os
+ * trechos que ficam vazios continuam na lista.
+ */
+std::vector<ByteRange> resolve_ranges(const std::vector<ByteRange> &ranges, uint64_t file_size) {
+    std::vector<ByteRange> resolved;
+
+    for (const ByteRange &range : ranges) {
+        uint64_t offset = range.from_end ? file_size - std::min(range.length, file_size)
+                                         : std::min(range.offset, file_size);
+        uint64_t length = std::min(range.length, file_size - offset);
+        resolved.push_back(ByteRange{offset, length, false});
+    }
+    return resolved;
+}
+
+
+// Ordena trechos resolvidos e junta os que se sobrepõem ou se encostam
+std::vector<ByteRange> merge_ranges(std::vector<ByteRange> ranges) {
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange &a, const ByteRange &b) {
+        return a.offset < b.offset;
+    });
+
+    std::vector<ByteRange> merged;
+    for (const ByteRange &range : ranges) {
+        if (range.length == 0) {
+            continue;
+        }
+        if (!merged.empty() && range.offset <= merged.back().offset + merged.back().length) {
+            uint64_t end = std::max(merged.back().offset + merged.back().length, range.offset + range.length);
+            merged.back().length = end - merged.back().offset;
+        }
+        else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
+
+
+uint64_t total_length(const std::vector<ByteRange> &ranges) {
+    uint64_t total = 0;
+    for (const ByteRange &range : ranges) {
+        total += range.length;
+    }
+    return total;
+}
+
+
+//=============================================================================
+// RangeSource
+//=============================================================================
+RangeSource::RangeSource(FileSource &source, std::vector<ByteRange> ranges)
+        : source_(source), ranges_(std::move(ranges)) {
+    next_range_ = 0;
+}
+
+
+/*
+ * O próximo extent é a interseção do próximo trecho com dados do arquivo
+ * com o próximo trecho pedido.
+ */
+bool RangeSource::next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) {
+    while (next_range_ < ranges_.size()) {
+        const ByteRange &range = ranges_[next_range_];
+        uint64_t range_end = range.offset + range.length;
+
+        if (*offset >= range_end) {
+            ++next_range_;
+            continue;
+        }
+
+        uint64_t position = std::max(*offset, range.offset);
+        uint64_t data_end;
+        if (!source_.next_extent(file_size, &position, &data_end)) {
+            return false;
+        }
+
+        // Os dados começam depois deste trecho: o resto dele é um buraco
+        if (position >= range_end) {
+            *offset = position;
+            ++next_range_;
+            continue;
+        }
+
+        *offset = position;
+        *end = std::min(data_end, range_end);
+        return true;
+    }
+    return false;
+}
+
+
+ssize_t RangeSource::read(uint64_t offset, char *data, size_t size) {
+    return source_.read(offset, data, size);
+}
+
+
+//=============================================================================
+// BufferSource
+//=============================================================================
+BufferSource::BufferSource(const char *data, uint64_t size) {
+    data_ = data;
+    size_ = size;
+}
+
+
+bool BufferSource::next_extent(uint64_t, uint64_t *offset, uint64_t *end) {
+    if (*offset >= size_) {
+        return false;
+    }
+    *end = size_;
+    return true;
+}
+
+
+ssize_t BufferSource::read(uint64_t offset, char *data, size_t size) {
+    if (offset >= size_) {
+        return 0;
+    }
+    size_t count = (size_t) std::min<uint64_t>(size, size_ - offset);
+    memcpy(data, data_ + offset, count);
+    return (ssize_t) count;
+}
+
+
+//=============================================================================
+// RangeSink
+//=============================================================================
+RangeSink::RangeSink(int fd, std::vector<ByteRange> ranges) : fd_(fd), ranges_(std::move(ranges)) {
+    uint64_t position = 0;
+    for (const ByteRange &range : ranges_) {
+        positions_.push_back(position);
+        position += range.length;
+    }
+}
+
+
+// Um bloco recebido pode pertencer a mais de um trecho pedido
+bool RangeSink::write(uint64_t offset, const char *data, size_t size) {
+    for (size_t i = 0; i < ranges_.size(); ++i) {
+        uint64_t start = std::max(offset, ranges_[i].offset);
+        uint64_t end = std::min(offset + size, ranges_[i].offset + ranges_[i].length);
+        if (start >= end) {
+            continue;
+        }
+
+        const char *bytes = data + (start - offset);
+        size_t remaining = (size_t) (end - start);
+        off_t position = (off_t) (positions_[i] + start - ranges_[i].offset);
+        while (remaining > 0) {
+            ssize_t written = pwrite(fd_, bytes, remaining, position);
+            if (written <= 0) {
+                std::cerr << "Erro na escrita do arquivo\n";
+                return false;
+            }
+            bytes += written;
+            remaining -= written;
+            position += written;
+        }
+    }
+    return true;
+}
+
+
+// O arquivo baixado tem o tamanho dos trechos, e não o do arquivo original
+bool RangeSink::finish(uint64_t) {
+    return ftruncate(fd_, (off_t) total_length(ranges_)) == 0;
+}
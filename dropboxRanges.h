@@ -0,0 +1,100 @@
+#ifndef __DROPBOX_RANGES_H__
+#define __DROPBOX_RANGES_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "dropboxUtil.h"
+
+// Trechos aceitos num único pedido de download parcial
+#define MAX_DOWNLOAD_RANGES 64
+
+// Comprimento de um trecho que vai até o fim do arquivo
+#define RANGE_TO_END UINT64_MAX
+
+/*
+ * Trecho de um arquivo pedido num download parcial.  Com "from_end", o
+ * trecho são os últimos "length" bytes do arquivo, e "offset" é ignorado.
+ */
+struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+    bool from_end;
+};
+
+bool parse_ranges(const std::string &text, std::vector<ByteRange> &ranges);
+std::vector<ByteRange> resolve_ranges(const std::vector<ByteRange> &ranges, uint64_t file_size);
+std::vector<ByteRange> merge_ranges(std::vector<ByteRange> ranges);
+uint64_t total_length(const std::vector<ByteRange> &ranges);
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * RangeSource
+ * ----------------------------------------------------------------------------
+ * Envia apenas os trechos pedidos de um arquivo.  Para "send_file", o resto
+ * do arquivo é um grande buraco, e o arquivo continua com o tamanho
+ * original.  Os trechos devem estar ordenados e sem sobreposição (ver
+ * "merge_ranges").
+ * ----------------------------------------------------------------------------
+ */
+class RangeSource : public FileSource {
+public:
+    RangeSource(FileSource &source, std::vector<ByteRange> ranges);
+
+    bool next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) override;
+    ssize_t read(uint64_t offset, char *data, size_t size) override;
+
+private:
+    FileSource &source_;
+    std::vector<ByteRange> ranges_;
+    size_t next_range_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * BufferSource
+ * ----------------------------------------------------------------------------
+ * Arquivo que já está na memória, num único extent.
+ * ----------------------------------------------------------------------------
+ */
+class BufferSource : public FileSource {
+public:
+    BufferSource(const char *data, uint64_t size);
+
+    bool next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) override;
+    ssize_t read(uint64_t offset, char *data, size_t size) override;
+
+private:
+    const char *data_;
+    uint64_t size_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * RangeSink
+ * ----------------------------------------------------------------------------
+ * Recebe os trechos enviados por um RangeSource e os escreve concatenados,
+ * na ordem em que foram pedidos, no descritor de um arquivo vazio.  Os
+ * trechos devem estar resolvidos (ver "resolve_ranges"), e podem se
+ * sobrepor.  Os buracos do arquivo original ficam como zeros.
+ * ----------------------------------------------------------------------------
+ */
+class RangeSink : public FileSink {
+public:
+    RangeSink(int fd, std::vector<ByteRange> ranges);
+
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+private:
+    int fd_;
+    std::vector<ByteRange> ranges_;
+
+    // Posição de cada trecho no arquivo escrito
+    std::vector<uint64_t> positions_;
+};
+
+#endif
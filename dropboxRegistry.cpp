@@ -0,0 +1,134 @@
+#include "dropboxRegistry.h"
+
+//=============================================================================
+// ClientRegistry
+//=============================================================================
+ClientRegistry::Table::Table(size_t capacity) : capacity(capacity), slots(new std::atomic<Client *>[capacity]) {
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+
+ClientRegistry::ClientRegistry() : shards_(new Shard[CLIENT_REGISTRY_SHARDS]) {
+    for (size_t i = 0; i < CLIENT_REGISTRY_SHARDS; ++i) {
+        Shard &shard = shards_[i];
+        shard.tables.emplace_back(new Table(CLIENT_REGISTRY_INITIAL_CAPACITY));
+        shard.table.store(shard.tables.back().get(), std::memory_order_release);
+        shard.count = 0;
+    }
+}
+
+
+ClientRegistry::~ClientRegistry() {
+    for_each([](Client *client) {
+        delete client;
+    });
+}
+
+
+/*
+ * Procura o cliente pelo user_id, sem travas.  Retorna nullptr caso o cliente
+ * não exista.
+ */
+Client *ClientRegistry::find(const std::string &user_id) const {
+    size_t h = hash(user_id);
+    const Table *table = shard_for(h).table.load(std::memory_order_acquire);
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        Client *client = table->slots[i].load(std::memory_order_acquire);
+        if (client == nullptr) {
+            return nullptr;
+        }
+        if (client->user_id == user_id) {
+            return client;
+        }
+    }
+}
+
+
+/*
+ * Insere um cliente já inicializado.  Se outro cliente com o mesmo user_id já
+ * tiver sido inserido, o registro não é alterado e o cliente existente é
+ * retornado; cabe ao chamador liberar o cliente que não foi usado.
+ */
+Client *ClientRegistry::insert(Client *client) {
+    size_t h = hash(client->user_id);
+    Shard &shard = shard_for(h);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Client *existing = find(client->user_id);
+    if (existing != nullptr) {
+        return existing;
+    }
+
+    Table *table = shard.table.load(std::memory_order_relaxed);
+
+    // Mantém a tabela no máximo meio cheia, para que as buscas sejam curtas
+    if ((shard.count + 1) * 2 > table->capacity) {
+        std::unique_ptr<Table> bigger(new Table(table->capacity * 2));
+        for (size_t i = 0; i < table->capacity; ++i) {
+            Client *old = table->slots[i].load(std::memory_order_relaxed);
+            if (old != nullptr) {
+                place(bigger.get(), old, hash(old->user_id));
+            }
+        }
+        table = bigger.get();
+        shard.tables.push_back(std::move(bigger));
+        shard.table.store(table, std::memory_order_release);
+    }
+
+    place(table, client, h);
+    ++shard.count;
+    return client;
+}
+
+
+/*
+ * Chama "function" para cada cliente registrado.  Clientes inseridos durante
+ * a iteração podem ou não ser visitados.
+ */
+void ClientRegistry::for_each(const std::function<void(Client *)> &function) const {
+    for (size_t s = 0; s < CLIENT_REGISTRY_SHARDS; ++s) {
+        const Table *table = shards_[s].table.load(std::memory_order_acquire);
+        for (size_t i = 0; i < table->capacity; ++i) {
+            Client *client = table->slots[i].load(std::memory_order_acquire);
+            if (client != nullptr) {
+                function(client);
+            }
+        }
+    }
+}
+
+
+size_t ClientRegistry::size() const {
+    size_t total = 0;
+    for_each([&total](Client *) {
+        ++total;
+    });
+    return total;
+}
+
+
+size_t ClientRegistry::hash(const std::string &user_id) {
+    return std::hash<std::string>()(user_id);
+}
+
+
+// Coloca o cliente na primeira posição livre a partir do seu hash
+void ClientRegistry::place(Table *table, Client *client, size_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].load(std::memory_order_relaxed) != nullptr) {
+        i = (i + 1) & mask;
+    }
+    table->slots[i].store(client, std::memory_order_release);
+}
+
+
+// Os bits altos do hash escolhem a partição e os baixos a posição na tabela
+ClientRegistry::Shard &ClientRegistry::shard_for(size_t hash) const {
+    return shards_[(hash >> 32) & (CLIENT_REGISTRY_SHARDS - 1)];
+}
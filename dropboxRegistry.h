@@ -0,0 +1,78 @@
+#ifndef __DROPBOX_REGISTRY_H__
+#define __DROPBOX_REGISTRY_H__
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include "dropboxUtil.h"
+
+// Quantidade de partições do registro de clientes.  Deve ser potência de 2.
+#define CLIENT_REGISTRY_SHARDS 64
+
+// Capacidade inicial da tabela de cada partição.  Deve ser potência de 2.
+#define CLIENT_REGISTRY_INITIAL_CAPACITY 16
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ClientRegistry
+ * ----------------------------------------------------------------------------
+ * Registro concorrente dos clientes do servidor, indexado pelo user_id.
+ *
+ * O registro é dividido em partições, e cada partição é uma tabela hash de
+ * endereçamento aberto cujas posições são ponteiros atômicos para Client.
+ *
+ * - Buscas não usam nenhuma trava: leem o ponteiro da tabela atual da
+ *   partição e percorrem as posições com leituras atômicas.
+ *
+ * - Inserções travam apenas o mutex da sua partição.  Quando a tabela passa
+ *   da metade da capacidade, uma tabela com o dobro do tamanho é montada e
+ *   publicada atomicamente.  A tabela antiga continua válida para quem ainda
+ *   a estiver lendo, e só é liberada junto com o registro (como a capacidade
+ *   dobra a cada vez, as tabelas antigas somam menos que a atual).
+ *
+ * Clientes nunca são removidos, então os ponteiros retornados permanecem
+ * válidos durante toda a execução do servidor.
+ * ----------------------------------------------------------------------------
+ */
+class ClientRegistry {
+public:
+    ClientRegistry();
+    ~ClientRegistry();
+
+    ClientRegistry(const ClientRegistry &) = delete;
+    ClientRegistry &operator=(const ClientRegistry &) = delete;
+
+    Client *find(const std::string &user_id) const;
+    Client *insert(Client *client);
+
+    void for_each(const std::function<void(Client *)> &function) const;
+    size_t size() const;
+
+private:
+    struct Table {
+        explicit Table(size_t capacity);
+
+        size_t capacity;
+        std::unique_ptr<std::atomic<Client *>[]> slots;
+    };
+
+    struct Shard {
+        std::atomic<Table *> table;
+        size_t count;
+        std::vector<std::unique_ptr<Table>> tables;
+        std::mutex mutex;
+    };
+
+    static size_t hash(const std::string &user_id);
+    static void place(Table *table, Client *client, size_t hash);
+
+    Shard &shard_for(size_t hash) const;
+
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "dropboxRelay.h"
+
+#include <iostream>
+
+//=============================================================================
+// RelaySubscriber
+//=============================================================================
+RelaySubscriber::RelaySubscriber(int socket_fd) {
+    socket_fd_ = socket_fd;
+    closed_ = false;
+    queued_bytes_ = 0;
+}
+
+
+void RelaySubscriber::begin(uint64_t transfer_id, const std::string &filename, uint64_t file_size, time_t time) {
+    Message message{};
+    message.type = RelayBegin;
+    message.transfer_id = transfer_id;
+    message.filename = filename;
+    message.file_size = file_size;
+    message.time = time;
+    push(std::move(message));
+}
+
+
+/*
+ * Enfileira um bloco de dados da transferência.  Se o último item da fila for
+ * um bloco da mesma transferência que termina onde este começa, os bytes são
+ * acrescentados a ele, para que o dispositivo receba poucos blocos grandes em
+ * vez de muitos pequenos.
+ *
+ * Caso a fila esteja cheia a transferência é abortada para este dispositivo,
+ * e os blocos seguintes são descartados.
+ */
+void RelaySubscriber::data(uint64_t transfer_id, uint64_t offset, const char *bytes, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (closed_ || dropped_.count(transfer_id) > 0) {
+        return;
+    }
+
+    if (queued_bytes_ + size > RELAY_QUEUE_BYTES) {
+        std::cout << "Dispositivo lento, repasse " << transfer_id << " abortado\n";
+        dropped_.insert(transfer_id);
+
+        Message message{};
+        message.type = RelayAbort;
+        message.transfer_id = transfer_id;
+        queue_.push_back(std::move(message));
+        condition_.notify_one();
+        return;
+    }
+
+    if (!queue_.empty() &&
+        queue_.back().type == RelayData &&
+        queue_.back().transfer_id == transfer_id &&
+        queue_.back().offset + queue_.back().bytes.size() == offset &&
+        queue_.back().bytes.size() + size <= RELAY_CHUNK_BYTES) {
+        queue_.back().bytes.insert(queue_.back().bytes.end(), bytes, bytes + size);
+    }
+    else {
+        Message message{};
+        message.type = RelayData;
+        message.transfer_id = transfer_id;
+        message.offset = offset;
+        message.bytes.assign(bytes, bytes + size);
+        queue_.push_back(std::move(message));
+    }
+
+    queued_bytes_ += size;
+    condition_.notify_one();
+}
+
+
+/*
+ * Conclui a transferência.  Se ela foi abortada para este dispositivo, ele é
+ * avisado de que o arquivo mudou, para que possa baixá-lo depois.
+ */
+void RelaySubscriber::commit(uint64_t transfer_id, const std::string &filename, const ContentHash &hash) {
+    bool dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        dropped = dropped_.erase(transfer_id) > 0;
+    }
+
+    if (dropped) {
+        changed(filename);
+        return;
+    }
+
+    Message message{};
+    message.type = RelayCommit;
+    message.transfer_id = transfer_id;
+    message.hash = hash;
+    push(std::move(message));
+}
+
+
+void RelaySubscriber::abort(uint64_t transfer_id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (dropped_.erase(transfer_id) > 0) {
+            // O dispositivo já recebeu o RelayAbort
+            return;
+        }
+    }
+
+    Message message{};
+    message.type = RelayAbort;
+    message.transfer_id = transfer_id;
+    push(std::move(message));
+}
+
+
+void RelaySubscriber::changed(const std::string &filename) {
+    Message message{};
+    message.type = RelayChanged;
+    message.filename = filename;
+    push(std::move(message));
+}
+
+
+void RelaySubscriber::moved(const std::string &from, const std::string &to) {
+    Message message{};
+    message.type = RelayMoved;
+    message.filename = from;
+    message.target = to;
+    push(std::move(message));
+}
+
+
+/*
+ * Escreve as mensagens da fila no socket até que o inscrito seja fechado ou
+ * que a escrita falhe.  Deve ser chamada pela thread da conexão de
+ * sincronização.
+ *
+ * As mensagens se acumulam no buffer da conexão enquanto houver outras na
+ * fila, e o buffer é enviado quando a fila esvazia.
+ */
+void RelaySubscriber::run() {
+    while (true) {
+        Message message;
+        bool last;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+
+            if (closed_) {
+                return;
+            }
+
+            message = std::move(queue_.front());
+            queue_.pop_front();
+            queued_bytes_ -= message.bytes.size();
+            last = queue_.empty();
+        }
+
+        if (!write_message(message) || (last && !flush_socket(socket_fd_))) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            return;
+        }
+    }
+}
+
+
+void RelaySubscriber::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    queue_.clear();
+    queued_bytes_ = 0;
+    condition_.notify_all();
+}
+
+
+// Mensagens de controle são pequenas e sempre entram na fila
+void RelaySubscriber::push(Message message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+        return;
+    }
+    queued_bytes_ += message.bytes.size();
+    queue_.push_back(std::move(message));
+    condition_.notify_one();
+}
+
+
+bool RelaySubscriber::write_message(const Message &message) {
+    if (!write_socket(socket_fd_, (const void *) &message.type, sizeof(message.type))) {
+        return false;
+    }
+
+    switch (message.type) {
+    case RelayBegin:
+        write_socket(socket_fd_, (const void *) &message.transfer_id, sizeof(message.transfer_id));
+        send_string(socket_fd_, message.filename);
+        write_socket(socket_fd_, (const void *) &message.file_size, sizeof(message.file_size));
+        return write_socket(socket_fd_, (const void *) &message.time, sizeof(message.time));
+
+    case RelayData: {
+        uint64_t size = message.bytes.size();
+        write_socket(socket_fd_, (const void *) &message.transfer_id, sizeof(message.transfer_id));
+        write_socket(socket_fd_, (const void *) &message.offset, sizeof(message.offset));
+        write_socket(socket_fd_, (const void *) &size, sizeof(size));
+        return write_socket(socket_fd_, (const void *) message.bytes.data(), size);
+    }
+
+    case RelayCommit:
+        write_socket(socket_fd_, (const void *) &message.transfer_id, sizeof(message.transfer_id));
+        return write_socket(socket_fd_, (const void *) &message.hash, sizeof(message.hash));
+
+    case RelayAbort:
+        return write_socket(socket_fd_, (const void *) &message.transfer_id, sizeof(message.transfer_id));
+
+    case RelayChanged:
+        send_string(socket_fd_, message.filename);
+        return true;
+
+    case RelayMoved:
+        send_string(socket_fd_, message.filename);
+        send_string(socket_fd_, message.target);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,99 @@
+#ifndef __DROPBOX_RELAY_H__
+#define __DROPBOX_RELAY_H__
+
+#include <string>
+#include <deque>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <ctime>
+#include "dropboxUtil.h"
+
+// Quantidade máxima de bytes que podem ficar na fila de um dispositivo.  Se a
+// fila encher, o dispositivo deixa de receber a transferência em andamento e
+// é avisado para baixar o arquivo por conta própria depois.
+#define RELAY_QUEUE_BYTES (16 * 1024 * 1024)
+
+// Mensagens de dados consecutivas são agrupadas até esse tamanho
+#define RELAY_CHUNK_BYTES (64 * 1024)
+
+/*
+ * Mensagens enviadas pelo servidor no canal de sincronização (conexão do
+ * tipo Sync) de cada dispositivo.
+ *
+ *  RelayBegin   transfer_id, nome do arquivo, tamanho, data de modificação
+ *  RelayData    transfer_id, posição do bloco, tamanho do bloco, bytes
+ *  RelayCommit  transfer_id, hash do conteúdo
+ *  RelayAbort   transfer_id
+ *  RelayChanged nome do arquivo
+ *  RelayMoved   nome anterior, nome novo
+ *
+ * RelayChanged avisa que um arquivo mudou no servidor mas não foi repassado
+ * ao dispositivo, que deve então baixá-lo com um Download normal.  RelayMoved
+ * avisa que um arquivo foi renomeado sem mudar de conteúdo; o dispositivo
+ * renomeia a sua cópia, ou baixa o arquivo se não a tiver.
+ *
+ * Tamanhos e posições são enviados como uint64_t.  Os buracos de arquivos
+ * esparsos não geram RelayData; o dispositivo ajusta o tamanho do arquivo no
+ * RelayCommit.
+ */
+enum RelayMessageType { RelayBegin, RelayData, RelayCommit, RelayAbort, RelayChanged, RelayMoved };
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * RelaySubscriber
+ * ----------------------------------------------------------------------------
+ * Um dispositivo inscrito para receber, em tempo real, os arquivos que outros
+ * dispositivos do mesmo usuário estão enviando ao servidor.
+ *
+ * A thread que recebe o upload apenas enfileira mensagens e nunca bloqueia.
+ * A thread da conexão de sincronização consome a fila e escreve no socket
+ * através de "run".  Se o dispositivo for lento e a fila passar de
+ * RELAY_QUEUE_BYTES, a transferência é abortada apenas para ele.
+ * ----------------------------------------------------------------------------
+ */
+class RelaySubscriber {
+public:
+    explicit RelaySubscriber(int socket_fd);
+
+    void begin(uint64_t transfer_id, const std::string &filename, uint64_t file_size, time_t time);
+    void data(uint64_t transfer_id, uint64_t offset, const char *bytes, size_t size);
+    void commit(uint64_t transfer_id, const std::string &filename, const ContentHash &hash);
+    void abort(uint64_t transfer_id);
+    void changed(const std::string &filename);
+    void moved(const std::string &from, const std::string &to);
+
+    void run();
+    void close();
+
+private:
+    struct Message {
+        RelayMessageType type;
+        uint64_t transfer_id;
+        std::string filename;
+        std::string target;
+        uint64_t file_size;
+        uint64_t offset;
+        time_t time;
+        ContentHash hash;
+        std::vector<char> bytes;
+    };
+
+    void push(Message message);
+    bool write_message(const Message &message);
+
+    int socket_fd_;
+    bool closed_;
+    size_t queued_bytes_;
+    std::deque<Message> queue_;
+
+    // Transferências que foram abortadas para este dispositivo
+    std::set<uint64_t> dropped_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "dropboxReplication.h"
+
+#include <random>
+#include <limits>
+
+//=============================================================================
+// ReplicationLog
+//=============================================================================
+ReplicationLog::ReplicationLog() {
+    std::random_device random;
+    epoch_ = ((uint64_t) random() << 32) | random();
+    last_sequence_ = 0;
+}
+
+
+uint64_t ReplicationLog::epoch() const {
+    return epoch_;
+}
+
+
+uint64_t ReplicationLog::last_sequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_sequence_;
+}
+
+
+void ReplicationLog::append(ReplicationChange change, const std::string &user_id, const std::string &filename) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    entries_.push_back(ReplicationEntry{++last_sequence_, change, user_id, filename,
+                                        std::chrono::steady_clock::now()});
+    if (entries_.size() > REPLICATION_LOG_ENTRIES) {
+        entries_.pop_front();
+    }
+    condition_.notify_all();
+}
+
+
+/*
+ * Copia para "entries" as mudanças depois de "sequence", esperando até
+ * "timeout_ms" por uma mudança nova.  Sem mudanças novas, "entries" fica
+ * vazio.  Retorna falso se alguma das mudanças já foi descartada, ou se
+ * "sequence" não é deste log.
+ */
+bool ReplicationLog::read_after(uint64_t sequence, std::vector<ReplicationEntry> &entries,
+                                uint64_t timeout_ms) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    entries.clear();
+
+    condition_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return last_sequence_ != sequence; });
+
+    if (sequence > last_sequence_) {
+        return false;
+    }
+    if (sequence == last_sequence_) {
+        return true;
+    }
+    if (sequence + 1 < entries_.front().sequence) {
+        return false;
+    }
+
+    for (auto it = entries_.begin() + (sequence + 1 - entries_.front().sequence); it != entries_.end(); ++it) {
+        entries.push_back(*it);
+    }
+    return true;
+}
+
+
+//=============================================================================
+// ReplicaStatus
+//=============================================================================
+ReplicaStatus::ReplicaStatus() = default;
+
+
+// Retorna a quantidade anterior de conexões
+size_t ReplicaStatus::set_streams(size_t streams) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    size_t previous = current_as_of_.size();
+    if (streams > previous) {
+        current_as_of_.resize(streams, std::chrono::steady_clock::time_point::min());
+    }
+    return previous;
+}
+
+
+void ReplicaStatus::update(size_t stream, std::chrono::steady_clock::time_point current_as_of) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stream < current_as_of_.size() && current_as_of > current_as_of_[stream]) {
+        current_as_of_[stream] = current_as_of;
+    }
+}
+
+
+uint64_t ReplicaStatus::staleness_ms() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (current_as_of_.empty()) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    uint64_t staleness = 0;
+    for (auto &current_as_of : current_as_of_) {
+        if (current_as_of == std::chrono::steady_clock::time_point::min()) {
+            return std::numeric_limits<uint64_t>::max();
+        }
+        auto lag = std::chrono::duration_cast<std::chrono::milliseconds>(now - current_as_of).count();
+        staleness = std::max<uint64_t>(staleness, lag > 0 ? (uint64_t) lag : 0);
+    }
+    return staleness;
+}
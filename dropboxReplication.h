@@ -0,0 +1,120 @@
+#ifndef __DROPBOX_REPLICATION_H__
+#define __DROPBOX_REPLICATION_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+// Mudanças guardadas na memória do primário para as réplicas que
+// reconectam.  Uma réplica mais atrasada que isso recebe uma cópia completa.
+#define REPLICATION_LOG_ENTRIES 4096
+
+// Intervalo das mensagens enviadas a uma réplica em dia quando não há
+// mudanças, para que ela saiba até quando está atualizada
+#define REPLICATION_HEARTBEAT_MS 1000
+
+// Atraso máximo padrão de uma réplica para que ela atenda leituras
+#define DEFAULT_REPLICA_MAX_STALENESS_MS 5000
+
+// Espera entre as tentativas de uma réplica de se conectar ao primário
+#define REPLICA_RETRY_MS 1000
+
+// Tempo máximo de uma leitura ou escrita no socket de uma réplica, depois do
+// qual o primário desiste da conexão
+#define REPLICA_SOCKET_TIMEOUT_MS (30 * 1000)
+
+/*
+ * Mensagens do primário para a réplica:
+ *
+ *  ReplicatedUpload        o arquivo foi enviado ou teve a data alterada
+ *  ReplicatedDelete        o arquivo foi apagado
+ *  ReplicationHeartbeat    a réplica recebeu todas as mudanças até agora
+ *  ReplicationSnapshotEnd  fim da cópia completa dos arquivos
+ */
+enum ReplicationChange { ReplicatedUpload, ReplicatedDelete, ReplicationHeartbeat, ReplicationSnapshotEnd };
+
+/*
+ * Cabeçalho de cada mensagem enviada à réplica.  "sequence" é 0 para os
+ * arquivos da cópia completa, e "lag_ms" é há quanto tempo a mudança
+ * aconteceu no primário.  Uploads e deletes são seguidos pelo user_id e pelo
+ * nome do arquivo.
+ */
+struct ReplicationHeader {
+    uint64_t sequence;
+    uint64_t lag_ms;
+    ReplicationChange change;
+};
+
+// Uma mudança confirmada no primário
+struct ReplicationEntry {
+    uint64_t sequence;
+    ReplicationChange change;
+    std::string user_id;
+    std::string filename;
+    std::chrono::steady_clock::time_point time;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ReplicationLog
+ * ----------------------------------------------------------------------------
+ * Log das mudanças confirmadas no primário, na ordem em que aconteceram.
+ *
+ * As mudanças são numeradas a partir de 1, e as mais antigas são descartadas
+ * quando o log passa de REPLICATION_LOG_ENTRIES.  O log só existe na
+ * memória: cada execução do primário tem uma época aleatória, e uma réplica
+ * que conhecia outra época precisa de uma cópia completa.
+ *
+ * O log guarda apenas os nomes dos arquivos.  O conteúdo enviado à réplica é
+ * o atual no momento do envio, então uma mudança antiga pode levar um
+ * conteúdo mais novo, que será enviado de novo pela mudança seguinte.
+ * ----------------------------------------------------------------------------
+ */
+class ReplicationLog {
+public:
+    ReplicationLog();
+
+    uint64_t epoch() const;
+    uint64_t last_sequence() const;
+
+    void append(ReplicationChange change, const std::string &user_id, const std::string &filename);
+    bool read_after(uint64_t sequence, std::vector<ReplicationEntry> &entries, uint64_t timeout_ms) const;
+
+private:
+    uint64_t epoch_;
+    uint64_t last_sequence_;
+    std::deque<ReplicationEntry> entries_;
+
+    mutable std::mutex mutex_;
+    mutable std::condition_variable condition_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ReplicaStatus
+ * ----------------------------------------------------------------------------
+ * Até quando a réplica está atualizada em cada conexão com o primário (uma
+ * por worker do primário).  O atraso da réplica é o da conexão mais
+ * atrasada, e é infinito até que todas tenham recebido a cópia completa.
+ * ----------------------------------------------------------------------------
+ */
+class ReplicaStatus {
+public:
+    ReplicaStatus();
+
+    size_t set_streams(size_t streams);
+    void update(size_t stream, std::chrono::steady_clock::time_point current_as_of);
+    uint64_t staleness_ms() const;
+
+private:
+    std::vector<std::chrono::steady_clock::time_point> current_as_of_;
+    mutable std::mutex mutex_;
+};
+
+#endif
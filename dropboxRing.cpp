@@ -0,0 +1,80 @@
+#include "dropboxRing.h"
+#include "dropboxUtil.h"
+
+//=============================================================================
+// HashRing
+//=============================================================================
+HashRing::HashRing(size_t virtual_nodes) {
+    virtual_nodes_ = virtual_nodes > 0 ? virtual_nodes : 1;
+}
+
+
+void HashRing::add(const std::string &backend) {
+    if (!backends_.insert(backend).second) {
+        return;
+    }
+
+    // Dois pontos com o mesmo hash ficam com o primeiro backend inserido
+    for (size_t i = 0; i < virtual_nodes_; ++i) {
+        points_.insert(std::make_pair(hash(backend + "#" + std::to_string(i)), backend));
+    }
+}
+
+
+void HashRing::remove(const std::string &backend) {
+    if (backends_.erase(backend) == 0) {
+        return;
+    }
+
+    for (auto it = points_.begin(); it != points_.end();) {
+        if (it->second == backend) {
+            it = points_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+
+void HashRing::clear() {
+    points_.clear();
+    backends_.clear();
+}
+
+
+bool HashRing::empty() const {
+    return points_.empty();
+}
+
+
+bool HashRing::contains(const std::string &backend) const {
+    return backends_.count(backend) > 0;
+}
+
+
+// Backend dono da chave, ou uma string vazia se o anel estiver vazio
+std::string HashRing::find(const std::string &key) const {
+    if (points_.empty()) {
+        return "";
+    }
+
+    auto it = points_.lower_bound(hash(key));
+    if (it == points_.end()) {
+        it = points_.begin();
+    }
+    return it->second;
+}
+
+
+// Só afeta os backends adicionados depois
+void HashRing::set_virtual_nodes(size_t virtual_nodes) {
+    virtual_nodes_ = virtual_nodes > 0 ? virtual_nodes : 1;
+}
+
+
+uint64_t HashRing::hash(const std::string &key) {
+    ContentHasher hasher;
+    hasher.update(key.data(), key.size());
+    return hasher.digest().low;
+}
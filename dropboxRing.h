@@ -0,0 +1,49 @@
+#ifndef __DROPBOX_RING_H__
+#define __DROPBOX_RING_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdint>
+
+// Pontos de cada backend no anel.  Mais pontos dividem os usuários de forma
+// mais uniforme entre os backends.
+#define DEFAULT_VIRTUAL_NODES 64
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * HashRing
+ * ----------------------------------------------------------------------------
+ * Anel de hash consistente.  Cada backend ocupa "virtual_nodes" pontos do
+ * anel, e uma chave pertence ao backend do primeiro ponto a partir do hash
+ * dela.
+ *
+ * Quando um backend entra ou sai do anel, só as chaves dos seus pontos mudam
+ * de dono: as chaves dos outros backends continuam onde estavam.
+ * ----------------------------------------------------------------------------
+ */
+class HashRing {
+public:
+    explicit HashRing(size_t virtual_nodes = DEFAULT_VIRTUAL_NODES);
+
+    void add(const std::string &backend);
+    void remove(const std::string &backend);
+    void clear();
+
+    bool empty() const;
+    bool contains(const std::string &backend) const;
+    std::string find(const std::string &key) const;
+
+    void set_virtual_nodes(size_t virtual_nodes);
+
+private:
+    static uint64_t hash(const std::string &key);
+
+    std::map<uint64_t, std::string> points_;
+    std::set<std::string> backends_;
+    size_t virtual_nodes_;
+};
+
+#endif
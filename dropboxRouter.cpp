@@ -0,0 +1,737 @@
+#include "dropboxRouter.h"
+#include "dropboxRing.h"
+#include "dropboxWorkers.h"
+#include "dropboxIgnore.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+// Globais
+fs::path router_dir;
+uint16_t port_number;
+
+// Backends passados na linha de comando, no formato host:porta
+std::vector<std::string> backends;
+
+// Anel com os backends que não estão em drenagem
+HashRing ring;
+
+// Configurações do ROUTER_SETTINGS_FILE
+std::set<std::string> drained;
+std::map<std::string, std::string> pinned;
+
+// Backend onde estão os arquivos de cada usuário já visto
+std::map<std::string, std::string> placements;
+
+// Usuários sendo migrados, cujas conexões são recusadas até o fim da
+// migração, e as conexões abertas de cada usuário
+std::set<std::string> migrating;
+std::map<std::string, std::set<int>> user_connections;
+
+std::deque<Migration> migrations;
+std::mutex router_mutex;
+std::condition_variable migration_condition;
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * main
+ * -----------------------------------------------------------------------------
+ * O roteador distribui os usuários entre vários servidores (backends).
+ *
+ *      ./router <porta> <host:porta> [<host:porta>...] [--vnodes=N]
+ *
+ * Cada conexão é atribuída ao backend do usuário e depois apenas repassada
+ * nos dois sentidos, sem que o roteador interprete o protocolo.  Os clientes
+ * se conectam ao roteador como se ele fosse o servidor.
+ *
+ * Um usuário novo vai para o backend indicado pelo anel de hash consistente.
+ * A partir daí ele fica nesse backend (ROUTER_PLACEMENTS_FILE), mesmo que o
+ * anel mude, até ser migrado.  As migrações acontecem quando um backend entra
+ * em drenagem, quando um usuário é fixado em outro backend, ou quando um
+ * backend novo é adicionado e passa a ser o dono de alguns usuários.
+ * -----------------------------------------------------------------------------
+ */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Argumentos insuficientes\n";
+        std::cerr << "./router <porta> <host:porta> [<host:porta>...] [--vnodes=N]\n";
+        std::exit(1);
+    }
+
+    char *end;
+    port_number = static_cast<uint16_t>(std::strtol(argv[1], &end, 10));
+
+    parse_options(argc, argv);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP é tratado por uma thread própria, e por isso é bloqueado antes
+    // que as outras threads sejam criadas
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    router_dir = fs::current_path();
+
+    load_placements();
+    load_router_settings();
+    rebalance();
+
+    std::thread signal_thread(run_signal_thread);
+    signal_thread.detach();
+
+    std::thread migration_thread(run_migration_thread);
+    migration_thread.detach();
+
+    int socket_fd = open_listener(port_number, false);
+    if (socket_fd == -1) {
+        std::exit(1);
+    }
+
+    std::cout << "O roteador está aguardando conexões na porta " << port_number << " com "
+              << backends.size() << " backends\n";
+
+    while (true) {
+        int new_socket_fd = accept(socket_fd, nullptr, nullptr);
+        if (new_socket_fd == -1) {
+            std::cerr << "Erro ao aceitar o socket do cliente\n";
+            continue;
+        }
+
+        std::thread thread(route_connection, new_socket_fd);
+        thread.detach();
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * parse_options
+ * -----------------------------------------------------------------------------
+ * Lê os backends e as opções passados depois da porta:
+ *
+ *  --vnodes=N  Pontos de cada backend no anel de hash consistente
+ *
+ * Encerra o programa caso alguma opção não seja reconhecida.
+ * -----------------------------------------------------------------------------
+ */
+void parse_options(int argc, char **argv) {
+    for (int i = 2; i < argc; ++i) {
+        std::string option(argv[i]);
+        if (option.compare(0, 2, "--") != 0) {
+            backends.push_back(option);
+            continue;
+        }
+
+        size_t equals = option.find('=');
+        std::string key = option.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (key == "--vnodes") {
+            ring.set_virtual_nodes(std::strtoull(value.c_str(), nullptr, 10));
+        }
+        else {
+            std::cerr << "Opção não reconhecida: " << option << "\n";
+            std::exit(1);
+        }
+    }
+
+    if (backends.empty()) {
+        std::cerr << "Informe pelo menos um backend\n";
+        std::exit(1);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * load_router_settings
+ * -----------------------------------------------------------------------------
+ * Lê o arquivo ROUTER_SETTINGS_FILE do diretório do roteador, caso exista, e
+ * monta o anel com os backends que não estão em drenagem.
+ *
+ * Linhas vazias ou começadas por '#' são ignoradas.  Exemplo:
+ *
+ *      drain localhost:4001
+ *      move alice localhost:4002
+ *
+ * "drain" tira o backend do anel e migra seus usuários para os outros.
+ * "move" fixa o usuário no backend, migrando-o se necessário.
+ * -----------------------------------------------------------------------------
+ */
+void load_router_settings() {
+    std::ifstream file((router_dir / fs::path(ROUTER_SETTINGS_FILE)).string());
+    std::string line;
+
+    std::lock_guard<std::mutex> lock(router_mutex);
+    drained.clear();
+    pinned.clear();
+
+    std::set<std::string> known(backends.begin(), backends.end());
+
+    while (std::getline(file, line)) {
+        std::istringstream tokens(line);
+        std::string directive;
+        if (!(tokens >> directive) || directive[0] == '#') {
+            continue;
+        }
+
+        std::string user_id;
+        std::string backend;
+        if (directive == "drain" && tokens >> backend && known.count(backend) > 0) {
+            drained.insert(backend);
+        }
+        else if (directive == "move" && tokens >> user_id >> backend && known.count(backend) > 0) {
+            pinned[user_id] = backend;
+        }
+        else {
+            std::cerr << "Configuração inválida em " << ROUTER_SETTINGS_FILE << ": " << line << "\n";
+        }
+    }
+
+    ring.clear();
+    for (const std::string &backend : backends) {
+        if (drained.count(backend) == 0) {
+            ring.add(backend);
+        }
+    }
+
+    if (ring.empty()) {
+        std::cerr << "Todos os backends estão em drenagem: usuários novos serão recusados\n";
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * load_placements, save_placements
+ * -----------------------------------------------------------------------------
+ * Lê e grava o ROUTER_PLACEMENTS_FILE, com uma linha "user_id host:porta" para
+ * cada usuário.  O arquivo é gravado num temporário e renomeado, para que
+ * uma queda do roteador nunca deixe um arquivo pela metade.
+ * -----------------------------------------------------------------------------
+ */
+void load_placements() {
+    std::ifstream file((router_dir / fs::path(ROUTER_PLACEMENTS_FILE)).string());
+    std::string user_id;
+    std::string backend;
+
+    std::lock_guard<std::mutex> lock(router_mutex);
+    while (file >> user_id >> backend) {
+        placements[user_id] = backend;
+    }
+}
+
+
+// Deve ser chamada com o "router_mutex" travado
+bool save_placements() {
+    fs::path path = router_dir / fs::path(ROUTER_PLACEMENTS_FILE);
+    fs::path temp_path = router_dir / fs::path(std::string(ROUTER_PLACEMENTS_FILE) + ".tmp");
+
+    {
+        std::ofstream file(temp_path.string(), std::ios::trunc);
+        for (auto &placement : placements) {
+            file << placement.first << " " << placement.second << "\n";
+        }
+        if (!file.flush()) {
+            std::cerr << "Erro ao gravar " << temp_path.string() << "\n";
+            return false;
+        }
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Erro ao gravar " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * target_for
+ * -----------------------------------------------------------------------------
+ * Backend onde o usuário deveria estar: o backend em que foi fixado ou o
+ * dono dele no anel.  Deve ser chamada com o "router_mutex" travado.
+ * -----------------------------------------------------------------------------
+ */
+std::string target_for(const std::string &user_id) {
+    auto it = pinned.find(user_id);
+    return it != pinned.end() ? it->second : ring.find(user_id);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * rebalance
+ * -----------------------------------------------------------------------------
+ * Agenda a migração de cada usuário que não está no backend onde deveria
+ * estar.  Com o anel de hash consistente, acrescentar um backend move apenas
+ * os usuários que passam a ser dele.
+ * -----------------------------------------------------------------------------
+ */
+void rebalance() {
+    std::lock_guard<std::mutex> lock(router_mutex);
+
+    std::set<std::string> queued;
+    for (const Migration &migration : migrations) {
+        queued.insert(migration.user_id);
+    }
+
+    for (auto &placement : placements) {
+        std::string target = target_for(placement.first);
+        if (target.empty() || target == placement.second ||
+            migrating.count(placement.first) > 0 || queued.count(placement.first) > 0) {
+            continue;
+        }
+
+        migrations.push_back(Migration{placement.first, placement.second, target});
+        std::cout << "Migração agendada: " << placement.first << " de " << placement.second
+                  << " para " << target << "\n";
+    }
+    migration_condition.notify_all();
+}
+
+
+#pragma clang diagnostic push // Não precisamos de warnings para loops infinitos
+#pragma clang diagnostic ignored "-Wmissing-noreturn"
+/*
+ * -----------------------------------------------------------------------------
+ * run_signal_thread
+ * -----------------------------------------------------------------------------
+ * A cada SIGHUP, relê o ROUTER_SETTINGS_FILE e agenda as migrações
+ * necessárias.
+ * -----------------------------------------------------------------------------
+ */
+void run_signal_thread() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    while (true) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+
+        std::cout << "Relendo " << ROUTER_SETTINGS_FILE << "\n";
+        load_router_settings();
+        rebalance();
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * run_migration_thread
+ * -----------------------------------------------------------------------------
+ * Executa as migrações agendadas, uma de cada vez.
+ *
+ * As conexões do usuário são derrubadas e as novas são recusadas até o fim
+ * da migração; os clientes reconectam sozinhos, já no backend novo.  Se a
+ * migração falhar, o usuário continua no backend antigo.
+ * -----------------------------------------------------------------------------
+ */
+void run_migration_thread() {
+    while (true) {
+        Migration migration;
+        {
+            std::unique_lock<std::mutex> lock(router_mutex);
+            migration_condition.wait(lock, [] { return !migrations.empty(); });
+            migration = migrations.front();
+            migrations.pop_front();
+            migrating.insert(migration.user_id);
+        }
+
+        disconnect_user(migration.user_id);
+        std::this_thread::sleep_for(std::chrono::milliseconds(ROUTER_MIGRATION_GRACE_MS));
+
+        std::cout << "Migrando " << migration.user_id << " de " << migration.from << " para "
+                  << migration.to << "\n";
+        bool ok = migrate_user(migration);
+
+        std::lock_guard<std::mutex> lock(router_mutex);
+        if (ok) {
+            placements[migration.user_id] = migration.to;
+            save_placements();
+            std::cout << migration.user_id << " migrado para " << migration.to << "\n";
+        }
+        else {
+            std::cerr << "Migração de " << migration.user_id << " falhou; o usuário continua em "
+                      << migration.from << "\n";
+        }
+        migrating.erase(migration.user_id);
+    }
+}
+#pragma clang diagnostic pop
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * route_connection
+ * -----------------------------------------------------------------------------
+ * Descobre o usuário da conexão sem consumir o handshake, conecta ao backend
+ * do usuário e repassa a conexão até que ela termine.
+ * -----------------------------------------------------------------------------
+ */
+void route_connection(int client_socket_fd) {
+    ConnectionType type;
+    std::string user_id;
+    if (!peek_handshake(client_socket_fd, &type, &user_id)) {
+        close(client_socket_fd);
+        return;
+    }
+
+    std::string backend;
+    {
+        std::lock_guard<std::mutex> lock(router_mutex);
+
+        // O cliente tenta de novo depois da migração
+        if (migrating.count(user_id) > 0) {
+            close(client_socket_fd);
+            return;
+        }
+
+        auto it = placements.find(user_id);
+        if (it != placements.end()) {
+            backend = it->second;
+        }
+        else {
+            backend = target_for(user_id);
+            if (backend.empty()) {
+                close(client_socket_fd);
+                return;
+            }
+            placements[user_id] = backend;
+            save_placements();
+        }
+        user_connections[user_id].insert(client_socket_fd);
+    }
+
+    int backend_socket_fd = connect_address(backend);
+    if (backend_socket_fd == -1) {
+        std::cerr << "Backend " << backend << " indisponível para " << user_id << "\n";
+    }
+    else {
+        splice_connection(client_socket_fd, backend_socket_fd);
+        close(backend_socket_fd);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(router_mutex);
+        auto it = user_connections.find(user_id);
+        it->second.erase(client_socket_fd);
+        if (it->second.empty()) {
+            user_connections.erase(it);
+        }
+    }
+    close(client_socket_fd);
+}
+
+
+/*
+ * Move os bytes de um socket para o outro pelo kernel, com um pipe no meio,
+ * sem copiá-los para a memória do roteador.  Quando a origem termina, o fim
+ * é repassado ao destino.
+ */
+static void pump(int from_socket_fd, int to_socket_fd) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        shutdown(from_socket_fd, SHUT_RDWR);
+        shutdown(to_socket_fd, SHUT_RDWR);
+        return;
+    }
+
+    while (true) {
+        ssize_t count = splice(from_socket_fd, nullptr, pipe_fds[1], nullptr, ROUTER_SPLICE_BYTES,
+                               SPLICE_F_MOVE);
+        if (count <= 0) {
+            break;
+        }
+
+        while (count > 0) {
+            ssize_t sent = splice(pipe_fds[0], nullptr, to_socket_fd, nullptr, (size_t) count, SPLICE_F_MOVE);
+            if (sent <= 0) {
+                break;
+            }
+            count -= sent;
+        }
+        if (count > 0) {
+            break;
+        }
+    }
+
+    shutdown(to_socket_fd, SHUT_WR);
+    shutdown(from_socket_fd, SHUT_RD);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * splice_connection
+ * -----------------------------------------------------------------------------
+ * Repassa os bytes entre o cliente e o backend nos dois sentidos, até que os
+ * dois terminem.
+ * -----------------------------------------------------------------------------
+ */
+void splice_connection(int client_socket_fd, int backend_socket_fd) {
+    // As mensagens do protocolo são repassadas assim que chegam
+    int enable = 1;
+    setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(backend_socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    std::thread responses(pump, backend_socket_fd, client_socket_fd);
+    pump(client_socket_fd, backend_socket_fd);
+    responses.join();
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * disconnect_user
+ * -----------------------------------------------------------------------------
+ * Derruba todas as conexões abertas do usuário.
+ * -----------------------------------------------------------------------------
+ */
+void disconnect_user(const std::string &user_id) {
+    std::lock_guard<std::mutex> lock(router_mutex);
+
+    auto it = user_connections.find(user_id);
+    if (it == user_connections.end()) {
+        return;
+    }
+    for (int socket_fd : it->second) {
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * migrate_user
+ * -----------------------------------------------------------------------------
+ * Copia os arquivos do usuário do backend antigo para o novo, usando o
+ * protocolo normal de um cliente.  Os arquivos só são apagados do backend
+ * antigo depois que todos foram copiados, então uma migração interrompida
+ * não perde nada.
+ *
+ * Os arquivos ignorados pelo SYNC_IGNORE_FILE do usuário também são
+ * copiados.  O SYNC_IGNORE_FILE é copiado por último, para que o backend
+ * novo ainda aceite os arquivos ignorados.
+ *
+ * As versões anteriores dos arquivos não são copiadas; elas continuam no
+ * diretório de versões do backend antigo.
+ * -----------------------------------------------------------------------------
+ */
+bool migrate_user(const Migration &migration) {
+    int source = open_session(migration.from, migration.user_id);
+    if (source == -1) {
+        return false;
+    }
+
+    int target = open_session(migration.to, migration.user_id);
+    if (target == -1) {
+        close_session(source);
+        return false;
+    }
+
+    std::vector<FileInfo> files;
+    bool ok = list_files(source, files);
+
+    std::stable_partition(files.begin(), files.end(), [](const FileInfo &file) {
+        return file.filename() != SYNC_IGNORE_FILE;
+    });
+
+    for (size_t i = 0; ok && i < files.size(); ++i) {
+        ok = copy_file(source, target, files[i].filename());
+    }
+
+    if (ok) {
+        for (const FileInfo &file : files) {
+            Command command = Delete;
+            write_socket(source, (const void *) &command, sizeof(command));
+            send_string(source, file.filename());
+        }
+        std::cout << files.size() << " arquivos de " << migration.user_id << " copiados\n";
+    }
+
+    close_session(source);
+    close_session(target);
+    return ok;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * open_session
+ * -----------------------------------------------------------------------------
+ * Abre uma sessão normal do usuário no backend.  Como as sessões antigas do
+ * usuário podem ainda estar sendo encerradas pelo backend, a conexão é
+ * tentada algumas vezes.  Retorna o socket, ou -1 em caso de erro.
+ * -----------------------------------------------------------------------------
+ */
+int open_session(const std::string &backend, const std::string &user_id) {
+    for (int attempt = 0; attempt < ROUTER_SESSION_ATTEMPTS; ++attempt) {
+        if (attempt > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ROUTER_SESSION_RETRY_MS));
+        }
+
+        int socket_fd = connect_address(backend);
+        if (socket_fd == -1) {
+            continue;
+        }
+        configure_socket(socket_fd);
+
+        ConnectionType type = Normal;
+        write_socket(socket_fd, (const void *) &type, sizeof(type));
+        send_string(socket_fd, user_id);
+
+        bool ok = false;
+        uint64_t session_id;
+        if (read_socket(socket_fd, (void *) &ok, sizeof(ok)) && ok &&
+            read_socket(socket_fd, (void *) &session_id, sizeof(session_id))) {
+            return socket_fd;
+        }
+        close_socket(socket_fd);
+    }
+
+    std::cerr << "Não foi possível abrir uma sessão de " << user_id << " em " << backend << "\n";
+    return -1;
+}
+
+
+void close_session(int socket_fd) {
+    Command command = Exit;
+    write_socket(socket_fd, (const void *) &command, sizeof(command));
+    close_socket(socket_fd);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * list_files
+ * -----------------------------------------------------------------------------
+ * Obtém os FileInfo de todos os arquivos do usuário no backend, inclusive os
+ * ignorados pelo SYNC_IGNORE_FILE.  Retorna falso se a conexão falhou.
+ * -----------------------------------------------------------------------------
+ */
+bool list_files(int socket_fd, std::vector<FileInfo> &files) {
+    Command command = ListStored;
+    write_socket(socket_fd, (const void *) &command, sizeof(command));
+
+    size_t n = 0;
+    if (!read_socket(socket_fd, (void *) &n, sizeof(n))) {
+        return false;
+    }
+
+    files.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        if (!read_socket(socket_fd, (void *) &files[i], sizeof(files[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * copy_file
+ * -----------------------------------------------------------------------------
+ * Baixa o arquivo de um backend para um arquivo temporário e o envia ao
+ * outro, com a mesma data de modificação.  Retorna falso se alguma das
+ * conexões falhou.
+ * -----------------------------------------------------------------------------
+ */
+bool copy_file(int from_socket_fd, int to_socket_fd, const std::string &filename) {
+    Command command = Download;
+    uint64_t version = 0;
+    write_socket(from_socket_fd, (const void *) &command, sizeof(command));
+    send_string(from_socket_fd, filename);
+    write_socket(from_socket_fd, (const void *) &version, sizeof(version));
+
+    bool exists = false;
+    if (!read_socket(from_socket_fd, (void *) &exists, sizeof(exists))) {
+        return false;
+    }
+    if (!exists) {
+        return true;
+    }
+
+    uint64_t file_size;
+    if (!read_socket(from_socket_fd, (void *) &file_size, sizeof(file_size))) {
+        return false;
+    }
+
+    FILE *file = tmpfile();
+    send_bool(from_socket_fd, file != nullptr);
+
+    time_t time;
+    if (file == nullptr) {
+        std::cerr << "Erro ao criar um arquivo temporário para " << filename << "\n";
+        read_socket(from_socket_fd, (void *) &time, sizeof(time));
+        return false;
+    }
+
+    ContentHasher hasher;
+    uint64_t hashed_bytes = 0;
+    bool received = read_file(from_socket_fd, file, file_size, [&](uint64_t offset, const char *chunk, size_t size) {
+        hasher.update_zeros(offset - hashed_bytes);
+        hasher.update(chunk, size);
+        hashed_bytes = offset + size;
+    });
+
+    if (!received || !read_socket(from_socket_fd, (void *) &time, sizeof(time))) {
+        fclose(file);
+        return false;
+    }
+    hasher.update_zeros(file_size - hashed_bytes);
+    ContentHash hash = hasher.digest();
+
+    command = Upload;
+    write_socket(to_socket_fd, (const void *) &command, sizeof(command));
+    send_string(to_socket_fd, filename);
+    write_socket(to_socket_fd, (const void *) &file_size, sizeof(file_size));
+    write_socket(to_socket_fd, (const void *) &time, sizeof(time));
+    write_socket(to_socket_fd, (const void *) &hash, sizeof(hash));
+
+    // O backend novo pode já ter o arquivo
+    bool wanted = false;
+    bool file_open_ok = false;
+    bool sent = read_socket(to_socket_fd, (void *) &wanted, sizeof(wanted));
+    if (sent && wanted) {
+        sent = read_socket(to_socket_fd, (void *) &file_open_ok, sizeof(file_open_ok)) && file_open_ok;
+        if (sent) {
+            rewind(file);
+            sent = send_file(to_socket_fd, file, file_size);
+        }
+    }
+
+    fclose(file);
+    return sent;
+}
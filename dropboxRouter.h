@@ -0,0 +1,52 @@
+#ifndef __DROPBOX_ROUTER_H__
+#define __DROPBOX_ROUTER_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "dropboxUtil.h"
+
+// Arquivo, no diretório do roteador, com os backends em drenagem e os
+// usuários fixados em um backend.  É relido quando o roteador recebe SIGHUP.
+#define ROUTER_SETTINGS_FILE "router.conf"
+
+// Arquivo, no diretório do roteador, com o backend onde estão os arquivos de
+// cada usuário já visto
+#define ROUTER_PLACEMENTS_FILE "router.placements"
+
+// Bytes movidos por chamada de splice
+#define ROUTER_SPLICE_BYTES (64 * 1024)
+
+// Espera entre derrubar as conexões de um usuário e começar a migrá-lo, para
+// que o backend antigo encerre as sessões
+#define ROUTER_MIGRATION_GRACE_MS 500
+
+// Tentativas de abrir uma sessão num backend durante a migração
+#define ROUTER_SESSION_ATTEMPTS 10
+#define ROUTER_SESSION_RETRY_MS 200
+
+// Uma migração pendente: os arquivos de "user_id" vão de "from" para "to"
+struct Migration {
+    std::string user_id;
+    std::string from;
+    std::string to;
+};
+
+void parse_options(int argc, char **argv);
+void load_router_settings();
+void load_placements();
+bool save_placements();
+std::string target_for(const std::string &user_id);
+void rebalance();
+void run_signal_thread();
+void run_migration_thread();
+void route_connection(int client_socket_fd);
+void splice_connection(int client_socket_fd, int backend_socket_fd);
+void disconnect_user(const std::string &user_id);
+bool migrate_user(const Migration &migration);
+int open_session(const std::string &backend, const std::string &user_id);
+void close_session(int socket_fd);
+bool list_files(int socket_fd, std::vector<FileInfo> &files);
+bool copy_file(int from_socket_fd, int to_socket_fd, const std::string &filename);
+
+#endif
@@ -0,0 +1,413 @@
+#include "dropboxScheduler.h"
+
+#include <algorithm>
+
+//=============================================================================
+// TokenBucket
+//=============================================================================
+TokenBucket::TokenBucket() {
+    rate_ = 0;
+    tokens_ = 0;
+    last_refill_ = std::chrono::steady_clock::now();
+}
+
+
+/*
+ * Altera a taxa do balde.  O balde começa cheio, com capacidade para um
+ * segundo de transferência.
+ */
+void TokenBucket::set_rate(uint64_t bytes_per_second) {
+    if (bytes_per_second == rate_) {
+        return;
+    }
+    rate_ = bytes_per_second;
+    tokens_ = std::max<double>(rate_, SCHEDULER_GRANT_BYTES);
+    last_refill_ = std::chrono::steady_clock::now();
+}
+
+
+bool TokenBucket::unlimited() const {
+    return rate_ == 0;
+}
+
+
+/*
+ * Consome as fichas necessárias para transferir "bytes", se houver fichas
+ * suficientes.  Retorna se o consumo foi possível.
+ */
+bool TokenBucket::try_consume(size_t bytes, std::chrono::steady_clock::time_point now) {
+    if (unlimited()) {
+        return true;
+    }
+
+    refill(now);
+    if (tokens_ < bytes) {
+        return false;
+    }
+    tokens_ -= bytes;
+    return true;
+}
+
+
+void TokenBucket::refund(size_t bytes) {
+    if (!unlimited()) {
+        tokens_ += bytes;
+    }
+}
+
+
+// Instante em que haverá fichas suficientes para "bytes"
+std::chrono::steady_clock::time_point TokenBucket::available_at(size_t bytes) const {
+    if (unlimited() || tokens_ >= bytes) {
+        return last_refill_;
+    }
+    double seconds = (bytes - tokens_) / rate_;
+    return last_refill_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(seconds));
+}
+
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+    if (elapsed <= 0) {
+        return;
+    }
+
+    double capacity = std::max<double>(rate_, SCHEDULER_GRANT_BYTES);
+    tokens_ = std::min(capacity, tokens_ + elapsed * rate_);
+    last_refill_ = now;
+}
+
+
+//=============================================================================
+// FairScheduler
+//=============================================================================
+FairScheduler::FairScheduler() {
+    bandwidth_limited_ = false;
+    user_streams_ = DEFAULT_USER_STREAMS;
+    disk_slots_ = 0;
+}
+
+
+/*
+ * Define o limite global de banda em bytes por segundo, os blocos de
+ * transferências grandes de cada usuário em andamento na rede e as vagas de
+ * cada dispositivo (0 para sem limite, nos três casos).
+ */
+void FairScheduler::configure(uint64_t bandwidth, size_t user_streams, size_t disk_slots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    network_.bandwidth.set_rate(bandwidth);
+    bandwidth_limited_ = bandwidth != 0;
+    user_streams_ = user_streams;
+
+    disk_slots_ = disk_slots;
+    for (auto &disk : disks_) {
+        disk.second.slots = disk_slots;
+    }
+    condition_.notify_all();
+}
+
+
+// Verifica se uma transferência de um usuário com esse limite de banda
+// precisa passar pelo escalonador
+bool FairScheduler::limits(uint64_t user_rate, bool interactive) const {
+    return bandwidth_limited_ || user_rate != 0 || (!interactive && user_streams_ != 0);
+}
+
+
+// Registra uma transferência do usuário, que guarda o seu estado
+void FairScheduler::begin(const std::string &user_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++users_[user_id].transfers;
+}
+
+
+// Encerra uma transferência do usuário.  Sem transferências, o usuário é
+// removido.
+void FairScheduler::end(const std::string &user_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = users_.find(user_id);
+    if (it != users_.end() && --it->second.transfers == 0) {
+        users_.erase(it);
+    }
+}
+
+
+/*
+ * Bloqueia até que o usuário possa transferir "bytes" pela rede, e cobra os
+ * bytes dos limites de banda.  Uma concessão de uma transferência grande
+ * ocupa uma das vagas do usuário até "release".  Deve ser chamada entre
+ * "begin" e "end".
+ */
+void FairScheduler::acquire(const std::string &user_id, size_t bytes, bool interactive, uint64_t user_rate) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    users_[user_id].bucket.set_rate(user_rate);
+
+    Request request{user_id, bytes, interactive, false};
+    wait_grant(network_, request, lock);
+}
+
+
+// Devolve a vaga do usuário ocupada por uma concessão de uma transferência
+// grande
+void FairScheduler::release(const std::string &user_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = users_.find(user_id);
+    if (it != users_.end() && it->second.streams > 0) {
+        --it->second.streams;
+    }
+    dispatch(network_, Clock::now());
+}
+
+
+// Bloqueia até que o usuário possa ler ou escrever "bytes" em "device".  A
+// vaga do dispositivo fica ocupada até "release_disk".
+void FairScheduler::acquire_disk(const std::string &user_id, dev_t device, size_t bytes, bool interactive) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto disk = disks_.emplace(device, Resource());
+    if (disk.second) {
+        disk.first->second.slots = disk_slots_;
+    }
+
+    Request request{user_id, bytes, interactive, false};
+    wait_grant(disk.first->second, request, lock);
+}
+
+
+void FairScheduler::release_disk(dev_t device) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Resource &disk = disks_[device];
+    if (disk.in_use > 0) {
+        --disk.in_use;
+    }
+    dispatch(disk, Clock::now());
+}
+
+
+// Enfileira o pedido no recurso e espera que ele seja atendido
+void FairScheduler::wait_grant(Resource &resource, Request &request, std::unique_lock<std::mutex> &lock) {
+    if (request.interactive) {
+        resource.interactive.push_back(&request);
+    }
+    else {
+        Lane &lane = resource.lanes[request.user_id];
+        if (lane.requests.empty()) {
+            lane.deficit = 0;
+            resource.round_robin.push_back(request.user_id);
+        }
+        lane.requests.push_back(&request);
+    }
+
+    while (true) {
+        dispatch(resource, Clock::now());
+
+        if (request.granted) {
+            return;
+        }
+
+        // Um pedido que não pôde ser atendido espera pelas fichas que faltam,
+        // ou por uma concessão ou vaga devolvida
+        if (resource.next_wakeup == Clock::time_point::max()) {
+            condition_.wait(lock);
+        }
+        else {
+            condition_.wait_until(lock, resource.next_wakeup);
+        }
+    }
+}
+
+
+/*
+ * Faz concessões enquanto houver pedidos que possam ser atendidos.  Os
+ * pedidos que esperam também são acordados se o próximo instante em que as
+ * fichas bastam ficou mais cedo, pois eles podem estar esperando sem prazo
+ * por uma vaga que acabou de ser devolvida.
+ */
+void FairScheduler::dispatch(Resource &resource, Clock::time_point now) {
+    Clock::time_point previous_wakeup = resource.next_wakeup;
+    resource.next_wakeup = Clock::time_point::max();
+
+    bool granted = false;
+    Request *request;
+    while ((request = next_request(resource, now)) != nullptr) {
+        request->granted = true;
+        granted = true;
+    }
+
+    if (granted || resource.next_wakeup < previous_wakeup) {
+        condition_.notify_all();
+    }
+}
+
+
+/*
+ * Escolhe o próximo pedido a ser atendido.  Os interativos são atendidos
+ * primeiro, na ordem de chegada.  Os demais são escolhidos por Deficit Round
+ * Robin: a cada vez que um usuário chega na frente da fila, seu déficit
+ * cresce de SCHEDULER_GRANT_BYTES (ou do tamanho do pedido, se for maior), e
+ * ele é atendido enquanto o déficit cobrir o tamanho do seu próximo pedido.
+ */
+FairScheduler::Request *FairScheduler::next_request(Resource &resource, Clock::time_point now) {
+    for (auto it = resource.interactive.begin(); it != resource.interactive.end(); ++it) {
+        Request *request = *it;
+        if (admit(resource, request, now)) {
+            resource.interactive.erase(it);
+            return request;
+        }
+    }
+
+    // Cada usuário é visitado no máximo uma vez, pois a primeira visita já
+    // lhe dá o déficit que falta
+    std::list<std::string> &round_robin = resource.round_robin;
+    size_t visits = round_robin.size();
+    while (!round_robin.empty() && visits-- > 0) {
+        auto lane = resource.lanes.find(round_robin.front());
+        Request *request = lane->second.requests.front();
+
+        if (lane->second.deficit < request->bytes) {
+            lane->second.deficit += std::max<size_t>(request->bytes, SCHEDULER_GRANT_BYTES);
+        }
+
+        if (!admit(resource, request, now)) {
+            round_robin.splice(round_robin.end(), round_robin, round_robin.begin());
+            continue;
+        }
+
+        lane->second.requests.pop_front();
+        lane->second.deficit -= request->bytes;
+
+        if (lane->second.requests.empty()) {
+            round_robin.pop_front();
+            resource.lanes.erase(lane);
+        }
+        else if (lane->second.deficit < lane->second.requests.front()->bytes) {
+            round_robin.splice(round_robin.end(), round_robin, round_robin.begin());
+        }
+        return request;
+    }
+    return nullptr;
+}
+
+
+/*
+ * Verifica as vagas e o limite de taxa do recurso e, na rede, as vagas e o
+ * limite de taxa do usuário.  Se um limite de taxa impedir o pedido, anota
+ * quando ele poderá ser atendido.  Um pedido admitido ocupa as vagas.
+ */
+bool FairScheduler::admit(Resource &resource, Request *request, Clock::time_point now) {
+    if (resource.slots != 0 && resource.in_use >= resource.slots) {
+        return false;
+    }
+
+    // Só a rede tem limites por usuário
+    UserState *user = &resource == &network_ ? &users_[request->user_id] : nullptr;
+    if (user != nullptr) {
+        if (!request->interactive && user_streams_ != 0 && user->streams >= user_streams_) {
+            return false;
+        }
+        if (!user->bucket.try_consume(request->bytes, now)) {
+            resource.next_wakeup = std::min(resource.next_wakeup, user->bucket.available_at(request->bytes));
+            return false;
+        }
+    }
+
+    if (!resource.bandwidth.try_consume(request->bytes, now)) {
+        // Devolve as fichas do usuário, que não chegaram a ser usadas
+        if (user != nullptr) {
+            user->bucket.refund(request->bytes);
+        }
+        resource.next_wakeup = std::min(resource.next_wakeup, resource.bandwidth.available_at(request->bytes));
+        return false;
+    }
+
+    if (user == nullptr) {
+        ++resource.in_use;
+    }
+    else if (!request->interactive) {
+        ++user->streams;
+    }
+    return true;
+}
+
+
+//=============================================================================
+// ScheduledTransfer
+//=============================================================================
+ScheduledTransfer::ScheduledTransfer(FairScheduler &scheduler,
+                                     const std::string &user_id,
+                                     size_t total_bytes,
+                                     uint64_t user_rate)
+        : scheduler_(scheduler), user_id_(user_id) {
+    interactive_ = total_bytes <= SMALL_TRANSFER_BYTES;
+    limited_ = scheduler_.limits(user_rate, interactive_);
+    user_rate_ = user_rate;
+    credit_ = 0;
+    holding_ = false;
+
+    if (limited_) {
+        scheduler_.begin(user_id_);
+    }
+}
+
+
+ScheduledTransfer::~ScheduledTransfer() {
+    if (holding_) {
+        scheduler_.release(user_id_);
+    }
+    if (limited_) {
+        scheduler_.end(user_id_);
+    }
+}
+
+
+void ScheduledTransfer::acquire(size_t bytes) {
+    if (!limited_) {
+        return;
+    }
+    if (credit_ < bytes) {
+        // A vaga da concessão anterior é devolvida antes, para que a
+        // transferência nunca ocupe duas vagas do usuário
+        if (holding_) {
+            scheduler_.release(user_id_);
+        }
+
+        size_t grant = std::max<size_t>(bytes - credit_, SCHEDULER_GRANT_BYTES);
+        scheduler_.acquire(user_id_, grant, interactive_, user_rate_);
+        holding_ = !interactive_;
+        credit_ += grant;
+    }
+    credit_ -= bytes;
+}
+
+
+// Os bytes já foram cobrados na concessão.  A vaga do usuário é devolvida
+// quando a concessão termina de ser consumida.
+void ScheduledTransfer::release(size_t) {
+    if (holding_ && credit_ == 0) {
+        scheduler_.release(user_id_);
+        holding_ = false;
+    }
+}
+
+
+//=============================================================================
+// ScheduledDisk
+//=============================================================================
+ScheduledDisk::ScheduledDisk(FairScheduler &scheduler, const std::string &user_id, dev_t device,
+                             uint64_t total_bytes)
+        : scheduler_(scheduler), user_id_(user_id) {
+    device_ = device;
+    interactive_ = total_bytes <= SMALL_TRANSFER_BYTES;
+}
+
+
+void ScheduledDisk::acquire(size_t bytes) {
+    scheduler_.acquire_disk(user_id_, device_, bytes, interactive_);
+}
+
+
+void ScheduledDisk::release(size_t) {
+    scheduler_.release_disk(device_);
+}
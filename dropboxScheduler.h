@@ -0,0 +1,209 @@
+#ifndef __DROPBOX_SCHEDULER_H__
+#define __DROPBOX_SCHEDULER_H__
+
+#include <sys/types.h>
+#include <string>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "dropboxUtil.h"
+
+// Tamanho de cada concessão do escalonador.  Uma transferência consome a
+// concessão em vários blocos de BUFFER_SIZE antes de pedir outra.
+#define SCHEDULER_GRANT_BYTES (64 * 1024)
+
+// Transferências até esse tamanho são consideradas interativas e passam na
+// frente das transferências grandes.
+#define SMALL_TRANSFER_BYTES (256 * 1024)
+
+// Blocos de transferências grandes de um mesmo usuário em andamento ao mesmo
+// tempo na rede (0 desliga)
+#define DEFAULT_USER_STREAMS 4
+
+
+/*
+ * Balde de fichas para limitar a taxa de bytes por segundo.  Uma taxa zero
+ * significa sem limite.
+ */
+class TokenBucket {
+public:
+    TokenBucket();
+
+    void set_rate(uint64_t bytes_per_second);
+    bool unlimited() const;
+    bool try_consume(size_t bytes, std::chrono::steady_clock::time_point now);
+    void refund(size_t bytes);
+    std::chrono::steady_clock::time_point available_at(size_t bytes) const;
+
+private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+    uint64_t rate_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_refill_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * FairScheduler
+ * ----------------------------------------------------------------------------
+ * Divide a banda de rede e de disco do servidor entre os usuários.
+ *
+ * Rede: cada bloco transferido precisa de uma concessão, que cobra os seus
+ * bytes do limite global de banda e do limite do usuário.  Quando há disputa
+ * pela banda global, as concessões são distribuídas por Deficit Round Robin
+ * entre os usuários, de forma que um usuário com um upload enorme recebe a
+ * mesma parte que um usuário com um arquivo pequeno, independente de quantas
+ * conexões tenha.  Mesmo sem limite configurado, cada usuário tem no máximo
+ * "user_streams" blocos de transferências grandes em andamento, para que
+ * suas muitas conexões não dividam o link com os outros usuários em partes
+ * desiguais.  Essa vaga é do próprio usuário, e um dispositivo lento só
+ * atrasa as outras transferências grandes dele.
+ *
+ * Disco: cada dispositivo tem "disk_slots" vagas, e cada leitura ou escrita
+ * de um bloco ocupa uma delas enquanto a operação é feita (nunca durante a
+ * escrita no socket).  As vagas são distribuídas da mesma forma, por Deficit
+ * Round Robin entre os usuários.
+ *
+ * Nos dois casos, os pedidos interativos (transferências pequenas) passam na
+ * frente e não contam no limite de blocos em andamento do usuário.
+ * ----------------------------------------------------------------------------
+ */
+class FairScheduler {
+public:
+    FairScheduler();
+
+    void configure(uint64_t bandwidth, size_t user_streams, size_t disk_slots);
+    bool limits(uint64_t user_rate, bool interactive) const;
+
+    void begin(const std::string &user_id);
+    void end(const std::string &user_id);
+    void acquire(const std::string &user_id, size_t bytes, bool interactive, uint64_t user_rate);
+    void release(const std::string &user_id);
+
+    void acquire_disk(const std::string &user_id, dev_t device, size_t bytes, bool interactive);
+    void release_disk(dev_t device);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Request {
+        std::string user_id;
+        size_t bytes;
+        bool interactive;
+        bool granted;
+    };
+
+    // Pedidos de um usuário a um recurso, atendidos em ordem
+    struct Lane {
+        std::deque<Request *> requests;
+        size_t deficit = 0;
+    };
+
+    /*
+     * Banda disputada pelos usuários: a rede, ou um dispositivo.  "slots"
+     * limita as concessões em andamento (0 sem limite), e "bandwidth" a taxa
+     * das concessões.
+     */
+    struct Resource {
+        TokenBucket bandwidth;
+        size_t slots = 0;
+        size_t in_use = 0;
+
+        std::deque<Request *> interactive;
+        std::list<std::string> round_robin;
+        std::unordered_map<std::string, Lane> lanes;
+
+        // Próximo instante em que um pedido limitado por taxa pode ser
+        // atendido
+        Clock::time_point next_wakeup = Clock::time_point::max();
+    };
+
+    struct UserState {
+        TokenBucket bucket;
+
+        // Blocos de transferências grandes do usuário em andamento na rede
+        size_t streams = 0;
+
+        // Transferências do usuário em andamento.  O usuário sai de "users_"
+        // quando a última termina.
+        size_t transfers = 0;
+    };
+
+    void wait_grant(Resource &resource, Request &request, std::unique_lock<std::mutex> &lock);
+    void dispatch(Resource &resource, Clock::time_point now);
+    Request *next_request(Resource &resource, Clock::time_point now);
+    bool admit(Resource &resource, Request *request, Clock::time_point now);
+
+    std::atomic<bool> bandwidth_limited_;
+    std::atomic<size_t> user_streams_;
+    size_t disk_slots_;
+
+    Resource network_;
+    std::unordered_map<std::string, UserState> users_;
+    std::unordered_map<dev_t, Resource> disks_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ScheduledTransfer
+ * ----------------------------------------------------------------------------
+ * Portão de uma transferência de um usuário pela rede.  Pede concessões de
+ * até SCHEDULER_GRANT_BYTES ao escalonador e as consome bloco a bloco.  Uma
+ * transferência grande devolve a vaga do usuário quando a concessão foi
+ * consumida.  Se nada limitar a transferência, não faz nada.
+ * ----------------------------------------------------------------------------
+ */
+class ScheduledTransfer : public TransferGate {
+public:
+    ScheduledTransfer(FairScheduler &scheduler, const std::string &user_id, size_t total_bytes, uint64_t user_rate);
+    ~ScheduledTransfer() override;
+
+    void acquire(size_t bytes) override;
+    void release(size_t bytes) override;
+
+private:
+    FairScheduler &scheduler_;
+    std::string user_id_;
+    bool limited_;
+    bool interactive_;
+    uint64_t user_rate_;
+    size_t credit_;
+    bool holding_;
+};
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * ScheduledDisk
+ * ----------------------------------------------------------------------------
+ * Portão das operações de disco de uma transferência de um usuário em
+ * "device".  Cada operação ocupa uma vaga do dispositivo no escalonador, de
+ * "acquire", antes de ser entregue ao DiskPool, até "release", quando
+ * termina.  "release" pode ser chamado pela thread de disco.
+ * ----------------------------------------------------------------------------
+ */
+class ScheduledDisk : public TransferGate {
+public:
+    ScheduledDisk(FairScheduler &scheduler, const std::string &user_id, dev_t device, uint64_t total_bytes);
+
+    void acquire(size_t bytes) override;
+    void release(size_t bytes) override;
+
+private:
+    FairScheduler &scheduler_;
+    std::string user_id_;
+    dev_t device_;
+    bool interactive_;
+};
+
+#endif
@@ -10,6 +10,26 @@
 #include "dropboxServer.h"
 #include "dropboxUtil.h"
 #include "dropboxClient.h"
+#include "dropboxCache.h"
+#include "dropboxRelay.h"
+#include "dropboxRegistry.h"
+#include "dropboxScheduler.h"
+#include "dropboxIngest.h"
+#include "dropboxVersions.h"
+#include "dropboxPack.h"
+#include "dropboxWorkers.h"
+#include "dropboxReplication.h"
+#include "dropboxDisk.h"
+#include "dropboxRanges.h"
+#include "dropboxSyncRules.h"
+#include "dropboxIgnore.h"
+#include <atomic>
+#include <csignal>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <deque>
+#include <condition_variable>
 #include <boost/filesystem.hpp>
 
 
@@ -19,24 +39,85 @@ namespace fs = boost::filesystem;
 fs::path server_dir;
 
 uint16_t port_number;
-sockaddr_in address{};
-ClientDict clients;
+ClientRegistry clients;
 
-std::mutex connection_mutex;
-std::mutex user_lock_mutex;
+// Gerador dos identificadores de repasse
+std::atomic<uint64_t> next_transfer_id{1};
+
+// Configurações padrão e de cada usuário
+UserSettings default_settings{MAX_DEVICES, 0, DEFAULT_VERSION_RETENTION, FileStorage};
+std::map<std::string, UserSettings> user_settings;
+
+// Cache dos arquivos mais baixados e enviados recentemente
+FileCache file_cache(DEFAULT_CACHE_BYTES, DEFAULT_CACHE_MAX_FILE_BYTES);
+
+// Divide a banda de rede e de disco das transferências entre os usuários
+FairScheduler io_scheduler;
+
+// Regras de sincronização seletiva, por usuário e nome do dispositivo.  Lidas
+// uma vez, antes das conexões serem aceitas.
+std::map<std::pair<std::string, std::string>, std::shared_ptr<const SyncRules>> sync_rules;
+
+// Operações de disco dos uploads e downloads, com filas por dispositivo
+DiskPool disk_pool;
+
+// Uploads a partir desse tamanho são escritos pelo IngestWriter (0 desliga)
+uint64_t ingest_threshold = DEFAULT_INGEST_THRESHOLD;
+
+// Packfiles dos usuários, abertos no primeiro uso.  Usuários sem packfiles
+// ficam registrados com nullptr.
+std::map<std::string, std::unique_ptr<PackStore>> pack_stores;
+std::mutex pack_stores_mutex;
+
+// Transferências em pedaços em andamento, pelo identificador
+std::map<uint64_t, std::shared_ptr<ChunkedTransfer>> chunked_transfers;
+std::mutex chunked_transfers_mutex;
+
+// Identificador da próxima conexão atendida por "run_user_interface".  Ao
+// contrário do socket, ele nunca é reaproveitado.
+std::atomic<uint64_t> next_connection_id{1};
+
+// Arquivos, por usuário e nome, cujo hash será calculado em segundo plano
+std::deque<std::pair<std::string, std::string>> pending_hashes;
+std::set<std::pair<std::string, std::string>> queued_hashes;
+std::mutex pending_hashes_mutex;
+std::condition_variable pending_hashes_condition;
+
+// Padrões do SYNC_IGNORE_FILE de cada usuário, compilados no primeiro uso
+std::map<std::string, std::shared_ptr<const IgnoreMatcher>> ignore_matchers;
+std::mutex ignore_matchers_mutex;
+
+// Arquivos até esse tamanho vão para os packfiles dos usuários com
+// armazenamento PackStorage
+uint64_t pack_max_file_bytes = DEFAULT_PACK_MAX_FILE_BYTES;
+
+// Processos workers do servidor (1 para o modo com um único processo), o
+// índice deste worker e o socket por onde ele recebe conexões de outros
+// workers
+size_t server_workers = 1;
+size_t worker_index = 0;
+int handoff_fd = -1;
+
+// Mudanças confirmadas neste servidor, enviadas às réplicas
+ReplicationLog replication_log;
+
+// No modo réplica, o endereço do primário e o atraso máximo, em
+// milissegundos, com que a réplica ainda atende leituras.  Vazio no primário.
+std::string replica_of;
+uint64_t replica_max_staleness = DEFAULT_REPLICA_MAX_STALENESS_MS;
+ReplicaStatus replica_status;
 
 /*
  * -----------------------------------------------------------------------------
  * main
  * -----------------------------------------------------------------------------
- * A função main espera 1 argumento que é em qual porta o servidor vai rodar
- *
- * Ela também fica escutando novas conexões ao seu socket e para cada nova
- * conexão cria uma thread nova.
+ * A função main espera 1 argumento que é em qual porta o servidor vai rodar.
+ * Depois da porta podem ser passadas opções no formato --chave=valor, que são
+ * tratadas por "parse_options".
  *
- * Essa thread se encarrega de escutar e responder a comandos do cliente.  O
- * socket do cliente é passado a essa thread.  Outras conexões ficam sendo
- * aguardadas.
+ * Com a opção --workers=N (N > 1), o processo se torna o supervisor de N
+ * processos workers, que escutam a mesma porta.  Senão, ele mesmo atende as
+ * conexões em "run_server".
  * -----------------------------------------------------------------------------
  */
 int main(int argc, char **argv) {
@@ -48,31 +129,100 @@ int main(int argc, char **argv) {
     char *end;
     port_number = static_cast<uint16_t >(std::strtol(argv[1], &end, 10));
 
-    bzero((void *) &address, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port_number);
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    parse_options(argc, argv);
+
+    // Um dispositivo que se desconecta no meio de uma escrita não deve
+    // derrubar o servidor.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Determina o diretório atual
+    server_dir = fs::current_path();
+
+    if (server_workers > 1) {
+        WorkerSupervisor supervisor(server_workers, run_server);
+        return supervisor.run();
+    }
+
+    run_server(0, -1);
+}
+
 
-    // Criando o socket
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+/*
+ * -----------------------------------------------------------------------------
+ * run_server
+ * -----------------------------------------------------------------------------
+ * Escuta novas conexões na porta do servidor, e para cada nova conexão cria
+ * uma thread nova.
+ *
+ * Essa thread se encarrega de escutar e responder a comandos do cliente.  O
+ * socket do cliente é passado a essa thread.  Outras conexões ficam sendo
+ * aguardadas.
+ *
+ * No modo com vários processos, "index" é o índice deste worker.  Cada
+ * worker carrega e atende apenas os seus usuários (ver "owns_user"); as
+ * conexões de outros usuários que ele aceitar são repassadas ao worker dono.
+ * Quando o worker está pronto, um byte é escrito em "ready_fd".
+ * -----------------------------------------------------------------------------
+ */
+void run_server(size_t index, int ready_fd) {
+    worker_index = index;
 
-    // Binding
-    if (bind(socket_fd, (sockaddr *) &address, sizeof(address)) < 0) {
-        std::cerr << "Erro ao fazer o binding\n";
-        close(socket_fd);
+    int socket_fd = open_listener(port_number, server_workers > 1);
+    if (socket_fd == -1) {
         std::exit(1);
     }
 
-    // Listening
-    listen(socket_fd, 5);
+    if (server_workers > 1) {
+        handoff_fd = open_handoff_socket(port_number, worker_index);
+        if (handoff_fd == -1) {
+            std::exit(1);
+        }
+        std::thread handoff_thread(run_handoff_thread);
+        handoff_thread.detach();
+    }
 
-    // Determina o diretório atual
-    server_dir = fs::current_path();
+    // As threads de disco são criadas em cada worker, depois do fork
+    disk_pool.start();
 
-    // Inicializa os clientes
+    // Lê as configurações dos usuários e inicializa os clientes
+    load_user_settings();
+    load_sync_rules();
     initialize_clients();
 
-    std::cout << "O servidor está aguardando conexões na porta " << port_number << "\n";
+    // Compacta os packfiles em segundo plano
+    std::thread compaction_thread(run_compaction_thread);
+    compaction_thread.detach();
+
+    // Descarta as transferências em pedaços abandonadas
+    std::thread chunked_expiry_thread(run_chunked_expiry_thread);
+    chunked_expiry_thread.detach();
+
+    // Calcula os hashes que faltam nas listas de arquivos
+    std::thread hash_thread(run_hash_thread);
+    hash_thread.detach();
+
+    // A réplica acompanha o primário.  A primeira conexão descobre quantas
+    // são necessárias e abre as outras.
+    if (!replica_of.empty()) {
+        std::thread replica_thread(run_replica_thread, 0);
+        replica_thread.detach();
+    }
+
+    if (server_workers > 1) {
+        std::cout << "Worker " << worker_index << " (" << getpid() << ") está aguardando conexões na porta "
+                  << port_number << "\n";
+    }
+    else {
+        std::cout << "O servidor está aguardando conexões na porta " << port_number << "\n";
+    }
+
+    if (ready_fd != -1) {
+        char byte = 1;
+        if (write(ready_fd, &byte, 1) != 1) {
+            std::cerr << "Erro ao avisar o supervisor\n";
+        }
+        close(ready_fd);
+    }
 
     // Aguardando conexões
     while (true) {
@@ -88,28 +238,362 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        ConnectionType type;
-        bzero(&type, sizeof(type));
-        ssize_t bytes = read_socket(new_socket_fd, (void *) &type, sizeof(type));
-        if (bytes == -1) {
-            std::cerr << "Erro ao ler o tipo de conexão do cliente\n";
-            close(socket_fd);
-            std::exit(1);
+        std::thread thread(server_workers > 1 ? route_connection : serve_connection, new_socket_fd);
+        thread.detach();
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * serve_connection
+ * -----------------------------------------------------------------------------
+ * Lê o tipo da conexão e a atende na thread atual até que ela termine.
+ * -----------------------------------------------------------------------------
+ */
+void serve_connection(int client_socket_fd) {
+    configure_socket(client_socket_fd);
+
+    ConnectionType type;
+    bzero(&type, sizeof(type));
+    if (!read_socket(client_socket_fd, (void *) &type, sizeof(type))) {
+        std::cerr << "Erro ao ler o tipo de conexão do cliente\n";
+        close_socket(client_socket_fd);
+        return;
+    }
+
+    // Se o cliente está se conectando normalmente
+    if (type == Normal) {
+        std::cout << "Running normal thread\n";
+        run_normal_thread(client_socket_fd);
+    }
+    else if (type == Sync) {
+        run_sync_connection_thread(client_socket_fd);
+    }
+    else if (type == Worker) {
+        run_worker_connection_thread(client_socket_fd);
+    }
+    else if (type == Replica) {
+        run_replication_thread(client_socket_fd);
+    }
+    else {
+        close_socket(client_socket_fd);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * route_connection
+ * -----------------------------------------------------------------------------
+ * No modo com vários processos, descobre o usuário da conexão sem consumir o
+ * handshake e a atende, se o usuário for deste worker, ou a repassa ao worker
+ * dono.  Se o dono estiver reiniciando, a conexão é fechada e o cliente
+ * tenta de novo.
+ * -----------------------------------------------------------------------------
+ */
+void route_connection(int client_socket_fd) {
+    ConnectionType type;
+    std::string user_id;
+    if (!peek_handshake(client_socket_fd, &type, &user_id)) {
+        std::cerr << "Handshake inválido ou incompleto\n";
+        close(client_socket_fd);
+        return;
+    }
+
+    // As réplicas abrem uma conexão com cada worker, e enviam o índice do
+    // worker no lugar do user_id
+    size_t owner = type == Replica ? std::strtoull(user_id.c_str(), nullptr, 10) % server_workers
+                                   : worker_for_user(user_id, server_workers);
+    if (owner == worker_index) {
+        serve_connection(client_socket_fd);
+        return;
+    }
+
+    hand_off(handoff_fd, port_number, owner, client_socket_fd);
+    close(client_socket_fd);
+}
+
+
+#pragma clang diagnostic push // Não precisamos de warnings para loops infinitos
+#pragma clang diagnostic ignored "-Wmissing-noreturn"
+/*
+ * -----------------------------------------------------------------------------
+ * run_handoff_thread
+ * -----------------------------------------------------------------------------
+ * Recebe as conexões dos usuários deste worker aceitas por outros workers e
+ * as atende como se tivessem sido aceitas aqui.
+ * -----------------------------------------------------------------------------
+ */
+void run_handoff_thread() {
+    while (true) {
+        int client_socket_fd = receive_handoff(handoff_fd);
+        if (client_socket_fd == -1) {
+            continue;
         }
 
-        // Se o cliente está se conectando normalmente
-        std::thread thread;
-        if (type == Normal) {
-            std::cout << "Running normal thread\n";
-            thread = std::thread(run_normal_thread, new_socket_fd);
-            thread.detach();
+        std::thread thread(serve_connection, client_socket_fd);
+        thread.detach();
+    }
+}
+#pragma clang diagnostic pop
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * owns_user
+ * -----------------------------------------------------------------------------
+ * Verifica se o estado do usuário pertence a este processo.  Com um único
+ * processo, todos os usuários pertencem a ele.
+ * -----------------------------------------------------------------------------
+ */
+bool owns_user(const std::string &user_id) {
+    return server_workers <= 1 || worker_for_user(user_id, server_workers) == worker_index;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * parse_options
+ * -----------------------------------------------------------------------------
+ * Lê as opções do servidor passadas depois da porta.  As opções têm o formato
+ * --chave=valor:
+ *
+ *  --cache-bytes=N     Orçamento em bytes da cache de arquivos (0 desliga)
+ *  --cache-max-file=N  Tamanho máximo de um arquivo guardado na cache
+ *  --max-devices=N     Limite padrão de dispositivos conectados por usuário
+ *  --bandwidth=N       Limite global de banda em bytes por segundo, dividido
+ *                      igualmente entre os usuários (0 sem limite)
+ *  --rate-limit=N      Limite padrão de banda de cada usuário em bytes por
+ *                      segundo (0 sem limite)
+ *  --user-streams=N    Blocos de transferências grandes de um mesmo usuário
+ *                      em andamento ao mesmo tempo na rede (0 sem limite)
+ *  --ingest-threshold=N
+ *                      Tamanho a partir do qual os uploads são escritos sem
+ *                      passar pelo page cache (0 desliga)
+ *  --versions=N        Versões anteriores guardadas de cada arquivo (0 desliga)
+ *  --storage=files|pack
+ *                      Formato de armazenamento padrão dos usuários.  Com
+ *                      "pack", os arquivos pequenos vão para packfiles
+ *  --pack-max-file=N   Tamanho máximo de um arquivo guardado nos packfiles
+ *  --workers=N         Processos que atendem conexões (1 para um único
+ *                      processo).  Cada usuário pertence a um dos processos,
+ *                      e a banda global e a cache são divididas entre eles
+ *  --replica-of=host:porta
+ *                      Torna o servidor uma réplica do primário nesse
+ *                      endereço.  A réplica recebe as mudanças do primário e
+ *                      atende apenas leituras (downloads e listagens)
+ *  --max-staleness=N   Atraso máximo, em milissegundos, com que a réplica
+ *                      ainda atende leituras.  Mais atrasada que isso, ela
+ *                      recusa conexões e encerra as sessões abertas
+ *  --disk-threads=N    Threads de disco de cada processo (0 faz as operações
+ *                      de disco nas threads das conexões)
+ *  --disk-depth=N      Operações de disco em andamento ao mesmo tempo em cada
+ *                      dispositivo.  As leituras e escritas das
+ *                      transferências ocupam essas vagas na ordem do
+ *                      escalonador, divididas igualmente entre os usuários
+ *
+ * Encerra o programa caso alguma opção não seja reconhecida.
+ * -----------------------------------------------------------------------------
+ */
+void parse_options(int argc, char **argv) {
+    size_t cache_bytes = DEFAULT_CACHE_BYTES;
+    size_t cache_max_file_bytes = DEFAULT_CACHE_MAX_FILE_BYTES;
+    uint64_t bandwidth = 0;
+    size_t user_streams = DEFAULT_USER_STREAMS;
+    size_t disk_threads = DEFAULT_DISK_THREADS;
+    size_t disk_depth = DEFAULT_DISK_DEPTH;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string option(argv[i]);
+        size_t equals = option.find('=');
+        std::string key = option.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (key == "--cache-bytes") {
+            cache_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--cache-max-file") {
+            cache_max_file_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--max-devices") {
+            default_settings.max_devices = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--bandwidth") {
+            bandwidth = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--rate-limit") {
+            default_settings.rate_limit = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--ingest-threshold") {
+            ingest_threshold = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--versions") {
+            default_settings.versions = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--storage" && (value == "files" || value == "pack")) {
+            default_settings.storage = value == "pack" ? PackStorage : FileStorage;
+        }
+        else if (key == "--pack-max-file") {
+            pack_max_file_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--workers") {
+            server_workers = std::max<size_t>(std::strtoull(value.c_str(), nullptr, 10), 1);
+        }
+        else if (key == "--replica-of" && !value.empty()) {
+            replica_of = value;
+        }
+        else if (key == "--max-staleness") {
+            replica_max_staleness = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--user-streams") {
+            user_streams = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--disk-threads") {
+            disk_threads = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else if (key == "--disk-depth") {
+            disk_depth = std::strtoull(value.c_str(), nullptr, 10);
         }
         else {
-            close(new_socket_fd);
+            std::cerr << "Opção não reconhecida: " << option << "\n";
+            std::exit(1);
+        }
+    }
+
+    if (!replica_of.empty() && server_workers > 1) {
+        std::cerr << "Uma réplica roda em um único processo\n";
+        std::exit(1);
+    }
+
+    // Cada worker tem sua própria cache e seu próprio escalonador
+    file_cache.configure(cache_bytes / server_workers, cache_max_file_bytes);
+    io_scheduler.configure(bandwidth / server_workers, user_streams, std::max<size_t>(disk_depth, 1));
+    disk_pool.configure(disk_threads, disk_depth);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * load_user_settings
+ * -----------------------------------------------------------------------------
+ * Lê o arquivo USER_SETTINGS_FILE do diretório do servidor, caso exista.
+ *
+ * Cada linha tem o user_id seguido de configurações no formato chave=valor.
+ * Linhas vazias ou começadas por '#' são ignoradas.  Exemplo:
+ *
+ *      alice max_devices=4 rate_limit=1048576 versions=20 storage=pack
+ *
+ * Configurações omitidas usam os valores padrão do servidor.
+ * -----------------------------------------------------------------------------
+ */
+void load_user_settings() {
+    std::ifstream file((server_dir / fs::path(USER_SETTINGS_FILE)).string());
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream tokens(line);
+        std::string user_id;
+        if (!(tokens >> user_id) || user_id[0] == '#') {
+            continue;
+        }
+
+        UserSettings settings = default_settings;
+        std::string setting;
+        while (tokens >> setting) {
+            size_t equals = setting.find('=');
+            std::string key = setting.substr(0, equals);
+            std::string value = equals == std::string::npos ? "" : setting.substr(equals + 1);
+
+            if (key == "max_devices") {
+                settings.max_devices = std::strtoull(value.c_str(), nullptr, 10);
+            }
+            else if (key == "rate_limit") {
+                settings.rate_limit = std::strtoull(value.c_str(), nullptr, 10);
+            }
+            else if (key == "versions") {
+                settings.versions = std::strtoull(value.c_str(), nullptr, 10);
+            }
+            else if (key == "storage" && (value == "files" || value == "pack")) {
+                settings.storage = value == "pack" ? PackStorage : FileStorage;
+            }
+            else {
+                std::cerr << "Configuração desconhecida para " << user_id << ": " << setting << "\n";
+            }
+        }
+        user_settings[user_id] = settings;
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * load_sync_rules
+ * -----------------------------------------------------------------------------
+ * Lê o arquivo SYNC_RULES_FILE do diretório do servidor, caso exista.
+ *
+ * Cada linha tem o user_id e o nome do dispositivo, seguidos das regras no
+ * formato chave=valor (ver SyncRules).  Linhas vazias ou começadas por '#'
+ * são ignoradas.  Exemplo:
+ *
+ *      alice notebook include=*.txt,*.md exclude=~* max_size=10485760
+ *      alice celular extensions=jpg,png
+ *
+ * Dispositivos sem regras recebem todos os arquivos.
+ * -----------------------------------------------------------------------------
+ */
+void load_sync_rules() {
+    std::ifstream file((server_dir / fs::path(SYNC_RULES_FILE)).string());
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream tokens(line);
+        std::string user_id;
+        std::string device;
+        if (!(tokens >> user_id) || user_id[0] == '#' || !(tokens >> device)) {
+            continue;
         }
 
+        auto rules = std::make_shared<SyncRules>();
+        std::string setting;
+        while (tokens >> setting) {
+            size_t equals = setting.find('=');
+            std::string key = setting.substr(0, equals);
+            std::string value = equals == std::string::npos ? "" : setting.substr(equals + 1);
+
+            if (!rules->set(key, value)) {
+                std::cerr << "Regra desconhecida para " << user_id << " (" << device << "): " << setting << "\n";
+            }
+        }
+        sync_rules[std::make_pair(user_id, device)] = rules;
     }
-    close(socket_fd);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * settings_for
+ * -----------------------------------------------------------------------------
+ * Retorna as configurações do usuário, ou as configurações padrão caso ele
+ * não esteja no USER_SETTINGS_FILE.
+ * -----------------------------------------------------------------------------
+ */
+UserSettings settings_for(const std::string &user_id) {
+    auto it = user_settings.find(user_id);
+    return it != user_settings.end() ? it->second : default_settings;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * apply_user_settings
+ * -----------------------------------------------------------------------------
+ * Aplica as configurações do usuário a um cliente recém criado.
+ * -----------------------------------------------------------------------------
+ */
+void apply_user_settings(Client *client) {
+    UserSettings settings = settings_for(client->user_id);
+    client->devices.set_max_devices(settings.max_devices);
 }
 
 
@@ -120,8 +604,10 @@ int main(int argc, char **argv) {
  *
  * Recebe um novo socket e lê o user_id da nova conexão.
  *
- * Tenta fazer a conexão e em caso de sucesso fica manda o socket para a função
- * que escuta pelos comandos do usuário
+ * Tenta fazer a conexão e em caso de sucesso envia ao cliente o identificador
+ * da sessão e manda o socket para a função que escuta pelos comandos do
+ * usuário.  O identificador é usado pelo cliente para abrir o canal de
+ * sincronização.
  *
  * No caso da conexão ser mal sucedida, envia a informação para o cliente e
  * encerra a thread.
@@ -134,20 +620,100 @@ void run_normal_thread(int client_socket_fd) {
 
     std::cout << user_id << " está tentando se conectar\n";
 
+    // Uma réplica atrasada recusa a conexão, e o cliente usa o primário
+    if (replica_stale()) {
+        send_bool(client_socket_fd, false);
+        close_socket(client_socket_fd);
+        return;
+    }
+
     // Tenta conectar
-    bool is_connected = false;
-    is_connected = connect_client(user_id, client_socket_fd);
+    uint64_t session_id = connect_client(user_id, client_socket_fd);
+    bool is_connected = session_id != 0;
     write_socket(client_socket_fd, (const void *) &is_connected, sizeof(is_connected));
 
     // Se a conexão for bem sucedida, rodar função que espera pelos comandos
     if (is_connected) {
         std::cout << user_id << " se conectou ao servidor\n";
 
-        run_user_interface(user_id, client_socket_fd);
+        write_socket(client_socket_fd, (const void *) &session_id, sizeof(session_id));
+
+        run_user_interface(user_id, client_socket_fd, session_id);
+        return;
+    }
+
+    // Se a conexão for mal sucedida, a recusa é enviada e o socket fechado
+    close_socket(client_socket_fd);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * run_sync_connection_thread
+ * -----------------------------------------------------------------------------
+ * Atende o canal de sincronização de um dispositivo.
+ *
+ * O cliente envia o user_id e o identificador da sessão recebido na conexão
+ * normal.  O canal é inscrito para receber os repasses de uploads feitos por
+ * outros dispositivos do mesmo usuário, e a thread fica escrevendo as
+ * mensagens repassadas até que a sessão termine ou o socket falhe.
+ * -----------------------------------------------------------------------------
+ */
+void run_sync_connection_thread(int client_socket_fd) {
+    std::string user_id = receive_string(client_socket_fd);
+
+    uint64_t session_id = 0;
+    read_socket(client_socket_fd, (void *) &session_id, sizeof(session_id));
+
+    Client *client = clients.find(user_id);
+
+    // A sessão precisa ser de um dispositivo conectado deste usuário
+    auto subscriber = std::make_shared<RelaySubscriber>(client_socket_fd);
+    bool ok = client != nullptr && client->devices.attach_subscriber(session_id, subscriber);
+
+    send_bool(client_socket_fd, ok);
+    if (!ok) {
+        close_socket(client_socket_fd);
+        return;
     }
+    flush_socket(client_socket_fd);
+
+    std::cout << user_id << " abriu o canal de sincronização da sessão " << session_id << "\n";
+
+    subscriber->run();
+
+    client->devices.detach_subscriber(session_id, subscriber);
+    close_socket(client_socket_fd);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * run_worker_connection_thread
+ * -----------------------------------------------------------------------------
+ * Atende uma conexão extra de um dispositivo, usada pelos workers de
+ * transferência do cliente.
+ *
+ * O cliente envia o user_id e o identificador da sessão.  A conexão não conta
+ * no limite de dispositivos: ela pertence à sessão, e os comandos recebidos
+ * por ela são atendidos como se viessem da conexão normal.  Encerrar a
+ * conexão não encerra a sessão.
+ * -----------------------------------------------------------------------------
+ */
+void run_worker_connection_thread(int client_socket_fd) {
+    std::string user_id = receive_string(client_socket_fd);
+
+    uint64_t session_id = 0;
+    read_socket(client_socket_fd, (void *) &session_id, sizeof(session_id));
 
-    // Se a conexão for mal sucedida, retorna;
-    return;
+    Client *client = clients.find(user_id);
+    bool ok = client != nullptr && client->devices.contains(session_id);
+
+    send_bool(client_socket_fd, ok);
+    if (ok) {
+        run_user_interface(user_id, client_socket_fd, session_id, false);
+    }
+    close_socket(client_socket_fd);
 }
 
 
@@ -159,11 +725,13 @@ void run_normal_thread(int client_socket_fd) {
  *
  * O diretório local onde o servidor está sendo executado é percorrido em busca
  * de subdiretórios.  Cada subdiretório é considerado como sendo um cliente, e
- * seus arquivos, os arquivos do cliente.
+ * seus arquivos, os arquivos do cliente.  Arquivos temporários de uploads
+ * interrompidos, começados por "~", são apagados.  O diretório VERSIONS_DIR
+ * com as versões anteriores é ignorado, e os arquivos guardados nos
+ * packfiles são lidos do índice do PackStore.
  *
- * A variável "clients" é uma global do tipo "std::map<std::string, Client*>",
- * ou seja, é um dicionário de chaves do tipo "strings" e valores do tipo
- * ponteiro de "Client".
+ * A variável "clients" é uma global do tipo "ClientRegistry", um dicionário
+ * concorrente de user_id para ponteiro de "Client".
  * ----------------------------------------------------------------------------
  */
 void initialize_clients() {
@@ -171,25 +739,30 @@ void initialize_clients() {
     fs::directory_iterator dir_iter(server_dir);
 
     while (dir_iter != end_iter) {
-        if (fs::is_directory(dir_iter->path())) {
-            std::string user_id(fs::basename(dir_iter->path().string()));
+        std::string user_id(fs::basename(dir_iter->path().string()));
+
+        // Os usuários de outros workers são carregados por eles
+        if (fs::is_directory(dir_iter->path()) && owns_user(user_id)) {
 
-            clients[user_id] = new Client(user_id);
+            auto *client = new Client(user_id);
+            apply_user_settings(client);
+            clients.insert(client);
 
             fs::directory_iterator client_dir_iter(dir_iter->path());
 
             while (client_dir_iter != end_iter) {
-                if (fs::is_regular_file(client_dir_iter->path())) {
-                    FileInfo file_info;
-                    fs::path filepath(client_dir_iter->path());
-                    file_info.set_filename(filepath.filename().string());
-                    file_info.set_extension(fs::extension(filepath));
-                    file_info.set_last_modified(fs::last_write_time(filepath));
-                    file_info.set_bytes(fs::file_size(filepath));
-                    clients[user_id]->files.push_back(file_info);
+                fs::path filepath(client_dir_iter->path());
+
+                // Sobras de uploads interrompidos por uma queda do servidor.
+                // O diretório de versões também começa com "~", mas não é um
+                // arquivo comum.
+                if (filepath.filename().string().compare(0, 1, "~") == 0 && fs::is_regular_file(filepath)) {
+                    fs::remove(filepath);
                 }
                 ++client_dir_iter;
             }
+
+            index_user_files(client);
         }
         ++dir_iter;
     }
@@ -198,83 +771,207 @@ void initialize_clients() {
 
 /*
  * ----------------------------------------------------------------------------
- * connect_client
+ * index_user_files
  * ----------------------------------------------------------------------------
- * Conecta o novo cliente, se já não houver outros 2 dispositivos desse
- * mesmo cliente conectados.
- *
- * Essa função só permite uma thread de cada vez, pois manipula uma variável
- * global.
- *
- * Retorna um booleano indicando o sucesso da conexão.
+ * Acrescenta ao vetor de FileInfo do cliente os arquivos do seu diretório e
+ * dos seus packfiles que ainda não estão nele.  Os arquivos ignorados pelo
+ * SYNC_IGNORE_FILE do usuário são descartados pelo nome, sem stat.
  * ----------------------------------------------------------------------------
  */
-bool connect_client(std::string user_id, int client_socket_fd) {
-    // Trava a função para apenas uma thread de cada vez.
-    std::lock_guard<std::mutex> lock(connection_mutex);
+void index_user_files(Client *client) {
+    std::shared_ptr<const IgnoreMatcher> ignore = ignore_matcher(client->user_id);
+
+    std::set<std::string> indexed;
+    for (FileInfo &info : client->files) {
+        indexed.insert(info.filename());
+    }
 
-    bool ok = false;
+    list_stored_files(client->user_id, *ignore, indexed, client->files);
+}
 
-    create_user_dir(user_id);
-    auto it = clients.find(user_id);
 
-    if (it == clients.end()) {
-        clients[user_id] = new Client(user_id);
-        clients[user_id]->is_logged = true;
-        ok = true;
+/*
+ * ----------------------------------------------------------------------------
+ * list_stored_files
+ * ----------------------------------------------------------------------------
+ * Acrescenta a "files" os arquivos do diretório e dos packfiles do usuário,
+ * menos os que estão em "skip" e os ignorados por "ignore".
+ * ----------------------------------------------------------------------------
+ */
+void list_stored_files(const std::string &user_id, const IgnoreMatcher &ignore, const std::set<std::string> &skip,
+                       std::vector<FileInfo> &files) {
+    fs::directory_iterator end_iter;
+    fs::directory_iterator client_dir_iter(server_dir / fs::path(user_id));
+
+    while (client_dir_iter != end_iter) {
+        fs::path filepath(client_dir_iter->path());
+        std::string filename = filepath.filename().string();
+
+        if (!ignore.ignored(filename) && skip.count(filename) == 0 && fs::is_regular_file(filepath)) {
+            FileInfo file_info;
+            file_info.set_filename(filename);
+            file_info.set_extension(fs::extension(filepath));
+            file_info.set_last_modified(fs::last_write_time(filepath));
+            file_info.set_bytes(fs::file_size(filepath));
+            files.push_back(file_info);
+        }
+        ++client_dir_iter;
     }
-    else {
-        for (int &device : it->second->connected_devices) {
-            if (device == EMPTY_DEVICE) {
-                it->second->is_logged = true;
-                device = client_socket_fd;
-                ok = true;
-                break;
+
+    PackStore *pack = pack_store(user_id);
+    if (pack != nullptr) {
+        for (auto &entry : pack->entries()) {
+            if (ignore.ignored(entry.first) || skip.count(entry.first) > 0) {
+                continue;
             }
+
+            FileInfo file_info;
+            file_info.set_filename(entry.first);
+            file_info.set_extension(fs::path(entry.first).extension().string());
+            file_info.set_last_modified(entry.second.last_modified);
+            file_info.set_bytes(entry.second.length);
+            file_info.set_hash(entry.second.hash);
+            files.push_back(file_info);
         }
     }
-    return ok;
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * disconnect_client
+ * ignore_matcher
  * ----------------------------------------------------------------------------
- * Encerra a conexão do cliente e fecha seu socket.
- *
- * Essa função só permite uma thread de cada vez, pois manipula uma variável
- * global.
+ * Retorna os padrões do SYNC_IGNORE_FILE do usuário, compilando-os no
+ * primeiro uso.  O arquivo é sincronizado como qualquer outro, e pode estar
+ * nos packfiles.
  * ----------------------------------------------------------------------------
  */
-void disconnect_client(std::string user_id, int client_socket_fd) {
-    std::lock_guard<std::mutex> lock(connection_mutex);
+std::shared_ptr<const IgnoreMatcher> ignore_matcher(const std::string &user_id) {
+    {
+        std::lock_guard<std::mutex> lock(ignore_matchers_mutex);
+        auto it = ignore_matchers.find(user_id);
+        if (it != ignore_matchers.end()) {
+            return it->second;
+        }
+    }
+
+    auto matcher = std::make_shared<IgnoreMatcher>();
+    PackStore *pack = pack_store(user_id);
+    std::vector<char> bytes;
+    if (pack != nullptr && pack->find(SYNC_IGNORE_FILE, nullptr) && pack->read(SYNC_IGNORE_FILE, bytes)) {
+        matcher->add_patterns(std::string(bytes.begin(), bytes.end()));
+    }
+    else {
+        matcher->load(server_dir / fs::path(user_id) / fs::path(SYNC_IGNORE_FILE));
+    }
+
+    std::lock_guard<std::mutex> lock(ignore_matchers_mutex);
+    ignore_matchers[user_id] = matcher;
+    return matcher;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * reload_ignore_matcher
+ * ----------------------------------------------------------------------------
+ * Recompila os padrões depois que o SYNC_IGNORE_FILE do usuário mudou.  Os
+ * arquivos que deixaram de ser ignorados voltam para o vetor de FileInfo.
+ * Deve ser chamada com o usuário travado.
+ * ----------------------------------------------------------------------------
+ */
+void reload_ignore_matcher(const std::string &user_id) {
+    {
+        std::lock_guard<std::mutex> lock(ignore_matchers_mutex);
+        ignore_matchers.erase(user_id);
+    }
+
+    Client *client = clients.find(user_id);
+    if (client != nullptr) {
+        index_user_files(client);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * connect_client
+ * ----------------------------------------------------------------------------
+ * Conecta o novo cliente, se ele ainda não tiver atingido seu limite de
+ * dispositivos conectados.
+ *
+ * Nenhuma trava global é usada: a busca no registro de clientes não trava, a
+ * criação de um cliente novo trava apenas uma partição do registro e o
+ * registro do dispositivo usa a trava do próprio cliente.
+ *
+ * Retorna o identificador da sessão do dispositivo, ou 0 caso a conexão seja
+ * recusada.
+ * ----------------------------------------------------------------------------
+ */
+uint64_t connect_client(std::string user_id, int client_socket_fd) {
+    Client *client = find_or_create_client(user_id);
+
+    uint64_t session_id = client->devices.register_device(client_socket_fd);
+    if (session_id == 0) {
+        std::cout << user_id << " já tem " << client->devices.max_devices()
+                  << " dispositivos conectados\n";
+    }
+    return session_id;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * find_or_create_client
+ * ----------------------------------------------------------------------------
+ * Retorna o cliente do usuário, criando-o, e ao seu diretório, se ele ainda
+ * não existir.
+ * ----------------------------------------------------------------------------
+ */
+Client *find_or_create_client(const std::string &user_id) {
+    Client *client = clients.find(user_id);
+
+    if (client == nullptr) {
+        create_user_dir(user_id);
+
+        // Se outro dispositivo do mesmo usuário inserir o cliente antes, o
+        // cliente dele é usado e o nosso descartado.
+        auto *new_client = new Client(user_id);
+        apply_user_settings(new_client);
+        client = clients.insert(new_client);
+        if (client != new_client) {
+            delete new_client;
+        }
+    }
+    return client;
+}
 
-    auto it = clients.find(user_id);
 
-    if (it == clients.end()) {
+/*
+ * ----------------------------------------------------------------------------
+ * disconnect_client
+ * ----------------------------------------------------------------------------
+ * Encerra a conexão do cliente e fecha seu socket.  O canal de sincronização
+ * da sessão também é encerrado.
+ * ----------------------------------------------------------------------------
+ */
+void disconnect_client(std::string user_id, int client_socket_fd, uint64_t session_id) {
+    Client *client = clients.find(user_id);
+
+    if (client == nullptr) {
         std::cerr << "Usuário " << user_id << " não encontrado para desconectar\n";
         return;
     }
-    else {
-        std::cout << "Desconectando " << user_id << "\n";
 
-        if (it->second->connected_devices[0] == EMPTY_DEVICE) {
-            it->second->connected_devices[1] = EMPTY_DEVICE;
-            it->second->is_logged = false;
-        }
-        else if (it->second->connected_devices[1] == EMPTY_DEVICE) {
-            it->second->connected_devices[0] = EMPTY_DEVICE;
-            it->second->is_logged = false;
-        }
-        else if (it->second->connected_devices[0] == client_socket_fd) {
-            it->second->connected_devices[0] = EMPTY_DEVICE;
-        }
-        else {
-            it->second->connected_devices[1] = EMPTY_DEVICE;
-        }
-        close(client_socket_fd);
+    std::cout << "Desconectando " << user_id << "\n";
+
+    std::shared_ptr<RelaySubscriber> subscriber;
+    client->devices.unregister_device(session_id, &subscriber);
+    if (subscriber) {
+        subscriber->close();
     }
+
+    close_socket(client_socket_fd);
 }
 
 
@@ -314,16 +1011,46 @@ void create_user_dir(std::string user_id) {
  *
  * Ao fim da execução do comando, o mutex é destravado, e outra thread (com o
  * mesmo user_id) pode executar o próximo comando.
+ *
+ * Se "owns_session" for falso, a conexão é de um worker, e o comando Exit
+ * apenas encerra a conexão, sem desconectar o dispositivo.
+ *
+ * Numa réplica, um comando de escrita, ou qualquer comando quando a réplica
+ * está atrasada, encerra a sessão.  O cliente refaz o comando no primário.
+ *
+ * As transferências em pedaços começadas pela conexão são descartadas quando
+ * ela termina, antes do socket ser fechado.
  * -----------------------------------------------------------------------------
  */
-void run_user_interface(const std::string user_id, int client_socket_fd) {
+void run_user_interface(const std::string user_id, int client_socket_fd, uint64_t session_id, bool owns_session) {
+    uint64_t connection_id = next_connection_id++;
     Command command = Exit;
 
     do {
-        read_socket(client_socket_fd, (void *) &command, sizeof(command));
+        // Se o dispositivo caiu, tratamos como se ele tivesse saído
+        if (!read_socket(client_socket_fd, (void *) &command, sizeof(command))) {
+            command = Exit;
+        }
 
-        // uma vez recebido o comando, devemos travar o usuário
-        lock_user(user_id);
+        if (!replica_of.empty() && command != Exit) {
+            if (command == Upload || command == Delete || command == Move || command == ChunkedUpload ||
+                command == UploadChunk) {
+                std::cerr << "A réplica não aceita escritas de " << user_id << "\n";
+                command = Exit;
+            }
+            else if (replica_stale()) {
+                std::cerr << "Réplica atrasada, encerrando a sessão de " << user_id << "\n";
+                command = Exit;
+            }
+        }
+
+        // uma vez recebido o comando, devemos travar o usuário.  Os pedaços de
+        // uma transferência em pedaços não travam, para que as conexões da
+        // sessão os transfiram ao mesmo tempo.
+        bool locks_user = command != UploadChunk && command != DownloadChunk;
+        if (locks_user) {
+            lock_user(user_id);
+        }
 
         std::string filename{};
 
@@ -333,13 +1060,30 @@ void run_user_interface(const std::string user_id, int client_socket_fd) {
             filename = receive_string(client_socket_fd);
 
             //std::cout << "Arquivo a ser rebido: " << filename << "\n";
-            receive_file(user_id, filename, client_socket_fd);
+            receive_file(user_id, filename, client_socket_fd, session_id);
             break;
 
-        case Download:
+        case Download: {
             //std::cout << "Download Requested\n";
             filename = receive_string(client_socket_fd);
-            send_file(user_id, filename, client_socket_fd);
+
+            // 0 para a versão atual, ou o número de uma versão anterior
+            uint64_t version = 0;
+            read_socket(client_socket_fd, (void *) &version, sizeof(version));
+            send_file(user_id, filename, client_socket_fd, version);
+            break;
+        }
+
+        case DownloadRanges:
+            filename = receive_string(client_socket_fd);
+            // Um pedido inválido encerra a sessão, pois o resto dele não foi lido
+            if (!send_file_ranges(user_id, filename, client_socket_fd)) {
+                drop_chunked_transfers(connection_id);
+                if (owns_session) {
+                    disconnect_client(user_id, client_socket_fd, session_id);
+                }
+                command = Exit;
+            }
             break;
 
         case Delete:
@@ -348,14 +1092,62 @@ void run_user_interface(const std::string user_id, int client_socket_fd) {
             delete_file(user_id, filename, client_socket_fd);
             break;
 
+        case Move: {
+            filename = receive_string(client_socket_fd);
+            std::string target = receive_string(client_socket_fd);
+            move_file(user_id, filename, target, client_socket_fd, session_id);
+            break;
+        }
+
+        case ChunkedUpload:
+            filename = receive_string(client_socket_fd);
+            begin_chunked_upload(user_id, filename, client_socket_fd, connection_id);
+            break;
+
+        case ChunkedDownload:
+            filename = receive_string(client_socket_fd);
+            begin_chunked_download(user_id, filename, client_socket_fd, connection_id);
+            break;
+
+        case UploadChunk:
+            receive_chunk(user_id, client_socket_fd);
+            break;
+
+        case DownloadChunk:
+            send_chunk(user_id, client_socket_fd);
+            break;
+
+        case ChunkedCommit:
+            commit_chunked(user_id, client_socket_fd, session_id);
+            break;
+
         case ListServer:
             //std::cout << "ListServer Requested\n";
-            send_file_infos(user_id, client_socket_fd);
+            send_file_infos(user_id, client_socket_fd, session_id);
+            break;
+
+        case ListStored:
+            send_stored_infos(user_id, client_socket_fd);
+            break;
+
+        case ListVersions:
+            filename = receive_string(client_socket_fd);
+            send_file_versions(user_id, filename, client_socket_fd);
+            break;
+
+        case SetDevice:
+            set_device(user_id, receive_string(client_socket_fd), session_id);
             break;
 
         case Exit:
             //std::cout << "Exit Requested\n";
-            disconnect_client(user_id, client_socket_fd);
+
+            // As transferências em pedaços começadas por esta conexão não
+            // serão mais confirmadas
+            drop_chunked_transfers(connection_id);
+            if (owns_session) {
+                disconnect_client(user_id, client_socket_fd, session_id);
+            }
             break;
 
         default:
@@ -363,7 +1155,14 @@ void run_user_interface(const std::string user_id, int client_socket_fd) {
             break;
         }
 
-        unlock_user(user_id);
+        // A resposta do comando sai inteira de uma vez
+        if (command != Exit) {
+            flush_socket(client_socket_fd);
+        }
+
+        if (locks_user) {
+            unlock_user(user_id);
+        }
     }
     while (command != Exit);
 }
@@ -376,21 +1175,36 @@ void run_user_interface(const std::string user_id, int client_socket_fd) {
  * Recebe um arquivo do usuário.
  *
  * Uma vez que o nome do arquivo foi fornecido, essa função recebe o tamanho do
- * arquivo em bytes e a data de modificação.  Caso o arquivo não exista no
- * servidor ou seja mais recente, uma notificação para enviar o arquivo será
- * enviada ao cliente.  Depois a função tentará abrir o arquivo.  O sucesso ou
- * não da abertura do arquivo é informado ao cliente.  Em caso de sucesso na
- * hora de abrir o arquivo ele será recebido do cliente.
+ * arquivo em bytes, a data de modificação e o hash do conteúdo.  Caso o
+ * arquivo não exista no servidor ou seja mais recente, uma notificação para
+ * enviar o arquivo será enviada ao cliente.  Depois a função tentará abrir o
+ * arquivo.  O sucesso ou não da abertura do arquivo é informado ao cliente.
+ * Em caso de sucesso na hora de abrir o arquivo ele será recebido do cliente.
+ *
+ * Se o conteúdo do arquivo no servidor tiver o mesmo hash, os bytes não são
+ * transferidos: apenas a data de modificação é atualizada.
+ *
+ * Arquivos pequenos o suficiente para a cache são copiados para ela enquanto
+ * são recebidos, de modo que o próximo download não precise ler o disco.
+ *
+ * Os bytes recebidos também são repassados, enquanto chegam, aos canais de
+ * sincronização dos outros dispositivos do usuário.  Assim eles recebem o
+ * arquivo ao mesmo tempo que o servidor, sem precisar baixá-lo depois.
+ *
+ * O conteúdo substituído é guardado como uma versão anterior do arquivo.
+ *
+ * Para usuários com armazenamento PackStorage, os arquivos pequenos são
+ * recebidos na memória e acrescentados aos packfiles.
  * -----------------------------------------------------------------------------
  */
-void receive_file(std::string user_id, std::string filename, int client_socket_fd) {
+void receive_file(std::string user_id, std::string filename, int client_socket_fd, uint64_t session_id) {
 
     fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
 
     //std::cout << "O caminho absoluto até o arquivo no servidor é " << absolute_path.string() << "\n";
 
     // Vamos ler o tamanho do arquivo!
-    size_t file_size;
+    uint64_t file_size;
     read_socket(client_socket_fd, (void *) &file_size, sizeof(file_size));
 
     std::cout << "Tamanho do arquivo recebido: " << file_size << " bytes\n";
@@ -399,18 +1213,37 @@ void receive_file(std::string user_id, std::string filename, int client_socket_f
     time_t time;
     read_socket(client_socket_fd, (void *) &time, sizeof(time));
 
-    // Temos que ver se o arquivo existe e se é mais antigo e se devemos recebê-lo.
-    bool should_download = !(fs::exists(absolute_path) && (fs::last_write_time(absolute_path) >= time));
+    // Recebendo o hash do conteúdo
+    ContentHash hash;
+    read_socket(client_socket_fd, (void *) &hash, sizeof(hash));
+
+    bool should_download = upload_wanted(user_id, filename, file_size, time, hash);
     send_bool(client_socket_fd, should_download);
 
     if (!should_download) {
         return;
     }
 
-    // Vamos tentar abrir o arquivo
-    FILE *file = fopen(absolute_path.c_str(), "wb");
-    if (file == nullptr) {
-        std::cerr << "Arquivo " << absolute_path << " não pode ser aberto\n";
+    PackStore *pack = pack_store(user_id);
+    bool packed = pack != nullptr && pack->find(filename, nullptr);
+
+    // Os bytes são escritos num arquivo temporário, que só substitui o arquivo
+    // atual quando o upload termina.  Um upload interrompido ou cancelado pelo
+    // cliente não deixa um arquivo pela metade.  Arquivos que vão para os
+    // packfiles são recebidos na memória.
+    fs::path temp_path = absolute_path.parent_path() / fs::path("~" + filename + ".part");
+    bool to_pack = pack != nullptr && settings_for(user_id).storage == PackStorage &&
+                   file_size <= pack_max_file_bytes;
+
+    // Vamos tentar abrir o arquivo.  As operações no disco passam pelo
+    // DiskPool, que limita quantas acontecem ao mesmo tempo em cada dispositivo.
+    dev_t device = DiskPool::device_of(absolute_path.parent_path());
+    FILE *file = nullptr;
+    if (!to_pack) {
+        disk_pool.run(device, [&] { file = fopen(temp_path.c_str(), "wb"); });
+    }
+    if (!to_pack && file == nullptr) {
+        std::cerr << "Arquivo " << temp_path << " não pode ser aberto\n";
         send_bool(client_socket_fd, false);
         return;
     }
@@ -419,22 +1252,202 @@ void receive_file(std::string user_id, std::string filename, int client_socket_f
     // Vamos receber os bytes do arquivo.
     std::cout << "Preparando para receber os bytes do arquivo\n";
 
-    // TODO: Receber o arquivo
-    read_file(client_socket_fd, file, file_size);
-    fclose(file);
+    // A versão anterior do arquivo não é mais válida
+    file_cache.invalidate(user_id, filename);
 
-    std::cout << "Arquivo " << absolute_path.string() << " recebido\n";
+    std::shared_ptr<std::vector<char>> bytes;
+    if (file_cache.accepts(file_size)) {
+        bytes = std::make_shared<std::vector<char>>(file_size);
+    }
+
+    // Os outros dispositivos do usuário recebem o arquivo enquanto ele chega
+    uint64_t transfer_id = next_transfer_id++;
+    std::vector<std::shared_ptr<RelaySubscriber>> relay = relay_targets(user_id, session_id, filename, file_size);
+    for (auto &subscriber : relay) {
+        subscriber->begin(transfer_id, filename, file_size, time);
+    }
+
+    // O hash é calculado sobre os bytes recebidos, e não sobre o valor
+    // informado pelo cliente.  Os buracos do arquivo entram no hash como zeros.
+    ContentHasher hasher;
+    uint64_t hashed_bytes = 0;
+    ChunkCallback on_chunk = [&](uint64_t offset, const char *chunk, size_t size) {
+        hasher.update_zeros(offset - hashed_bytes);
+        hasher.update(chunk, size);
+        hashed_bytes = offset + size;
+
+        if (bytes) {
+            std::copy(chunk, chunk + size, bytes->begin() + offset);
+        }
+        for (auto &subscriber : relay) {
+            subscriber->data(transfer_id, offset, chunk, size);
+        }
+    };
+
+    // Cada bloco recebido, e cada escrita no disco, passa pelo escalonador,
+    // para que um upload grande não tome a banda dos outros usuários.
+    ScheduledTransfer gate(io_scheduler, user_id, file_size, settings_for(user_id).rate_limit);
+    ScheduledDisk disk_gate(io_scheduler, user_id, device, file_size);
+
+    // Arquivos grandes são escritos em blocos grandes, com espaço reservado e
+    // sem ficar no page cache.  Os outros são escritos pelo DiskPool enquanto
+    // os blocos seguintes chegam.
+    bool received;
+    BufferSink memory(to_pack ? file_size : 0);
+    if (to_pack) {
+        received = read_file(client_socket_fd, memory, file_size, on_chunk, &gate);
+    }
+    else if (ingest_threshold > 0 && file_size >= ingest_threshold) {
+        IngestWriter writer(fileno(file), &disk_gate);
+        received = read_file(client_socket_fd, writer, file_size, on_chunk, &gate);
+    }
+    else {
+        PooledWriter writer(disk_pool, fileno(file), &disk_gate);
+        received = read_file(client_socket_fd, writer, file_size, on_chunk, &gate);
+    }
+    if (file != nullptr) {
+        disk_pool.run(device, [&] { fclose(file); });
+    }
+
+    if (!received) {
+        std::cerr << "Upload de " << absolute_path.string() << " interrompido\n";
+        if (!to_pack) {
+            disk_pool.run(device, [&] { fs::remove(temp_path); });
+        }
+        for (auto &subscriber : relay) {
+            subscriber->abort(transfer_id);
+        }
+        return;
+    }
+
+    hasher.update_zeros(file_size - hashed_bytes);
+    ContentHash hash_received = hasher.digest();
+
+    preserve_version(user_id, filename);
+
+    if (to_pack) {
+        pack->put(filename, memory.bytes().data(), file_size, time, hash_received);
+
+        // O arquivo pode ter sido um arquivo comum antes
+        boost::system::error_code error;
+        fs::remove(absolute_path, error);
+    }
+    else {
+        // escreve a data de modificação do arquivo
+        disk_pool.run(device, [&] {
+            fs::last_write_time(temp_path, time);
+            fs::rename(temp_path, absolute_path);
+        });
+
+        // O arquivo pode ter estado nos packfiles antes
+        if (packed) {
+            pack->remove(filename);
+        }
+    }
+
+    if (bytes) {
+        file_cache.put(user_id, filename, time, bytes);
+    }
 
-    // escreve a data de modificação do arquivo
-    fs::last_write_time(absolute_path, time);
+    std::cout << "Arquivo " << absolute_path.string() << " recebido\n";
 
     // Atualiza lista de arquivos do usuário
-    update_files(user_id, filename, file_size, time);
+    update_files(user_id, filename, file_size, time, hash_received);
+    replicate_change(ReplicatedUpload, user_id, filename);
 
+    for (auto &subscriber : relay) {
+        subscriber->commit(transfer_id, filename, hash_received);
+    }
 }
 // }}}
 
 
+/*
+ * -----------------------------------------------------------------------------
+ * upload_wanted
+ * -----------------------------------------------------------------------------
+ * Decide se os bytes de um arquivo enviado pelo usuário devem ser recebidos.
+ * Arquivos ignorados pelo SYNC_IGNORE_FILE do usuário e arquivos que não são
+ * mais recentes que os do servidor não são recebidos.
+ *
+ * Se o conteúdo do arquivo no servidor tiver o mesmo hash, apenas a data de
+ * modificação é atualizada.  Um arquivo cujo hash ainda não foi calculado não
+ * é lido aqui, com o usuário travado: o hash é pedido ao "run_hash_thread",
+ * e a decisão fica só com a data de modificação.
+ * -----------------------------------------------------------------------------
+ */
+bool upload_wanted(const std::string &user_id, const std::string &filename, uint64_t file_size, time_t time,
+                   const ContentHash &hash) {
+    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
+
+    if (ignore_matcher(user_id)->ignored(filename)) {
+        return false;
+    }
+
+    PackStore *pack = pack_store(user_id);
+    PackEntry packed_entry{};
+    bool packed = pack != nullptr && pack->find(filename, &packed_entry);
+
+    bool exists = packed || fs::exists(absolute_path);
+    time_t stored_time = !exists ? 0 : packed ? packed_entry.last_modified : fs::last_write_time(absolute_path);
+
+    // Se o conteúdo é o mesmo, só precisamos atualizar a data de modificação.
+    if (exists && hash.valid()) {
+        Client *client = clients.find(user_id);
+        FileInfo *info = client != nullptr ? find_file_info(client, filename) : nullptr;
+
+        if (info != nullptr && !info->hash().valid()) {
+            queue_hash(user_id, filename);
+        }
+        else if (info != nullptr && info->bytes() == file_size && info->hash() == hash) {
+            if (stored_time < time) {
+                if (packed) {
+                    pack->touch(filename, time);
+                }
+                else {
+                    fs::last_write_time(absolute_path, time);
+                }
+                file_cache.invalidate(user_id, filename);
+                update_files(user_id, filename, file_size, time, hash);
+                replicate_change(ReplicatedUpload, user_id, filename);
+                std::cout << "Arquivo " << absolute_path.string() << " não mudou, data atualizada\n";
+            }
+            return false;
+        }
+    }
+
+    // Temos que ver se o arquivo existe e se é mais antigo e se devemos recebê-lo.
+    return !(exists && stored_time >= time);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * stored_file_time
+ * -----------------------------------------------------------------------------
+ * Escreve em "time" a data de modificação do arquivo do usuário no servidor,
+ * nos packfiles ou no disco.  Retorna falso se o arquivo não existe.
+ * -----------------------------------------------------------------------------
+ */
+bool stored_file_time(const std::string &user_id, const std::string &filename, time_t *time) {
+    PackStore *pack = pack_store(user_id);
+    PackEntry packed_entry{};
+    if (pack != nullptr && pack->find(filename, &packed_entry)) {
+        *time = packed_entry.last_modified;
+        return true;
+    }
+
+    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
+    boost::system::error_code error;
+    time_t disk_time = fs::last_write_time(absolute_path, error);
+    if (error) {
+        return false;
+    }
+    *time = disk_time;
+    return true;
+}
+
+
 /*
  * -----------------------------------------------------------------------------
  * send_file
@@ -445,24 +1458,33 @@ void receive_file(std::string user_id, std::string filename, int client_socket_f
  * o arquivo para escrita localmente.  Em caso afirmativo, o arquivo é enviado
  * ao cliente.  Por fim, a função envia a data de modificação para o cliente,
  * a fim de manter o arquivo sincronizado.
+ *
+ * Se "version" não for 0, é enviada a versão anterior com esse número.
  * -----------------------------------------------------------------------------
  */
-void send_file(std::string user_id, std::string filename, int client_socket_fd) {
-
-    // Determina o caminho absoluto do arquivo no servidor
-    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
-
-    FILE *file;
-    bool file_ok;
+void send_file(std::string user_id, std::string filename, int client_socket_fd, uint64_t version) {
+    StoredFile stored{};
+    bool file_ok = open_stored_file(user_id, filename, version, stored);
+    send_stored_file(user_id, filename, client_socket_fd, stored, file_ok, version == 0);
+}
 
-    // Se o arquivo existir, tenta abri-lo
-    if ((file_ok = fs::exists(absolute_path)) == true) {
-        file = fopen(absolute_path.c_str(), "rb");
 
-        if (file == nullptr) {
-            file_ok = false;
-        }
-    }
+/*
+ * -----------------------------------------------------------------------------
+ * send_stored_file
+ * -----------------------------------------------------------------------------
+ * Envia um arquivo já aberto por "open_stored_file", no protocolo de
+ * "send_file", e fecha o arquivo.  Só a versão atual ("cacheable") entra na
+ * cache.  Retorna falso se a conexão falhou ou o arquivo não foi entregue.
+ * -----------------------------------------------------------------------------
+ */
+bool send_stored_file(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                      StoredFile &stored, bool file_ok, bool cacheable) {
+    FileBytes &bytes = stored.bytes;
+    FILE *file = stored.file;
+    dev_t device = stored.device;
+    uint64_t file_size = stored.size;
+    time_t timestamp = stored.timestamp;
 
     // Indica ao usuário se o arquivo existe ou se foi possível abri-lo
     send_bool(client_socket_fd, file_ok);
@@ -472,198 +1494,1726 @@ void send_file(std::string user_id, std::string filename, int client_socket_fd)
     }
     else {
         std::cout << "Arquivo não ok\n";
-        return;
+        return true;
+    }
+
+    if (!bytes && cacheable && file_cache.accepts(file_size)) {
+        // Se o arquivo couber na cache, ele é lido inteiro para a memória e
+        // guardado para os próximos downloads.
+        auto buffer = std::make_shared<std::vector<char>>(file_size);
+        bool read_ok = false;
+        disk_pool.run(device, [&] {
+            read_ok = fread(buffer->data(), sizeof(char), file_size, file) == file_size;
+        });
+        if (read_ok) {
+            file_cache.put(user_id, filename, timestamp, buffer);
+            bytes = buffer;
+        }
     }
 
     // Caso o arquivo esteja ok, envia o tamanho do arquivo
-    size_t file_size = fs::file_size(absolute_path);
     write_socket(client_socket_fd, (const void *) &file_size, sizeof(file_size));
 
     // Recebe a confirmação que o cliente conseguiu criar o arquivo localmente,
     // e está esperando os bytes.
     bool ok = read_bool(client_socket_fd);
+    bool sent = false;
 
     if (ok) {
+        ScheduledTransfer gate(io_scheduler, user_id, file_size, settings_for(user_id).rate_limit);
+
         // Envia os bytes do arquivo ao cliente
-        send_file(client_socket_fd, file, file_size);
+        if (bytes) {
+            sent = send_buffer(client_socket_fd, bytes->data(), bytes->size(), &gate);
+        }
+        else {
+            // Os blocos seguintes são lidos enquanto cada bloco é enviado
+            ScheduledDisk disk_gate(io_scheduler, user_id, device, file_size);
+            PooledReader reader(disk_pool, fileno(file), &disk_gate);
+            sent = send_file(client_socket_fd, reader, file_size, &gate);
+        }
+    }
+    if (file != nullptr) {
+        disk_pool.run(device, [&] { fclose(file); });
+        stored.file = nullptr;
     }
-    fclose(file);
 
     // Envia ao cliente a data de modificação do arquivo, para que ele possa
     // modificar sua cópia local com a data correta.
-    //
-    time_t timestamp = fs::last_write_time(absolute_path);
     std::cout << "Last write time a ser enviado: " << timestamp << "\n";
-    // Envia a data de modificação
-    write_socket(client_socket_fd, (const void *) &timestamp, sizeof(timestamp));
+    bool written = write_socket(client_socket_fd, (const void *) &timestamp, sizeof(timestamp));
     std::cout << "Data de criação enviada\n";
-
+    return sent && written;
 }
 
 
 /*
  * -----------------------------------------------------------------------------
- * delete_file
+ * open_stored_file
  * -----------------------------------------------------------------------------
- * Exclui no servidor o arquivo cujo nome foi passado pelo usuário.  Se o
- * arquivo for excluído, o vetor de FileInfo do usuário é atualizado para
- * remover o arquivo. Se o arquivo não existir, não faz nada.
+ * Encontra o conteúdo de um arquivo do usuário para ser enviado.
+ *
+ * Primeiro tentamos a cache.  A versão esperada vem do FileInfo em memória,
+ * então um acerto na cache não precisa nem consultar o sistema de arquivos.
+ * Depois os packfiles, cujo arquivo lido também vai para a cache.  Por fim o
+ * arquivo é aberto no disco pelo DiskPool, e quem chamou deve fechá-lo.
+ *
+ * As versões anteriores ("version" diferente de 0) não passam pela cache nem
+ * pelos packfiles.  Retorna falso se o arquivo não existe ou não pôde ser
+ * aberto.
  * -----------------------------------------------------------------------------
  */
-void delete_file(std::string user_id, std::string filename, int client_socket_fd) {
+bool open_stored_file(const std::string &user_id, const std::string &filename, uint64_t version,
+                      StoredFile &stored) {
 
-    auto it = clients.find(user_id);
-    if (it == clients.end()) {
-        return;
+    // Determina o caminho absoluto do arquivo no servidor
+    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
+    if (version != 0) {
+        absolute_path = VersionStore(absolute_path.parent_path()).path(filename, version);
     }
 
-    fs::path user_dir(user_id);
-    fs::path file_path(filename);
-    fs::path full_path = server_dir / user_dir / file_path;
-
-    bool deleted = fs::remove(full_path);
-    if (deleted) {
-        std::cout << "Arquivo " << full_path << " removido do servidor\n";
-
-        bool found = false;
-        int counter = 0;
+    stored.file = nullptr;
+    stored.device = DiskPool::device_of(absolute_path.parent_path());
 
-        for (FileInfo &info : it->second->files) {
-            if (info.filename() == filename) {
-                //std::cout << filename << " Encontrado nos filenames\n";
-                found = true;
-                break;
-            }
-            ++counter;
-        }
-        if (found) {
-            it->second->files.erase(it->second->files.begin() + counter);
+    Client *client = version == 0 ? clients.find(user_id) : nullptr;
+    if (client != nullptr) {
+        FileInfo *info = find_file_info(client, filename);
+        if (info != nullptr) {
+            stored.timestamp = info->last_modified();
+            stored.bytes = file_cache.get(user_id, filename, stored.timestamp);
         }
+    }
 
+    PackStore *pack = version == 0 ? pack_store(user_id) : nullptr;
+    PackEntry entry{};
+    if (!stored.bytes && pack != nullptr && pack->find(filename, &entry)) {
+        auto buffer = std::make_shared<std::vector<char>>();
+        if (pack->read(filename, *buffer)) {
+            stored.timestamp = entry.last_modified;
+            file_cache.put(user_id, filename, stored.timestamp, buffer);
+            stored.bytes = buffer;
+        }
     }
-    else {
-        std::cout << "Arquivo " << full_path << " não existe\n";
+
+    if (stored.bytes) {
+        stored.size = stored.bytes->size();
+        return true;
     }
 
+    disk_pool.run(stored.device, [&] {
+        if (fs::exists(absolute_path) && (stored.file = fopen(absolute_path.c_str(), "rb")) != nullptr) {
+            stored.size = fs::file_size(absolute_path);
+            stored.timestamp = fs::last_write_time(absolute_path);
+        }
+    });
+    return stored.file != nullptr;
 }
 
 
 /*
- * ----------------------------------------------------------------------------
- * update_files
- * ----------------------------------------------------------------------------
- * Atualiza o vetor de FileInfo do client com novas informações, ou insere um
- * novo FileInfo, caso o registro ainda não exista.
- * ----------------------------------------------------------------------------
+ * -----------------------------------------------------------------------------
+ * send_file_ranges
+ * -----------------------------------------------------------------------------
+ * Envia apenas alguns trechos da versão atual de um arquivo.
+ *
+ * Depois do nome do arquivo, a função recebe a quantidade de trechos e os
+ * trechos (ByteRange).  Se o arquivo existir, ela envia o tamanho e a data de
+ * modificação do arquivo e espera a confirmação do cliente.  Então os
+ * trechos são enviados como um arquivo esparso do tamanho original, em que
+ * só os trechos pedidos têm dados (ver RangeSource).  O cliente, que conhece
+ * o tamanho, resolve os mesmos trechos para saber onde está cada byte.
+ *
+ * Retorna falso se o pedido for inválido, e a sessão deve ser encerrada.
+ * -----------------------------------------------------------------------------
  */
-void update_files(std::string user_id,
-                  std::string filename,
-                  size_t file_size,
-                  time_t timestamp) {
-
-    auto it = clients.find(user_id);
+bool send_file_ranges(std::string user_id, std::string filename, int client_socket_fd) {
+    uint32_t count = 0;
+    if (!read_socket(client_socket_fd, (void *) &count, sizeof(count)) || count > MAX_DOWNLOAD_RANGES) {
+        std::cerr << "Pedido de trechos inválido de " << user_id << "\n";
+        return false;
+    }
 
-    // Verifica se o cliente existe no dicionário
-    if (it == clients.end()) {
-        std::cerr << "Erro ao atualizar os arquivos do cliente, cliente "
-                  << user_id << " não encontrado.\n";
-        return;
+    std::vector<ByteRange> ranges(count);
+    if (count > 0 && !read_socket(client_socket_fd, (void *) ranges.data(), count * sizeof(ByteRange))) {
+        return false;
     }
 
-    Client *client = it->second;
+    StoredFile stored{};
+    bool file_ok = open_stored_file(user_id, filename, 0, stored);
 
-    // Procura o FileInfo a ser atualizado
-    FileInfo *file = nullptr;
+    send_bool(client_socket_fd, file_ok);
+    if (!file_ok) {
+        return true;
+    }
+
+    write_socket(client_socket_fd, (const void *) &stored.size, sizeof(stored.size));
+    write_socket(client_socket_fd, (const void *) &stored.timestamp, sizeof(stored.timestamp));
+
+    if (read_bool(client_socket_fd)) {
+        std::vector<ByteRange> merged = merge_ranges(resolve_ranges(ranges, stored.size));
+        ScheduledTransfer gate(io_scheduler, user_id, total_length(merged), settings_for(user_id).rate_limit);
+        ScheduledDisk disk_gate(io_scheduler, user_id, stored.device, total_length(merged));
+
+        std::unique_ptr<FileSource> source;
+        if (stored.bytes) {
+            source.reset(new BufferSource(stored.bytes->data(), stored.size));
+        }
+        else {
+            source.reset(new PooledReader(disk_pool, fileno(stored.file), &disk_gate));
+        }
+        RangeSource range_source(*source, merged);
+        send_file(client_socket_fd, range_source, stored.size, &gate);
+
+        std::cout << "Enviados " << total_length(merged) << " de " << stored.size << " bytes de " << filename
+                  << "\n";
+    }
+
+    if (stored.file != nullptr) {
+        disk_pool.run(stored.device, [&] { fclose(stored.file); });
+    }
+    return true;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * delete_file
+ * -----------------------------------------------------------------------------
+ * Exclui no servidor o arquivo cujo nome foi passado pelo usuário.  Se o
+ * arquivo for excluído, o vetor de FileInfo do usuário é atualizado para
+ * remover o arquivo. Se o arquivo não existir, não faz nada.
+ *
+ * O conteúdo excluído é guardado como uma versão anterior do arquivo.
+ * -----------------------------------------------------------------------------
+ */
+void delete_file(std::string user_id, std::string filename, int client_socket_fd) {
+
+    Client *client = clients.find(user_id);
+    if (client == nullptr) {
+        return;
+    }
+
+    fs::path user_dir(user_id);
+    fs::path file_path(filename);
+    fs::path full_path = server_dir / user_dir / file_path;
+
+    file_cache.invalidate(user_id, filename);
+
+    PackStore *pack = pack_store(user_id);
+    bool packed = pack != nullptr && pack->find(filename, nullptr);
+
+    bool deleted = packed || fs::is_regular_file(full_path);
+    if (deleted) {
+        preserve_version(user_id, filename);
+        if (packed) {
+            pack->remove(filename);
+        }
+        else {
+            disk_pool.run(DiskPool::device_of(full_path), [&] { fs::remove(full_path); });
+        }
+
+        std::cout << "Arquivo " << full_path << " removido do servidor\n";
+
+        bool found = false;
+        int counter = 0;
+
+        for (FileInfo &info : client->files) {
+            if (info.filename() == filename) {
+                //std::cout << filename << " Encontrado nos filenames\n";
+                found = true;
+                break;
+            }
+            ++counter;
+        }
+        if (found) {
+            client->files.erase(client->files.begin() + counter);
+        }
+
+        if (filename == SYNC_IGNORE_FILE) {
+            reload_ignore_matcher(user_id);
+        }
+
+        replicate_change(ReplicatedDelete, user_id, filename);
+
+    }
+    else {
+        std::cout << "Arquivo " << full_path << " não existe\n";
+    }
+
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * move_file
+ * -----------------------------------------------------------------------------
+ * Renomeia um arquivo do usuário no servidor, sem transferir seu conteúdo.
+ *
+ * O cliente envia o tamanho e a data de modificação do arquivo renomeado.  A
+ * mudança só é aplicada se eles forem os do arquivo "from" no servidor, pois
+ * um upload anterior do arquivo pode não ter chegado.  O cliente recebe se o
+ * arquivo foi renomeado; se não foi, ele apaga "from" e envia o arquivo com
+ * um Upload normal.
+ *
+ * Um arquivo comum é renomeado com rename(), e um dos packfiles é copiado
+ * para o novo nome, pois é pequeno.  O conteúdo substituído em "to" é
+ * guardado como uma versão anterior.  Os outros dispositivos recebem um
+ * RelayMoved, e as réplicas um delete e um upload.
+ * -----------------------------------------------------------------------------
+ */
+void move_file(const std::string &user_id, const std::string &from, const std::string &to, int client_socket_fd,
+               uint64_t session_id) {
+    uint64_t file_size = 0;
+    read_socket(client_socket_fd, (void *) &file_size, sizeof(file_size));
+
+    time_t time = 0;
+    read_socket(client_socket_fd, (void *) &time, sizeof(time));
+
+    Client *client = clients.find(user_id);
+    FileInfo *info = client != nullptr ? find_file_info(client, from) : nullptr;
+
+    if (info == nullptr || to.empty() || to == from || info->bytes() != file_size ||
+        info->last_modified() != time || ignore_matcher(user_id)->ignored(to)) {
+        send_bool(client_socket_fd, false);
+        return;
+    }
+
+    fs::path user_dir = server_dir / fs::path(user_id);
+    fs::path from_path = user_dir / fs::path(from);
+    fs::path to_path = user_dir / fs::path(to);
+
+    PackStore *pack = pack_store(user_id);
+    PackEntry entry{};
+    bool packed = pack != nullptr && pack->find(from, &entry);
+    bool target_packed = pack != nullptr && pack->find(to, nullptr);
+
+    if (target_packed || fs::is_regular_file(to_path)) {
+        preserve_version(user_id, to);
+    }
+
+    bool moved;
+    if (packed) {
+        std::vector<char> bytes;
+        moved = pack->read(from, bytes) && pack->put(to, bytes.data(), bytes.size(), entry.last_modified, entry.hash);
+        if (moved) {
+            pack->remove(from);
+
+            // O destino pode ter sido um arquivo comum antes
+            boost::system::error_code error;
+            fs::remove(to_path, error);
+        }
+    }
+    else {
+        boost::system::error_code error;
+        disk_pool.run(DiskPool::device_of(user_dir), [&] { fs::rename(from_path, to_path, error); });
+        moved = !error;
+
+        // O destino pode ter estado nos packfiles antes
+        if (moved && target_packed) {
+            pack->remove(to);
+        }
+    }
+
+    if (!moved) {
+        std::cerr << "Arquivo " << from_path << " não pode ser renomeado para " << to_path << "\n";
+        send_bool(client_socket_fd, false);
+        return;
+    }
+
+    file_cache.invalidate(user_id, from);
+    file_cache.invalidate(user_id, to);
+
+    // O registro do arquivo passa a ter o novo nome.  O registro antigo do
+    // destino é removido antes, pois apagá-lo move os outros registros.
+    for (auto it = client->files.begin(); it != client->files.end(); ++it) {
+        if (it->filename() == to) {
+            client->files.erase(it);
+            break;
+        }
+    }
+    info = find_file_info(client, from);
+    info->set_filename(to);
+    info->set_extension(fs::path(to).extension().string());
+
+    if (from == SYNC_IGNORE_FILE || to == SYNC_IGNORE_FILE) {
+        reload_ignore_matcher(user_id);
+    }
+
+    std::cout << "Arquivo " << from_path << " renomeado para " << to_path << "\n";
+    send_bool(client_socket_fd, true);
+
+    replicate_change(ReplicatedDelete, user_id, from);
+    replicate_change(ReplicatedUpload, user_id, to);
+
+    for (auto &subscriber : relay_targets(user_id, session_id, to, file_size)) {
+        subscriber->moved(from, to);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * ChunkedTransfer
+ * -----------------------------------------------------------------------------
+ * O arquivo é fechado, e o temporário de um upload não confirmado apagado,
+ * quando a última conexão deixa de usar a transferência.
+ * -----------------------------------------------------------------------------
+ */
+ChunkedTransfer::ChunkedTransfer(uint64_t file_size, uint64_t chunk_size) : chunks(file_size, chunk_size) {
+    upload = false;
+    stored.file = nullptr;
+    stored.size = file_size;
+    owner_connection = 0;
+    last_used = ::time(nullptr);
+}
+
+
+ChunkedTransfer::~ChunkedTransfer() {
+    if (stored.file != nullptr) {
+        fclose(stored.file);
+    }
+    if (!temp_path.empty()) {
+        boost::system::error_code error;
+        fs::remove(temp_path, error);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * begin_chunked_upload
+ * -----------------------------------------------------------------------------
+ * Começa o upload de um arquivo grande em pedaços.  Recebe o tamanho, a data
+ * de modificação e o hash, como "receive_file", e responde se os bytes devem
+ * ser enviados e se o arquivo temporário foi criado.  Em caso afirmativo,
+ * envia o identificador da transferência e o tamanho dos pedaços.
+ *
+ * O arquivo temporário já é criado com o tamanho final, e cada pedaço é
+ * escrito na sua posição pelo UploadChunk que o trouxer.
+ * -----------------------------------------------------------------------------
+ */
+void begin_chunked_upload(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                          uint64_t connection_id) {
+    uint64_t file_size = 0;
+    read_socket(client_socket_fd, (void *) &file_size, sizeof(file_size));
+
+    time_t time = 0;
+    read_socket(client_socket_fd, (void *) &time, sizeof(time));
+
+    ContentHash hash;
+    read_socket(client_socket_fd, (void *) &hash, sizeof(hash));
+
+    bool wanted = upload_wanted(user_id, filename, file_size, time, hash);
+    send_bool(client_socket_fd, wanted);
+    if (!wanted) {
+        return;
+    }
+
+    auto transfer = std::make_shared<ChunkedTransfer>(file_size, CHUNK_SIZE);
+    transfer->user_id = user_id;
+    transfer->filename = filename;
+    transfer->upload = true;
+    transfer->owner_connection = connection_id;
+    transfer->stored.timestamp = time;
+
+    uint64_t id = next_transfer_id++;
+    fs::path user_dir = server_dir / fs::path(user_id);
+    transfer->stored.device = DiskPool::device_of(user_dir);
+
+    fs::path temp_path = user_dir / fs::path("~" + filename + "." + std::to_string(id) + ".chunks");
+    disk_pool.run(transfer->stored.device, [&] {
+        FILE *file = fopen(temp_path.c_str(), "wb");
+        if (file != nullptr && ftruncate(fileno(file), (off_t) file_size) != 0) {
+            fclose(file);
+            fs::remove(temp_path);
+            file = nullptr;
+        }
+        transfer->stored.file = file;
+    });
+
+    if (transfer->stored.file == nullptr) {
+        std::cerr << "Arquivo " << temp_path << " não pode ser criado\n";
+        send_bool(client_socket_fd, false);
+        return;
+    }
+    transfer->temp_path = temp_path;
+
+    {
+        std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+        chunked_transfers[id] = transfer;
+    }
+
+    send_bool(client_socket_fd, true);
+
+    uint64_t chunk_size = CHUNK_SIZE;
+    write_socket(client_socket_fd, (const void *) &id, sizeof(id));
+    write_socket(client_socket_fd, (const void *) &chunk_size, sizeof(chunk_size));
+
+    std::cout << "Upload em " << transfer->chunks.count() << " pedaços de " << filename << " iniciado\n";
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * begin_chunked_download
+ * -----------------------------------------------------------------------------
+ * Começa o download de um arquivo grande em pedaços.  Responde se o arquivo
+ * existe e, em caso afirmativo, envia o identificador da transferência, o
+ * tamanho, a data de modificação e o tamanho dos pedaços.
+ *
+ * O arquivo fica aberto até o ChunkedCommit, e todos os pedaços são lidos
+ * dele, mesmo que o arquivo seja substituído durante o download.
+ * -----------------------------------------------------------------------------
+ */
+void begin_chunked_download(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                            uint64_t connection_id) {
+    StoredFile stored{};
+    bool file_ok = open_stored_file(user_id, filename, 0, stored);
+
+    send_bool(client_socket_fd, file_ok);
+    if (!file_ok) {
+        return;
+    }
+
+    // O tamanho que o cliente conhecia pode estar desatualizado, e um arquivo
+    // que ficou pequeno vai num único pedaço
+    uint64_t chunk_size = stored.size < CHUNKED_TRANSFER_THRESHOLD ? std::max<uint64_t>(stored.size, 1) : CHUNK_SIZE;
+
+    auto transfer = std::make_shared<ChunkedTransfer>(stored.size, chunk_size);
+    transfer->user_id = user_id;
+    transfer->filename = filename;
+    transfer->owner_connection = connection_id;
+    transfer->stored = stored;
+
+    uint64_t id = next_transfer_id++;
+    {
+        std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+        chunked_transfers[id] = transfer;
+    }
+
+    write_socket(client_socket_fd, (const void *) &id, sizeof(id));
+    write_socket(client_socket_fd, (const void *) &stored.size, sizeof(stored.size));
+    write_socket(client_socket_fd, (const void *) &stored.timestamp, sizeof(stored.timestamp));
+    write_socket(client_socket_fd, (const void *) &chunk_size, sizeof(chunk_size));
+
+    std::cout << "Download em " << transfer->chunks.count() << " pedaços de " << filename << " iniciado\n";
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * find_chunked_transfer
+ * -----------------------------------------------------------------------------
+ * Retorna a transferência em pedaços com esse identificador, se ela for do
+ * usuário, ou nullptr.
+ * -----------------------------------------------------------------------------
+ */
+std::shared_ptr<ChunkedTransfer> find_chunked_transfer(const std::string &user_id, uint64_t id) {
+    std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+    auto it = chunked_transfers.find(id);
+    if (it == chunked_transfers.end() || it->second->user_id != user_id) {
+        return nullptr;
+    }
+    it->second->last_used = time(nullptr);
+    return it->second;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * expire_chunked_transfers
+ * -----------------------------------------------------------------------------
+ * Descarta as transferências em pedaços sem nenhum byte transferido há mais
+ * de CHUNKED_IDLE_TIMEOUT segundos, cujo cliente sumiu antes do ChunkedCommit
+ * sem que a conexão fosse encerrada.
+ * -----------------------------------------------------------------------------
+ */
+void expire_chunked_transfers() {
+    time_t now = time(nullptr);
+
+    std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+    for (auto it = chunked_transfers.begin(); it != chunked_transfers.end();) {
+        if (it->second->last_used + CHUNKED_IDLE_TIMEOUT < now) {
+            std::cout << "Transferência em pedaços de " << it->second->filename << " abandonada\n";
+            it = chunked_transfers.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * drop_chunked_transfers
+ * -----------------------------------------------------------------------------
+ * Descarta as transferências em pedaços começadas pela conexão
+ * "connection_id", que terminou antes do ChunkedCommit.  Um pedaço ainda em andamento numa
+ * outra conexão termina normalmente, e o arquivo é liberado em seguida.
+ * -----------------------------------------------------------------------------
+ */
+void drop_chunked_transfers(uint64_t connection_id) {
+    std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+    for (auto it = chunked_transfers.begin(); it != chunked_transfers.end();) {
+        if (it->second->owner_connection == connection_id) {
+            std::cout << "Transferência em pedaços de " << it->second->filename << " interrompida\n";
+            it = chunked_transfers.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * run_chunked_expiry_thread
+ * -----------------------------------------------------------------------------
+ * De tempos em tempos, descarta as transferências em pedaços abandonadas.
+ * -----------------------------------------------------------------------------
+ */
+void run_chunked_expiry_thread() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(CHUNKED_EXPIRE_INTERVAL));
+        expire_chunked_transfers();
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * receive_chunk
+ * -----------------------------------------------------------------------------
+ * Recebe um pedaço de um upload em pedaços.  Lê o identificador da
+ * transferência e o índice do pedaço, e responde se o pedaço é aceito.  Em
+ * caso afirmativo, os bytes do pedaço são recebidos com "read_file" e
+ * escritos pelo DiskPool no arquivo temporário.
+ * -----------------------------------------------------------------------------
+ */
+void receive_chunk(const std::string &user_id, int client_socket_fd) {
+    uint64_t id = 0;
+    uint64_t index = 0;
+    read_socket(client_socket_fd, (void *) &id, sizeof(id));
+    read_socket(client_socket_fd, (void *) &index, sizeof(index));
+
+    std::shared_ptr<ChunkedTransfer> transfer = find_chunked_transfer(user_id, id);
+    bool accepted = transfer && transfer->upload && index < transfer->chunks.count();
+    send_bool(client_socket_fd, accepted);
+    if (!accepted) {
+        return;
+    }
+
+    ByteRange range = transfer->chunks.range(index);
+    ScheduledTransfer scheduled(io_scheduler, user_id, range.length, settings_for(user_id).rate_limit);
+    ChunkGate gate(scheduled, transfer->last_used);
+
+    ScheduledDisk disk_gate(io_scheduler, user_id, transfer->stored.device, range.length);
+    PooledWriter writer(disk_pool, fileno(transfer->stored.file), &disk_gate);
+    ChunkSink sink(writer, range);
+    if (read_file(client_socket_fd, sink, transfer->stored.size, nullptr, &gate)) {
+        transfer->chunks.done(index);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * send_chunk
+ * -----------------------------------------------------------------------------
+ * Envia um pedaço de um download em pedaços.  Lê o identificador da
+ * transferência e o índice do pedaço, e responde se o pedaço existe.  Em
+ * caso afirmativo, os bytes do pedaço são enviados com "send_file", nas suas
+ * posições do arquivo.
+ * -----------------------------------------------------------------------------
+ */
+void send_chunk(const std::string &user_id, int client_socket_fd) {
+    uint64_t id = 0;
+    uint64_t index = 0;
+    read_socket(client_socket_fd, (void *) &id, sizeof(id));
+    read_socket(client_socket_fd, (void *) &index, sizeof(index));
+
+    std::shared_ptr<ChunkedTransfer> transfer = find_chunked_transfer(user_id, id);
+    bool accepted = transfer && !transfer->upload && index < transfer->chunks.count();
+    send_bool(client_socket_fd, accepted);
+    if (!accepted) {
+        return;
+    }
+
+    ByteRange range = transfer->chunks.range(index);
+    ScheduledTransfer scheduled(io_scheduler, user_id, range.length, settings_for(user_id).rate_limit);
+    ChunkGate gate(scheduled, transfer->last_used);
+
+    bool sent;
+    if (transfer->stored.bytes) {
+        BufferSource buffer(transfer->stored.bytes->data(), transfer->stored.size);
+        RangeSource source(buffer, {range});
+        sent = send_file(client_socket_fd, source, transfer->stored.size, &gate);
+    }
+    else {
+        ScheduledDisk disk_gate(io_scheduler, user_id, transfer->stored.device, range.length);
+        PooledReader reader(disk_pool, fileno(transfer->stored.file), &disk_gate);
+        RangeSource source(reader, {range});
+        sent = send_file(client_socket_fd, source, transfer->stored.size, &gate);
+    }
+
+    if (sent) {
+        transfer->chunks.done(index);
+    }
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * commit_chunked
+ * -----------------------------------------------------------------------------
+ * Encerra uma transferência em pedaços, e responde se ela foi concluída.
+ *
+ * Um upload com todos os pedaços recebidos substitui o arquivo do usuário,
+ * como no final de "receive_file".  O hash do conteúdo fica para ser
+ * calculado quando for necessário, pois os pedaços chegam fora de ordem.  Os
+ * outros dispositivos recebem um RelayChanged e baixam o arquivo.  Um upload
+ * incompleto, ou mais antigo que o arquivo do servidor neste momento, é
+ * descartado, e o cliente o envia de novo.
+ * -----------------------------------------------------------------------------
+ */
+void commit_chunked(const std::string &user_id, int client_socket_fd, uint64_t session_id) {
+    uint64_t id = 0;
+    read_socket(client_socket_fd, (void *) &id, sizeof(id));
+
+    std::shared_ptr<ChunkedTransfer> transfer = find_chunked_transfer(user_id, id);
+    if (transfer) {
+        std::lock_guard<std::mutex> lock(chunked_transfers_mutex);
+        chunked_transfers.erase(id);
+    }
+
+    if (!transfer || !transfer->chunks.complete()) {
+        send_bool(client_socket_fd, false);
+        return;
+    }
+
+    if (!transfer->upload) {
+        send_bool(client_socket_fd, true);
+        return;
+    }
+
+    const std::string &filename = transfer->filename;
+    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
+    uint64_t file_size = transfer->stored.size;
+    time_t time = transfer->stored.timestamp;
+
+    // Enquanto os pedaços chegavam, sem o usuário travado, outro dispositivo
+    // pode ter enviado uma versão mais nova, ou o arquivo passou a ser
+    // ignorado.  Nesse caso o upload é descartado.
+    time_t stored_time = 0;
+    if (ignore_matcher(user_id)->ignored(filename) ||
+        (stored_file_time(user_id, filename, &stored_time) && stored_time >= time)) {
+        std::cout << "Upload em pedaços de " << absolute_path.string() << " descartado, o servidor tem um "
+                  << "arquivo mais recente\n";
+        send_bool(client_socket_fd, false);
+        return;
+    }
+
+    preserve_version(user_id, filename);
+
+    boost::system::error_code error;
+    disk_pool.run(transfer->stored.device, [&] {
+        fs::last_write_time(transfer->temp_path, time, error);
+        if (!error) {
+            fs::rename(transfer->temp_path, absolute_path, error);
+        }
+    });
+    if (error) {
+        std::cerr << "Arquivo " << absolute_path << " não pode ser substituído\n";
+        send_bool(client_socket_fd, false);
+        return;
+    }
+    transfer->temp_path.clear();
+
+    // O arquivo pode ter estado nos packfiles antes
+    PackStore *pack = pack_store(user_id);
+    if (pack != nullptr && pack->find(filename, nullptr)) {
+        pack->remove(filename);
+    }
+
+    file_cache.invalidate(user_id, filename);
+    update_files(user_id, filename, file_size, time, ContentHash{});
+    replicate_change(ReplicatedUpload, user_id, filename);
+
+    for (auto &subscriber : relay_targets(user_id, session_id, filename, file_size)) {
+        subscriber->changed(filename);
+    }
+
+    std::cout << "Arquivo " << absolute_path.string() << " recebido em " << transfer->chunks.count()
+              << " pedaços\n";
+    send_bool(client_socket_fd, true);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * update_files
+ * ----------------------------------------------------------------------------
+ * Atualiza o vetor de FileInfo do client com novas informações, ou insere um
+ * novo FileInfo, caso o registro ainda não exista.
+ *
+ * Um hash inválido indica que o hash deve ser recalculado a partir do disco
+ * quando for necessário.
+ * ----------------------------------------------------------------------------
+ */
+void update_files(std::string user_id,
+                  std::string filename,
+                  uint64_t file_size,
+                  time_t timestamp,
+                  const ContentHash &hash) {
+
+    Client *client = clients.find(user_id);
+
+    // Verifica se o cliente existe no dicionário
+    if (client == nullptr) {
+        std::cerr << "Erro ao atualizar os arquivos do cliente, cliente "
+                  << user_id << " não encontrado.\n";
+        return;
+    }
+
+    // Procura o FileInfo a ser atualizado
+    FileInfo *file = find_file_info(client, filename);
+
+    if (file != nullptr) {
+        // Se encontrar um registro, ele será atualizado
+        file->set_bytes(file_size);
+        file->set_last_modified(timestamp);
+        file->set_hash(hash);
+    }
+    else {
+        // Se não encontrar, cria um novo FileInfo e insere no vetor
+        FileInfo new_file{};
+        new_file.set_filename(filename);
+        new_file.set_extension(fs::path(filename).extension().string());
+        new_file.set_bytes(file_size);
+        new_file.set_last_modified(timestamp);
+        new_file.set_hash(hash);
+        client->files.push_back(new_file);
+    }
+
+    if (filename == SYNC_IGNORE_FILE) {
+        reload_ignore_matcher(user_id);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_file_infos
+ * ----------------------------------------------------------------------------
+ * Envia os registros de FileInfo do usuário para o cliente.  Os arquivos
+ * ignorados pelo SYNC_IGNORE_FILE do usuário e os recusados pelas regras de
+ * sincronização seletiva do dispositivo da sessão não são enviados.
+ *
+ * Primeiramente é enviado o tamanho do vetor, e depois cada um dos structs
+ * é enviado.
+ * ----------------------------------------------------------------------------
+ */
+void send_file_infos(std::string user_id, int client_socket_fd, uint64_t session_id) {
+    Client *client = clients.find(user_id);
+
+    // Testa se o cliente foi encontrado
+    if (client == nullptr) {
+        std::cerr << "Erro ao enviar a lista de file_infos, client " << user_id
+                  << " não encontrado\n";
+        return;
+    }
+
+    std::shared_ptr<const SyncRules> rules = client->devices.rules_for(session_id);
+    std::shared_ptr<const IgnoreMatcher> ignore = ignore_matcher(user_id);
+    std::vector<FileInfo *> files;
+    for (FileInfo &info : client->files) {
+        if (!ignore->ignored(info.filename()) && (!rules || rules->accepts(info))) {
+            files.push_back(&info);
+        }
+    }
+    size_t n = files.size();
+
+    // Os hashes que faltam são calculados em segundo plano, sem travar o
+    // usuário.  Até lá, o registro vai sem hash, e o dispositivo compara o
+    // arquivo pela data de modificação.
+    for (FileInfo *info : files) {
+        if (!info->hash().valid()) {
+            queue_hash(user_id, info->filename());
+        }
+    }
+
+    // Envia o tamanho da lista
+    write_socket(client_socket_fd, (const void *) &n, sizeof(n));
+
+    for (FileInfo *info : files) {
+        write_socket(client_socket_fd, (const void *) info, sizeof(*info));
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_stored_infos
+ * ----------------------------------------------------------------------------
+ * Envia os FileInfo de todos os arquivos guardados do usuário, inclusive os
+ * ignorados pelo SYNC_IGNORE_FILE, que não estão no vetor de FileInfo.  É
+ * usada pela migração do roteador, que precisa copiar tudo.  Os hashes que
+ * ainda não foram calculados não são enviados.
+ * ----------------------------------------------------------------------------
+ */
+void send_stored_infos(const std::string &user_id, int client_socket_fd) {
+    std::vector<FileInfo> files;
+    std::set<std::string> listed;
+
+    Client *client = clients.find(user_id);
+    if (client != nullptr) {
+        files = client->files;
+        for (const FileInfo &info : files) {
+            listed.insert(info.filename());
+        }
+    }
+
+    // Sem os padrões do usuário, só os arquivos temporários ficam de fora
+    IgnoreMatcher temporaries;
+    list_stored_files(user_id, temporaries, listed, files);
+
+    size_t n = files.size();
+    write_socket(client_socket_fd, (const void *) &n, sizeof(n));
+    for (const FileInfo &info : files) {
+        write_socket(client_socket_fd, (const void *) &info, sizeof(info));
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * preserve_version
+ * ----------------------------------------------------------------------------
+ * Guarda o conteúdo atual do arquivo como uma versão anterior, antes dele ser
+ * substituído ou apagado.  Um arquivo comum pode deixar de existir no
+ * diretório do usuário (ver VersionStore).  Os arquivos dos packfiles são
+ * pequenos, e são copiados para o diretório de versões.
+ * ----------------------------------------------------------------------------
+ */
+void preserve_version(const std::string &user_id, const std::string &filename) {
+    VersionStore versions(server_dir / fs::path(user_id));
+    size_t retention = settings_for(user_id).versions;
+
+    PackStore *pack = pack_store(user_id);
+    PackEntry entry{};
+    if (pack != nullptr && pack->find(filename, &entry)) {
+        std::vector<char> bytes;
+        if (retention > 0 && pack->read(filename, bytes)) {
+            versions.store(filename, bytes.data(), bytes.size(), entry.last_modified, retention);
+        }
+    }
+    else {
+        versions.preserve(filename, retention);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * pack_store
+ * ----------------------------------------------------------------------------
+ * Retorna os packfiles do usuário, abrindo-os no primeiro uso.  Retorna
+ * nullptr se o usuário não usa armazenamento PackStorage e nunca usou.
+ * ----------------------------------------------------------------------------
+ */
+PackStore *pack_store(const std::string &user_id) {
+    std::lock_guard<std::mutex> lock(pack_stores_mutex);
+
+    auto it = pack_stores.find(user_id);
+    if (it != pack_stores.end()) {
+        return it->second.get();
+    }
+
+    fs::path user_dir = server_dir / fs::path(user_id);
+    std::unique_ptr<PackStore> store;
+
+    // Mesmo que o usuário tenha voltado para FileStorage, os arquivos que já
+    // estão nos packfiles continuam lá.
+    if (settings_for(user_id).storage == PackStorage || PackStore::exists(user_dir)) {
+        store.reset(new PackStore(user_dir));
+        if (!store->open()) {
+            std::cerr << "Erro ao abrir os packfiles de " << user_id << "\n";
+            store.reset();
+        }
+    }
+
+    PackStore *result = store.get();
+    pack_stores[user_id] = std::move(store);
+    return result;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * run_compaction_thread
+ * ----------------------------------------------------------------------------
+ * De tempos em tempos, compacta os packfiles que acumularam muitos bytes de
+ * arquivos apagados ou substituídos.  Cada usuário é travado durante a sua
+ * compactação.
+ * ----------------------------------------------------------------------------
+ */
+void run_compaction_thread() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(PACK_COMPACT_INTERVAL_SECONDS));
+
+        std::vector<std::pair<std::string, PackStore *>> stores;
+        {
+            std::lock_guard<std::mutex> lock(pack_stores_mutex);
+            for (auto &store : pack_stores) {
+                if (store.second) {
+                    stores.emplace_back(store.first, store.second.get());
+                }
+            }
+        }
+
+        for (auto &store : stores) {
+            lock_user(store.first);
+            if (store.second->needs_compaction()) {
+                store.second->compact();
+            }
+            unlock_user(store.first);
+        }
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_file_versions
+ * ----------------------------------------------------------------------------
+ * Envia as versões anteriores guardadas de um arquivo, da mais antiga para a
+ * mais recente.  Primeiro é enviada a quantidade, e depois cada FileVersion.
+ * ----------------------------------------------------------------------------
+ */
+void send_file_versions(std::string user_id, std::string filename, int client_socket_fd) {
+    VersionStore versions(server_dir / fs::path(user_id));
+    std::vector<FileVersion> list = versions.list(filename);
+
+    uint64_t n = list.size();
+    write_socket(client_socket_fd, (const void *) &n, sizeof(n));
+
+    for (const FileVersion &version : list) {
+        write_socket(client_socket_fd, (const void *) &version, sizeof(version));
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * lock_user
+ * ----------------------------------------------------------------------------
+ * Trava todas as outras threads de um mesmo usuário.
+ *
+ * A busca do cliente no registro não usa travas, e como clientes nunca são
+ * removidos, apenas o mutex do próprio usuário é travado.
+ * ----------------------------------------------------------------------------
+ */
+void lock_user(std::string user_id) {
+    Client *client = clients.find(user_id);
+    if (client != nullptr) {
+        client->user_mutex.lock();
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * unlock_user
+ * ----------------------------------------------------------------------------
+ * Destrava as threads do usuário.
+ * ----------------------------------------------------------------------------
+ */
+void unlock_user(std::string user_id) {
+    Client *client = clients.find(user_id);
+    if (client != nullptr) {
+        client->user_mutex.unlock();
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * find_file_info
+ * ----------------------------------------------------------------------------
+ * Procura o FileInfo de um arquivo do cliente.
+ *
+ * Retorna um ponteiro para o registro dentro do vetor "files" do cliente, ou
+ * nullptr caso o arquivo não seja conhecido.  O ponteiro só é válido enquanto
+ * o vetor não for alterado, ou seja, enquanto o usuário estiver travado.
+ * ----------------------------------------------------------------------------
+ */
+FileInfo *find_file_info(Client *client, const std::string &filename) {
     for (FileInfo &file_info : client->files) {
         if (file_info.filename() == filename) {
-            file = &file_info;
-            break;
+            return &file_info;
+        }
+    }
+    return nullptr;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * stored_file_hash
+ * ----------------------------------------------------------------------------
+ * Retorna o hash do conteúdo de um arquivo do usuário no servidor.
+ *
+ * Os hashes são calculados sob demanda: arquivos encontrados na inicialização
+ * do servidor só são lidos na primeira vez que seu hash for necessário.  O
+ * resultado é guardado no FileInfo.
+ * ----------------------------------------------------------------------------
+ */
+ContentHash stored_file_hash(const std::string &user_id, FileInfo *info) {
+    if (!info->hash().valid()) {
+        fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(info->filename());
+
+        FILE *file = fopen(absolute_path.c_str(), "rb");
+        if (file != nullptr) {
+            info->set_hash(hash_file(file));
+            fclose(file);
         }
     }
+    return info->hash();
+}
 
-    if (file != nullptr) {
-        // Se encontrar um registro, ele será atualizado
-        file->set_bytes(file_size);
-        file->set_last_modified(timestamp);
+
+/*
+ * ----------------------------------------------------------------------------
+ * hash_stored_content
+ * ----------------------------------------------------------------------------
+ * Calcula o hash de um conteúdo aberto por "open_stored_file", sem travar o
+ * usuário.  Um arquivo no disco é lido pelo DiskPool e volta para o início.
+ * ----------------------------------------------------------------------------
+ */
+ContentHash hash_stored_content(StoredFile &stored) {
+    ContentHash hash;
+    if (stored.bytes) {
+        ContentHasher hasher;
+        hasher.update(stored.bytes->data(), stored.bytes->size());
+        hash = hasher.digest();
     }
     else {
-        // Se não encontrar, cria um novo FileInfo e insere no vetor
-        FileInfo new_file{};
-        new_file.set_filename(filename);
-        new_file.set_extension(fs::path(filename).extension().string());
-        new_file.set_bytes(file_size);
-        new_file.set_last_modified(timestamp);
-        client->files.push_back(new_file);
+        disk_pool.run(stored.device, [&] {
+            hash = hash_file(stored.file);
+            rewind(stored.file);
+        });
     }
+    return hash;
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * send_file_infos
+ * keep_computed_hash
  * ----------------------------------------------------------------------------
- * Envia todos os registros de FileInfo do usuário para o cliente.
- *
- * Primeiramente é enviado o tamanho do vetor, e depois cada um dos structs
- * é enviado.
+ * Guarda no FileInfo atual o hash calculado sem o usuário travado, a partir
+ * da cópia "info".  O hash é descartado se o arquivo mudou nesse meio tempo.
  * ----------------------------------------------------------------------------
  */
-void send_file_infos(std::string user_id, int client_socket_fd) {
-    auto it = clients.find(user_id);
+void keep_computed_hash(const std::string &user_id, const FileInfo &info) {
+    lock_user(user_id);
+
+    Client *client = clients.find(user_id);
+    FileInfo *current = client != nullptr ? find_file_info(client, info.filename()) : nullptr;
+    if (current != nullptr && current->bytes() == info.bytes() &&
+        current->last_modified() == info.last_modified() && !current->hash().valid()) {
+        current->set_hash(info.hash());
+    }
 
-    // Testa se o cliente foi encontrado
-    if (it == clients.end()) {
-        std::cerr << "Erro ao enviar a lista de file_infos, client " << user_id
-                  << " não encontrado\n";
+    unlock_user(user_id);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * queue_hash
+ * ----------------------------------------------------------------------------
+ * Pede que o hash de um arquivo do usuário seja calculado em segundo plano
+ * pelo "run_hash_thread".
+ * ----------------------------------------------------------------------------
+ */
+void queue_hash(const std::string &user_id, const std::string &filename) {
+    std::lock_guard<std::mutex> lock(pending_hashes_mutex);
+    auto file = std::make_pair(user_id, filename);
+    if (queued_hashes.insert(file).second) {
+        pending_hashes.push_back(file);
+        pending_hashes_condition.notify_one();
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * run_hash_thread
+ * ----------------------------------------------------------------------------
+ * Calcula os hashes pedidos por "queue_hash".  Com o usuário travado, só o
+ * registro é copiado e o conteúdo aberto; a leitura do arquivo é feita sem
+ * travar o usuário.
+ * ----------------------------------------------------------------------------
+ */
+void run_hash_thread() {
+    while (true) {
+        std::pair<std::string, std::string> file;
+        {
+            std::unique_lock<std::mutex> lock(pending_hashes_mutex);
+            pending_hashes_condition.wait(lock, [] { return !pending_hashes.empty(); });
+            file = pending_hashes.front();
+            pending_hashes.pop_front();
+            queued_hashes.erase(file);
+        }
+
+        const std::string &user_id = file.first;
+        lock_user(user_id);
+
+        Client *client = clients.find(user_id);
+        FileInfo *current = client != nullptr ? find_file_info(client, file.second) : nullptr;
+
+        FileInfo info{};
+        StoredFile stored{};
+        bool file_ok = false;
+        if (current != nullptr && !current->hash().valid()) {
+            info = *current;
+            file_ok = open_stored_file(user_id, file.second, 0, stored);
+        }
+
+        unlock_user(user_id);
+
+        if (!file_ok) {
+            continue;
+        }
+
+        info.set_hash(hash_stored_content(stored));
+        if (stored.file != nullptr) {
+            disk_pool.run(stored.device, [&] { fclose(stored.file); });
+        }
+        keep_computed_hash(user_id, info);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * set_device
+ * ----------------------------------------------------------------------------
+ * Associa a sessão às regras de sincronização seletiva do dispositivo com
+ * esse nome, caso existam.  O cliente envia o nome logo depois de conectar.
+ * ----------------------------------------------------------------------------
+ */
+void set_device(const std::string &user_id, const std::string &device, uint64_t session_id) {
+    Client *client = clients.find(user_id);
+    if (client == nullptr) {
         return;
     }
 
-    Client *client = it->second;
-    size_t n = client->files.size();
+    auto it = sync_rules.find(std::make_pair(user_id, device));
+    client->devices.set_rules(session_id, it == sync_rules.end() ? nullptr : it->second);
 
-    // Envia o tamanho da lista
-    write_socket(client_socket_fd, (const void *) &n, sizeof(n));
+    if (it != sync_rules.end()) {
+        std::cout << "Sessão " << session_id << " de " << user_id << " usa as regras do dispositivo " << device
+                  << "\n";
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * relay_targets
+ * ----------------------------------------------------------------------------
+ * Retorna os canais de sincronização dos dispositivos do usuário, exceto o
+ * da sessão que está fazendo o upload e os dos dispositivos cujas regras de
+ * sincronização seletiva recusam o arquivo.
+ * ----------------------------------------------------------------------------
+ */
+std::vector<std::shared_ptr<RelaySubscriber>> relay_targets(const std::string &user_id, uint64_t session_id,
+                                                            const std::string &filename, uint64_t file_size) {
+    std::vector<std::shared_ptr<RelaySubscriber>> subscribers;
 
-    for (int i = 0; i < n; ++i) {
-        write_socket(client_socket_fd, (const void *) &client->files[i], sizeof(client->files[i]));
+    Client *client = clients.find(user_id);
+    if (client == nullptr) {
+        return subscribers;
     }
+
+    std::string extension = fs::path(filename).extension().string();
+    for (Device &device : client->devices.devices_except(session_id)) {
+        if (device.subscriber && (!device.rules || device.rules->accepts(filename, extension, file_size))) {
+            subscribers.push_back(device.subscriber);
+        }
+    }
+    return subscribers;
 }
 
 
 /*
  * ----------------------------------------------------------------------------
- * lock_user
+ * replicate_change
  * ----------------------------------------------------------------------------
- * Trava todas as outras threads de um mesmo usuário.
+ * Registra uma mudança confirmada no log lido pelas réplicas.  Deve ser
+ * chamada com o usuário travado, para que as mudanças de um mesmo usuário
+ * entrem no log na ordem em que aconteceram.  Numa réplica não faz nada.
+ * ----------------------------------------------------------------------------
+ */
+void replicate_change(ReplicationChange change, const std::string &user_id, const std::string &filename) {
+    if (replica_of.empty()) {
+        replication_log.append(change, user_id, filename);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * replica_stale
+ * ----------------------------------------------------------------------------
+ * Verifica se este servidor é uma réplica mais atrasada que o permitido para
+ * atender leituras.
+ * ----------------------------------------------------------------------------
+ */
+bool replica_stale() {
+    return !replica_of.empty() && replica_status.staleness_ms() > replica_max_staleness;
+}
+
+
+#pragma clang diagnostic push // Não precisamos de warnings para loops infinitos
+#pragma clang diagnostic ignored "-Wmissing-noreturn"
+/*
+ * ----------------------------------------------------------------------------
+ * run_replica_thread
+ * ----------------------------------------------------------------------------
+ * No modo réplica, mantém a conexão "stream" com o primário (uma por worker
+ * do primário) e aplica as mudanças recebidas por ela, na ordem.
  *
- * Como essa função altera uma variável local, ela também faz uso de um mutex,
- * para permitir apenas uma thread por vez de entrar na seção crítica.
+ * No handshake, a réplica envia a época e a última mudança que recebeu do
+ * primário.  Se o primário ainda tiver as mudanças seguintes, ele envia só
+ * elas; senão envia uma cópia completa dos arquivos, e os arquivos que não
+ * vieram nela são apagados da réplica.  Arquivos com o mesmo hash na réplica
+ * não são transferidos de novo.
+ *
+ * Se a conexão cair, a réplica tenta de novo a cada REPLICA_RETRY_MS, e
+ * continua atendendo leituras enquanto o atraso permitir.
  * ----------------------------------------------------------------------------
  */
-void lock_user(std::string user_id) {
-    std::lock_guard<std::mutex> lock(user_lock_mutex);
+void run_replica_thread(size_t stream) {
+    uint64_t epoch = 0;
+    uint64_t sequence = 0;
+
+    while (true) {
+        int socket_fd = connect_address(replica_of);
+        if (socket_fd == -1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RETRY_MS));
+            continue;
+        }
+        configure_socket(socket_fd);
+
+        ConnectionType type = Replica;
+        write_socket(socket_fd, (const void *) &type, sizeof(type));
+        send_string(socket_fd, std::to_string(stream));
+        write_socket(socket_fd, (const void *) &epoch, sizeof(epoch));
+        write_socket(socket_fd, (const void *) &sequence, sizeof(sequence));
+
+        bool ok = false;
+        uint64_t streams = 0;
+        uint64_t primary_epoch = 0;
+        if (!read_socket(socket_fd, (void *) &ok, sizeof(ok)) || !ok ||
+            !read_socket(socket_fd, (void *) &streams, sizeof(streams)) ||
+            !read_socket(socket_fd, (void *) &primary_epoch, sizeof(primary_epoch))) {
+            std::cerr << "O primário " << replica_of << " recusou a réplica\n";
+            close_socket(socket_fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RETRY_MS));
+            continue;
+        }
+
+        if (stream == 0) {
+            for (size_t i = std::max<size_t>(replica_status.set_streams(streams), 1); i < streams; ++i) {
+                std::thread thread(run_replica_thread, i);
+                thread.detach();
+            }
+        }
+
+        std::cout << "Réplica conectada ao primário " << replica_of << " (conexão " << stream << ")\n";
+
+        // Arquivos recebidos na cópia completa em andamento
+        std::set<std::pair<std::string, std::string>> snapshot_files;
+
+        ReplicationHeader header{};
+        while (read_socket(socket_fd, (void *) &header, sizeof(header))) {
+            auto current_as_of = std::chrono::steady_clock::now() - std::chrono::milliseconds(header.lag_ms);
+
+            if (header.change == ReplicatedUpload || header.change == ReplicatedDelete) {
+                std::string user_id = receive_string(socket_fd);
+                std::string filename = receive_string(socket_fd);
+                if (header.sequence == 0) {
+                    snapshot_files.emplace(user_id, filename);
+                }
+
+                find_or_create_client(user_id);
+                lock_user(user_id);
+                bool applied = true;
+                if (header.change == ReplicatedUpload) {
+                    applied = apply_replicated_upload(user_id, filename, socket_fd);
+                }
+                else {
+                    delete_file(user_id, filename, socket_fd);
+                }
+                unlock_user(user_id);
+
+                if (!applied) {
+                    break;
+                }
+            }
+            else if (header.change == ReplicationSnapshotEnd) {
+                finish_snapshot(stream, streams, snapshot_files);
+                snapshot_files.clear();
 
-    auto it = clients.find(user_id);
-    if (it != clients.end()) {
-        it->second->user_mutex.lock();
+                // Só agora a réplica tem o estado dessa época
+                epoch = primary_epoch;
+            }
+
+            // Os arquivos da cópia completa não dizem até quando a réplica
+            // está atualizada: só o fim dela
+            if (header.sequence != 0 || header.change != ReplicatedUpload) {
+                sequence = header.sequence;
+                replica_status.update(stream, current_as_of);
+            }
+        }
+
+        std::cerr << "Conexão com o primário " << replica_of << " perdida\n";
+        close_socket(socket_fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RETRY_MS));
     }
 }
+#pragma clang diagnostic pop
 
 
 /*
  * ----------------------------------------------------------------------------
- * lock_user
+ * apply_replicated_upload
  * ----------------------------------------------------------------------------
- * Destrava as threads do usuário.
+ * Recebe do primário o conteúdo atual de um arquivo e o grava na réplica.
+ * Deve ser chamada com o usuário travado.
+ *
+ * O primário envia o FileInfo do arquivo, e a réplica responde se quer os
+ * bytes: com o mesmo hash, apenas a data de modificação é atualizada.  Os
+ * bytes vêm pelo protocolo de um Download.  Se o arquivo não existe mais no
+ * primário, ele é apagado da réplica.
  *
- * Também usa mutex para fazer exclusão mútua de todas as threads.
+ * A réplica guarda todos os arquivos como arquivos comuns.  Retorna falso se
+ * a conexão com o primário falhou.
  * ----------------------------------------------------------------------------
  */
-void unlock_user(std::string user_id) {
-    std::lock_guard<std::mutex> lock(user_lock_mutex);
+bool apply_replicated_upload(const std::string &user_id, const std::string &filename, int primary_socket_fd) {
+    bool exists = false;
+    if (!read_socket(primary_socket_fd, (void *) &exists, sizeof(exists))) {
+        return false;
+    }
+    if (!exists) {
+        delete_file(user_id, filename, primary_socket_fd);
+        return true;
+    }
+
+    FileInfo info;
+    if (!read_socket(primary_socket_fd, (void *) &info, sizeof(info))) {
+        return false;
+    }
+
+    fs::path absolute_path = server_dir / fs::path(user_id) / fs::path(filename);
+    PackStore *pack = pack_store(user_id);
+    bool packed = pack != nullptr && pack->find(filename, nullptr);
+
+    Client *client = clients.find(user_id);
+    FileInfo *local = find_file_info(client, filename);
+    bool wanted = local == nullptr || local->bytes() != info.bytes() ||
+                  stored_file_hash(user_id, local) != info.hash();
+    send_bool(primary_socket_fd, wanted);
+
+    if (!wanted) {
+        if (local->last_modified() != info.last_modified()) {
+            if (packed) {
+                pack->touch(filename, info.last_modified());
+            }
+            else {
+                fs::last_write_time(absolute_path, info.last_modified());
+            }
+            file_cache.invalidate(user_id, filename);
+            update_files(user_id, filename, info.bytes(), info.last_modified(), info.hash());
+        }
+        return true;
+    }
+
+    // O arquivo pode ter deixado de existir no primário desde o FileInfo
+    bool file_ok = false;
+    if (!read_socket(primary_socket_fd, (void *) &file_ok, sizeof(file_ok))) {
+        return false;
+    }
+    if (!file_ok) {
+        return true;
+    }
+
+    uint64_t file_size;
+    if (!read_socket(primary_socket_fd, (void *) &file_size, sizeof(file_size))) {
+        return false;
+    }
+
+    fs::path temp_path = absolute_path.parent_path() / fs::path("~" + filename + ".part");
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    send_bool(primary_socket_fd, file != nullptr);
+
+    time_t time;
+    if (file == nullptr) {
+        std::cerr << "Arquivo " << temp_path << " não pode ser aberto\n";
+        return read_socket(primary_socket_fd, (void *) &time, sizeof(time));
+    }
+
+    bool received = read_file(primary_socket_fd, file, file_size);
+    fclose(file);
+
+    if (!received || !read_socket(primary_socket_fd, (void *) &time, sizeof(time))) {
+        fs::remove(temp_path);
+        return false;
+    }
+
+    preserve_version(user_id, filename);
+    fs::last_write_time(temp_path, time);
+    fs::rename(temp_path, absolute_path);
+    if (packed) {
+        pack->remove(filename);
+    }
+
+    file_cache.invalidate(user_id, filename);
+    update_files(user_id, filename, file_size, time, info.hash());
+
+    std::cout << "Arquivo " << absolute_path.string() << " replicado\n";
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * finish_snapshot
+ * ----------------------------------------------------------------------------
+ * Ao fim de uma cópia completa recebida pela conexão "stream", apaga da
+ * réplica os arquivos dos usuários dessa conexão que não vieram na cópia.
+ * ----------------------------------------------------------------------------
+ */
+void finish_snapshot(size_t stream, size_t streams, const std::set<std::pair<std::string, std::string>> &files) {
+    std::vector<std::string> users;
+    clients.for_each([&](Client *client) {
+        if (streams <= 1 || worker_for_user(client->user_id, streams) == stream) {
+            users.push_back(client->user_id);
+        }
+    });
+
+    for (const std::string &user_id : users) {
+        lock_user(user_id);
+
+        std::vector<std::string> removed;
+        for (FileInfo &info : clients.find(user_id)->files) {
+            if (files.count(std::make_pair(user_id, info.filename())) == 0) {
+                removed.push_back(info.filename());
+            }
+        }
+        for (const std::string &filename : removed) {
+            delete_file(user_id, filename, -1);
+        }
+
+        unlock_user(user_id);
+    }
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * run_replication_thread
+ * ----------------------------------------------------------------------------
+ * Atende a conexão de uma réplica: envia as mudanças do ReplicationLog na
+ * ordem em que aconteceram, e uma mensagem a cada REPLICATION_HEARTBEAT_MS
+ * sem mudanças.  Se a réplica não conhece esta época do primário, ou está
+ * mais atrasada que o log, recebe antes uma cópia completa.
+ *
+ * Uma réplica não aceita réplicas.
+ * ----------------------------------------------------------------------------
+ */
+void run_replication_thread(int replica_socket_fd) {
+    std::string stream = receive_string(replica_socket_fd);
+
+    uint64_t epoch = 0;
+    uint64_t sequence = 0;
+    bool ok = read_socket(replica_socket_fd, (void *) &epoch, sizeof(epoch)) &&
+              read_socket(replica_socket_fd, (void *) &sequence, sizeof(sequence)) &&
+              replica_of.empty();
+
+    send_bool(replica_socket_fd, ok);
+    if (!ok) {
+        close_socket(replica_socket_fd);
+        return;
+    }
+
+    uint64_t streams = server_workers;
+    uint64_t log_epoch = replication_log.epoch();
+    write_socket(replica_socket_fd, (const void *) &streams, sizeof(streams));
+    write_socket(replica_socket_fd, (const void *) &log_epoch, sizeof(log_epoch));
+    flush_socket(replica_socket_fd);
+
+    std::cout << "Réplica conectada (conexão " << stream << ")\n";
+
+    // Uma réplica parada derruba a conexão em vez de prender o envio
+    timeval timeout{REPLICA_SOCKET_TIMEOUT_MS / 1000, (REPLICA_SOCKET_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(replica_socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(replica_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    bool snapshot = epoch != log_epoch;
+    bool connected = true;
+    std::vector<ReplicationEntry> entries;
+
+    while (connected) {
+        if (snapshot) {
+            // As mudanças durante a cópia são enviadas depois dela
+            sequence = replication_log.last_sequence();
+            auto start = std::chrono::steady_clock::now();
+
+            connected = send_snapshot(replica_socket_fd) &&
+                        send_replication_header(replica_socket_fd, sequence, start, ReplicationSnapshotEnd) &&
+                        flush_socket(replica_socket_fd);
+            snapshot = false;
+            continue;
+        }
+
+        if (!replication_log.read_after(sequence, entries, REPLICATION_HEARTBEAT_MS)) {
+            snapshot = true;
+            continue;
+        }
+
+        if (entries.empty()) {
+            connected = send_replication_header(replica_socket_fd, sequence, std::chrono::steady_clock::now(),
+                                                ReplicationHeartbeat) && flush_socket(replica_socket_fd);
+            continue;
+        }
+
+        for (const ReplicationEntry &entry : entries) {
+            if (!(connected = send_replicated_change(replica_socket_fd, entry))) {
+                break;
+            }
+            sequence = entry.sequence;
+        }
+        connected = connected && flush_socket(replica_socket_fd);
+    }
+
+    std::cout << "Réplica desconectada (conexão " << stream << ")\n";
+    close_socket(replica_socket_fd);
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_snapshot
+ * ----------------------------------------------------------------------------
+ * Envia à réplica todos os arquivos dos usuários deste servidor, como
+ * uploads com sequência 0.  Retorna falso se a conexão falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool send_snapshot(int replica_socket_fd) {
+    std::vector<std::string> users;
+    clients.for_each([&](Client *client) { users.push_back(client->user_id); });
+
+    for (const std::string &user_id : users) {
+        std::vector<std::string> filenames;
+        lock_user(user_id);
+        for (FileInfo &info : clients.find(user_id)->files) {
+            filenames.push_back(info.filename());
+        }
+        unlock_user(user_id);
+
+        for (const std::string &filename : filenames) {
+            ReplicationEntry entry{0, ReplicatedUpload, user_id, filename, std::chrono::steady_clock::now()};
+            if (!send_replicated_change(replica_socket_fd, entry)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_replication_header
+ * ----------------------------------------------------------------------------
+ * Envia o cabeçalho de uma mensagem à réplica, com o atraso desde "time".
+ * ----------------------------------------------------------------------------
+ */
+bool send_replication_header(int replica_socket_fd, uint64_t sequence, std::chrono::steady_clock::time_point time,
+                             ReplicationChange change) {
+    ReplicationHeader header{};
+    header.sequence = sequence;
+    header.lag_ms = (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - time).count();
+    header.change = change;
+    return write_socket(replica_socket_fd, (const void *) &header, sizeof(header));
+}
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * send_replicated_change
+ * ----------------------------------------------------------------------------
+ * Envia uma mudança à réplica.  Para um upload, o conteúdo atual do arquivo
+ * é enviado (ver "apply_replicated_upload").  Retorna falso se a conexão
+ * falhou.
+ * ----------------------------------------------------------------------------
+ */
+bool send_replicated_change(int replica_socket_fd, const ReplicationEntry &entry) {
+    if (!send_replication_header(replica_socket_fd, entry.sequence, entry.time, entry.change)) {
+        return false;
+    }
+    send_string(replica_socket_fd, entry.user_id);
+    send_string(replica_socket_fd, entry.filename);
+
+    if (entry.change != ReplicatedUpload) {
+        return true;
+    }
+
+    // Com o usuário travado, só o registro é copiado e o conteúdo aberto.  O
+    // envio à réplica, que pode ser lenta, é feito sem travar o usuário.
+    lock_user(entry.user_id);
+
+    Client *client = clients.find(entry.user_id);
+    FileInfo *current = client != nullptr ? find_file_info(client, entry.filename) : nullptr;
+    bool exists = current != nullptr;
+
+    FileInfo info{};
+    StoredFile stored{};
+    bool file_ok = false;
+    if (exists) {
+        info = *current;
+        file_ok = open_stored_file(entry.user_id, entry.filename, 0, stored);
+    }
 
-    auto it = clients.find(user_id);
-    if (it != clients.end()) {
-        it->second->user_mutex.unlock();
+    unlock_user(entry.user_id);
+
+    // O hash que ainda não foi calculado é lido do conteúdo aberto
+    if (file_ok && !info.hash().valid()) {
+        info.set_hash(hash_stored_content(stored));
+        keep_computed_hash(entry.user_id, info);
+    }
+
+    bool ok = write_socket(replica_socket_fd, (const void *) &exists, sizeof(exists));
+    if (ok && exists) {
+        ok = write_socket(replica_socket_fd, (const void *) &info, sizeof(info));
+
+        bool wanted = false;
+        ok = ok && read_socket(replica_socket_fd, (void *) &wanted, sizeof(wanted));
+        if (ok && wanted) {
+            ok = send_stored_file(entry.user_id, entry.filename, replica_socket_fd, stored, file_ok, true);
+        }
+    }
+
+    if (stored.file != nullptr) {
+        disk_pool.run(stored.device, [&] { fclose(stored.file); });
     }
+    return ok;
 }
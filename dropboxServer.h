@@ -1,20 +1,160 @@
 #ifndef __DROPBOX_SERVER_H__
 #define __DROPBOX_SERVER_H__
 #include <string>
+#include <vector>
+#include <memory>
+#include <set>
+#include <chrono>
+#include <boost/filesystem.hpp>
+#include "dropboxUtil.h"
+#include "dropboxCache.h"
+#include "dropboxReplication.h"
+#include "dropboxChunked.h"
 
+// Arquivo, no diretório do servidor, com as configurações de cada usuário
+#define USER_SETTINGS_FILE "users.conf"
+
+/*
+ * Formatos de armazenamento dos arquivos de um usuário no servidor:
+ *
+ *  FileStorage  um arquivo comum para cada arquivo do usuário
+ *  PackStorage  arquivos pequenos concatenados em packfiles (ver PackStore)
+ */
+enum StorageLayout { FileStorage, PackStorage };
+
+class PackStore;
+class IgnoreMatcher;
+
+/*
+ * Configurações de um usuário.  Os valores padrão podem ser alterados pelas
+ * opções do servidor, e cada usuário pode ter os seus no USER_SETTINGS_FILE.
+ */
+struct UserSettings {
+    size_t max_devices;
+
+    // Limite de banda do usuário em bytes por segundo (0 para sem limite)
+    uint64_t rate_limit;
+
+    // Versões anteriores guardadas de cada arquivo (0 para nenhuma)
+    size_t versions;
+
+    StorageLayout storage;
+};
+
+// Conteúdo de um arquivo a ser enviado: os bytes da cache ou dos packfiles,
+// ou o arquivo aberto no disco
+struct StoredFile {
+    FileBytes bytes;
+    FILE *file;
+    dev_t device;
+    uint64_t size;
+    time_t timestamp;
+};
+
+/*
+ * Transferência em pedaços em andamento.  Os pedaços são transferidos pelas
+ * conexões da sessão ao mesmo tempo, sem travar o usuário.  Num upload,
+ * "stored.file" é o arquivo temporário "temp_path", que só substitui o
+ * arquivo do usuário no ChunkedCommit.  Num download, "stored" é o conteúdo
+ * aberto no início, de modo que todos os pedaços sejam da mesma versão.
+ */
+struct ChunkedTransfer {
+    ChunkedTransfer(uint64_t file_size, uint64_t chunk_size);
+    ~ChunkedTransfer();
+
+    std::string user_id;
+    std::string filename;
+    bool upload;
+    StoredFile stored;
+    boost::filesystem::path temp_path;
+    ChunkTracker chunks;
+
+    // Conexão que começou a transferência (ver "run_user_interface"), que a
+    // descarta ao terminar
+    uint64_t owner_connection;
+
+    // Momento do último bloco, para descartar transferências abandonadas
+    std::atomic<time_t> last_used;
+};
+
+void parse_options(int argc, char **argv);
+void load_user_settings();
+void load_sync_rules();
+UserSettings settings_for(const std::string &user_id);
+void apply_user_settings(Client *client);
 void initialize_clients();
+void index_user_files(Client *client);
+void list_stored_files(const std::string &user_id, const IgnoreMatcher &ignore, const std::set<std::string> &skip,
+                       std::vector<FileInfo> &files);
+std::shared_ptr<const IgnoreMatcher> ignore_matcher(const std::string &user_id);
+void reload_ignore_matcher(const std::string &user_id);
 void create_user_dir(std::string user_id);
-void update_files(std::string user_id, std::string filename, size_t file_size, time_t timestamp);
-bool connect_client(std::string user_id, int client_socket_fd);
-void disconnect_client(std::string user_id, int client_socket_fd);
+void update_files(std::string user_id, std::string filename, uint64_t file_size, time_t timestamp,
+                  const ContentHash &hash);
+uint64_t connect_client(std::string user_id, int client_socket_fd);
+Client *find_or_create_client(const std::string &user_id);
+void disconnect_client(std::string user_id, int client_socket_fd, uint64_t session_id);
 void sync_server(std::string user_id, int client_socket_fd);
-void receive_file(std::string user_id, std::string filename, int client_socket_fd);
-void send_file(std::string user_id, std::string filename, int client_socket_fd);
+void receive_file(std::string user_id, std::string filename, int client_socket_fd, uint64_t session_id);
+void send_file(std::string user_id, std::string filename, int client_socket_fd, uint64_t version = 0);
+bool send_stored_file(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                      StoredFile &stored, bool file_ok, bool cacheable);
+bool open_stored_file(const std::string &user_id, const std::string &filename, uint64_t version,
+                      StoredFile &stored);
+bool send_file_ranges(std::string user_id, std::string filename, int client_socket_fd);
 void delete_file(std::string user_id, std::string filename, int client_socket_fd);
+void move_file(const std::string &user_id, const std::string &from, const std::string &to, int client_socket_fd,
+               uint64_t session_id);
+bool stored_file_time(const std::string &user_id, const std::string &filename, time_t *time);
+bool upload_wanted(const std::string &user_id, const std::string &filename, uint64_t file_size, time_t time,
+                   const ContentHash &hash);
+void begin_chunked_upload(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                          uint64_t connection_id);
+void begin_chunked_download(const std::string &user_id, const std::string &filename, int client_socket_fd,
+                            uint64_t connection_id);
+std::shared_ptr<ChunkedTransfer> find_chunked_transfer(const std::string &user_id, uint64_t id);
+void expire_chunked_transfers();
+void drop_chunked_transfers(uint64_t connection_id);
+void run_chunked_expiry_thread();
+void receive_chunk(const std::string &user_id, int client_socket_fd);
+void send_chunk(const std::string &user_id, int client_socket_fd);
+void commit_chunked(const std::string &user_id, int client_socket_fd, uint64_t session_id);
+void run_server(size_t index, int ready_fd);
+void serve_connection(int client_socket_fd);
+void route_connection(int client_socket_fd);
+void run_handoff_thread();
+bool owns_user(const std::string &user_id);
 void run_normal_thread(int client_socket_fd);
-void run_user_interface(const std::string user_id, int client_socket_fd);
-void send_file_infos(std::string user_id, int client_socket_fd);
+void run_sync_connection_thread(int client_socket_fd);
+void run_worker_connection_thread(int client_socket_fd);
+void run_user_interface(const std::string user_id, int client_socket_fd, uint64_t session_id,
+                        bool owns_session = true);
+void send_file_infos(std::string user_id, int client_socket_fd, uint64_t session_id = 0);
+void send_stored_infos(const std::string &user_id, int client_socket_fd);
+void send_file_versions(std::string user_id, std::string filename, int client_socket_fd);
+void preserve_version(const std::string &user_id, const std::string &filename);
+PackStore *pack_store(const std::string &user_id);
+void run_compaction_thread();
 void lock_user(std::string user_id);
 void unlock_user(std::string user_id);
+FileInfo *find_file_info(Client *client, const std::string &filename);
+ContentHash stored_file_hash(const std::string &user_id, FileInfo *info);
+ContentHash hash_stored_content(StoredFile &stored);
+void keep_computed_hash(const std::string &user_id, const FileInfo &info);
+void queue_hash(const std::string &user_id, const std::string &filename);
+void run_hash_thread();
+void set_device(const std::string &user_id, const std::string &device, uint64_t session_id);
+std::vector<std::shared_ptr<RelaySubscriber>> relay_targets(const std::string &user_id, uint64_t session_id,
+                                                            const std::string &filename, uint64_t file_size);
+void replicate_change(ReplicationChange change, const std::string &user_id, const std::string &filename);
+bool replica_stale();
+void run_replica_thread(size_t stream);
+bool apply_replicated_upload(const std::string &user_id, const std::string &filename, int primary_socket_fd);
+void finish_snapshot(size_t stream, size_t streams, const std::set<std::pair<std::string, std::string>> &files);
+void run_replication_thread(int replica_socket_fd);
+bool send_snapshot(int replica_socket_fd);
+bool send_replication_header(int replica_socket_fd, uint64_t sequence, std::chrono::steady_clock::time_point time,
+                             ReplicationChange change);
+bool send_replicated_change(int replica_socket_fd, const ReplicationEntry &entry);
 
 #endif
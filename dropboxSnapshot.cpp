@@ -0,0 +1,92 @@
+#include "dropboxSnapshot.h"
+
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+//=============================================================================
+// DirectorySnapshot
+//=============================================================================
+// Lê o estado de todos os arquivos abaixo de "root"
+void DirectorySnapshot::capture(const fs::path &root) {
+    root_ = root;
+    entries_ = scan();
+}
+
+
+// Atualiza um arquivo depois que seu evento foi tratado
+void DirectorySnapshot::update(const fs::path &path) {
+    struct stat info{};
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        entries_.erase(path.string());
+        return;
+    }
+
+    entries_[path.string()] = Entry{info.st_ino, info.st_size, info.st_mtim};
+}
+
+
+void DirectorySnapshot::remove(const fs::path &path) {
+    entries_.erase(path.string());
+}
+
+
+/*
+ * Compara o diretório com o snapshot.  Arquivos novos ou com inode, tamanho
+ * ou data diferentes vão para "changed", e arquivos que sumiram vão para
+ * "removed".  No final, o snapshot passa a refletir o diretório.
+ */
+void DirectorySnapshot::rescan(std::vector<fs::path> &changed, std::vector<fs::path> &removed) {
+    std::map<std::string, Entry> current = scan();
+
+    for (const auto &entry : current) {
+        auto it = entries_.find(entry.first);
+        if (it == entries_.end() || !same(it->second, entry.second)) {
+            changed.emplace_back(entry.first);
+        }
+    }
+
+    for (const auto &entry : entries_) {
+        if (current.count(entry.first) == 0) {
+            removed.emplace_back(entry.first);
+        }
+    }
+
+    entries_ = std::move(current);
+}
+
+
+size_t DirectorySnapshot::size() const {
+    return entries_.size();
+}
+
+
+bool DirectorySnapshot::same(const Entry &a, const Entry &b) {
+    return a.inode == b.inode &&
+           a.size == b.size &&
+           a.modified.tv_sec == b.modified.tv_sec &&
+           a.modified.tv_nsec == b.modified.tv_nsec;
+}
+
+
+// Lê o estado atual de todos os arquivos comuns abaixo da raiz
+std::map<std::string, DirectorySnapshot::Entry> DirectorySnapshot::scan() const {
+    std::map<std::string, Entry> result;
+
+    boost::system::error_code error;
+    fs::recursive_directory_iterator it(root_, error);
+    fs::recursive_directory_iterator end;
+
+    for (; !error && it != end; it.increment(error)) {
+        struct stat info{};
+        if (lstat(it->path().c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        result[it->path().string()] = Entry{info.st_ino, info.st_size, info.st_mtim};
+    }
+
+    if (error) {
+        std::cerr << "Erro ao varrer " << root_.string() << ": " << error.message() << "\n";
+    }
+    return result;
+}
@@ -0,0 +1,52 @@
+#ifndef __DROPBOX_SNAPSHOT_H__
+#define __DROPBOX_SNAPSHOT_H__
+
+#include <string>
+#include <map>
+#include <vector>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * DirectorySnapshot
+ * ----------------------------------------------------------------------------
+ * Último estado conhecido dos arquivos do diretório de sincronização: inode,
+ * tamanho e data de modificação de cada arquivo.
+ *
+ * O snapshot é atualizado a cada evento tratado.  Quando a fila do inotify
+ * transborda e eventos são perdidos, "rescan" compara o diretório com o
+ * snapshot usando apenas stat, sem ler o conteúdo de nenhum arquivo, e
+ * devolve os arquivos criados, alterados e removidos desde então.
+ *
+ * Não é thread-safe: deve ser usado apenas pela thread do inotify.
+ * ----------------------------------------------------------------------------
+ */
+class DirectorySnapshot {
+public:
+    void capture(const boost::filesystem::path &root);
+    void update(const boost::filesystem::path &path);
+    void remove(const boost::filesystem::path &path);
+
+    void rescan(std::vector<boost::filesystem::path> &changed,
+                std::vector<boost::filesystem::path> &removed);
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        ino_t inode;
+        off_t size;
+        timespec modified;
+    };
+
+    static bool same(const Entry &a, const Entry &b);
+
+    std::map<std::string, Entry> scan() const;
+
+    boost::filesystem::path root_;
+    std::map<std::string, Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "dropboxSyncRules.h"
+
+#include <fnmatch.h>
+#include <sstream>
+
+// Valores separados por vírgulas
+static std::vector<std::string> split_list(const std::string &value) {
+    std::vector<std::string> items;
+    std::istringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Extensão com o ponto, como a guardada no FileInfo
+static std::string normalize_extension(const std::string &extension) {
+    return extension.empty() || extension[0] == '.' ? extension : "." + extension;
+}
+
+static bool matches_any(const std::vector<std::string> &patterns, const std::string &filename) {
+    for (const std::string &pattern : patterns) {
+        if (fnmatch(pattern.c_str(), filename.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+SyncRules::SyncRules() {
+    max_size_ = 0;
+}
+
+
+/*
+ * Acrescenta uma regra no formato chave=valor.  "include", "exclude" e
+ * "extensions" aceitam listas separadas por vírgulas e podem ser repetidas.
+ * Retorna falso se a chave não for conhecida.
+ */
+bool SyncRules::set(const std::string &key, const std::string &value) {
+    if (key == "include") {
+        for (const std::string &pattern : split_list(value)) {
+            include_.push_back(pattern);
+        }
+    }
+    else if (key == "exclude") {
+        for (const std::string &pattern : split_list(value)) {
+            exclude_.push_back(pattern);
+        }
+    }
+    else if (key == "extensions") {
+        for (const std::string &extension : split_list(value)) {
+            extensions_.insert(normalize_extension(extension));
+        }
+    }
+    else if (key == "max_size") {
+        max_size_ = std::strtoull(value.c_str(), nullptr, 10);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+
+bool SyncRules::accepts(const std::string &filename, const std::string &extension, uint64_t size) const {
+    if (!include_.empty() && !matches_any(include_, filename)) {
+        return false;
+    }
+    if (matches_any(exclude_, filename)) {
+        return false;
+    }
+    if (!extensions_.empty() && extensions_.count(normalize_extension(extension)) == 0) {
+        return false;
+    }
+    return max_size_ == 0 || size <= max_size_;
+}
+
+
+bool SyncRules::accepts(const FileInfo &info) const {
+    return accepts(info.filename(), info.extension(), info.bytes());
+}
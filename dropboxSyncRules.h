@@ -0,0 +1,47 @@
+#ifndef __DROPBOX_SYNC_RULES_H__
+#define __DROPBOX_SYNC_RULES_H__
+
+#include <string>
+#include <vector>
+#include <set>
+#include <cstdint>
+#include "dropboxUtil.h"
+
+// Arquivo, no diretório do servidor, com as regras de sincronização seletiva
+// de cada dispositivo
+#define SYNC_RULES_FILE "sync_rules.conf"
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * SyncRules
+ * ----------------------------------------------------------------------------
+ * Regras de sincronização seletiva de um dispositivo, avaliadas no servidor.
+ * Um arquivo é sincronizado com o dispositivo se:
+ *
+ *  - as regras "include" estiverem vazias, ou o nome casar com alguma delas;
+ *  - o nome não casar com nenhuma regra "exclude";
+ *  - as extensões estiverem vazias, ou a extensão do arquivo for uma delas;
+ *  - "max_size" for 0, ou o arquivo não for maior que isso.
+ *
+ * As regras "include" e "exclude" são globs (ver fnmatch(3)).  Os arquivos
+ * que não passam pelas regras não aparecem na lista enviada ao dispositivo
+ * nem são repassados pelo seu canal de sincronização.
+ * ----------------------------------------------------------------------------
+ */
+class SyncRules {
+public:
+    SyncRules();
+
+    bool set(const std::string &key, const std::string &value);
+    bool accepts(const std::string &filename, const std::string &extension, uint64_t size) const;
+    bool accepts(const FileInfo &info) const;
+
+private:
+    std::vector<std::string> include_;
+    std::vector<std::string> exclude_;
+    std::set<std::string> extensions_;
+    uint64_t max_size_;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "dropboxTransfer.h"
+#include "dropboxUtil.h"
+
+#include <iostream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Nomes de arquivo afetados por uma transferência.  Uma mudança de nome
+// também afeta o nome anterior.
+static std::vector<std::string> job_names(const TransferJob &job) {
+    std::vector<std::string> names{job.name};
+    if (job.kind == MoveJob) {
+        names.push_back(job.source);
+    }
+    return names;
+}
+
+
+// Indica se as duas transferências afetam um mesmo arquivo e uma delas é uma
+// mudança de nome, caso em que elas rodam na ordem em que chegaram
+static bool ordered_with(const TransferJob &a, const TransferJob &b) {
+    if (a.kind != MoveJob && b.kind != MoveJob) {
+        return false;
+    }
+    for (const std::string &name : job_names(a)) {
+        for (const std::string &other : job_names(b)) {
+            if (name == other) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+//=============================================================================
+// TransferQueue
+//=============================================================================
+TransferQueue::TransferQueue() {
+    next_id_ = 1;
+    stopping_ = false;
+    paused_ = false;
+    running_ = 0;
+    generation_ = 0;
+}
+
+
+bool TransferQueue::Order::operator()(const std::shared_ptr<Entry> &a, const std::shared_ptr<Entry> &b) const {
+    if (a->job.priority != b->job.priority) {
+        return a->job.priority < b->job.priority;
+    }
+    if (a->job.size != b->job.size) {
+        return a->job.size < b->job.size;
+    }
+    return a->job.id < b->job.id;
+}
+
+
+void TransferQueue::start(size_t workers, const WorkerConnector &connect, const TransferExecutor &execute,
+                          const TransferObserver &finished) {
+    connect_ = connect;
+    execute_ = execute;
+    finished_ = finished;
+
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back(&TransferQueue::run_worker, this);
+    }
+}
+
+
+/*
+ * Enfileira uma transferência e retorna seu identificador.  Se ela alterar o
+ * diretório de sincronização, substitui a transferência do mesmo arquivo que
+ * ainda estiver na fila, herdando sua prioridade caso seja maior.  Uma
+ * mudança de nome também substitui a do nome anterior, que deixou de existir
+ * (se o servidor não tiver esse arquivo, "move_remote" envia o novo nome).
+ * Mudanças de nome não são substituídas.
+ */
+uint64_t TransferQueue::submit(TransferJob job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    job.id = next_id_++;
+
+    if (job.to_sync_dir) {
+        for (const std::string &name : job_names(job)) {
+            for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+                const TransferJob &queued = (*it)->job;
+                if (queued.to_sync_dir && queued.kind != MoveJob && queued.name == name) {
+                    if (queued.priority < job.priority) {
+                        job.priority = queued.priority;
+                    }
+                    jobs_.erase(queued.id);
+                    queue_.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->job = job;
+    entry->running = false;
+    entry->cancelled = false;
+    entry->socket_fd = -1;
+
+    queue_.insert(entry);
+    jobs_[job.id] = entry;
+    condition_.notify_all();
+    return job.id;
+}
+
+
+/*
+ * Cancela uma transferência.  Se ela estiver em andamento, a conexão do seu
+ * worker é derrubada para interrompê-la.  Retorna falso se a transferência
+ * não existir ou já tiver terminado.
+ */
+bool TransferQueue::cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+        return false;
+    }
+
+    std::shared_ptr<Entry> entry = it->second;
+    if (!entry->running) {
+        queue_.erase(entry);
+        jobs_.erase(it);
+        condition_.notify_all();
+        return true;
+    }
+
+    entry->cancelled = true;
+    if (entry->socket_fd != -1) {
+        shutdown(entry->socket_fd, SHUT_RDWR);
+    }
+    return true;
+}
+
+
+// Transferências em andamento seguidas das que estão na fila, em ordem
+std::vector<TransferStatus> TransferQueue::status() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<TransferStatus> result;
+    for (auto &entry : jobs_) {
+        if (entry.second->running) {
+            result.push_back(TransferStatus{entry.second->job, true});
+        }
+    }
+    for (auto &entry : queue_) {
+        result.push_back(TransferStatus{entry->job, false});
+    }
+    return result;
+}
+
+
+// Impede que novas transferências comecem, sem afetar as que estão rodando
+void TransferQueue::pause() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    paused_ = true;
+}
+
+
+void TransferQueue::resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    paused_ = false;
+    condition_.notify_all();
+}
+
+
+/*
+ * Derruba as conexões das transferências em andamento e espera que elas
+ * terminem.  Os workers abrem conexões novas para as próximas
+ * transferências.  Usada quando a conexão com o servidor caiu.
+ */
+void TransferQueue::reset_connections() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++generation_;
+
+    for (auto &entry : jobs_) {
+        if (entry.second->running && entry.second->socket_fd != -1) {
+            shutdown(entry.second->socket_fd, SHUT_RDWR);
+        }
+    }
+    condition_.wait(lock, [this] { return running_ == 0; });
+}
+
+
+// Espera todas as transferências terminarem e encerra os workers
+void TransferQueue::drain() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this] { return queue_.empty() && running_ == 0; });
+        stopping_ = true;
+        condition_.notify_all();
+    }
+
+    for (std::thread &worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+}
+
+
+void TransferQueue::run_worker() {
+    int socket_fd = -1;
+    uint64_t socket_generation = 0;
+
+    while (true) {
+        std::shared_ptr<Entry> entry;
+        uint64_t generation;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!(entry = next_job()) && !stopping_) {
+                condition_.wait(lock);
+            }
+            generation = generation_;
+        }
+
+        if (!entry) {
+            break;
+        }
+
+        // A conexão é de antes da última queda do servidor
+        if (socket_fd != -1 && socket_generation != generation) {
+            close_socket(socket_fd);
+            socket_fd = -1;
+        }
+
+        if (socket_fd == -1) {
+            socket_generation = generation;
+            socket_fd = connect_();
+        }
+
+        bool cancelled;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry->socket_fd = socket_fd;
+            cancelled = entry->cancelled;
+        }
+
+        bool ok = cancelled || execute_(socket_fd, entry->job);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled = entry->cancelled;
+            entry->socket_fd = -1;
+        }
+
+        if (cancelled) {
+            std::cout << "Transferência " << entry->job.id << " cancelada\n";
+        }
+        else if (!ok) {
+            std::cerr << "Transferência " << entry->job.id << " falhou\n";
+        }
+
+        // O resultado é informado antes da transferência sair da lista, para
+        // que "drain" e "reset_connections" só retornem depois dele
+        if (!cancelled && finished_) {
+            finished_(entry->job, ok);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const std::string &name : job_names(entry->job)) {
+                busy_.erase(name);
+            }
+            jobs_.erase(entry->job.id);
+            --running_;
+            condition_.notify_all();
+        }
+
+        // A conexão pode ter ficado no meio de um comando.  Se a transferência
+        // foi cancelada, a conexão é fechada com RST, descartando os bytes que
+        // ainda não saíram do buffer do socket.
+        if ((cancelled || !ok) && socket_fd != -1) {
+            if (cancelled) {
+                linger abort{1, 0};
+                setsockopt(socket_fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+            }
+            close_socket(socket_fd);
+            socket_fd = -1;
+        }
+    }
+
+    if (socket_fd != -1) {
+        close_socket(socket_fd);
+    }
+}
+
+
+/*
+ * Retira da fila a primeira transferência cujos arquivos não estejam ocupados
+ * por outro worker.  Uma transferência que envolve uma mudança de nome não
+ * passa na frente de outra do mesmo arquivo que chegou antes.  Deve ser
+ * chamada com o mutex travado.
+ */
+std::shared_ptr<TransferQueue::Entry> TransferQueue::next_job() {
+    if (paused_) {
+        return nullptr;
+    }
+
+    for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+        std::shared_ptr<Entry> entry = *it;
+        std::vector<std::string> names = job_names(entry->job);
+
+        bool ready = true;
+        for (const std::string &name : names) {
+            ready = ready && busy_.count(name) == 0;
+        }
+        for (auto &other : queue_) {
+            ready = ready && !(other->job.id < entry->job.id && ordered_with(other->job, entry->job));
+        }
+
+        if (ready) {
+            queue_.erase(it);
+            busy_.insert(names.begin(), names.end());
+            entry->running = true;
+            ++running_;
+            return entry;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,160 @@
+#ifndef __DROPBOX_TRANSFER_H__
+#define __DROPBOX_TRANSFER_H__
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdint>
+#include <boost/filesystem.hpp>
+#include "dropboxRanges.h"
+
+// Quantidade padrão de transferências feitas ao mesmo tempo pelo cliente
+#define DEFAULT_TRANSFER_WORKERS 2
+
+enum TransferKind { UploadJob, DownloadJob, DeleteJob, MoveJob, RangesJob };
+
+// Transferências interativas, pedidas pelo usuário, passam na frente das
+// transferências de sincronização.
+enum TransferPriority { Interactive, Background };
+
+
+/*
+ * Uma transferência a ser feita por um worker.
+ *
+ *  UploadJob    envia o arquivo "path" ao servidor
+ *  DownloadJob  baixa o arquivo "name" do servidor para "path"
+ *  DeleteJob    apaga o arquivo "name" no servidor
+ *  MoveJob      renomeia o arquivo "source" do servidor para "name", que é
+ *               o arquivo local "path"
+ *  RangesJob    baixa apenas os trechos "ranges" do arquivo "name" para
+ *               "path", que nunca fica no diretório de sincronização
+ *
+ * "to_sync_dir" indica que a transferência altera o estado do diretório de
+ * sincronização (uploads de arquivos desse diretório, todo delete, e
+ * downloads para esse diretório).
+ * "version" é o número da versão anterior a ser baixada, ou 0 para a atual.
+ */
+struct TransferJob {
+    uint64_t id;
+    TransferKind kind;
+    TransferPriority priority;
+    std::string name;
+    std::string source;
+    boost::filesystem::path path;
+    uint64_t size;
+    bool to_sync_dir;
+    uint64_t version;
+    std::vector<ByteRange> ranges;
+};
+
+
+struct TransferStatus {
+    TransferJob job;
+    bool running;
+};
+
+
+// Abre a conexão de um worker.  Retorna o socket, ou -1 em caso de erro.
+typedef std::function<int()> WorkerConnector;
+
+// Executa uma transferência no socket do worker (-1 se o worker não tiver
+// conexão própria).  Retorna falso se a conexão ficou num estado inválido.
+typedef std::function<bool(int, const TransferJob &)> TransferExecutor;
+
+// Chamada quando uma transferência que não foi cancelada termina, com o
+// resultado do TransferExecutor
+typedef std::function<void(const TransferJob &, bool)> TransferObserver;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * TransferQueue
+ * ----------------------------------------------------------------------------
+ * Fila de transferências do cliente, atendida por um número fixo de workers,
+ * cada um com sua própria conexão com o servidor.  Assim a interface e a
+ * thread do inotify apenas enfileiram as transferências e seguem em frente.
+ *
+ * - As transferências interativas são atendidas antes das de sincronização,
+ *   e entre as de mesma prioridade as menores vão primeiro.
+ *
+ * - Duas transferências do mesmo arquivo nunca rodam ao mesmo tempo.  Uma
+ *   transferência que altera o diretório de sincronização substitui a que
+ *   ainda estiver na fila para o mesmo arquivo, pois só o último estado
+ *   importa.  Uma mudança de nome nunca é substituída, pois também apaga o
+ *   nome anterior, e ela ocupa os dois nomes enquanto roda.  Transferências
+ *   de um arquivo envolvido numa mudança de nome rodam na ordem em que
+ *   chegaram.
+ *
+ * - Transferências podem ser canceladas na fila ou em andamento.  No segundo
+ *   caso a conexão do worker é derrubada, e ele abre outra para a próxima
+ *   transferência.
+ *
+ * - Enquanto o cliente está sem conexão com o servidor a fila fica pausada:
+ *   as transferências continuam sendo aceitas, mas só começam depois de
+ *   "resume".
+ * ----------------------------------------------------------------------------
+ */
+class TransferQueue {
+public:
+    TransferQueue();
+
+    void start(size_t workers, const WorkerConnector &connect, const TransferExecutor &execute,
+               const TransferObserver &finished = nullptr);
+
+    uint64_t submit(TransferJob job);
+    bool cancel(uint64_t id);
+    std::vector<TransferStatus> status();
+
+    void pause();
+    void resume();
+    void reset_connections();
+
+    void drain();
+
+private:
+    struct Entry {
+        TransferJob job;
+        bool running;
+        bool cancelled;
+        int socket_fd;
+    };
+
+    // Ordem de atendimento: prioridade, tamanho e ordem de chegada
+    struct Order {
+        bool operator()(const std::shared_ptr<Entry> &a, const std::shared_ptr<Entry> &b) const;
+    };
+
+    void run_worker();
+    std::shared_ptr<Entry> next_job();
+
+    uint64_t next_id_;
+    bool stopping_;
+    bool paused_;
+    size_t running_;
+
+    // Incrementado a cada reconexão; conexões abertas antes são descartadas
+    uint64_t generation_;
+
+    std::set<std::shared_ptr<Entry>, Order> queue_;
+    std::map<uint64_t, std::shared_ptr<Entry>> jobs_;
+
+    // Arquivos com uma transferência em andamento (os dois nomes, numa
+    // mudança de nome)
+    std::set<std::string> busy_;
+
+    std::vector<std::thread> workers_;
+    WorkerConnector connect_;
+    TransferExecutor execute_;
+    TransferObserver finished_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+};
+
+#endif
@@ -1,5 +1,4 @@
 #include "dropboxUtil.h"
-
 #include <utility>
 #include <memory.h>
 #include <cstring>
@@ -12,20 +11,219 @@
 #include <netinet/in.h>
 #include <memory.h>
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <cerrno>
+#include <new>
+
+// A implementação do xxHash é compilada aqui
+#define XXH_STATIC_LINKING_ONLY
+#define XXH_IMPLEMENTATION
+#include "xxHash-0.8.2/xxhash.h"
 
 //=============================================================================
 // Client
 //=============================================================================
-Client::Client(std::string user_id) {
+Client::Client(std::string user_id) : devices(MAX_DEVICES) {
     this->user_id = std::move(user_id);
-    this->is_logged = false;
-    for (int &connected_device : connected_devices) {
-        connected_device = EMPTY_DEVICE;
-    }
 }
 
 Client::Client(const char *user_id) : Client(std::string(user_id)) {}
 
+//=============================================================================
+// DeviceRegistry
+//=============================================================================
+std::atomic<uint64_t> DeviceRegistry::next_session_id_{1};
+
+DeviceRegistry::DeviceRegistry(size_t max_devices) {
+    max_devices_ = max_devices;
+}
+
+/*
+ * Registra um novo dispositivo.  Retorna o identificador da sessão, ou 0 caso
+ * o usuário já tenha atingido o limite de dispositivos.
+ */
+uint64_t DeviceRegistry::register_device(int socket_fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (devices_.size() >= max_devices_) {
+        return 0;
+    }
+
+    Device device{};
+    device.session_id = next_session_id_++;
+    device.socket_fd = socket_fd;
+    devices_[device.session_id] = device;
+
+    return device.session_id;
+}
+
+/*
+ * Remove o dispositivo da sessão.  Se ele tinha um canal de sincronização, o
+ * canal é devolvido em "subscriber" para que o chamador possa fechá-lo.
+ */
+bool DeviceRegistry::unregister_device(uint64_t session_id, std::shared_ptr<RelaySubscriber> *subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(session_id);
+    if (it == devices_.end()) {
+        return false;
+    }
+
+    if (subscriber != nullptr) {
+        *subscriber = std::move(it->second.subscriber);
+    }
+    devices_.erase(it);
+    return true;
+}
+
+bool DeviceRegistry::contains(uint64_t session_id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return devices_.count(session_id) > 0;
+}
+
+/*
+ * Associa o canal de sincronização ao dispositivo da sessão.  Falha se a
+ * sessão não pertencer a este usuário.
+ */
+bool DeviceRegistry::attach_subscriber(uint64_t session_id, const std::shared_ptr<RelaySubscriber> &subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(session_id);
+    if (it == devices_.end()) {
+        return false;
+    }
+    it->second.subscriber = subscriber;
+    return true;
+}
+
+// Desfaz a associação, caso o canal da sessão ainda seja "subscriber"
+void DeviceRegistry::detach_subscriber(uint64_t session_id, const std::shared_ptr<RelaySubscriber> &subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(session_id);
+    if (it != devices_.end() && it->second.subscriber == subscriber) {
+        it->second.subscriber.reset();
+    }
+}
+
+std::vector<Device> DeviceRegistry::devices_except(uint64_t session_id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<Device> devices;
+    for (auto &entry : devices_) {
+        if (entry.first != session_id) {
+            devices.push_back(entry.second);
+        }
+    }
+    return devices;
+}
+
+bool DeviceRegistry::set_rules(uint64_t session_id, const std::shared_ptr<const SyncRules> &rules) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(session_id);
+    if (it == devices_.end()) {
+        return false;
+    }
+    it->second.rules = rules;
+    return true;
+}
+
+std::shared_ptr<const SyncRules> DeviceRegistry::rules_for(uint64_t session_id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = devices_.find(session_id);
+    return it == devices_.end() ? nullptr : it->second.rules;
+}
+
+void DeviceRegistry::set_max_devices(size_t max_devices) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_devices_ = max_devices;
+}
+
+size_t DeviceRegistry::max_devices() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_devices_;
+}
+
+size_t DeviceRegistry::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return devices_.size();
+}
+
+//=============================================================================
+// ContentHash
+//=============================================================================
+ContentHash::ContentHash() {
+    low = 0;
+    high = 0;
+}
+
+bool ContentHash::valid() const {
+    return low != 0 || high != 0;
+}
+
+bool ContentHash::operator==(const ContentHash &other) const {
+    return low == other.low && high == other.high;
+}
+
+bool ContentHash::operator!=(const ContentHash &other) const {
+    return !(*this == other);
+}
+
+std::string ContentHash::string() const {
+    std::stringstream result;
+    result << std::hex << std::setfill('0')
+           << std::setw(16) << high
+           << std::setw(16) << low;
+    return result.str();
+}
+
+//=============================================================================
+// ContentHasher
+//=============================================================================
+ContentHasher::ContentHasher() {
+    state_ = XXH3_createState();
+    if (state_ == nullptr) {
+        throw std::bad_alloc();
+    }
+    XXH3_128bits_reset(state_);
+}
+
+ContentHasher::~ContentHasher() {
+    XXH3_freeState(state_);
+}
+
+void ContentHasher::update(const char *data, size_t size) {
+    XXH3_128bits_update(state_, data, size);
+}
+
+/*
+ * Equivale a "update" com "count" bytes zerados.  Usada para os buracos de
+ * arquivos esparsos, que não são transferidos.
+ */
+void ContentHasher::update_zeros(uint64_t count) {
+    static const char zeros[64 * 1024] = {};
+    while (count > 0) {
+        size_t size = (size_t) std::min<uint64_t>(sizeof(zeros), count);
+        update(zeros, size);
+        count -= size;
+    }
+}
+
+ContentHash ContentHasher::digest() const {
+    XXH128_hash_t digest = XXH3_128bits_digest(state_);
+
+    ContentHash hash;
+    hash.low = digest.low64;
+    hash.high = digest.high64;
+    return hash;
+}
+
 //=============================================================================
 // FileInfo
 //=============================================================================
@@ -68,14 +266,22 @@ time_t FileInfo::last_modified() const {
     return last_modified_;
 }
 
-void FileInfo::set_bytes(size_t bytes) {
+void FileInfo::set_bytes(uint64_t bytes) {
     bytes_ = bytes;
 }
 
-size_t FileInfo::bytes() const {
+uint64_t FileInfo::bytes() const {
     return bytes_;
 }
 
+void FileInfo::set_hash(const ContentHash &hash) {
+    hash_ = hash;
+}
+
+ContentHash FileInfo::hash() const {
+    return hash_;
+}
+
 std::string FileInfo::string() const {
     char date_buffer[20];
 	
@@ -91,83 +297,259 @@ std::string FileInfo::string() const {
     return result.str();
 }
 
-// Abstração da leitura do socket
-bool read_socket(int socket_fd, void *buffer, size_t count) {
-    auto *ptr = (char *) buffer;
+//=============================================================================
+// Sockets
+//=============================================================================
 
-    ssize_t bytes_read = 0;
-    while (bytes_read < count) {
-        ssize_t bytes = recv(socket_fd, ptr, count - bytes_read, 0);
-        if (bytes < 1) {
+/*
+ * Buffers de uma conexão.  As escritas são acumuladas em "out" e enviadas
+ * juntas, e as leituras pequenas são servidas de "in", que é preenchido com
+ * uma única chamada a recv.  Assim uma mensagem do protocolo, formada por
+ * vários campos, custa uma chamada de sistema em cada sentido.
+ *
+ * "out" é protegido por "write_mutex", pois a thread que lê a conexão
+ * esvazia o buffer de escrita antes de ler.  "in" só é usado por quem lê.
+ */
+struct SocketStream {
+    std::mutex write_mutex;
+    std::vector<char> out;
+
+    std::vector<char> in;
+    size_t in_start = 0;
+    size_t in_end = 0;
+
+    SocketStream() : in(SOCKET_BUFFER_SIZE) {
+        out.reserve(SOCKET_BUFFER_SIZE);
+    }
+};
+
+static std::mutex streams_mutex;
+static std::unordered_map<int, std::shared_ptr<SocketStream>> streams;
+
+static std::shared_ptr<SocketStream> stream_for(int socket_fd) {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    std::shared_ptr<SocketStream> &stream = streams[socket_fd];
+    if (!stream) {
+        stream = std::make_shared<SocketStream>();
+    }
+    return stream;
+}
+
+// Envia os dois trechos com writev, repetindo até que tudo tenha sido enviado
+static bool send_vectored(int socket_fd, const char *first, size_t first_size,
+                          const char *second, size_t second_size) {
+    iovec parts[2] = {{(void *) first, first_size}, {(void *) second, second_size}};
+    iovec *part = parts;
+    int count = 2;
+
+    while (count > 0) {
+        if (part->iov_len == 0) {
+            ++part;
+            --count;
+            continue;
+        }
+
+        ssize_t bytes = writev(socket_fd, part, count);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
         }
-        ptr += bytes;
-        bytes_read += bytes;
+
+        while (count > 0 && (size_t) bytes >= part->iov_len) {
+            bytes -= part->iov_len;
+            ++part;
+            --count;
+        }
+        if (count > 0) {
+            part->iov_base = (char *) part->iov_base + bytes;
+            part->iov_len -= bytes;
+        }
     }
     return true;
 }
 
+static bool flush_stream(int socket_fd, SocketStream &stream) {
+    std::lock_guard<std::mutex> lock(stream.write_mutex);
+    if (stream.out.empty()) {
+        return true;
+    }
+    bool ok = send_vectored(socket_fd, stream.out.data(), stream.out.size(), nullptr, 0);
+    stream.out.clear();
+    return ok;
+}
+
+
+/*
+ * Prepara um socket recém conectado ou aceito.  Desliga o algoritmo de Nagle,
+ * já que as mensagens são agrupadas pelos buffers da conexão, e liga o
+ * keepalive para que conexões mortas sejam detectadas.  Os buffers que
+ * tenham sobrado de um socket anterior com o mesmo descritor são descartados.
+ */
+void configure_socket(int socket_fd) {
+    int enable = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    streams[socket_fd] = std::make_shared<SocketStream>();
+}
+
+
+// Envia o que estiver acumulado no buffer de escrita da conexão
+bool flush_socket(int socket_fd) {
+    return flush_stream(socket_fd, *stream_for(socket_fd));
+}
+
+
+// Envia o que estiver acumulado, descarta os buffers e fecha o socket
+void close_socket(int socket_fd) {
+    flush_socket(socket_fd);
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        streams.erase(socket_fd);
+    }
+    close(socket_fd);
+}
+
+
+/*
+ * Abre uma conexão TCP com o endereço "host:porta".  O socket retornado
+ * ainda não foi preparado com "configure_socket".  Retorna -1 em caso de
+ * erro.
+ */
+int connect_address(const std::string &address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return -1;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+
+    int socket_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (socket_fd != -1 && connect(socket_fd, result->ai_addr, result->ai_addrlen) != 0) {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    freeaddrinfo(result);
+    return socket_fd;
+}
+
+
+/*
+ * Abstração da leitura do socket.  O buffer de escrita é enviado antes, pois
+ * quem lê normalmente está esperando a resposta do que acabou de escrever.
+ * Leituras grandes vão direto para o destino, sem passar pelo buffer.
+ */
+bool read_socket(int socket_fd, void *buffer, size_t count) {
+    std::shared_ptr<SocketStream> stream = stream_for(socket_fd);
+    if (!flush_stream(socket_fd, *stream)) {
+        return false;
+    }
 
-// Abstração de escrita no socket
-bool write_socket(int socket_fd, const void *buffer, size_t count) {
     auto *ptr = (char *) buffer;
 
-    ssize_t bytes_written = 0;
-    while (bytes_written < count) {
-        ssize_t bytes = send(socket_fd, ptr, count - bytes_written, 0);
-        if (bytes < 0) {
+    while (count > 0) {
+        size_t buffered = stream->in_end - stream->in_start;
+        if (buffered > 0) {
+            size_t chunk = std::min(buffered, count);
+            memcpy(ptr, stream->in.data() + stream->in_start, chunk);
+            stream->in_start += chunk;
+            ptr += chunk;
+            count -= chunk;
+            continue;
+        }
+
+        ssize_t bytes;
+        if (count >= stream->in.size()) {
+            bytes = recv(socket_fd, ptr, count, 0);
+            if (bytes > 0) {
+                ptr += bytes;
+                count -= bytes;
+            }
+        }
+        else {
+            bytes = recv(socket_fd, stream->in.data(), stream->in.size(), 0);
+            stream->in_start = 0;
+            stream->in_end = bytes > 0 ? (size_t) bytes : 0;
+        }
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 1) {
             return false;
         }
-        ptr += bytes;
-        bytes_written += bytes;
     }
     return true;
 }
 
 
-void send_string(int socket_fd, const std::string &input) {
-    size_t size = input.length() + 1;
-    char buffer[size];
-    bzero((void *) buffer, size);
-    std::strcpy(buffer, input.c_str());
+/*
+ * Abstração de escrita no socket.  Os bytes são acumulados no buffer da
+ * conexão, que é enviado quando enche, antes de uma leitura, ou por
+ * "flush_socket".  Escritas que não cabem no buffer são enviadas junto com
+ * ele numa única chamada a writev.
+ */
+bool write_socket(int socket_fd, const void *buffer, size_t count) {
+    std::shared_ptr<SocketStream> stream = stream_for(socket_fd);
+    std::lock_guard<std::mutex> lock(stream->write_mutex);
+
+    if (stream->out.size() + count <= SOCKET_BUFFER_SIZE) {
+        stream->out.insert(stream->out.end(), (const char *) buffer, (const char *) buffer + count);
+        return true;
+    }
 
-    ssize_t bytes;
+    bool ok = send_vectored(socket_fd, stream->out.data(), stream->out.size(), (const char *) buffer, count);
+    stream->out.clear();
+    return ok;
+}
 
-    // Envia o tamanho
-    if (write_socket(socket_fd, (const void *) &size, sizeof(size))) {
 
-        // Envia os bytes
-        if (!write_socket(socket_fd, (const void *) buffer, size)) {
-            std::cerr << "Erro ao tentar enviar a string " << input << "\n";
-        }
+// O tamanho enviado inclui o '\0' do fim da string
+void send_string(int socket_fd, const std::string &input) {
+    uint64_t size = input.length() + 1;
+
+    // Envia o tamanho e os bytes, que saem juntos pelo buffer da conexão
+    if (!write_socket(socket_fd, (const void *) &size, sizeof(size)) ||
+        !write_socket(socket_fd, (const void *) input.c_str(), size)) {
+        std::cerr << "Erro ao tentar enviar a string " << input << "\n";
     }
 }
 
 
 std::string receive_string(int socket_fd) {
-    ssize_t bytes;
-
     // Lê o tamanho
-    size_t size;
-    bool ok = read_socket(socket_fd, (void *) &size, sizeof(size));
+    uint64_t size;
+    if (!read_socket(socket_fd, (void *) &size, sizeof(size))) {
+        std::cerr << "Erro ao receber o tamanho da string\n";
+        return "";
+    }
 
-    if (ok) {
-        // Lê os bytes
-        char buffer[size];
-        if (!read_socket(socket_fd, (void *) buffer, size)) {
-            std::cout << "Erro ao receber a string\n";
-        }
-        return std::string(buffer);
+    if (size == 0 || size > MAX_STRING_SIZE) {
+        std::cerr << "Tamanho de string inválido: " << size << "\n";
+        return "";
     }
-    else {
 
-        std::cerr << "Erro ao receber o tamanho da string\n";
+    // Lê os bytes
+    std::vector<char> buffer(size);
+    if (!read_socket(socket_fd, (void *) buffer.data(), size)) {
+        std::cout << "Erro ao receber a string\n";
         return "";
     }
+    return std::string(buffer.data(), strnlen(buffer.data(), size));
 }
 
 bool read_bool(int socket_fd) {
-    bool value;
+    bool value = false;
     read_socket(socket_fd, (void *) &value, sizeof(value));
     return value;
 }
@@ -176,22 +558,111 @@ void send_bool(int socket_fd, bool value) {
     write_socket(socket_fd, (const void *) &value, sizeof(value));
 }
 
-bool send_file(int to_socket_fd, FILE *in_file, size_t file_size) {
-    char buffer[BUFFER_SIZE];
-    bzero(buffer, BUFFER_SIZE);
+// Escreve o cabeçalho de um extent: posição e tamanho, ambos com 64 bits
+static bool send_extent_header(int socket_fd, uint64_t offset, uint64_t length) {
+    uint64_t header[2] = {offset, length};
+    return write_socket(socket_fd, (const void *) header, sizeof(header));
+}
+
+/*
+ * Procura o próximo trecho com dados do arquivo a partir de "*offset".  Em
+ * caso de sucesso, "*offset" passa a ser o início do trecho e "*end" o seu
+ * fim.  Retorna falso se não houver mais dados até "file_size".
+ *
+ * Sistemas de arquivos sem suporte a SEEK_DATA/SEEK_HOLE são tratados como
+ * se o arquivo não tivesse buracos.
+ */
+bool next_data_extent(int fd, uint64_t file_size, uint64_t *offset, uint64_t *end) {
+    off_t data = lseek(fd, (off_t) *offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO) {
+            return false;
+        }
+        *end = file_size;
+        return true;
+    }
+
+    if ((uint64_t) data >= file_size) {
+        return false;
+    }
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    *offset = (uint64_t) data;
+    *end = (hole < 0 || (uint64_t) hole > file_size) ? file_size : (uint64_t) hole;
+    return true;
+}
+
+bool DescriptorSource::next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) {
+    return next_data_extent(fd_, file_size, offset, end);
+}
+
+ssize_t DescriptorSource::read(uint64_t offset, char *data, size_t size) {
+    return pread(fd_, data, size, (off_t) offset);
+}
+
+/*
+ * Envia "file_size" bytes do arquivo como uma sequência de extents.  Cada
+ * extent tem um cabeçalho com a posição e o tamanho, seguido dos bytes, e um
+ * extent de tamanho zero encerra a sequência.  Os extents são enviados em
+ * ordem crescente de posição.
+ *
+ * Os buracos de arquivos esparsos não são enviados: quem recebe os recria
+ * simplesmente não escrevendo nada neles.  Depois dos extents é aguardada a
+ * confirmação de recebimento.
+ */
+bool send_file(int to_socket_fd, FILE *in_file, uint64_t file_size, TransferGate *gate) {
+    DescriptorSource source(fileno(in_file));
+    return send_file(to_socket_fd, source, file_size, gate);
+}
+
+/*
+ * Envia um arquivo lido de "source", no mesmo protocolo.
+ */
+bool send_file(int to_socket_fd, FileSource &source, uint64_t file_size, TransferGate *gate) {
+    std::vector<char> buffer(FILE_CHUNK_SIZE);
+
+    uint64_t offset = 0;
+    uint64_t end;
+    while (offset < file_size && source.next_extent(file_size, &offset, &end)) {
+        if (!send_extent_header(to_socket_fd, offset, end - offset)) {
+            fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
+            return false;
+        }
+
+        while (offset < end) {
+            size_t chunk = (size_t) std::min<uint64_t>(buffer.size(), end - offset);
+
+            if (gate) {
+                gate->acquire(chunk);
+            }
 
-    size_t bytes_read_from_file;
-    while ((bytes_read_from_file = fread(buffer, sizeof(char), BUFFER_SIZE, in_file)) > 0) {
+            // O tamanho do extent já foi anunciado, então se o arquivo
+            // diminuiu durante o envio o que falta é completado com zeros.
+            ssize_t bytes_read_from_file = source.read(offset, buffer.data(), chunk);
+            size_t valid = bytes_read_from_file > 0 ? (size_t) bytes_read_from_file : 0;
+            if (valid < chunk) {
+                bzero(buffer.data() + valid, chunk - valid);
+            }
+
+            bool written = write_socket(to_socket_fd, (const void *) buffer.data(), chunk);
+
+            if (gate) {
+                gate->release(chunk);
+            }
 
-        ssize_t bytes_sent = 0;
-        while (bytes_sent < bytes_read_from_file) {
-            if ((bytes_sent += send(to_socket_fd, buffer + bytes_sent, bytes_read_from_file, 0)) < 0) {
+            if (!written) {
                 fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
                 return false;
             }
+            offset += chunk;
         }
-        bzero(buffer, BUFFER_SIZE);
     }
+
+    if (!send_extent_header(to_socket_fd, file_size, 0)) {
+        fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
+        return false;
+    }
+
     bool ok = read_bool(to_socket_fd);
     
     if (ok) {
@@ -203,50 +674,161 @@ bool send_file(int to_socket_fd, FILE *in_file, size_t file_size) {
     return true;
 }
 
-bool read_file(int from_socket_fd, FILE *out_file, size_t file_size) {
-    //std::cout << "Tamanho do arquivo: " << file_size << "\n";
+/*
+ * Envia um arquivo que já está na memória.  Segue o mesmo protocolo de
+ * "send_file", com todo o conteúdo num único extent.
+ */
+bool send_buffer(int to_socket_fd, const char *buffer, uint64_t size, TransferGate *gate) {
+    if (size > 0 && !send_extent_header(to_socket_fd, 0, size)) {
+        fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
+        return false;
+    }
+
+    uint64_t bytes_sent = 0;
+    while (bytes_sent < size) {
+        size_t chunk = gate ? (size_t) std::min<uint64_t>(BUFFER_SIZE, size - bytes_sent) : (size_t) size;
 
-    char buffer[BUFFER_SIZE];
-    bzero(buffer, BUFFER_SIZE);
+        if (gate) {
+            gate->acquire(chunk);
+        }
+        bool written = write_socket(to_socket_fd, (const void *) (buffer + bytes_sent), chunk);
+        if (gate) {
+            gate->release(chunk);
+        }
+
+        if (!written) {
+            fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
+            return false;
+        }
+        bytes_sent += chunk;
+    }
 
-    size_t bytes_received = 0;
+    if (!send_extent_header(to_socket_fd, size, 0)) {
+        fprintf(stderr, "Erro ao enviar o arquivo. Errno = %d\n", errno);
+        return false;
+    }
 
-    while (bytes_received < file_size) {
-        //std::cout << "Outer loop: " << bytes_received << "\n";
+    return read_bool(to_socket_fd);
+}
 
-        ssize_t bytes_read_from_socket = 0;
-        while ((bytes_read_from_socket = recv(from_socket_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            
-            // TODO: Temos que testar isto.
-            ssize_t bytes_written_to_file = fwrite(buffer, sizeof(char), bytes_read_from_socket, out_file);
+bool DescriptorSink::write(uint64_t offset, const char *data, size_t size) {
+    if (pwrite(fd_, data, size, (off_t) offset) != (ssize_t) size) {
+        std::cerr << "Erro na escrita do arquivo.\n";
+        return false;
+    }
+    return true;
+}
 
-            if (bytes_written_to_file < bytes_read_from_socket) {
-                std::cerr << "Erro na escrita do arquivo.\n";
-            }
+// Os buracos no fim do arquivo só existem se o tamanho for ajustado
+bool DescriptorSink::finish(uint64_t file_size) {
+    if (ftruncate(fd_, (off_t) file_size) != 0) {
+        std::cerr << "Erro ao ajustar o tamanho do arquivo.\n";
+        return false;
+    }
+    return true;
+}
 
-            bzero(buffer, BUFFER_SIZE);
-            bytes_received += bytes_read_from_socket;
+/*
+ * Recebe um arquivo de "file_size" bytes enviado por "send_file" e o escreve
+ * em "out_file", que deve ter sido aberto vazio.  Cada extent é escrito na sua
+ * posição, e os trechos que não foram enviados ficam como buracos, sem
+ * ocupar espaço em disco.
+ *
+ * Se "on_chunk" for fornecida, ela é chamada com cada bloco recebido e sua
+ * posição, o que permite que o chamador observe os bytes sem precisar
+ * relê-los do disco.  Os blocos chegam em ordem crescente de posição, e os
+ * intervalos entre eles contêm zeros.
+ */
+bool read_file(int from_socket_fd, FILE *out_file, uint64_t file_size,
+               const ChunkCallback &on_chunk, TransferGate *gate) {
+    fflush(out_file);
+    DescriptorSink sink(fileno(out_file));
+    return read_file(from_socket_fd, sink, file_size, on_chunk, gate);
+}
 
-            //std::cout << "Inner loop: Bytes recebidos: " << bytes_received << "\n";
+/*
+ * Recebe um arquivo enviado por "send_file", entregando os bytes a "sink".
+ *
+ * Uma falha de escrita não interrompe a recepção, para que o protocolo
+ * continue consistente, mas faz a função retornar falso.
+ */
+bool read_file(int from_socket_fd, FileSink &sink, uint64_t file_size,
+               const ChunkCallback &on_chunk, TransferGate *gate) {
+    std::vector<char> buffer(FILE_CHUNK_SIZE);
+    bool written = true;
+
+    uint64_t next_offset = 0;
+
+    while (true) {
+        uint64_t header[2];
+        if (!read_socket(from_socket_fd, (void *) header, sizeof(header))) {
+            std::cerr << "Conexão fechada durante a transferência do arquivo.\n";
+            return false;
+        }
 
-            if (bytes_received == file_size) {
-                break;
-            }
+        uint64_t offset = header[0];
+        uint64_t length = header[1];
+        if (length == 0) {
+            break;
         }
 
-        if (bytes_read_from_socket < 0) {
-            if (errno == EAGAIN) {
-                printf("recv() timed out.\n");
+        if (offset < next_offset || offset > file_size || length > file_size - offset) {
+            std::cerr << "Extent inválido: " << offset << "+" << length << "\n";
+            return false;
+        }
+
+        sink.extent(offset, length);
+
+        while (length > 0) {
+            size_t chunk = (size_t) std::min<uint64_t>(buffer.size(), length);
+
+            if (gate) {
+                gate->acquire(chunk);
+            }
+            bool ok = read_socket(from_socket_fd, (void *) buffer.data(), chunk);
+            if (gate) {
+                gate->release(chunk);
             }
-            else {
+
+            if (!ok) {
                 fprintf(stderr, "recv() failed due to errno = %d\n", errno);
+                return false;
             }
-            return false;
+
+            written = sink.write(offset, buffer.data(), chunk) && written;
+
+            if (on_chunk) {
+                on_chunk(offset, buffer.data(), chunk);
+            }
+
+            offset += chunk;
+            length -= chunk;
         }
+        next_offset = offset;
     }
+
+    written = sink.finish(file_size) && written;
     
+    // A confirmação sai imediatamente, pois quem enviou está esperando por ela
     send_bool(from_socket_fd, true);
+    flush_socket(from_socket_fd);
 
     std::cout << "Arquivo recebido!\n";
-    return true;
+    return written;
+}
+
+
+/*
+ * Calcula o hash do conteúdo do arquivo, da posição atual até o fim.
+ */
+ContentHash hash_file(FILE *file) {
+    char buffer[BUFFER_SIZE * 64];
+    ContentHasher hasher;
+
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, sizeof(char), sizeof(buffer), file)) > 0) {
+        hasher.update(buffer, bytes_read);
+    }
+
+    return hasher.digest();
 }
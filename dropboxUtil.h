@@ -1,26 +1,99 @@
 #ifndef __DROPBOX_UTIL_H__
 #define __DROPBOX_UTIL_H__
 
+// Limite padrão de dispositivos conectados de um mesmo usuário.  Pode ser
+// alterado para todos os usuários ou para cada usuário no servidor.
 #define MAX_DEVICES 2
 #define MAX_NAME_SIZE 256
 #define BUFFER_SIZE 1024
-#define EMPTY_DEVICE (-1)
+
+// Tamanho máximo de cada leitura do socket durante a recepção de um arquivo
+#define FILE_CHUNK_SIZE (64 * 1024)
+
+// Tamanho dos buffers de leitura e de escrita de cada conexão
+#define SOCKET_BUFFER_SIZE (64 * 1024)
+
+// Maior string aceita por "receive_string", incluindo o '\0'
+#define MAX_STRING_SIZE (64 * 1024)
 
 #include <string>
 #include <map>
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <sys/types.h>
+
+/*
+ * Tipos de conexão com o servidor:
+ *
+ *  Normal  conexão principal de um dispositivo, que abre a sessão
+ *  Sync    canal por onde o servidor repassa as mudanças à sessão
+ *  Worker  conexão extra de uma sessão, usada para transferências paralelas
+ *  Replica conexão de uma réplica, que recebe as mudanças do primário
+ */
+enum ConnectionType { Normal, Sync, Worker, Replica };
+
+enum Command {
+    Upload, Download, Delete, ListServer, ListVersions, DownloadRanges, SetDevice, Move,
+    ChunkedUpload, ChunkedDownload, UploadChunk, DownloadChunk, ChunkedCommit, ListStored, Exit
+};
+
+/*
+ * Hash de 128 bits do conteúdo de um arquivo.  Um hash com as duas metades
+ * zeradas significa que o hash ainda não foi calculado.
+ */
+struct ContentHash {
+    uint64_t low;
+    uint64_t high;
+
+    ContentHash();
+
+    bool valid() const;
+    bool operator==(const ContentHash &other) const;
+    bool operator!=(const ContentHash &other) const;
+    std::string string() const;
+};
+
+
+// Estado do XXH3 (ver xxHash-0.8.2/xxhash.h)
+struct XXH3_state_s;
+
+/*
+ * Calcula o ContentHash de forma incremental, para que o hash possa ser
+ * obtido enquanto o arquivo é transferido, sem precisar relê-lo.
+ *
+ * O algoritmo é o XXH3 de 128 bits da biblioteca xxHash, incluída no
+ * diretório xxHash-0.8.2.
+ */
+class ContentHasher {
+public:
+    ContentHasher();
+    ~ContentHasher();
 
-enum ConnectionType { Normal, Sync };
+    ContentHasher(const ContentHasher &) = delete;
+    ContentHasher &operator=(const ContentHasher &) = delete;
+
+    void update(const char *data, size_t size);
+    void update_zeros(uint64_t count);
+    ContentHash digest() const;
+
+private:
+    XXH3_state_s *state_;
+};
 
-enum Command { Upload, Download, Delete, ListServer, Exit };
 
 struct FileInfo {
     char filename_[MAX_NAME_SIZE];
     char extension_[MAX_NAME_SIZE];
     time_t last_modified_;
-    size_t bytes_;
+    uint64_t bytes_;
+    ContentHash hash_;
 
     explicit FileInfo();
 
@@ -35,17 +108,85 @@ struct FileInfo {
     void set_last_modified(time_t time);
     time_t last_modified() const;
 
-    void set_bytes(size_t bytes);
-    size_t bytes() const;
+    void set_bytes(uint64_t bytes);
+    uint64_t bytes() const;
+
+    void set_hash(const ContentHash &hash);
+    ContentHash hash() const;
 
     std::string string() const;
 };
 
 
+/*
+ * Versão anterior de um arquivo guardada pelo servidor.  As versões são
+ * numeradas em ordem crescente, e o número 0 representa a versão atual.
+ */
+struct FileVersion {
+    uint64_t number;
+    uint64_t bytes;
+    time_t last_modified;
+};
+
+
+class RelaySubscriber;
+class SyncRules;
+
+/*
+ * Um dispositivo conectado.  Cada conexão normal aceita recebe um
+ * identificador de sessão único no processo.
+ */
+struct Device {
+    uint64_t session_id;
+    int socket_fd;
+
+    // Canal de sincronização do dispositivo, se já foi aberto
+    std::shared_ptr<RelaySubscriber> subscriber;
+
+    // Regras de sincronização seletiva do dispositivo (nullptr sincroniza
+    // todos os arquivos)
+    std::shared_ptr<const SyncRules> rules;
+};
+
+
+/*
+ * Registro dos dispositivos conectados de um usuário.
+ *
+ * Os dispositivos ficam numa tabela hash indexada pela sessão, então entrar
+ * e sair custam O(1).  Cada registro tem seu próprio mutex: conexões de
+ * usuários diferentes nunca disputam a mesma trava.
+ */
+class DeviceRegistry {
+public:
+    explicit DeviceRegistry(size_t max_devices);
+
+    uint64_t register_device(int socket_fd);
+    bool unregister_device(uint64_t session_id, std::shared_ptr<RelaySubscriber> *subscriber);
+    bool contains(uint64_t session_id) const;
+
+    bool attach_subscriber(uint64_t session_id, const std::shared_ptr<RelaySubscriber> &subscriber);
+    void detach_subscriber(uint64_t session_id, const std::shared_ptr<RelaySubscriber> &subscriber);
+    std::vector<Device> devices_except(uint64_t session_id) const;
+
+    bool set_rules(uint64_t session_id, const std::shared_ptr<const SyncRules> &rules);
+    std::shared_ptr<const SyncRules> rules_for(uint64_t session_id) const;
+
+    void set_max_devices(size_t max_devices);
+    size_t max_devices() const;
+    size_t size() const;
+
+private:
+    std::unordered_map<uint64_t, Device> devices_;
+    size_t max_devices_;
+    mutable std::mutex mutex_;
+
+    static std::atomic<uint64_t> next_session_id_;
+};
+
+
 struct Client {
     std::string user_id;
-    bool is_logged;
-    int connected_devices[MAX_DEVICES];
+    DeviceRegistry devices;
     std::vector<FileInfo> files;
 
     //Semaphore sem;
@@ -58,7 +199,84 @@ struct Client {
 };
 
 
-typedef std::map<std::string, Client *> ClientDict;
+// Função chamada a cada bloco de bytes transferido de um arquivo, com a
+// posição do bloco no arquivo
+typedef std::function<void(uint64_t, const char *, size_t)> ChunkCallback;
+
+/*
+ * Portão consultado a cada bloco de uma transferência de arquivo.  "acquire"
+ * é chamado antes do bloco ser transferido e pode bloquear até que a
+ * transferência possa prosseguir; "release" é chamado depois.
+ */
+class TransferGate {
+public:
+    virtual ~TransferGate() = default;
+
+    virtual void acquire(size_t bytes) = 0;
+    virtual void release(size_t bytes) = 0;
+};
+
+/*
+ * Destino dos bytes de um arquivo recebido por "read_file".  "extent" é
+ * chamado antes dos bytes de cada extent, "write" com cada bloco, em ordem
+ * crescente de posição, e "finish" depois do último extent.
+ */
+class FileSink {
+public:
+    virtual ~FileSink() = default;
+
+    virtual void extent(uint64_t, uint64_t) {}
+    virtual bool write(uint64_t offset, const char *data, size_t size) = 0;
+    virtual bool finish(uint64_t file_size) = 0;
+};
+
+/*
+ * Origem dos bytes de um arquivo enviado por "send_file".  "next_extent"
+ * procura o próximo trecho com dados a partir de "*offset" (ver
+ * "next_data_extent"), e "read" lê os bytes dos trechos, em ordem crescente
+ * de posição.  "read" retorna quantos bytes leu, ou -1 em caso de erro.
+ */
+class FileSource {
+public:
+    virtual ~FileSource() = default;
+
+    virtual bool next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) = 0;
+    virtual ssize_t read(uint64_t offset, char *data, size_t size) = 0;
+};
+
+/*
+ * Lê os bytes diretamente do descritor de um arquivo aberto.
+ */
+class DescriptorSource : public FileSource {
+public:
+    explicit DescriptorSource(int fd) : fd_(fd) {}
+
+    bool next_extent(uint64_t file_size, uint64_t *offset, uint64_t *end) override;
+    ssize_t read(uint64_t offset, char *data, size_t size) override;
+
+private:
+    int fd_;
+};
+
+/*
+ * Escreve os bytes recebidos diretamente no descritor de um arquivo aberto
+ * vazio.  Os trechos que não são escritos ficam como buracos.
+ */
+class DescriptorSink : public FileSink {
+public:
+    explicit DescriptorSink(int fd) : fd_(fd) {}
+
+    bool write(uint64_t offset, const char *data, size_t size) override;
+    bool finish(uint64_t file_size) override;
+
+private:
+    int fd_;
+};
+
+void configure_socket(int socket_fd);
+bool flush_socket(int socket_fd);
+void close_socket(int socket_fd);
+int connect_address(const std::string &address);
 
 bool read_socket(int socket_fd, void *buffer, size_t count);
 bool write_socket(int socket_fd, const void *buffer, size_t count);
@@ -69,7 +287,15 @@ std::string receive_string(int socket_fd);
 void send_bool(int socket_fd, bool value);
 bool read_bool(int socket_fd);
 
-bool send_file(int to_socket_fd, FILE *in_file, size_t file_size);
-bool read_file(int from_socket_fd, FILE *out_file, size_t file_size);
+bool next_data_extent(int fd, uint64_t file_size, uint64_t *offset, uint64_t *end);
+bool send_file(int to_socket_fd, FILE *in_file, uint64_t file_size, TransferGate *gate = nullptr);
+bool send_file(int to_socket_fd, FileSource &source, uint64_t file_size, TransferGate *gate = nullptr);
+bool send_buffer(int to_socket_fd, const char *buffer, uint64_t size, TransferGate *gate = nullptr);
+bool read_file(int from_socket_fd, FILE *out_file, uint64_t file_size,
+               const ChunkCallback &on_chunk = nullptr, TransferGate *gate = nullptr);
+bool read_file(int from_socket_fd, FileSink &sink, uint64_t file_size,
+               const ChunkCallback &on_chunk = nullptr, TransferGate *gate = nullptr);
+
+ContentHash hash_file(FILE *file);
 
 #endif
@@ -0,0 +1,168 @@
+#include "dropboxVersions.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <algorithm>
+#include <iostream>
+
+namespace fs = boost::filesystem;
+
+// Clona "source" em "target" compartilhando os blocos.  Retorna falso se o
+// sistema de arquivos não suportar reflinks.
+static bool clone_file(const fs::path &source, const fs::path &target) {
+    int source_fd = open(source.c_str(), O_RDONLY);
+    if (source_fd == -1) {
+        return false;
+    }
+
+    int target_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (target_fd == -1) {
+        close(source_fd);
+        return false;
+    }
+
+    bool cloned = ioctl(target_fd, FICLONE, source_fd) == 0;
+    close(target_fd);
+    close(source_fd);
+
+    if (!cloned) {
+        fs::remove(target);
+    }
+    return cloned;
+}
+
+
+//=============================================================================
+// VersionStore
+//=============================================================================
+VersionStore::VersionStore(const fs::path &user_dir) {
+    user_dir_ = user_dir;
+}
+
+
+/*
+ * Guarda o conteúdo atual do arquivo como uma nova versão.  Se o arquivo for
+ * renomeado para o diretório de versões, ele deixa de existir no diretório do
+ * usuário, e o chamador deve colocar o novo conteúdo no lugar.  Retorna falso
+ * se nenhuma versão foi guardada.
+ */
+bool VersionStore::preserve(const std::string &filename, size_t retention) {
+    fs::path current = user_dir_ / fs::path(filename);
+    if (retention == 0 || !fs::is_regular_file(current)) {
+        return false;
+    }
+
+    boost::system::error_code error;
+    fs::path target = next_path(filename);
+
+    if (clone_file(current, target)) {
+        fs::last_write_time(target, fs::last_write_time(current), error);
+    }
+    else {
+        fs::rename(current, target, error);
+        if (error) {
+            std::cerr << "Erro ao guardar a versão " << target.filename().string() << " de " << current.string()
+                      << ": " << error.message() << "\n";
+            return false;
+        }
+    }
+
+    prune(filename, retention);
+    return true;
+}
+
+
+/*
+ * Guarda como nova versão um conteúdo que não está num arquivo comum.  Usada
+ * para os arquivos pequenos guardados nos packfiles.
+ */
+bool VersionStore::store(const std::string &filename, const char *data, uint64_t size, time_t time,
+                         size_t retention) {
+    if (retention == 0) {
+        return false;
+    }
+
+    fs::path target = next_path(filename);
+    FILE *file = fopen(target.c_str(), "wb");
+    if (file == nullptr) {
+        std::cerr << "Erro ao guardar a versão " << target.filename().string() << " de " << filename << "\n";
+        return false;
+    }
+
+    bool written = fwrite(data, sizeof(char), size, file) == size;
+    fclose(file);
+
+    boost::system::error_code error;
+    fs::last_write_time(target, time, error);
+
+    prune(filename, retention);
+    return written;
+}
+
+
+// Versões guardadas do arquivo, da mais antiga para a mais recente
+std::vector<FileVersion> VersionStore::list(const std::string &filename) const {
+    std::vector<FileVersion> versions;
+
+    for (uint64_t number : numbers(filename)) {
+        boost::system::error_code error;
+        fs::path version_path = path(filename, number);
+
+        FileVersion version{};
+        version.number = number;
+        version.bytes = fs::file_size(version_path, error);
+        version.last_modified = fs::last_write_time(version_path, error);
+        if (!error) {
+            versions.push_back(version);
+        }
+    }
+    return versions;
+}
+
+
+fs::path VersionStore::path(const std::string &filename, uint64_t number) const {
+    return user_dir_ / fs::path(VERSIONS_DIR) / fs::path(filename) / fs::path(std::to_string(number));
+}
+
+
+// Caminho da próxima versão do arquivo, criando o diretório se necessário
+fs::path VersionStore::next_path(const std::string &filename) {
+    boost::system::error_code error;
+    fs::create_directories(user_dir_ / fs::path(VERSIONS_DIR) / fs::path(filename), error);
+
+    std::vector<uint64_t> existing = numbers(filename);
+    return path(filename, existing.empty() ? 1 : existing.back() + 1);
+}
+
+
+std::vector<uint64_t> VersionStore::numbers(const std::string &filename) const {
+    std::vector<uint64_t> result;
+
+    fs::path directory = user_dir_ / fs::path(VERSIONS_DIR) / fs::path(filename);
+    boost::system::error_code error;
+    for (fs::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+        uint64_t number = std::strtoull(it->path().filename().c_str(), nullptr, 10);
+        if (number > 0) {
+            result.push_back(number);
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+// Apaga as versões mais antigas, mantendo as "retention" mais recentes
+void VersionStore::prune(const std::string &filename, size_t retention) {
+    std::vector<uint64_t> existing = numbers(filename);
+    if (existing.size() <= retention) {
+        return;
+    }
+
+    boost::system::error_code error;
+    for (size_t i = 0; i < existing.size() - retention; ++i) {
+        fs::remove(path(filename, existing[i]), error);
+    }
+}
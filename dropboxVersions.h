@@ -0,0 +1,53 @@
+#ifndef __DROPBOX_VERSIONS_H__
+#define __DROPBOX_VERSIONS_H__
+
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "dropboxUtil.h"
+
+// Quantidade padrão de versões anteriores guardadas de cada arquivo
+#define DEFAULT_VERSION_RETENTION 5
+
+// Diretório, dentro do diretório do usuário, com as versões anteriores
+#define VERSIONS_DIR "~versions"
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * VersionStore
+ * ----------------------------------------------------------------------------
+ * Guarda as versões anteriores dos arquivos de um usuário em
+ * VERSIONS_DIR/<arquivo>/<número>, numeradas a partir de 1.
+ *
+ * Guardar uma versão não copia bytes:
+ *
+ * - Onde o sistema de arquivos suporta reflinks (btrfs, XFS), a versão é um
+ *   clone do arquivo feito com FICLONE, que compartilha os blocos até que um
+ *   dos dois seja modificado.
+ *
+ * - Nos demais, o arquivo atual é renomeado para dentro do diretório de
+ *   versões, e o novo conteúdo toma seu lugar logo em seguida.
+ *
+ * Apenas as "retention" versões mais recentes são mantidas.  As funções
+ * devem ser chamadas com o usuário travado.
+ * ----------------------------------------------------------------------------
+ */
+class VersionStore {
+public:
+    explicit VersionStore(const boost::filesystem::path &user_dir);
+
+    bool preserve(const std::string &filename, size_t retention);
+    bool store(const std::string &filename, const char *data, uint64_t size, time_t time, size_t retention);
+    std::vector<FileVersion> list(const std::string &filename) const;
+    boost::filesystem::path path(const std::string &filename, uint64_t number) const;
+
+private:
+    boost::filesystem::path next_path(const std::string &filename);
+    std::vector<uint64_t> numbers(const std::string &filename) const;
+    void prune(const std::string &filename, size_t retention);
+
+    boost::filesystem::path user_dir_;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "dropboxWorkers.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+// Sinais recebidos pelo supervisor, tratados fora do handler
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_supervisor_signal(int signal) {
+    if (signal == SIGHUP) {
+        restart_requested = 1;
+    }
+    else {
+        stop_requested = 1;
+    }
+}
+
+
+//=============================================================================
+// WorkerSupervisor
+//=============================================================================
+WorkerSupervisor::WorkerSupervisor(size_t workers, const WorkerMain &worker_main)
+        : pids_(workers, -1), worker_main_(worker_main) {}
+
+
+int WorkerSupervisor::run() {
+    // Sem SA_RESTART, para que os sinais interrompam o waitpid
+    struct sigaction action{};
+    action.sa_handler = handle_supervisor_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+
+    for (size_t i = 0; i < pids_.size(); ++i) {
+        if (!spawn(i)) {
+            stop_all();
+            return 1;
+        }
+    }
+
+    std::cout << "Supervisor " << getpid() << " iniciou " << pids_.size() << " workers\n";
+
+    while (true) {
+        if (stop_requested) {
+            stop_all();
+            return 0;
+        }
+        if (restart_requested) {
+            restart_requested = 0;
+            restart_all();
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Erro ao esperar os workers: " << strerror(errno) << "\n";
+            return 1;
+        }
+
+        for (size_t i = 0; i < pids_.size(); ++i) {
+            if (pids_[i] != pid) {
+                continue;
+            }
+
+            std::cerr << "Worker " << i << " terminou ("
+                      << (WIFSIGNALED(status) ? "sinal " : "status ")
+                      << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status)) << "), recriando\n";
+
+            pids_[i] = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(WORKER_RESTART_DELAY_MS));
+            if (!stop_requested) {
+                spawn(i);
+            }
+        }
+    }
+}
+
+
+/*
+ * Cria o processo do worker e espera até que ele esteja escutando a porta.
+ * O supervisor não tem outras threads, então o fork é seguro.
+ */
+bool WorkerSupervisor::spawn(size_t index) {
+    int ready[2];
+    if (pipe(ready) != 0) {
+        std::cerr << "Erro ao criar o pipe do worker " << index << "\n";
+        return false;
+    }
+
+    // O que ainda está no buffer sairia duas vezes
+    std::cout.flush();
+    std::cerr.flush();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cerr << "Erro ao criar o worker " << index << ": " << strerror(errno) << "\n";
+        close(ready[0]);
+        close(ready[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(ready[0]);
+
+        // O worker morre junto com o supervisor, e volta ao tratamento
+        // padrão dos sinais
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+
+        worker_main_(index, ready[1]);
+        _exit(0);
+    }
+
+    close(ready[1]);
+
+    // Se o worker cair antes de ficar pronto, o read retorna 0
+    char byte;
+    ssize_t count;
+    do {
+        count = read(ready[0], &byte, 1);
+    }
+    while (count == -1 && errno == EINTR);
+    close(ready[0]);
+
+    pids_[index] = pid;
+    if (count != 1) {
+        std::cerr << "Worker " << index << " não iniciou\n";
+    }
+    return true;
+}
+
+
+// Reinicia os workers um de cada vez, esperando cada um ficar pronto
+void WorkerSupervisor::restart_all() {
+    std::cout << "Reiniciando os workers\n";
+
+    for (size_t i = 0; i < pids_.size() && !stop_requested; ++i) {
+        if (pids_[i] != -1) {
+            kill(pids_[i], SIGTERM);
+            while (waitpid(pids_[i], nullptr, 0) == -1 && errno == EINTR) {
+            }
+            pids_[i] = -1;
+        }
+        spawn(i);
+    }
+}
+
+
+void WorkerSupervisor::stop_all() {
+    for (pid_t pid : pids_) {
+        if (pid != -1) {
+            kill(pid, SIGTERM);
+        }
+    }
+    for (pid_t &pid : pids_) {
+        if (pid != -1) {
+            while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+            }
+            pid = -1;
+        }
+    }
+}
+
+
+//=============================================================================
+// Sockets
+//=============================================================================
+
+/*
+ * Cria o socket que escuta a porta do servidor.  Com "reuse_port", vários
+ * processos podem escutar a mesma porta, e o kernel distribui as conexões
+ * novas entre eles.
+ */
+int open_listener(uint16_t port, bool reuse_port) {
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        std::cerr << "Erro ao criar o socket do servidor\n";
+        return -1;
+    }
+
+    // Um servidor reiniciado precisa voltar à mesma porta enquanto as conexões
+    // anteriores ainda estão em TIME_WAIT, para que os clientes reconectem
+    int enable = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port) {
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(socket_fd, (sockaddr *) &address, sizeof(address)) < 0) {
+        std::cerr << "Erro ao fazer o binding\n";
+        close(socket_fd);
+        return -1;
+    }
+
+    listen(socket_fd, 5);
+    return socket_fd;
+}
+
+
+// Endereço abstrato do socket de repasse do worker, único por porta
+static socklen_t handoff_address(uint16_t port, size_t index, sockaddr_un *address) {
+    std::string name = "dropbox-" + std::to_string(port) + "-" + std::to_string(index);
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path + 1, name.data(), name.size());
+    return (socklen_t) (offsetof(sockaddr_un, sun_path) + 1 + name.size());
+}
+
+
+/*
+ * Cria o socket por onde o worker recebe as conexões de seus usuários que
+ * foram aceitas por outros workers.
+ */
+int open_handoff_socket(uint16_t port, size_t index) {
+    int socket_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) {
+        std::cerr << "Erro ao criar o socket de repasse\n";
+        return -1;
+    }
+
+    sockaddr_un address{};
+    socklen_t length = handoff_address(port, index, &address);
+    if (bind(socket_fd, (sockaddr *) &address, length) < 0) {
+        std::cerr << "Erro ao fazer o binding do socket de repasse: " << strerror(errno) << "\n";
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+
+/*
+ * Worker dono do estado de um usuário.  Todas as conexões do usuário (a
+ * normal, a de sincronização e as de transferência) vão para o mesmo worker.
+ */
+size_t worker_for_user(const std::string &user_id, size_t workers) {
+    ContentHasher hasher;
+    hasher.update(user_id.data(), user_id.size());
+    return (size_t) (hasher.digest().low % workers);
+}
+
+
+/*
+ * Lê o tipo da conexão e o user_id sem retirá-los do socket, para que o
+ * worker que atender a conexão os leia normalmente.  Os bytes não passam
+ * pelo buffer de leitura da conexão, que não acompanharia o socket num
+ * repasse.
+ */
+bool peek_handshake(int socket_fd, ConnectionType *type, std::string *user_id) {
+    const size_t header = sizeof(ConnectionType) + sizeof(uint64_t);
+    std::vector<char> buffer(header + MAX_NAME_SIZE);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        pollfd poll_fd{socket_fd, POLLIN, 0};
+        if (remaining <= 0 || poll(&poll_fd, 1, (int) remaining) <= 0) {
+            return false;
+        }
+
+        ssize_t count = recv(socket_fd, buffer.data(), buffer.size(), MSG_PEEK);
+        if (count <= 0) {
+            return false;
+        }
+
+        if ((size_t) count >= header) {
+            uint64_t size;
+            memcpy(&size, buffer.data() + sizeof(ConnectionType), sizeof(size));
+            if (size == 0 || size > MAX_NAME_SIZE) {
+                return false;
+            }
+
+            if ((size_t) count >= header + size) {
+                memcpy(type, buffer.data(), sizeof(*type));
+                user_id->assign(buffer.data() + header, size - 1);
+                return true;
+            }
+        }
+
+        // O resto do handshake ainda não chegou
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+
+/*
+ * Envia a conexão ao worker "index" com SCM_RIGHTS.  O socket continua
+ * aberto neste processo, e deve ser fechado pelo chamador.  Falha se o
+ * worker não estiver rodando.
+ */
+bool hand_off(int handoff_fd, uint16_t port, size_t index, int socket_fd) {
+    sockaddr_un address{};
+    socklen_t length = handoff_address(port, index, &address);
+
+    char byte = 0;
+    iovec data{&byte, sizeof(byte)};
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    msghdr message{};
+    message.msg_name = &address;
+    message.msg_namelen = length;
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &socket_fd, sizeof(int));
+
+    if (sendmsg(handoff_fd, &message, 0) < 0) {
+        std::cerr << "Erro ao repassar a conexão ao worker " << index << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+// Espera a próxima conexão repassada por outro worker.  Retorna -1 em erro.
+int receive_handoff(int handoff_fd) {
+    char byte;
+    iovec data{&byte, sizeof(byte)};
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if (recvmsg(handoff_fd, &message, MSG_CMSG_CLOEXEC) <= 0) {
+        return -1;
+    }
+
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == nullptr || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    int socket_fd;
+    memcpy(&socket_fd, CMSG_DATA(header), sizeof(int));
+    return socket_fd;
+}
@@ -0,0 +1,62 @@
+#ifndef __DROPBOX_WORKERS_H__
+#define __DROPBOX_WORKERS_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
+#include "dropboxUtil.h"
+
+// Espera antes de recriar um worker que terminou sozinho, para que um worker
+// que cai ao iniciar não seja recriado sem parar
+#define WORKER_RESTART_DELAY_MS 1000
+
+// Tempo máximo para o cliente enviar o tipo da conexão e o user_id
+#define HANDSHAKE_TIMEOUT_MS 5000
+
+// Corpo de um processo worker: recebe o índice do worker e o descritor onde
+// deve escrever um byte quando estiver pronto para receber conexões
+typedef std::function<void(size_t, int)> WorkerMain;
+
+
+/*
+ * ----------------------------------------------------------------------------
+ * WorkerSupervisor
+ * ----------------------------------------------------------------------------
+ * Processo pai do servidor no modo com vários processos.  Ele não atende
+ * conexões: apenas cria os workers, recria os que terminarem (uma queda
+ * derruba só os usuários daquele worker) e os reinicia um de cada vez quando
+ * recebe SIGHUP.  SIGTERM e SIGINT encerram todos os workers.
+ *
+ * Durante a reinicialização de um worker os outros continuam escutando a
+ * porta, então o servidor nunca deixa de aceitar conexões.  Os clientes do
+ * worker reiniciado reconectam sozinhos.
+ * ----------------------------------------------------------------------------
+ */
+class WorkerSupervisor {
+public:
+    WorkerSupervisor(size_t workers, const WorkerMain &worker_main);
+
+    int run();
+
+private:
+    bool spawn(size_t index);
+    void restart_all();
+    void stop_all();
+
+    std::vector<pid_t> pids_;
+    WorkerMain worker_main_;
+};
+
+
+int open_listener(uint16_t port, bool reuse_port);
+int open_handoff_socket(uint16_t port, size_t index);
+
+size_t worker_for_user(const std::string &user_id, size_t workers);
+bool peek_handshake(int socket_fd, ConnectionType *type, std::string *user_id);
+
+bool hand_off(int handoff_fd, uint16_t port, size_t index, int socket_fd);
+int receive_handoff(int handoff_fd);
+
+#endif